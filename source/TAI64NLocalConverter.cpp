@@ -0,0 +1,147 @@
+/* COPYING ******************************************************************
+For copyright and licensing terms, see the file named COPYING.
+// **************************************************************************
+*/
+
+#define __STDC_FORMAT_MACROS
+#include <cstddef>
+#include <cstdio>
+#include <cctype>
+#include <ctime>
+#include <inttypes.h>
+#include <stdint.h>
+#include "utils.h"
+#include "ProcessEnvironment.h"
+#include "TAI64NLocalConverter.h"
+
+static inline 
+int 
+x2d ( int c ) 
+{
+	if (std::isdigit(c)) return c - '0';
+	if (std::isalpha(c)) {
+		c = std::tolower(c);
+		return c - 'a' + 10;
+	}
+	return EOF;
+}
+
+static
+uint64_t
+convert (
+	const char * buf,
+	std::size_t len
+) {
+	uint64_t r(0U);
+	while (len) {
+		--len;
+		r <<= 4;
+		r |= x2d(*buf++);
+	}
+	return r;
+}
+
+TAI64NLocalConverter::TAI64NLocalConverter(
+	const ProcessEnvironment & e,
+	std::FILE * f,
+	bool l
+) :
+	envs(e),
+	out(f),
+	non_standard(l),
+	s_pos(0U),
+	n_pos(0U),
+	at(0U),
+	state(BOL)
+{
+}
+
+/// Write out whatever part of a would-be timestamp has been seen, as it was.
+void 
+TAI64NLocalConverter::WriteUnconverted()
+{
+	if (at) std::fputc('@', out);
+	std::fwrite(s, s_pos, 1, out);
+	std::fwrite(n, n_pos, 1, out);
+	at = s_pos = n_pos = 0U;
+}
+
+void 
+TAI64NLocalConverter::WriteConverted()
+{
+	const TimeTAndLeap z(tai64_to_time(envs, convert(s, s_pos)));
+	const uint32_t nano(convert(n, n_pos));
+	struct tm tm;
+	if (localtime_r(&z.time, &tm)) {
+		if (z.leap) ++tm.tm_sec;
+		char fmt[64];
+		const int l(std::strftime(fmt, sizeof fmt, non_standard ? "%x %X" : "%F %T", &tm));
+		std::fwrite(fmt, l, 1, out);
+		std::fprintf(out, ".%09" PRIu32, nano);
+		at = s_pos = n_pos = 0U;
+	} else
+		WriteUnconverted();
+}
+
+void 
+TAI64NLocalConverter::Process(
+	const char * buf,
+	std::size_t len
+) {
+	for (std::size_t i(0U); i < len; ++i) {
+		const char c(buf[i]);
+		switch (state) {
+			body:
+			case BODY:
+				std::fputc(c, out);
+				if ('\n' == c) state = BOL;
+				break;
+			case BOL:
+				if ('@' == c) {
+					state = STAMP;
+					s_pos = n_pos = 0U;
+					at = 1U;
+				} else {
+					WriteUnconverted();
+					state = BODY;
+					goto body;
+				}
+				break;
+			case STAMP:
+				if (s_pos < sizeof s/sizeof *s) {
+					if (std::isxdigit(c)) {
+						s[s_pos++] = c;
+					} else {
+						WriteUnconverted();
+						state = BODY;
+						goto body;
+					}
+				} else
+				if (n_pos < sizeof n/sizeof *n) {
+					if (std::isxdigit(c)) {
+						n[n_pos++] = c;
+					} else {
+						WriteUnconverted();
+						state = BODY;
+						goto body;
+					}
+				} else
+				{
+					WriteConverted();
+					state = BODY;
+					goto body;
+				}
+				break;
+		}
+	}
+}
+
+void 
+TAI64NLocalConverter::Finish()
+{
+	if (BOL != state) {
+		WriteUnconverted();
+		std::fputc('\n', out);
+		state = BOL;
+	}
+}
@@ -0,0 +1,35 @@
+/* COPYING ******************************************************************
+For copyright and licensing terms, see the file named COPYING.
+// **************************************************************************
+*/
+
+#if !defined(INCLUDE_TAI64NLOCALCONVERTER_H)
+#define INCLUDE_TAI64NLOCALCONVERTER_H
+
+#include <cstddef>
+#include <cstdio>
+
+struct ProcessEnvironment;
+
+/// \brief Converts the TAI64N timestamps at the starts of log lines into local date and time, as the data pass through.
+/// Lines without valid timestamps are passed through untouched.
+class TAI64NLocalConverter 
+{
+public:
+	TAI64NLocalConverter(const ProcessEnvironment &, std::FILE *, bool non_standard);
+	void Process(const char *, std::size_t);
+	/// Terminates any unterminated last line.
+	void Finish();
+	bool AtLineStart() const { return BOL == state; }
+protected:
+	const ProcessEnvironment & envs;
+	std::FILE * const out;
+	const bool non_standard;
+	char s[16], n[8];
+	std::size_t s_pos, n_pos, at;
+	enum { BOL, STAMP, BODY } state;
+	void WriteUnconverted();
+	void WriteConverted();
+};
+
+#endif
@@ -16,6 +16,7 @@ For copyright and licensing terms, see the file named COPYING.
 extern void init ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void reboot_poweroff_halt_command ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void emergency_rescue_normal_command ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
+extern void daemon_reexec_command ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void activate ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void deactivate ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void isolate ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
@@ -28,6 +29,7 @@ extern void cat ( const char * & , std::vector<const char *> &, ProcessEnvironme
 extern void show ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void show_json ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void status ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
+extern void analyse_critical_chain ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void escape ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void systemd_escape ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
 extern void print_service_env ( const char * & , std::vector<const char *> &, ProcessEnvironment & );
@@ -102,6 +104,7 @@ commands[] = {
 	{	"single",			emergency_rescue_normal_command	},
 	{	"normal",			emergency_rescue_normal_command	},
 	{	"default",			emergency_rescue_normal_command	},
+	{	"daemon-reexec",		daemon_reexec_command	},
 	{	"init",				init			},
 	{	"activate",			activate		},
 	{	"start",			activate		},
@@ -118,6 +121,8 @@ commands[] = {
 	{	"show",				show			},
 	{	"show-json",			show_json		},
 	{	"status",			status			},
+	{	"analyse-critical-chain",	analyse_critical_chain	},
+	{	"analyze-critical-chain",	analyse_critical_chain	},
 	{	"escape",			escape			},
 	{	"print-service-env",		print_service_env	},
 	{	"set-service-env",		set_service_env		},
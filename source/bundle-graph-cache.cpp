@@ -0,0 +1,356 @@
+/* COPYING ******************************************************************
+For copyright and licensing terms, see the file named COPYING.
+// **************************************************************************
+*/
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include "fdutils.h"
+#include "runtime-dir.h"
+#include "FileDescriptorOwner.h"
+#include "DirStar.h"
+#include "bundle-graph-cache.h"
+
+namespace {
+
+/// Relations that are cached for this many rewrites of the file without being found in use are dropped.
+/// This is how records for bundles that no longer exist eventually disappear.
+const uint32_t MAX_UNUSED_GENERATIONS = 64U;
+
+/// A subdirectory that has changed this recently might change again within the granularity of its timestamps, so it is not trusted.
+const time_t MIN_STABLE_SECONDS = 2;
+
+struct record_before {
+	bool operator() (const bundle_graph_cache_record & r, const std::pair<uint64_t, uint64_t> & k) const { return r.dev < k.first || (r.dev == k.first && r.ino < k.second); }
+};
+
+inline
+void
+stamp (
+	bundle_graph_cache_relation & r,
+	bool absent,
+	const struct stat & s
+) {
+	std::memset(&r, 0, sizeof r);
+	if (absent) {
+		r.flags = r.ABSENT|r.VALID;
+		return;
+	}
+	r.dev = s.st_dev;
+	r.ino = s.st_ino;
+	r.mtime_sec = s.st_mtim.tv_sec;
+	r.mtime_nsec = s.st_mtim.tv_nsec;
+	r.ctime_sec = s.st_ctim.tv_sec;
+	r.ctime_nsec = s.st_ctim.tv_nsec;
+	const time_t now(std::time(0));
+	if (s.st_mtim.tv_sec + MIN_STABLE_SECONDS < now && s.st_ctim.tv_sec + MIN_STABLE_SECONDS < now)
+		r.flags = r.VALID;
+}
+
+inline
+bool
+matches (
+	const bundle_graph_cache_relation & r,
+	bool absent,
+	const struct stat & s
+) {
+	if (!(r.flags & r.VALID)) return false;
+	if (absent) return r.flags & r.ABSENT;
+	return !(r.flags & r.ABSENT)
+	&&	r.dev == static_cast<uint64_t>(s.st_dev)
+	&&	r.ino == static_cast<uint64_t>(s.st_ino)
+	&&	r.mtime_sec == s.st_mtim.tv_sec
+	&&	r.mtime_nsec == static_cast<uint32_t>(s.st_mtim.tv_nsec)
+	&&	r.ctime_sec == s.st_ctim.tv_sec
+	&&	r.ctime_nsec == static_cast<uint32_t>(s.st_ctim.tv_nsec)
+	;
+}
+
+BundleGraphCache::entry_list
+read_relation (
+	int bundle_dir_fd,
+	const char * name
+) {
+	BundleGraphCache::entry_list r;
+	FileDescriptorOwner relation_dir_fd(open_dir_at(bundle_dir_fd, name));
+	if (0 > relation_dir_fd.get()) return r;
+	const DirStar relation_dir(relation_dir_fd);
+	if (!relation_dir) return r;
+	for (;;) {
+		const dirent * d(readdir(relation_dir));
+		if (!d) break;
+		if ('.' == d->d_name[0]) continue;
+		struct stat l;
+		if (0 > fstatat(relation_dir.fd(), d->d_name, &l, AT_SYMLINK_NOFOLLOW)) continue;
+		BundleGraphCache::entry e;
+		e.name = d->d_name;
+		e.is_link = S_ISLNK(l.st_mode);
+		e.is_directory = e.is_link || S_ISDIR(l.st_mode);
+		if (e.is_link) {
+			std::vector<char> buf(l.st_size, char());
+			const int n(readlinkat(relation_dir.fd(), d->d_name, buf.data(), buf.size()));
+			if (0 > n) continue;
+			e.link.assign(buf.data(), n);
+		}
+		struct stat t;
+		e.has_target = e.is_directory && 0 <= fstatat(relation_dir.fd(), d->d_name, &t, 0) && S_ISDIR(t.st_mode);
+		e.dev = e.has_target ? t.st_dev : 0;
+		e.ino = e.has_target ? t.st_ino : 0;
+		r.push_back(e);
+	}
+	return r;
+}
+
+}
+
+BundleGraphCache::BundleGraphCache(
+	bool is_system
+) :
+	name(is_system ? "/run/service-manager/bundle-graph" : effective_user_runtime_dir() + "service-manager/bundle-graph"),
+	base(0),
+	length(0U),
+	header(0)
+{
+	const FileDescriptorOwner fd(open_read_at(AT_FDCWD, name.c_str()));
+	if (0 > fd.get()) return;
+	struct stat s;
+	if (0 > fstat(fd.get(), &s)) return;
+	if (static_cast<std::size_t>(s.st_size) < sizeof *header) return;
+	void * p(mmap(0, s.st_size, PROT_READ, MAP_SHARED, fd.get(), 0));
+	if (MAP_FAILED == p) return;
+	base = static_cast<const char *>(p);
+	length = s.st_size;
+	const bundle_graph_cache_header & h(*reinterpret_cast<const bundle_graph_cache_header *>(base));
+	const std::size_t expected(
+		sizeof h +
+		static_cast<std::size_t>(h.record_count) * sizeof(bundle_graph_cache_record) +
+		static_cast<std::size_t>(h.entry_count) * sizeof(bundle_graph_cache_entry) +
+		h.strings_size
+	);
+	if (h.MAGIC != h.magic || h.VERSION != h.version || RELATION_COUNT != h.relation_count || expected != length || (h.strings_size && base[length - 1U])) {
+		munmap(const_cast<char *>(base), length);
+		base = 0;
+		length = 0U;
+		return;
+	}
+	header = &h;
+}
+
+BundleGraphCache::~BundleGraphCache()
+{
+	if (base)
+		munmap(const_cast<char *>(base), length);
+}
+
+const char *
+BundleGraphCache::name_of(
+	relation r
+) {
+	switch (r) {
+		case WANTS:		return "wants";
+		case EXPECTS:		return "expects";
+		case BEFORE:		return "before";
+		case AFTER:		return "after";
+		case CONFLICTS:		return "conflicts";
+		case REQUIRES:		return "requires";
+		case REQUIRED_BY:	return "required-by";
+		case WANTED_BY:		return "wanted-by";
+		case STOPPED_BY:	return "stopped-by";
+		case RELATION_COUNT:	break;
+	}
+	return "";
+}
+
+const bundle_graph_cache_record *
+BundleGraphCache::find(
+	const bundle_key & key
+) const {
+	if (!header) return 0;
+	const bundle_graph_cache_record * const records(reinterpret_cast<const bundle_graph_cache_record *>(header + 1));
+	const bundle_graph_cache_record * const end(records + header->record_count);
+	const bundle_graph_cache_record * const r(std::lower_bound(records, end, key, record_before()));
+	if (end == r || r->dev != key.first || r->ino != key.second) return 0;
+	return r;
+}
+
+const char *
+BundleGraphCache::string_at(
+	uint32_t offset
+) const {
+	const char * const strings(base + length - header->strings_size);
+	return offset < header->strings_size ? strings + offset : "";
+}
+
+/// Copies the entries of a relation in the file into memory.
+/// \returns false if the relation's entries are not all in the file
+bool
+BundleGraphCache::list(
+	const bundle_graph_cache_relation & c,
+	entry_list & l
+) const {
+	l.clear();
+	if (c.first_entry > header->entry_count || c.entry_count > header->entry_count - c.first_entry) return false;
+	const bundle_graph_cache_entry * const entries(reinterpret_cast<const bundle_graph_cache_entry *>(reinterpret_cast<const bundle_graph_cache_record *>(header + 1) + header->record_count));
+	for (uint32_t j(0U); j < c.entry_count; ++j) {
+		const bundle_graph_cache_entry & f(entries[c.first_entry + j]);
+		entry e;
+		e.name = string_at(f.name);
+		e.link = string_at(f.link);
+		e.is_link = f.flags & f.IS_LINK;
+		e.is_directory = f.flags & f.IS_DIRECTORY;
+		e.has_target = f.flags & f.HAS_TARGET;
+		e.dev = f.dev;
+		e.ino = f.ino;
+		l.push_back(e);
+	}
+	return true;
+}
+
+/// Copies a record in the file, if there is one, into memory.
+void
+BundleGraphCache::load(
+	const bundle_key & key,
+	record & m
+) const {
+	const bundle_graph_cache_record * const r(find(key));
+	if (!r) return;
+	m.generation = r->generation;
+	for (std::size_t i(0U); i < RELATION_COUNT; ++i) {
+		m.relations[i] = r->relations[i];
+		if (!list(r->relations[i], m.lists[i]))
+			m.relations[i].flags &= ~m.relations[i].VALID;
+	}
+}
+
+BundleGraphCache::entry_list
+BundleGraphCache::entries(
+	int bundle_dir_fd,
+	relation rel
+) {
+	struct stat b;
+	if (0 > fstat(bundle_dir_fd, &b)) return entry_list();
+	const bundle_key key(b.st_dev, b.st_ino);
+	struct stat s;
+	const bool absent(0 > fstatat(bundle_dir_fd, name_of(rel), &s, 0) || !S_ISDIR(s.st_mode));
+
+	record_map::iterator u(updated.find(key));
+	if (updated.end() != u) {
+		if (matches(u->second.relations[rel], absent, s))
+			return u->second.lists[rel];
+	} else
+	if (const bundle_graph_cache_record * r = find(key)) {
+		entry_list l;
+		if (matches(r->relations[rel], absent, s) && list(r->relations[rel], l)) {
+			used.insert(key);
+			return l;
+		}
+	}
+
+	if (updated.end() == u) {
+		u = updated.insert(record_map::value_type(key, record())).first;
+		load(key, u->second);
+	}
+	record & m(u->second);
+	stamp(m.relations[rel], absent, s);
+	m.lists[rel] = absent ? entry_list() : read_relation(bundle_dir_fd, name_of(rel));
+	return m.lists[rel];
+}
+
+void
+BundleGraphCache::save()
+{
+	if (updated.empty()) return;
+	const uint32_t generation(header ? header->generation + 1U : 1U);
+
+	// Merge the records from the file that are still in use with the ones read afresh.
+	record_map all;
+	if (header) {
+		const bundle_graph_cache_record * const records(reinterpret_cast<const bundle_graph_cache_record *>(header + 1));
+		for (uint32_t i(0U); i < header->record_count; ++i) {
+			const bundle_key key(records[i].dev, records[i].ino);
+			if (updated.end() != updated.find(key)) continue;
+			const bool in_use(used.end() != used.find(key));
+			if (!in_use && generation - records[i].generation > MAX_UNUSED_GENERATIONS) continue;
+			record & m(all[key]);
+			load(key, m);
+			if (in_use)
+				m.generation = generation;
+		}
+	}
+	for (record_map::iterator i(updated.begin()); updated.end() != i; ++i) {
+		record & m(all[i->first]);
+		m = i->second;
+		m.generation = generation;
+	}
+
+	std::vector<bundle_graph_cache_record> records;
+	std::vector<bundle_graph_cache_entry> entries;
+	std::string strings(1U, '\0');	// Offset zero is the empty string.
+	for (record_map::const_iterator i(all.begin()); all.end() != i; ++i) {
+		bundle_graph_cache_record r;
+		std::memset(&r, 0, sizeof r);
+		r.dev = i->first.first;
+		r.ino = i->first.second;
+		r.generation = i->second.generation;
+		for (std::size_t j(0U); j < RELATION_COUNT; ++j) {
+			r.relations[j] = i->second.relations[j];
+			r.relations[j].first_entry = entries.size();
+			r.relations[j].entry_count = i->second.lists[j].size();
+			for (entry_list::const_iterator k(i->second.lists[j].begin()); i->second.lists[j].end() != k; ++k) {
+				bundle_graph_cache_entry e;
+				std::memset(&e, 0, sizeof e);
+				e.dev = k->dev;
+				e.ino = k->ino;
+				e.flags = (k->is_link ? e.IS_LINK : 0) | (k->is_directory ? e.IS_DIRECTORY : 0) | (k->has_target ? e.HAS_TARGET : 0);
+				e.name = strings.length();
+				strings.append(k->name.c_str(), k->name.length() + 1U);
+				if (!k->link.empty()) {
+					e.link = strings.length();
+					strings.append(k->link.c_str(), k->link.length() + 1U);
+				}
+				entries.push_back(e);
+			}
+		}
+		records.push_back(r);
+	}
+
+	bundle_graph_cache_header h;
+	std::memset(&h, 0, sizeof h);
+	h.magic = h.MAGIC;
+	h.version = h.VERSION;
+	h.relation_count = RELATION_COUNT;
+	h.generation = generation;
+	h.record_count = records.size();
+	h.entry_count = entries.size();
+	h.strings_size = strings.length();
+
+	// Write a new file and atomically replace the old one, so that readers always see one or the other in full.
+	char pid[32];
+	std::snprintf(pid, sizeof pid, ".%u", static_cast<unsigned>(getpid()));
+	const std::string temp_name(name + pid);
+	const FileDescriptorOwner fd(open(temp_name.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY|O_CLOEXEC, 0644));
+	if (0 > fd.get()) return;
+	const struct iovec v[4] = {
+		{ &h, sizeof h },
+		{ records.data(), records.size() * sizeof *records.data() },
+		{ entries.data(), entries.size() * sizeof *entries.data() },
+		{ const_cast<char *>(strings.data()), strings.length() },
+	};
+	std::size_t total(0U);
+	for (std::size_t i(0U); i < sizeof v/sizeof *v; ++i)
+		total += v[i].iov_len;
+	if (static_cast<ssize_t>(total) != writev(fd.get(), v, sizeof v/sizeof *v) || 0 > rename(temp_name.c_str(), name.c_str()))
+		unlink(temp_name.c_str());
+}
@@ -0,0 +1,102 @@
+/* COPYING ******************************************************************
+For copyright and licensing terms, see the file named COPYING.
+// **************************************************************************
+*/
+
+#if !defined(INCLUDE_BUNDLE_GRAPH_CACHE_H)
+#define INCLUDE_BUNDLE_GRAPH_CACHE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <utility>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// \brief The header of a bundle graph cache file.
+/// It is followed by record_count records sorted by bundle, then entry_count entries, and then strings_size bytes of NUL-terminated strings.
+struct bundle_graph_cache_header {
+	enum { MAGIC = 0x6E6F7367U, VERSION = 1U };
+	uint32_t magic;
+	uint16_t version;
+	uint16_t relation_count;
+	uint32_t generation;	///< incremented every time that the file is rewritten
+	uint32_t record_count;
+	uint32_t entry_count;
+	uint32_t strings_size;
+};
+/// \brief What a relation subdirectory looked like when its entries were cached.
+struct bundle_graph_cache_relation {
+	enum { ABSENT = 0x01, VALID = 0x02 };
+	uint64_t dev, ino;
+	int64_t mtime_sec, ctime_sec;
+	uint32_t mtime_nsec, ctime_nsec;
+	uint32_t flags;
+	uint32_t first_entry, entry_count;
+	uint32_t reserved;
+};
+struct bundle_graph_cache_record {
+	enum { RELATIONS = 9U };
+	uint64_t dev, ino;	///< the bundle directory
+	uint32_t generation;	///< when the record was last found to be in use
+	uint32_t reserved;
+	bundle_graph_cache_relation relations[RELATIONS];
+};
+struct bundle_graph_cache_entry {
+	enum { IS_LINK = 0x01, IS_DIRECTORY = 0x02, HAS_TARGET = 0x04 };
+	uint64_t dev, ino;	///< the directory that the entry leads to, if HAS_TARGET is set
+	uint32_t name, link;	///< offsets into the strings
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/// \brief A persistent cache of the contents of the relation subdirectories of service bundles, shared by all of the tools that walk them.
+/// Each relation subdirectory is checked against the cache with a single stat, and is only read again if it has changed.
+/// The cache is a file alongside the service manager's control socket, which is mapped into memory read-only and is replaced atomically when anything has changed.
+/// Target identities are hints; they can go stale without the subdirectory changing, if a target bundle directory is replaced, so callers should check before relying upon them.
+class BundleGraphCache
+{
+public:
+	enum relation { WANTS, EXPECTS, BEFORE, AFTER, CONFLICTS, REQUIRES, REQUIRED_BY, WANTED_BY, STOPPED_BY, RELATION_COUNT };
+	struct entry {
+		std::string name, link;	///< link is empty for entries that are not symbolic links
+		bool is_link, is_directory, has_target;	///< is_directory is whether the entry is a directory or a symbolic link that could lead to one
+		dev_t dev;
+		ino_t ino;
+	};
+	typedef std::vector<entry> entry_list;
+
+	BundleGraphCache(bool is_system);
+	~BundleGraphCache();
+	static const char * name_of(relation);
+	/// Lists the entries of a relation subdirectory of a bundle, in directory order, omitting those whose names begin with a dot.
+	/// A missing subdirectory has no entries.
+	entry_list entries(int bundle_dir_fd, relation);
+	/// Writes the cache out again if anything has been read afresh, quietly doing nothing if that is not possible.
+	void save();
+protected:
+	typedef std::pair<uint64_t, uint64_t> bundle_key;
+	/// \brief A record read afresh, or carried over from the file, in memory.
+	struct record {
+		record() : generation(0U), relations(), lists() {}
+		uint32_t generation;
+		bundle_graph_cache_relation relations[RELATION_COUNT];
+		entry_list lists[RELATION_COUNT];
+	};
+	typedef std::map<bundle_key, record> record_map;
+	std::string name;
+	const char * base;
+	std::size_t length;
+	const bundle_graph_cache_header * header;
+	const bundle_graph_cache_record * find(const bundle_key &) const;
+	const char * string_at(uint32_t) const;
+	record_map updated;	///< records that have had relations read afresh
+	std::set<bundle_key> used;	///< records in the file that have been found valid
+	bool list(const bundle_graph_cache_relation &, entry_list &) const;
+	void load(const bundle_key &, record &) const;
+private:
+	BundleGraphCache(const BundleGraphCache &);
+};
+
+#endif
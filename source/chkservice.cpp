@@ -92,7 +92,7 @@ struct bundle {
 	uint64_t seconds;
 	uint32_t nanoseconds;
 
-	void load_data();
+	void load_data(const ServiceManagerSnapshot &);
 	const ColourPair & colour_of_state () const;
 	const char * name_of_state () const;
 	bool valid_status() const { return UNKNOWN != state && UNLOADED != state && NOTAPI != state && FIFO_ERROR != state && STATUS_ERROR != state && LOADING != state; }
@@ -154,32 +154,37 @@ bundle::state_of (
 
 void
 bundle::load_data(
+	const ServiceManagerSnapshot & snapshot
 ) {
 	initially_up = is_initially_up(service_dir_fd.get());
 
-	const FileDescriptorOwner ok_fd(open_writeexisting_at(supervise_dir_fd.get(), "ok"));
-	if (0 > ok_fd.get()) {
-		const int error(errno);
-		if (ENXIO == error) {
-			state = UNLOADED;
-		} else
-		if (ENOENT == error) {
-			state = NOTAPI;
-		} else
-		{
-			state = FIFO_ERROR;
+	char status[EXTENDED_STATUS_BLOCK_SIZE];
+	// Services that are not in the snapshot might yet be under some other supervisor, so are looked at individually.
+	int b(snapshot.read(supervise_dir_fd.get(), status));
+	if (!b) {
+		const FileDescriptorOwner ok_fd(open_writeexisting_at(supervise_dir_fd.get(), "ok"));
+		if (0 > ok_fd.get()) {
+			const int error(errno);
+			if (ENXIO == error) {
+				state = UNLOADED;
+			} else
+			if (ENOENT == error) {
+				state = NOTAPI;
+			} else
+			{
+				state = FIFO_ERROR;
+			}
+			return;
 		}
-		return;
-	}
 
-	const FileDescriptorOwner status_fd(open_read_at(supervise_dir_fd.get(), "status"));
-	if (0 > status_fd.get()) {
-		state = STATUS_ERROR;
-		return;
-	}
+		const FileDescriptorOwner status_fd(open_read_at(supervise_dir_fd.get(), "status"));
+		if (0 > status_fd.get()) {
+			state = STATUS_ERROR;
+			return;
+		}
 
-	char status[STATUS_BLOCK_SIZE];
-	const int b(read(status_fd.get(), status, sizeof status));
+		b = read(status_fd.get(), status, sizeof status);
+	}
 
 	if (b < DAEMONTOOLS_STATUS_BLOCK_SIZE) {
 		state = LOADING;
@@ -787,8 +792,11 @@ chkservice [[gnu::noreturn]] (
 		bundle_map.add_bundle(bundle_dir_s, bundle_dir_fd, supervise_dir_fd, service_dir_fd, path, name, suffix);
 	}
 
-	for (bundle_info_map::iterator i(bundle_map.begin()), e(bundle_map.end()); e != i; ++i)
-		i->second.load_data();
+	{
+		const ServiceManagerSnapshot snapshot(prog, !per_user_mode, 1000);
+		for (bundle_info_map::iterator i(bundle_map.begin()), e(bundle_map.end()); e != i; ++i)
+			i->second.load_data(snapshot);
+	}
 
 	const FileDescriptorOwner queue(kqueue());
 	if (0 > queue.get()) {
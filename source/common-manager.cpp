@@ -26,6 +26,7 @@ For copyright and licensing terms, see the file named COPYING.
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
 #include <cerrno>
 #include <csignal>
 #include <ctime>
@@ -92,6 +93,7 @@ static sig_atomic_t fastpoweroff_signalled (false);
 static sig_atomic_t fastpowercycle_signalled (false);
 static sig_atomic_t fastreboot_signalled (false);
 static sig_atomic_t unknown_signalled (false);
+static sig_atomic_t reexec_signalled (false);
 static inline bool stop_signalled() { return fasthalt_signalled || fastpoweroff_signalled || fastpowercycle_signalled || fastreboot_signalled; }
 
 static inline
@@ -99,6 +101,13 @@ void
 record_signal_system (
 	int signo
 ) {
+#if defined(REEXEC_SIGNAL)
+	// This is not necessarily a constant, so cannot be a case label.
+	if (REEXEC_SIGNAL == signo) {
+		reexec_signalled = true;
+		return;
+	}
+#endif
 	switch (signo) {
 		case SIGCHLD:		child_signalled = true; break;
 #if defined(KBREQ_SIGNAL)
@@ -164,6 +173,7 @@ record_signal_user (
 #if defined(SIGRTMIN)
 		case SIGINT:		halt_signalled = true; break;
 #endif
+		// This holds even where SIGTERM is REEXEC_SIGNAL; a per-user manager is only re-executed by its 'X' command.
 		case SIGTERM:		halt_signalled = true; break;
 		case SIGHUP:		halt_signalled = true; break;
 		case SIGPIPE:		halt_signalled = true; break;
@@ -220,6 +230,7 @@ read_command (
 			case 's':	(is_system ? rescue_signalled : unknown_signalled) = true; break;
 			case 'b':	(is_system ? emergency_signalled : unknown_signalled) = true; break;
 			case 'n':	normal_signalled = true; break;
+			case 'X':	reexec_signalled = true; break;
 		}
 	}
 }
@@ -1258,6 +1269,169 @@ fork_service_manager_as_needed (
 	return false;
 }
 
+/* Re-execution *************************************************************
+// **************************************************************************
+// To re-execute itself, a manager writes the process IDs of its children, its signal flags, and the numbers of the descriptors that it holds to an anonymous file, and passes that and the descriptors across execve().
+// Its children remain its children throughout, as the process ID does not change.
+*/
+
+namespace {
+
+struct saved_manager_state {
+	enum { MAGIC = 0x6E6F7368U, VERSION = 1U };
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;		///< sizeof(saved_manager_state)
+	int32_t service_manager_pid, cyclog_pid, regular_system_control_pid, emergency_system_control_pid, kbreq_system_control_pid;
+	int32_t saved_stdio[STDERR_FILENO + 1], read_log_pipe, write_log_pipe, service_manager_socket_fd;
+	uint8_t signalled[20];
+};
+
+}
+
+static
+sig_atomic_t *
+const
+saved_flags[] = {
+	&sysinit_signalled,
+	&init_signalled,
+	&normal_signalled,
+	&child_signalled,
+	&rescue_signalled,
+	&emergency_signalled,
+	&halt_signalled,
+	&poweroff_signalled,
+	&powercycle_signalled,
+	&reboot_signalled,
+	&power_signalled,
+	&kbrequest_signalled,
+	&sak_signalled,
+	&fasthalt_signalled,
+	&fastpoweroff_signalled,
+	&fastpowercycle_signalled,
+	&fastreboot_signalled,
+	&unknown_signalled,
+};
+
+/// \returns true if there was state from a previous incarnation to restore
+static
+bool
+restore_manager_state (
+	const char * prog,
+	ProcessEnvironment & envs,
+	saved_manager_state & state
+) {
+	const char * state_fd_str(envs.query("STATE_FD"));
+	if (!state_fd_str) return false;
+	const char * end(state_fd_str);
+	const long fd(std::strtol(state_fd_str, const_cast<char **>(&end), 10));
+	envs.unset("STATE_FD");
+	if (end == state_fd_str || *end || 0 > fd || INT_MAX < fd) {
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "STATE_FD", "Not a file descriptor number.");
+		return false;
+	}
+	const FileDescriptorOwner state_fd(fd);
+	const ssize_t n(pread(state_fd.get(), &state, sizeof state, 0));
+	if (0 > n) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "STATE_FD", std::strerror(error));
+		return false;
+	}
+	if (static_cast<ssize_t>(sizeof state) != n || saved_manager_state::MAGIC != state.magic || saved_manager_state::VERSION != state.version || sizeof state != state.size) {
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "STATE_FD", "Unrecognized saved state format.");
+		return false;
+	}
+	service_manager_pid = state.service_manager_pid;
+	cyclog_pid = state.cyclog_pid;
+	regular_system_control_pid = state.regular_system_control_pid;
+	emergency_system_control_pid = state.emergency_system_control_pid;
+	kbreq_system_control_pid = state.kbreq_system_control_pid;
+	for (std::size_t i(0U); i < sizeof saved_flags/sizeof *saved_flags; ++i)
+		*saved_flags[i] = state.signalled[i];
+	// Anything that ended during the handoff is waiting to be reaped.
+	child_signalled = true;
+	const int fds[] = { state.saved_stdio[0], state.saved_stdio[1], state.saved_stdio[2], state.read_log_pipe, state.write_log_pipe, state.service_manager_socket_fd };
+	for (std::size_t i(0U); i < sizeof fds/sizeof *fds; ++i)
+		if (0 <= fds[i])
+			set_close_on_exec(fds[i], true);
+	std::fprintf(stderr, "%s: INFO: %s\n", prog, "re-executed");
+	return true;
+}
+
+static
+void
+reexec_manager (
+	const char * prog,
+	const char * self,
+	ProcessEnvironment & envs,
+	unsigned listen_fds,
+	const FileDescriptorOwner saved_stdio[STDERR_FILENO + 1],
+	const FileDescriptorOwner & read_log_pipe,
+	const FileDescriptorOwner & write_log_pipe,
+	const FileDescriptorOwner & service_manager_socket_fd
+) {
+	saved_manager_state state;
+	std::memset(&state, 0, sizeof state);
+	state.magic = saved_manager_state::MAGIC;
+	state.version = saved_manager_state::VERSION;
+	state.size = sizeof state;
+	state.service_manager_pid = service_manager_pid;
+	state.cyclog_pid = cyclog_pid;
+	state.regular_system_control_pid = regular_system_control_pid;
+	state.emergency_system_control_pid = emergency_system_control_pid;
+	state.kbreq_system_control_pid = kbreq_system_control_pid;
+	for (std::size_t i(0U); i < sizeof saved_flags/sizeof *saved_flags; ++i)
+		state.signalled[i] = *saved_flags[i];
+	for (std::size_t i(0U); i <= STDERR_FILENO; ++i)
+		state.saved_stdio[i] = saved_stdio[i].get();
+	state.read_log_pipe = read_log_pipe.get();
+	state.write_log_pipe = write_log_pipe.get();
+	state.service_manager_socket_fd = service_manager_socket_fd.get();
+
+	const FileDescriptorOwner state_fd(open_anonymous_file("manager-state"));
+	if (0 > state_fd.get() || sizeof state != static_cast<std::size_t>(pwrite(state_fd.get(), &state, sizeof state, 0))) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "saving state", std::strerror(error));
+		return;
+	}
+
+	const int fds[] = { state.saved_stdio[0], state.saved_stdio[1], state.saved_stdio[2], state.read_log_pipe, state.write_log_pipe, state.service_manager_socket_fd, state_fd.get() };
+	for (std::size_t i(0U); i < sizeof fds/sizeof *fds; ++i)
+		if (0 <= fds[i])
+			set_close_on_exec(fds[i], false);
+	for (unsigned i(0U); i < listen_fds; ++i)
+		set_close_on_exec(LISTEN_SOCKET_FILENO + i, false);
+	char state_fd_buf[64], listen_fds_buf[64], listen_pid_buf[64];
+	std::snprintf(state_fd_buf, sizeof state_fd_buf, "%d", state_fd.get());
+	std::snprintf(listen_fds_buf, sizeof listen_fds_buf, "%u", listen_fds);
+	std::snprintf(listen_pid_buf, sizeof listen_pid_buf, "%u", getpid());
+	envs.set("STATE_FD", state_fd_buf);
+	if (listen_fds) {
+		envs.set("LISTEN_FDS", listen_fds_buf);
+		envs.set("LISTEN_PID", listen_pid_buf);
+	}
+
+	std::fprintf(stderr, "%s: INFO: %s\n", prog, "re-executing");
+	std::fflush(stderr);
+	const char * args[] = { self, 0 };
+	if (std::strchr(self, '/'))
+		execve(self, const_cast<char **>(args), const_cast<char **>(envs.data()));
+	else
+		safe_execvp(self, args, envs);
+	const int error(errno);
+	std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, self, std::strerror(error));
+
+	// Put everything back as it was.
+	for (std::size_t i(0U); i < sizeof fds/sizeof *fds; ++i)
+		if (0 <= fds[i])
+			set_close_on_exec(fds[i], true);
+	for (unsigned i(0U); i < listen_fds; ++i)
+		set_close_on_exec(LISTEN_SOCKET_FILENO + i, true);
+	envs.unset("STATE_FD");
+	envs.unset("LISTEN_FDS");
+	envs.unset("LISTEN_PID");
+}
+
 /* Main program *************************************************************
 // **************************************************************************
 */
@@ -1272,13 +1446,17 @@ common_manager (
 ) {
 	record_signal = (is_system ? record_signal_system : record_signal_user);
 
-	const char * prog(basename_of(args[0]));
+	const char * self(args[0]);
+	const char * prog(basename_of(self));
 	args.erase(args.begin());
 
+	saved_manager_state state;
+	const bool reexecuted(restore_manager_state(prog, envs, state));
+
 #if defined(__FreeBSD__) || defined(__DragonFly__)
 	// FreeBSD initializes process #1 with a controlling terminal!
 	// The only way to get rid of it is to close all open file descriptors to it.
-	if (is_system) {
+	if (is_system && !reexecuted) {
 		for (std::size_t i(0U); i < LISTEN_SOCKET_FILENO; ++i)
 			if (isatty(i)) 
 				close(i);
@@ -1286,8 +1464,9 @@ common_manager (
 #endif
 
 	// We must ensure that no new file descriptors are allocated in the standard+systemd file descriptors range, otherwise dup2() and automatic-close() in child processes go wrong later.
+	// A re-executed manager already has them all.
 	FileDescriptorOwner filler_stdio[LISTEN_SOCKET_FILENO + 1] = { -1, -1, -1, -1 };
-	for (
+	if (!reexecuted) for (
 		FileDescriptorOwner root(open_dir_at(AT_FDCWD, "/")); 
 		0 <= root.get() && root.get() <= LISTEN_SOCKET_FILENO; 
 		root.reset(dup(root.release()))
@@ -1299,22 +1478,29 @@ common_manager (
 	// A per-user manager begins with standard I/O connected to logger services and suchlike.
 	// We want to save these, if they are open, for use as log destinations of last resort during shutdown.
 	FileDescriptorOwner saved_stdio[STDERR_FILENO + 1] = { -1, -1, -1 };
-	for (std::size_t i(0U); i < sizeof saved_stdio/sizeof *saved_stdio; ++i) {
-		if (0 > filler_stdio[i].get())
-			saved_stdio[i].reset(dup(i));
-	}
-
-	// In the normal course of events, standard output and error will be connected to some form of logger process, via a pipe.
-	// We don't want our output cluttering a TTY, and device files such as /dev/null and /dev/console do not exist yet.
 	FileDescriptorOwner read_log_pipe(-1), write_log_pipe(-1);
-	open_logging_pipe(prog, read_log_pipe, write_log_pipe);
-	dup2(prog, filler_stdio, write_log_pipe, STDOUT_FILENO);
-	dup2(prog, filler_stdio, write_log_pipe, STDERR_FILENO);
-
-	// Now we perform the process initialization that does thing like mounting /dev.
-	// Errors mounting things go down the pipe, from which nothing is reading as yet.
-	// We must be careful about not writing too much to this pipe without a running cyclog process.
-	setup_process_state(is_system, prog, envs);
+	if (reexecuted) {
+		for (std::size_t i(0U); i < sizeof saved_stdio/sizeof *saved_stdio; ++i)
+			saved_stdio[i].reset(state.saved_stdio[i]);
+		read_log_pipe.reset(state.read_log_pipe);
+		write_log_pipe.reset(state.write_log_pipe);
+	} else {
+		for (std::size_t i(0U); i < sizeof saved_stdio/sizeof *saved_stdio; ++i) {
+			if (0 > filler_stdio[i].get())
+				saved_stdio[i].reset(dup(i));
+		}
+
+		// In the normal course of events, standard output and error will be connected to some form of logger process, via a pipe.
+		// We don't want our output cluttering a TTY, and device files such as /dev/null and /dev/console do not exist yet.
+		open_logging_pipe(prog, read_log_pipe, write_log_pipe);
+		dup2(prog, filler_stdio, write_log_pipe, STDOUT_FILENO);
+		dup2(prog, filler_stdio, write_log_pipe, STDERR_FILENO);
+
+		// Now we perform the process initialization that does thing like mounting /dev.
+		// Errors mounting things go down the pipe, from which nothing is reading as yet.
+		// We must be careful about not writing too much to this pipe without a running cyclog process.
+		setup_process_state(is_system, prog, envs);
+	}
 	PreventDefaultForFatalSignals ignored_signals(
 		SIGTERM, 
 		SIGINT, 
@@ -1329,6 +1515,9 @@ common_manager (
 #if defined(SIGPWR)
 		SIGPWR,
 #endif
+#if defined(REEXEC_SIGNAL)
+		REEXEC_SIGNAL,
+#endif
 #if defined(SIGRTMIN)
 		SIGRTMIN + 0,
 		SIGRTMIN + 1,
@@ -1376,10 +1565,13 @@ common_manager (
 #endif
 #if defined(SIGPWR)
 		SIGPWR,
+#endif
+#if defined(REEXEC_SIGNAL)
+		REEXEC_SIGNAL,
 #endif
 		0
 	);
-	if (is_system) {
+	if (is_system && !reexecuted) {
 #if defined(__LINUX__) || defined(__linux__) || defined(__NetBSD__)
 		initialize_system_clock_timezone();
 #elif defined(__FreeBSD__) || defined(__DragonFly__)
@@ -1391,23 +1583,27 @@ common_manager (
 #endif
 		setup_kernel_api_volumes_and_devices(prog);
 	}
-	make_needed_run_directories(is_system, prog);
-	if (is_system) {
-		if (!am_in_jail(envs)) 
-			start_system();
+	if (!reexecuted) {
+		make_needed_run_directories(is_system, prog);
+		if (is_system) {
+			if (!am_in_jail(envs)) 
+				start_system();
+		}
+		initialize_root_control_groups(prog);
 	}
-	initialize_root_control_groups(prog);
 
 	// Now we can use /dev/console, /dev/null, and the rest.
 	const FileDescriptorOwner dev_null_fd(open_null(prog));
-	dup2(prog, filler_stdio, dev_null_fd, STDIN_FILENO);
-	last_resort_io_defaults(is_system, prog, dev_null_fd, saved_stdio);
+	if (!reexecuted) {
+		dup2(prog, filler_stdio, dev_null_fd, STDIN_FILENO);
+		last_resort_io_defaults(is_system, prog, dev_null_fd, saved_stdio);
+	}
 
 	const unsigned listen_fds(query_listen_fds(envs));
 	if (listen_fds)
 		envs.unset("LISTEN_FDNAMES");
 
-	const FileDescriptorOwner service_manager_socket_fd(listen_service_manager_socket(is_system, prog));
+	const FileDescriptorOwner service_manager_socket_fd(reexecuted ? state.service_manager_socket_fd : listen_service_manager_socket(is_system, prog));
 
 #if defined(DEBUG)	// This is not an emergency mode.  Do not abuse as such.
 	if (is_system) {
@@ -1452,6 +1648,9 @@ common_manager (
 #endif
 #if defined(SIGPWR)
 		set_event(&p[n++], SIGPWR, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+#endif
+#if defined(REEXEC_SIGNAL)
+		set_event(&p[n++], REEXEC_SIGNAL, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
 #endif
 	} else {
 		if (SIGINT != REBOOT_SIGNAL) {
@@ -1525,6 +1724,12 @@ common_manager (
 			unknown_signalled = false;
 		}
 
+		// Re-execute, keeping all of our children and descriptors, if asked.
+		if (reexec_signalled) {
+			reexec_signalled = false;
+			reexec_manager(prog, self, envs, listen_fds, saved_stdio, read_log_pipe, write_log_pipe, service_manager_socket_fd);
+		}
+
 		const int rc(kevent(queue.get(), p.data(), 0, p.data(), p.size(), 0));
 		if (0 > rc) {
 			if (EINTR == errno) continue;
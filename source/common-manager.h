@@ -158,4 +158,15 @@ extern bool per_user_mode;	// Shared with the service manager client API.
 #define FORCE_POWEROFF_SIGNAL	SIGTERM
 #endif
 
+// This signal tells process #1 to re-execute itself, keeping its state.
+#if defined(__LINUX__) || defined(__linux__)
+// On Linux, we go with systemd since upstart and System 5 init do not have a defined convention.
+#define REEXEC_SIGNAL	SIGTERM
+#elif defined(SIGRTMIN)
+// On the BSDs, SIGTERM is taken by BSD init, and there is no convention.
+#define REEXEC_SIGNAL	(SIGRTMIN + 20)
+#else
+// And we cannot define this at all on OpenBSD!
+#endif
+
 #endif
@@ -1855,7 +1855,7 @@ console_terminal_emulator [[gnu::noreturn]] (
 		}
 	}
 
-	append_event(ip, PTY_MASTER_FILENO, EVFILT_READ, EV_ADD, 0, 0, 0);
+	append_event(ip, PTY_MASTER_FILENO, EVFILT_READ, EV_ADD, NOTE_FIONREAD, 0, 0);
 	append_event(ip, PTY_MASTER_FILENO, EVFILT_WRITE, EV_ADD, 0, 0, 0);
 	append_event(ip, input_fifo.get(), EVFILT_READ, EV_ADD, 0, 0, 0);
 	ReserveSignalsForKQueue kqueue_reservation(SIGTERM, SIGINT, SIGHUP, 0);
@@ -1876,6 +1876,7 @@ console_terminal_emulator [[gnu::noreturn]] (
 	// We want slightly different defaults, with UTF-8 input mode on because that's what our input encoder sends, and tostop mode on.
 	tcsetattr_nointr(PTY_MASTER_FILENO, TCSADRAIN, sane(false /*tostop on*/, false /*utf8 on*/));
 
+	std::vector<char> master_buffer(16384U);
 	bool hangup(false);
 	while (!shutdown_signalled && !hangup) {
 		append_event(ip, PTY_MASTER_FILENO, EVFILT_WRITE, input_encoder.OutputAvailable() ? EV_ENABLE : EV_DISABLE, 0, 0, 0);
@@ -1893,6 +1894,7 @@ console_terminal_emulator [[gnu::noreturn]] (
 		}
 
 		bool masterin_ready(false), masterout_ready(false), master_hangup(false), fifo_ready(false), fifo_hangup(false);
+		intptr_t masterin_waiting(0);
 
 		for (size_t i(0); i < static_cast<size_t>(rc); ++i) {
 			const struct kevent & e(p[i]);
@@ -1903,6 +1905,7 @@ console_terminal_emulator [[gnu::noreturn]] (
 				case EVFILT_READ:
 					if (PTY_MASTER_FILENO == e.ident) {
 						masterin_ready = true;
+						masterin_waiting = e.data;
 						master_hangup |= EV_EOF & e.flags;
 					}
 					if (input_fifo.get() == static_cast<int>(e.ident)) {
@@ -1918,11 +1921,10 @@ console_terminal_emulator [[gnu::noreturn]] (
 		}
 
 		if (masterin_ready) {
-			char b[16384];
-			const int l(read(PTY_MASTER_FILENO, b, sizeof b));
+			const ssize_t l(read_waiting(PTY_MASTER_FILENO, master_buffer, masterin_waiting));
 			if (l > 0) {
-				for (int i(0); i < l; ++i)
-					emulator.Process(b[i]);
+				for (ssize_t i(0); i < l; ++i)
+					emulator.Process(master_buffer[i]);
 				master_hangup = false;
 			}
 		}
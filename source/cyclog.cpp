@@ -416,7 +416,7 @@ cyclog [[gnu::noreturn]] (
 	struct kevent p[16];
 	{
 		std::size_t index(0);
-		set_event(&p[index++], STDIN_FILENO, EVFILT_READ, EV_ADD, 0, 0, 0);
+		set_event(&p[index++], STDIN_FILENO, EVFILT_READ, EV_ADD, NOTE_FIONREAD, 0, 0);
 		set_event(&p[index++], SIGHUP, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
 		set_event(&p[index++], SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
 		set_event(&p[index++], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
@@ -431,7 +431,7 @@ cyclog [[gnu::noreturn]] (
 		}
 	}
 
-	char buf[4096];
+	std::vector<char> buf(4096U);
 	bool pending(false);
 	struct timespec zero = { 0, 0 };
 	for (;;) {
@@ -449,7 +449,7 @@ cyclog [[gnu::noreturn]] (
 		} else
 		for (size_t i(0); i < static_cast<size_t>(rc); ++i) {
 			if (EVFILT_READ == p[i].filter && STDIN_FILENO == p[i].ident) {
-				const ssize_t rd(read(STDIN_FILENO, buf, sizeof buf));
+				const ssize_t rd(read_waiting(STDIN_FILENO, buf, p[i].data));
 				if (0 > rd) {
 					const int error(errno);
 					if (EINTR != error) {
@@ -0,0 +1,74 @@
+/* COPYING ******************************************************************
+For copyright and licensing terms, see the file named COPYING.
+// **************************************************************************
+*/
+
+// Simulate a service start that is bound by a disc that slows down when it is shared, for concurrency-benchmark.
+// Usage: disc-contention-simulator active-directory milliseconds
+// The process needs that many milliseconds of the whole disc to itself.
+// When k processes are active, the disc delivers 1/(1+0.15(k-1)) of its throughput, shared equally between them, as seeking thrashes.
+// Active processes are counted by the files that they create in the active directory, named by process ID.
+
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+const double TICK_MILLISECONDS = 5.0;
+const double SEEK_PENALTY = 0.15;
+
+unsigned
+count_active (
+	const char * dir
+) {
+	DIR * d(opendir(dir));
+	if (!d) return 1U;
+	unsigned n(0U);
+	while (const dirent * e = readdir(d))
+		if ('.' != e->d_name[0])
+			++n;
+	closedir(d);
+	return n ? n : 1U;
+}
+
+}
+
+int
+main (
+	int argc,
+	const char * argv[]
+) {
+	if (argc < 3) {
+		std::fprintf(stderr, "%s: FATAL: %s\n", argv[0], "Missing active directory or milliseconds.");
+		return EXIT_FAILURE;
+	}
+	const char * dir(argv[1]);
+	const double work(std::strtod(argv[2], 0));
+	char pid[32];
+	std::snprintf(pid, sizeof pid, "/%ld", static_cast<long>(getpid()));
+	const std::string marker(dir + std::string(pid));
+	const int fd(open(marker.c_str(), O_CREAT|O_WRONLY|O_NOCTTY|O_CLOEXEC, 0644));
+	if (0 > fd) {
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", argv[0], marker.c_str(), std::strerror(errno));
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	const timespec tick = { 0, static_cast<long>(TICK_MILLISECONDS * 1000000.0) };
+	for (double done(0.0); done < work; ) {
+		nanosleep(&tick, 0);
+		const unsigned k(count_active(dir));
+		done += TICK_MILLISECONDS / (k * (1.0 + SEEK_PENALTY * (k - 1U)));
+	}
+
+	unlink(marker.c_str());
+	return EXIT_SUCCESS;
+}
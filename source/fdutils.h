@@ -223,6 +223,12 @@ pipe_close_on_exec (
 	int fds[2]
 );
 
+extern
+int
+open_anonymous_file (
+	const char * name
+);
+
 extern
 int
 socket_close_on_exec (
@@ -10,6 +10,15 @@ For copyright and licensing terms, see the file named COPYING.
 #include <sys/event.h>
 #endif
 #include <vector>
+#include <unistd.h>
+
+#if !defined(__LINUX__) && !defined(__linux__)
+/// BSD kqueue always obtains the number of bytes available for EVFILT_READ, so there is nothing to ask for.
+enum { NOTE_FIONREAD = 0 };
+#endif
+
+/// The most that read_waiting() will read at once, however much is said to be waiting.
+enum { MAXIMUM_WAITING_READ = 1048576 };
 
 /// \brief An inline function that replicates EV_SET.
 /// This does not evaluate its arguments more than once.
@@ -51,3 +60,19 @@ append_event (
 	set_event(&ev, ident, filter, flags, fflags, data, udata);
 	p.push_back(ev);
 }
+
+/// Read as much as an EVFILT_READ event's data field says is waiting, up to MAXIMUM_WAITING_READ, so that one read can drain a burst.
+/// The buffer is grown as needed, and never shrunk.
+/// The filter should have been added with NOTE_FIONREAD.
+extern inline
+ssize_t
+read_waiting (
+	int fd,
+	std::vector<char> & buf,
+	intptr_t waiting
+) {
+	const intptr_t limit(MAXIMUM_WAITING_READ);
+	if (waiting > 0 && static_cast<std::size_t>(waiting) > buf.size())
+		buf.resize(waiting < limit ? waiting : limit);
+	return read(fd, buf.data(), buf.size());
+}
@@ -10,8 +10,10 @@ For copyright and licensing terms, see the file named COPYING.
 #include <cstdlib>
 #include <cstdio>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <deque>
+#include <mutex>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -19,6 +21,10 @@ For copyright and licensing terms, see the file named COPYING.
 #include <sys/inotify.h>
 #include <sys/poll.h>
 #include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 #include <fcntl.h>	// Needed for fstatat(), contrary to the manual
 #include <unistd.h>
 #include "kqueue_linux.h"
@@ -27,16 +33,25 @@ For copyright and licensing terms, see the file named COPYING.
 // This is "good enough" for the needs of the nosh toolset.
 // But it is missing several things.
 //
-//  * It is a single-threaded implementation, for use in single-threaded programs.
-//    There is no locking of the queues map or the queue objects themselves, or reference counting.
+//  * There is no reference counting of queues, and they are never freed.
+//  * Only one thread at a time may wait on a queue.
+//    Any number of other threads may concurrently change it, notably triggering EVFILT_USER events to wake the waiter.
+//    Changes are serialized by a per-queue lock, which the waiter does not hold whilst it is blocked.
 //  * Several filters are missing.
 //  * Pending returned events can potentially be returned after their conditions become false.
-//  * EV_ONESHOT, EV_DISPATCH, and EV_CLEAR have no effect.
-//  * EVFILT_READ does not return bytes available in data.
-//  * EVFILT_WRITE does not return EV_EOF.
+//  * EV_ONESHOT and EV_DISPATCH have no effect.
+//  * EV_CLEAR only has an effect on EVFILT_USER, where it resets the triggered state and fflags once the event has been returned.
+//    Without it, a user event stays triggered, and is returned by every wait, until it is deleted.
+//    Other filters ignore it: EVFILT_READ and EVFILT_WRITE are always level-triggered, and EVFILT_VNODE, EVFILT_SIGNAL, and EVFILT_PROC always report each occurrence once.
+//  * EVFILT_READ only obtains bytes available in data if NOTE_FIONREAD is given when the filter is added, as that costs an ioctl() per event.
+//    It obtains them from FIONREAD, so they are 0 for things such as listening sockets.
+//  * EVFILT_WRITE does not return buffer space available in data.
 //  * EVFILT_VNODE does not handle character devices, block devices, or FIFOs.
 //  * EVFILT_READ and EVFILT_WRITE do not handle regular files (because epoll does not).
 //  * User data in filters is not supported.
+//  * EVFILT_USER events are all multiplexed through a single eventfd per queue.
+//  * EVFILT_PROC only supports NOTE_EXIT, and needs process file descriptors (Linux 5.3 or later).
+//    It does not reap the process, but it does obtain the exit status in data.
 //
 // Differences from Linux libkqueue:
 //
@@ -59,22 +74,44 @@ public:
 
 class PollFD {
 public:
-	PollFD() : added_events(0), enabled_events(0) {}
+	PollFD() : added_events(0), enabled_events(0), in_epoll(false), count_readable(false) {}
 	uint32_t added_events, enabled_events;
+	bool in_epoll;	///< epoll always reports EPOLLERR and EPOLLHUP, so wholly disabled descriptors are taken out of the set.
+	bool count_readable;	///< whether EVFILT_READ events should carry the FIONREAD byte count
 	uint32_t mask() const { return added_events & enabled_events ; }
 };
 
+class UserEvent {
+public:
+	UserEvent() : clear(false), enabled(true), triggered(false), fflags(0U) {}
+	bool clear, enabled, triggered;
+	uint32_t fflags;
+	void change_fflags(uint32_t);
+};
+
+class Process {
+public:
+	Process() : fd(-1), wanted_notes(0U), in_epoll(false) {}
+	int fd;		///< a process file descriptor
+	uint32_t wanted_notes;
+	bool in_epoll;
+};
+
 class Queue {
 public:
 	Queue(FileDescriptorOwner &);
 	~Queue() {}
+	std::mutex lock;
 	FileDescriptorOwner epoll;
 	FileDescriptorOwner notify;
 	FileDescriptorOwner signals;
+	FileDescriptorOwner user;
 	sigset_t added_signals, enabled_signals;
 
 	bool legal_changes(const struct kevent *, int);
 	bool apply_changes(const struct kevent *, int);
+	bool update_pollfd(int, PollFD &);
+	bool wake_user();
 	int wait(struct kevent * pevents, int nevents, const struct timespec* timeout);
 	void return_event(int & n, struct kevent * pevents, int nevents, const struct kevent & k);
 
@@ -82,8 +119,17 @@ public:
 
 	typedef std::map<int, Watch> WatchMap;
 	WatchMap watches;
-	typedef std::map<int, PollFD> PollFDMap;
+	typedef std::unordered_map<int, PollFD> PollFDMap;
 	PollFDMap pollfds;
+	typedef std::map<uintptr_t, UserEvent> UserEventMap;
+	UserEventMap user_events;
+	typedef std::unordered_map<int, Process> ProcessMap;
+	ProcessMap processes;	///< keyed by process ID
+	typedef std::unordered_map<int, int> ProcessFDMap;
+	ProcessFDMap process_fds;	///< process IDs keyed by process file descriptor
+
+	bool update_process(Process &, bool);
+	void delete_process(ProcessMap::iterator);
 
 	std::size_t signal_off;
 	union {
@@ -99,6 +145,38 @@ public:
 
 typedef std::map<int, Queue *> QueueMap;
 QueueMap queues;
+std::mutex queues_lock;
+
+#if !defined(SYS_pidfd_open)
+#define SYS_pidfd_open 434
+#endif
+
+inline
+int
+pidfd_open(
+	pid_t pid,
+	unsigned int flags
+) {
+	return syscall(SYS_pidfd_open, pid, flags);
+}
+
+/// \returns a wait() status for an exited process, without reaping it, or 0 if it cannot be obtained
+inline
+int
+peek_exit_status(
+	pid_t pid
+) {
+	siginfo_t si;
+	si.si_pid = 0;
+	if (0 > waitid(P_PID, pid, &si, WEXITED|WNOWAIT|WNOHANG) || 0 == si.si_pid)
+		return 0;
+	switch (si.si_code) {
+		case CLD_EXITED:	return (si.si_status & 0xFF) << 8;
+		case CLD_KILLED:	return si.si_status & 0x7F;
+		case CLD_DUMPED:	return (si.si_status & 0x7F) | 0x80;
+		default:		return 0;
+	}
+}
 
 inline
 int 
@@ -158,7 +236,7 @@ Watch::notes_for(
 			n |= NOTE_WRITE;
 	} else
 	if (S_ISDIR(s.st_mode)) {
-		if (mask & (IN_CREATE|IN_DELETE))
+		if (mask & (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO))
 			n |= NOTE_WRITE;
 	}
 	if (mask & IN_DELETE_SELF)
@@ -181,8 +259,9 @@ Watch::mask_for(
 			m |= IN_MODIFY;
 	} else
 	if (S_ISDIR(s.st_mode)) {
+		// As with BSD kqueue, renaming entries into, out of, or within a directory writes to it.
 		if (notes & NOTE_WRITE)
-			m |= IN_CREATE|IN_DELETE;
+			m |= IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO;
 	}
 	if (notes & NOTE_DELETE)
 		m |= IN_DELETE_SELF;
@@ -191,16 +270,32 @@ Watch::mask_for(
 	return m;
 }
 
+void
+UserEvent::change_fflags(
+	uint32_t f
+) {
+	switch (f & NOTE_FFCTRLMASK) {
+		case NOTE_FFNOP:	break;
+		case NOTE_FFAND:	fflags &= f & NOTE_FFLAGSMASK; break;
+		case NOTE_FFOR:		fflags |= f & NOTE_FFLAGSMASK; break;
+		case NOTE_FFCOPY:	fflags = f & NOTE_FFLAGSMASK; break;
+	}
+}
+
 Queue::Queue(
 	FileDescriptorOwner & e
 ) : 
+	lock(),
 	epoll(e.release()),
 	notify(-1),
 	signals(-1),
+	user(-1),
 	added_signals(),
 	enabled_signals(),
 	pending(),
 	watches(),
+	pollfds(),
+	user_events(),
 	signal_off(0),
 	notify_off(0)
 {
@@ -232,10 +327,9 @@ Queue::legal_changes(
 			case EVFILT_READ:
 			case EVFILT_WRITE:
 			case EVFILT_VNODE:
-#if 0 // Not implemented.  Yet.
 			case EVFILT_PROC:
-#endif
 			case EVFILT_SIGNAL:
+			case EVFILT_USER:
 				break;
 			default:
 				return false;
@@ -244,6 +338,75 @@ Queue::legal_changes(
 	return true;
 }
 
+inline
+bool
+Queue::update_pollfd(
+	int fd,
+	PollFD & p
+) {
+	epoll_event e;
+	e.data.fd = fd;
+	e.events = p.mask();
+	if (!e.events) {
+		if (!p.in_epoll)
+			return true;
+		// Closing a descriptor removes it from the epoll set, just as closing it removes its knotes on the BSDs.
+		if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_DEL, fd, &e) && EBADF != errno && ENOENT != errno)
+			return false;
+		p.in_epoll = false;
+	} else
+	if (p.in_epoll) {
+		if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_MOD, fd, &e)) {
+			// The descriptor was closed and its number re-used since it was added.
+			if (ENOENT != errno || 0 > epoll_ctl(epoll.get(), EPOLL_CTL_ADD, fd, &e))
+				return false;
+		}
+	} else
+	{
+		if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_ADD, fd, &e))
+			return false;
+		p.in_epoll = true;
+	}
+	return true;
+}
+
+inline
+bool
+Queue::update_process(
+	Process & p,
+	bool enabled
+) {
+	epoll_event e;
+	e.data.fd = p.fd;
+	e.events = EPOLLIN;
+	if (enabled == p.in_epoll)
+		return true;
+	if (0 > epoll_ctl(epoll.get(), enabled ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, p.fd, &e))
+		return false;
+	p.in_epoll = enabled;
+	return true;
+}
+
+inline
+void
+Queue::delete_process(
+	ProcessMap::iterator i
+) {
+	// Closing the process file descriptor removes it from the epoll set.
+	process_fds.erase(i->second.fd);
+	close(i->second.fd);
+	processes.erase(i);
+}
+
+inline
+bool
+Queue::wake_user()
+{
+	const uint64_t one(1U);
+	// EAGAIN means that the counter is already saturated, and so the waiter will be woken anyway.
+	return 0 <= write(user.get(), &one, sizeof one) || EAGAIN == errno;
+}
+
 // This routine assumes that all illegal combinations have been eliminated.
 inline
 bool 
@@ -275,9 +438,6 @@ Queue::apply_changes(
 				}
 				break;
 			}
-#if 0 // Not implemented.  Yet.
-			case EVFILT_PROC:
-#endif
 			case EVFILT_SIGNAL:
 			{
 				if (-1 != signals.get()) 
@@ -300,6 +460,24 @@ Queue::apply_changes(
 				}
 				break;
 			}
+			case EVFILT_USER:
+			{
+				if (-1 != user.get()) 
+					break;
+				user.reset(eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK));
+				if (-1 == user.get())
+					return false;
+				epoll_event e;
+				e.events = EPOLLIN;
+				e.data.fd = user.get();
+				if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_ADD, user.get(), &e)) {
+					const int error(errno);
+					user.reset(-1);
+					errno = error;
+					return false;
+				}
+				break;
+			}
 		}
 	}
 
@@ -313,13 +491,20 @@ Queue::apply_changes(
 				if (-1 == notify.get()) 
 					return errno = EINVAL, false;
 				break;
-#if 0 // Not implemented.  Yet.
 			case EVFILT_PROC:
-#endif
+				if (processes.end() == processes.find(c.ident))
+					return errno = ENOENT, false;
+				break;
 			case EVFILT_SIGNAL:
 				if (-1 == signals.get())
 					return errno = EINVAL, false;
 				break;
+			case EVFILT_USER:
+				if (-1 == user.get())
+					return errno = EINVAL, false;
+				if (user_events.end() == user_events.find(c.ident))
+					return errno = ENOENT, false;
+				break;
 		}
 	}
 
@@ -336,40 +521,34 @@ Queue::apply_changes(
 			case EVFILT_READ:
 			case EVFILT_WRITE:
 			{
-				epoll_event e;
-				e.data.fd = c.ident;
 				const uint32_t mask(EVFILT_READ == c.filter ? EPOLLIN|EPOLLHUP|EPOLLRDHUP : EPOLLOUT);
 				if (c.flags & EV_ADD) {
 					std::pair<PollFDMap::iterator, bool> r(pollfds.insert(PollFDMap::value_type(c.ident, PollFD())));
 					const PollFDMap::iterator & pi(r.first);
 					pi->second.added_events |= mask;
+					if (EVFILT_READ == c.filter)
+						pi->second.count_readable = c.fflags & NOTE_FIONREAD;
 					if (c.flags & EV_DISABLE)
 						pi->second.enabled_events &= ~mask;
 					else
 						pi->second.enabled_events |= mask;
-					e.events = pi->second.mask();
-					if (r.second) {
-						if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_ADD, c.ident, &e))
-							return false;
-					} else {
-						if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_MOD, c.ident, &e))
-							return false;
+					if (!update_pollfd(c.ident, pi->second)) {
+						if (r.second) {
+							const int error(errno);
+							pollfds.erase(pi);
+							errno = error;
+						}
+						return false;
 					}
 				} else
 				if (c.flags & EV_DELETE) {
 					const PollFDMap::iterator pi(pollfds.find(c.ident));
 					if (pi != pollfds.end()) {
 						pi->second.added_events &= ~mask;
-						if (!pi->second.added_events) {
-							e.events = 0;
-							if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_DEL, c.ident, &e))
-								return false;
+						if (!update_pollfd(c.ident, pi->second))
+							return false;
+						if (!pi->second.added_events)
 							pollfds.erase(pi);
-						} else {
-							e.events = pi->second.mask();
-							if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_MOD, c.ident, &e))
-								return false;
-						}
 					} else
 						return errno = EINVAL, false;
 				} else
@@ -377,8 +556,7 @@ Queue::apply_changes(
 					const PollFDMap::iterator pi(pollfds.find(c.ident));
 					if (pi != pollfds.end()) {
 						pi->second.enabled_events |= mask;
-						e.events = pi->second.mask();
-						if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_MOD, c.ident, &e))
+						if (!update_pollfd(c.ident, pi->second))
 							return false;
 					} else
 						return errno = EINVAL, false;
@@ -387,8 +565,7 @@ Queue::apply_changes(
 					const PollFDMap::iterator pi(pollfds.find(c.ident));
 					if (pi != pollfds.end()) {
 						pi->second.enabled_events &= ~mask;
-						e.events = pi->second.mask();
-						if (0 > epoll_ctl(epoll.get(), EPOLL_CTL_MOD, c.ident, &e))
+						if (!update_pollfd(c.ident, pi->second))
 							return false;
 					} else
 						return errno = EINVAL, false;
@@ -451,9 +628,62 @@ Queue::apply_changes(
 				}
 				break;
 			}
-#if 0 // Not implemented.  Yet.
+			case EVFILT_USER:
+			{
+				if (c.flags & EV_DELETE) {
+					user_events.erase(c.ident);
+					break;
+				}
+				UserEvent & u(user_events[c.ident]);
+				if (c.flags & EV_ADD)
+					u.clear = c.flags & EV_CLEAR;
+				if (c.flags & EV_DISABLE)
+					u.enabled = false;
+				else
+				if (c.flags & (EV_ADD|EV_ENABLE))
+					u.enabled = true;
+				u.change_fflags(c.fflags);
+				if (c.fflags & NOTE_TRIGGER)
+					u.triggered = true;
+				if (u.triggered && u.enabled && !wake_user())
+					return false;
+				break;
+			}
 			case EVFILT_PROC:
-#endif
+			{
+				const int pid(c.ident);
+				if (c.flags & EV_DELETE) {
+					const ProcessMap::iterator pi(processes.find(pid));
+					if (pi == processes.end())
+						return errno = ENOENT, false;
+					delete_process(pi);
+					break;
+				}
+				const ProcessMap::iterator pi(processes.find(pid));
+				if (pi != processes.end()) {
+					Process & p(pi->second);
+					if (c.flags & EV_ADD)
+						p.wanted_notes = c.fflags;
+					if (!update_process(p, !(c.flags & EV_DISABLE)))
+						return false;
+				} else
+				if (c.flags & EV_ADD) {
+					Process p;
+					p.fd = pidfd_open(pid, 0);
+					if (0 > p.fd)
+						return false;
+					p.wanted_notes = c.fflags;
+					if (!update_process(p, !(c.flags & EV_DISABLE))) {
+						const int error(errno);
+						close(p.fd);
+						errno = error;
+						return false;
+					}
+					processes[pid] = p;
+					process_fds[p.fd] = pid;
+				}
+				break;
+			}
 			case EVFILT_SIGNAL:
 				mask_changed = true;
 
@@ -518,6 +748,8 @@ Queue::wait(
 
 	int nreturn(0);
 
+	std::unique_lock<std::mutex> l(lock);
+
 	if (!pending.empty()) {
 		while (nreturn < nevents) {
 			pevents[nreturn++] = pending.front();
@@ -527,6 +759,9 @@ Queue::wait(
 		return nreturn;
 	}
 
+	// Other threads must be able to make changes, such as triggering user events, whilst we are blocked.
+	l.unlock();
+
 	if (timeout) {
 		pollfd p[1];
 		p[0].fd = epoll.get();
@@ -552,6 +787,8 @@ Queue::wait(
 	const int rc(epoll_wait(epoll.get(), events.data(), events.size(), -1));
 	if (0 > rc) return rc;
 
+	l.lock();
+
 	for (int i(0); i < rc; ++i) {
 		const struct epoll_event & e(events[i]);
 		if (signals.get() == e.data.fd) {
@@ -593,16 +830,62 @@ Queue::wait(
 				}
 			}
 		} else
+		if (process_fds.end() != process_fds.find(e.data.fd)) {
+			const int pid(process_fds.find(e.data.fd)->second);
+			const ProcessMap::iterator pi(processes.find(pid));
+			if (pi == processes.end())
+				continue;
+			if (pi->second.wanted_notes & NOTE_EXIT) {
+				struct kevent k;
+				EV_SET(&k, pid, EVFILT_PROC, EV_EOF, NOTE_EXIT, peek_exit_status(pid), 0);
+				return_event(nreturn, pevents, nevents, k);
+			}
+			// As on the BSDs, the event is deleted once the process has exited.
+			delete_process(pi);
+		} else
+		if (user.get() == e.data.fd) {
+			if (!(e.events & EPOLLIN))
+				continue;
+			uint64_t count;
+			if (0 > read(user.get(), &count, sizeof count))
+				continue;
+			bool still_triggered(false);
+			for (UserEventMap::iterator j(user_events.begin()); user_events.end() != j; ++j) {
+				UserEvent & u(j->second);
+				if (!u.triggered || !u.enabled)
+					continue;
+				struct kevent k;
+				EV_SET(&k, j->first, EVFILT_USER, 0, u.fflags, 0, 0);
+				return_event(nreturn, pevents, nevents, k);
+				if (u.clear) {
+					u.triggered = false;
+					u.fflags = 0U;
+				} else
+					still_triggered = true;
+			}
+			// Without EV_CLEAR, a user event stays triggered until it is deleted.
+			if (still_triggered)
+				wake_user();
+		} else
 		{
-			if (e.events & EPOLLOUT) {
+			// epoll always reports EPOLLERR and EPOLLHUP, even for filters that were never added.
+			const PollFDMap::const_iterator pi(pollfds.find(e.data.fd));
+			const uint32_t wanted(pollfds.end() != pi ? pi->second.mask() : 0U);
+			const bool count_readable(pollfds.end() != pi && pi->second.count_readable);
+			if ((wanted & EPOLLOUT) && (e.events & (EPOLLOUT|EPOLLERR|EPOLLHUP))) {
+				// A pipe whose reader has gone reports EPOLLERR; a socket whose peer has gone reports EPOLLHUP.
 				struct kevent k;
-				EV_SET(&k, e.data.fd, EVFILT_WRITE, 0, 0, 0, 0);
+				const int f(e.events & (EPOLLERR|EPOLLHUP) ? EV_EOF : 0);
+				EV_SET(&k, e.data.fd, EVFILT_WRITE, f, 0, 0, 0);
 				return_event(nreturn, pevents, nevents, k);
 			}
-			if (e.events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP)) {
+			if ((wanted & EPOLLIN) && (e.events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))) {
 				struct kevent k;
-				const int n(e.events & (EPOLLHUP|EPOLLRDHUP) ? EV_EOF : 0);
-				EV_SET(&k, e.data.fd, EVFILT_READ, n, 0, 0, 0);
+				const int f(e.events & (EPOLLHUP|EPOLLRDHUP) ? EV_EOF : 0);
+				int n(0);
+				if (count_readable && 0 > ioctl(e.data.fd, FIONREAD, &n))
+					n = 0;
+				EV_SET(&k, e.data.fd, EVFILT_READ, f, 0, n, 0);
 				return_event(nreturn, pevents, nevents, k);
 			}
 		}
@@ -618,6 +901,7 @@ kqueue_linux()
 	FileDescriptorOwner fd(epoll_create1(EPOLL_CLOEXEC));
 	if (0 > fd.get()) return fd.release();
 
+	const std::lock_guard<std::mutex> l(queues_lock);
 	Queue * & pq(queues[fd.get()]);
 	if (pq) 
 		delete pq;
@@ -638,16 +922,25 @@ kevent_linux(
 	int nevents,
 	const struct timespec* timeout
 ) {
-	QueueMap::iterator i(queues.find(fd));
-	if (queues.end() == i)
-		return errno = EBADF, -1;
-	Queue & q(*i->second);
+	Queue * pq(0);
+	{
+		const std::lock_guard<std::mutex> l(queues_lock);
+		QueueMap::iterator i(queues.find(fd));
+		if (queues.end() == i || !i->second)
+			return errno = EBADF, -1;
+		pq = i->second;
+	}
+	Queue & q(*pq);
 
-	if (!q.legal_changes(pchanges, nchanges))
-		return errno = EINVAL, -1;
+	{
+		const std::lock_guard<std::mutex> l(q.lock);
 
-	if (!q.apply_changes(pchanges, nchanges))
-		return -1;
+		if (!q.legal_changes(pchanges, nchanges))
+			return errno = EINVAL, -1;
+
+		if (!q.apply_changes(pchanges, nchanges))
+			return -1;
+	}
 
 	return q.wait(pevents, nevents, timeout);
 }
@@ -31,10 +31,9 @@ enum {	// Filter types
 	EVFILT_READ	= -1,
 	EVFILT_WRITE	= -2,
 	EVFILT_VNODE	= -4,
-#if 0 // Not implemented.  Yet.
 	EVFILT_PROC	= -5,
-#endif
 	EVFILT_SIGNAL	= -6,
+	EVFILT_USER	= -11,
 };
 
 enum {	// Flags
@@ -61,6 +60,23 @@ enum { // Notes for VNODE filters
 	NOTE_RENAME	= 0x0020,
 	NOTE_REVOKE	= 0x0040
 };
+
+enum { // Notes for READ filters
+	NOTE_FIONREAD	= 0x00010000	///< an extension: obtain the number of bytes available in data, which BSD kqueue always does
+};
+enum { // Notes for PROC filters
+	NOTE_EXIT	= 0x80000000
+};
+
+enum { // Notes for USER filters
+	NOTE_FFNOP	= 0x00000000,
+	NOTE_FFAND	= 0x40000000,
+	NOTE_FFOR	= 0x80000000,
+	NOTE_FFCOPY	= 0xc0000000,
+	NOTE_FFCTRLMASK	= 0xc0000000,
+	NOTE_FFLAGSMASK	= 0x00ffffff,
+	NOTE_TRIGGER	= 0x01000000
+};
 	
 extern "C" int kqueue_linux();
 extern "C" int kevent_linux(int, const struct kevent *, int, struct kevent *, int, const struct timespec*);
@@ -0,0 +1,34 @@
+/* COPYING ******************************************************************
+For copyright and licensing terms, see the file named COPYING.
+// **************************************************************************
+*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fdutils.h"
+
+/// An anonymous file, which vanishes once the last descriptor to it is closed.
+extern
+int
+open_anonymous_file (
+	const char * name
+) {
+#if defined(__LINUX__) || defined(__linux__)
+	return memfd_create(name, MFD_CLOEXEC);
+#elif defined(__FreeBSD__) || defined(__DragonFly__)
+	static_cast<void>(name);	// Silence a compiler warning.
+	return shm_open(SHM_ANON, O_RDWR|O_CLOEXEC, 0600);
+#else
+	std::string filename(std::string("/tmp/") + name + ".XXXXXX");
+	const int fd(mkstemp(&filename[0]));
+	if (0 <= fd) {
+		unlink(filename.c_str());
+		set_close_on_exec(fd, true);
+	}
+	return fd;
+#endif
+}
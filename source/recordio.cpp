@@ -9,12 +9,8 @@ For copyright and licensing terms, see the file named COPYING.
 #include <cstring>
 #include <csignal>
 #include <cerrno>
-#if defined(__LINUX__) || defined(__linux__)
-#include "kqueue_linux.h"
-#else
 #include <sys/types.h>
-#include <sys/event.h>
-#endif
+#include "kqueue_common.h"
 #include <unistd.h>
 #include "popt.h"
 #include "utils.h"
@@ -153,14 +149,15 @@ recordio (
 	PreventDefaultForFatalSignals ignored_signals(SIGPIPE, 0);
 
 	struct kevent p[2];
-	EV_SET(&p[0], STDIN_FILENO, EVFILT_READ, EV_ADD, 0, 0, 0);
-	EV_SET(&p[1], output_fds[0], EVFILT_READ, EV_ADD, 0, 0, 0);
+	EV_SET(&p[0], STDIN_FILENO, EVFILT_READ, EV_ADD, NOTE_FIONREAD, 0, 0);
+	EV_SET(&p[1], output_fds[0], EVFILT_READ, EV_ADD, NOTE_FIONREAD, 0, 0);
 	if (0 > kevent(queue, p, sizeof p/sizeof *p, 0, 0, 0)) {
 		const int error(errno);
 		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "kevent", std::strerror(error));
 		throw EXIT_FAILURE;
 	}
 
+	std::vector<char> buf(4096U);
 	for (;;) {
 		const int rc(kevent(queue, 0, 0, p, sizeof p/sizeof *p, 0));
 		if (0 > rc) {
@@ -174,8 +171,7 @@ recordio (
 			if (EVFILT_READ != e.filter) 
 				continue;
 			const int fd(static_cast<int>(e.ident));
-			char buf [4096];
-			const ssize_t n(read(fd, buf, sizeof buf));
+			const ssize_t n(read_waiting(fd, buf, e.data));
 			if (output_fds[0] == fd) {
 				if (0 > n) {
 					const int error(errno);
@@ -183,9 +179,9 @@ recordio (
 					std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "read-pipe", std::strerror(error));
 					throw EXIT_FAILURE;
 				}
-				log('>', buf, n);
+				log('>', buf.data(), n);
 				if (0 != n)
-					writeall(STDOUT_FILENO, buf, n);
+					writeall(STDOUT_FILENO, buf.data(), n);
 				else {
 					close(STDOUT_FILENO);
 					EV_SET(&p[0], fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
@@ -204,9 +200,9 @@ recordio (
 					std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "read-stdin", std::strerror(error));
 					throw EXIT_FAILURE;
 				}
-				log('<', buf, n);
+				log('<', buf.data(), n);
 				if (0 != n)
-					writeall(input_fds[1], buf, n);
+					writeall(input_fds[1], buf.data(), n);
 				else {
 					close(input_fds[1]); input_fds[1] = -1;
 					EV_SET(&p[0], fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
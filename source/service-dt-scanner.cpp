@@ -4,6 +4,10 @@ For copyright and licensing terms, see the file named COPYING.
 */
 
 #include <vector>
+#include <map>
+#include <string>
+#include <utility>
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <csignal>
@@ -21,6 +25,7 @@ For copyright and licensing terms, see the file named COPYING.
 #include "utils.h"
 #include "fdutils.h"
 #include "service-manager-client.h"
+#include "service-manager.h"
 #include "FileDescriptorOwner.h"
 #include "DirStar.h"
 
@@ -28,30 +33,171 @@ For copyright and licensing terms, see the file named COPYING.
 // **************************************************************************
 */
 
-static 
+namespace {
+
+/// \brief A service to be started once the batch that loads it has completed.
+struct pending_start {
+	pending_start(const std::string & n, const char * w, int s, std::size_t o) : name(n), what(w), supervise_dir_fd(s), op(o) {}
+	std::string name;
+	const char * what;
+	int supervise_dir_fd;	///< owned
+	std::size_t op;		///< the index of the load operation in the batch
+};
+typedef std::vector<pending_start> pending_start_list;
+
+/// \brief The load operations in a batch, each with the name of the bundle that it is for.
+typedef std::vector<std::pair<std::string, std::size_t> > pending_load_list;
+
+}
+
+/// Send the batch, and start the services that it has loaded.
+/// The names of bundles whose loads failed, or were not answered in time, are added to failed.
+static
 void
-rescan (
+commit (
+	const char * prog,
+	ServiceManagerRPCBatch & batch,
+	pending_start_list & starts,
+	pending_load_list & loads,
+	std::vector<std::string> & failed
+) {
+	const std::vector<int> statuses(batch.commit(5000));
+	for (pending_load_list::const_iterator i(loads.begin()); loads.end() != i; ++i)
+		if (statuses[i->second])
+			failed.push_back(i->first);
+	loads.clear();
+	for (pending_start_list::const_iterator i(starts.begin()); starts.end() != i; ++i) {
+		if (statuses[i->op])
+			std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, i->name.c_str(), i->what, "Unable to load service bundle.");
+		else
+			start(i->supervise_dir_fd);
+		close(i->supervise_dir_fd);
+	}
+	starts.clear();
+}
+
+/// Load and plumb one bundle, and its log, queueing them in the batch.
+/// \returns false if anything went wrong, so that the bundle should be tried again at the next rescan
+static
+bool
+scan_bundle (
 	const char * prog,
+	const int scan_dir_fd,
 	const char * name,
-	const int socket_fd,
-	const int retained_scan_dir_fd,
+	ServiceManagerRPCBatch & batch,
+	pending_start_list & starts,
+	pending_load_list & loads,
 	const bool input_activation
 ) {
-	FileDescriptorOwner scan_dir_fd(dup(retained_scan_dir_fd));
-	if (0 > scan_dir_fd.get()) {
-exit_scan:
-		const int error(errno);
-		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, name, std::strerror(error));
-		return;
+	bool ok(true);
+	const int bundle_dir_fd(open_dir_at(scan_dir_fd, name));
+	if (0 <= bundle_dir_fd) {
+		int service_dir_fd(open_service_dir(bundle_dir_fd));
+		if (0 <= service_dir_fd) {
+			make_supervise(bundle_dir_fd);
+			const int supervise_dir_fd(open_supervise_dir(bundle_dir_fd));
+			if (0 <= supervise_dir_fd) {
+				const bool was_already_loaded(is_ok(supervise_dir_fd));
+				std::size_t load_op(0U);
+				if (!was_already_loaded) {
+					make_supervise_fifos(supervise_dir_fd);
+					load_op = batch.load(name, supervise_dir_fd, service_dir_fd);
+					loads.push_back(pending_load_list::value_type(name, load_op));
+				}
+				const int log_bundle_dir_fd(open_dir_at(bundle_dir_fd, "log/"));
+				if (0 <= log_bundle_dir_fd) {
+					const std::string log_name(name + std::string("/log"));
+					int log_service_dir_fd(open_service_dir(log_bundle_dir_fd));
+					if (0 <= log_service_dir_fd) {
+						make_supervise(log_bundle_dir_fd);
+						const int log_supervise_dir_fd(open_supervise_dir(log_bundle_dir_fd));
+						if (0 <= log_supervise_dir_fd) {
+							const bool log_was_already_loaded(is_ok(log_supervise_dir_fd));
+							std::size_t log_load_op(0U);
+							if (!log_was_already_loaded) {
+								make_supervise_fifos(log_supervise_dir_fd);
+								log_load_op = batch.load(log_name.c_str(), log_supervise_dir_fd, log_service_dir_fd);
+								loads.push_back(pending_load_list::value_type(name, log_load_op));
+								batch.make_pipe_connectable(log_supervise_dir_fd, pipe_capacity(log_service_dir_fd));
+							}
+							batch.plumb(supervise_dir_fd, log_supervise_dir_fd);
+							if (!log_was_already_loaded) {
+								if (input_activation) 
+									batch.make_input_activated(log_supervise_dir_fd);
+								else {
+									if (is_initially_up(log_service_dir_fd)) {
+										const int fd(dup(log_supervise_dir_fd));
+										if (0 <= fd)
+											starts.push_back(pending_start(name, "log/supervise/ok", fd, log_load_op));
+									} else
+										std::fprintf(stderr, "%s: INFO: %s/%s: %s\n", prog, name, "log", "Service is initially down.");
+								}
+							}
+							close(log_supervise_dir_fd);
+						} else {
+							std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, "log/supervise", std::strerror(errno));
+							ok = false;
+						}
+						close(log_service_dir_fd);
+					} else {
+						std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, "log/service", std::strerror(errno));
+						ok = false;
+					}
+					close(log_bundle_dir_fd);
+				} else
+					std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, "log", std::strerror(errno));
+				if (!was_already_loaded) {
+					if (is_initially_up(service_dir_fd)) {
+						const int fd(dup(supervise_dir_fd));
+						if (0 <= fd)
+							starts.push_back(pending_start(name, "supervise/ok", fd, load_op));
+					} else
+						std::fprintf(stderr, "%s: INFO: %s: %s\n", prog, name, "Service is initially down.");
+				}
+				close(supervise_dir_fd);
+			} else {
+				std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, "supervise", std::strerror(errno));
+				ok = false;
+			}
+			close(service_dir_fd);
+		} else {
+			std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, "service", std::strerror(errno));
+			ok = false;
+		}
+		close(bundle_dir_fd);
+	} else {
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, name, std::strerror(errno));
+		ok = false;
 	}
+	return ok;
+}
+
+namespace {
+
+/// \brief The bundles that have been successfully scanned, by name, with the inode numbers of their directory entries.
+/// A rescan only looks at directory entries that are not in the index or whose inode numbers have changed, so its cost is proportional to the number of changed entries rather than to the size of the directory.
+typedef std::map<std::string, ino_t> scan_index;
+typedef std::vector<std::pair<std::string, ino_t> > scan_snapshot;
+
+}
+
+/// Read the names and inode numbers of the entries in the scan directory that could be bundles, sorted by name.
+static
+bool
+read_snapshot (
+	const int retained_scan_dir_fd,
+	scan_snapshot & snapshot
+) {
+	FileDescriptorOwner scan_dir_fd(dup(retained_scan_dir_fd));
+	if (0 > scan_dir_fd.get()) return false;
 	const DirStar scan_dir(scan_dir_fd);
-	if (!scan_dir) goto exit_scan;
+	if (!scan_dir) return false;
 	rewinddir(scan_dir);	// because the last pass left it at EOF.
 	for (;;) {
 		errno = 0;
 		const dirent * entry(readdir(scan_dir));
 		if (!entry) {
-			if (errno) goto exit_scan;
+			if (errno) return false;
 			break;
 		}
 #if defined(_DIRENT_HAVE_D_NAMLEN)
@@ -62,81 +208,65 @@ exit_scan:
 #if defined(_DIRENT_HAVE_D_TYPE)
 		if (DT_DIR != entry->d_type && DT_LNK != entry->d_type) continue;
 #endif
+		snapshot.push_back(scan_snapshot::value_type(entry->d_name, entry->d_ino));
+	}
+	std::sort(snapshot.begin(), snapshot.end());
+	return true;
+}
 
-		const int bundle_dir_fd(open_dir_at(scan_dir.fd(), entry->d_name));
-		if (0 <= bundle_dir_fd) {
-			int service_dir_fd(open_service_dir(bundle_dir_fd));
-			if (0 <= service_dir_fd) {
-				make_supervise(bundle_dir_fd);
-				const int supervise_dir_fd(open_supervise_dir(bundle_dir_fd));
-				if (0 <= supervise_dir_fd) {
-					const bool was_already_loaded(is_ok(supervise_dir_fd));
-					if (!was_already_loaded) {
-						make_supervise_fifos(supervise_dir_fd);
-						load(prog, socket_fd, entry->d_name, supervise_dir_fd, service_dir_fd);
-					}
-					const int log_bundle_dir_fd(open_dir_at(bundle_dir_fd, "log/"));
-					if (0 <= log_bundle_dir_fd) {
-						char log_name[NAME_MAX + sizeof "/log"];
-						std::strncpy(log_name, entry->d_name, sizeof log_name);
-#if defined(_DIRENT_HAVE_D_NAMLEN)
-						std::strncat(log_name, "/log", sizeof log_name - entry->d_namelen);
-#else
-						std::strncat(log_name, "/log", sizeof log_name - std::strlen(entry->d_name));
-#endif
-						int log_service_dir_fd(open_service_dir(log_bundle_dir_fd));
-						if (0 <= log_service_dir_fd) {
-							make_supervise(log_bundle_dir_fd);
-							const int log_supervise_dir_fd(open_supervise_dir(log_bundle_dir_fd));
-							if (0 <= log_supervise_dir_fd) {
-								const bool log_was_already_loaded(is_ok(log_supervise_dir_fd));
-								if (!log_was_already_loaded) {
-									make_supervise_fifos(log_supervise_dir_fd);
-									load(prog, socket_fd, log_name, log_supervise_dir_fd, log_service_dir_fd);
-									make_pipe_connectable(prog, socket_fd, log_supervise_dir_fd);
-								}
-								plumb(prog, socket_fd, supervise_dir_fd, log_supervise_dir_fd);
-								if (!log_was_already_loaded) {
-									if (input_activation) 
-										make_input_activated(prog, socket_fd, log_supervise_dir_fd);
-									else {
-										if (is_initially_up(log_service_dir_fd)) {
-											if (!wait_ok(log_supervise_dir_fd, 5000))
-												std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, entry->d_name, "log/supervise/ok", "Unable to load service bundle.");
-											else
-												start(log_supervise_dir_fd);
-										} else
-											std::fprintf(stderr, "%s: INFO: %s/%s: %s\n", prog, entry->d_name, "log", "Service is initially down.");
-									}
-								}
-								close(log_supervise_dir_fd);
-							} else
-								std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, entry->d_name, "log/supervise", std::strerror(errno));
-							close(log_service_dir_fd);
-						} else
-							std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, entry->d_name, "log/service", std::strerror(errno));
-						close(log_bundle_dir_fd);
-					} else
-						std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, entry->d_name, "log", std::strerror(errno));
-					if (!was_already_loaded) {
-						if (is_initially_up(service_dir_fd)) {
-							if (!wait_ok(supervise_dir_fd, 5000))
-								std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, entry->d_name, "supervise/ok", "Unable to load service bundle.");
-							else
-								start(supervise_dir_fd);
-						} else
-							std::fprintf(stderr, "%s: INFO: %s: %s\n", prog, entry->d_name, "Service is initially down.");
-					}
-					close(supervise_dir_fd);
-				} else
-					std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, entry->d_name, "supervise", std::strerror(errno));
-				close(service_dir_fd);
+/// Compare the scan directory against the index, and scan only the added, replaced, and renamed bundles.
+/// Removed bundles are simply forgotten; they remain loaded in the service manager, as they always have.
+static 
+void
+rescan (
+	const char * prog,
+	const char * name,
+	const int socket_fd,
+	const int retained_scan_dir_fd,
+	const bool input_activation,
+	scan_index & known
+) {
+	scan_snapshot snapshot;
+	if (!read_snapshot(retained_scan_dir_fd, snapshot)) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, name, std::strerror(error));
+		return;
+	}
+	// Loads and plumbings are sent to the service manager in batches; services are started once their batches have completed.
+	ServiceManagerRPCBatch batch(prog, socket_fd);
+	pending_start_list starts;
+	pending_load_list loads;
+	std::vector<std::string> failed;
+	scan_index::iterator k(known.begin());
+	for (scan_snapshot::const_iterator i(snapshot.begin()); snapshot.end() != i; ++i) {
+		while (known.end() != k && k->first < i->first)
+			k = known.erase(k);
+		const bool is_known(known.end() != k && k->first == i->first);
+		if (is_known && k->second == i->second) {
+			++k;
+			continue;
+		}
+
+		// A bundle and its log take at most six operations.
+		if (!batch.has_room_for(6U))
+			commit(prog, batch, starts, loads, failed);
+
+		const bool ok(scan_bundle(prog, retained_scan_dir_fd, i->first.c_str(), batch, starts, loads, input_activation));
+		if (is_known) {
+			if (ok) {
+				k->second = i->second;
+				++k;
 			} else
-				std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, entry->d_name, "service", std::strerror(errno));
-			close(bundle_dir_fd);
+				k = known.erase(k);
 		} else
-			std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, entry->d_name, std::strerror(errno));
+		if (ok)
+			known.insert(k, *i);
 	}
+	known.erase(k, known.end());
+	commit(prog, batch, starts, loads, failed);
+	// Bundles that the service manager failed to load are forgotten, so that they are tried again at the next rescan.
+	for (std::vector<std::string>::const_iterator i(failed.begin()); failed.end() != i; ++i)
+		known.erase(*i);
 }
 
 /* Main function ************************************************************
@@ -205,7 +335,8 @@ service_dt_scanner [[gnu::noreturn]] (
 
 	const int socket_fd(connect_service_manager_socket(is_system, prog));
 	if (0 > socket_fd) throw EXIT_FAILURE;
-	rescan(prog, scan_directory, socket_fd, scan_dir_fd.get(), input_activation);
+	scan_index known;
+	rescan(prog, scan_directory, socket_fd, scan_dir_fd.get(), input_activation, known);
 
 	for (;;) {
 		try {
@@ -222,7 +353,7 @@ service_dt_scanner [[gnu::noreturn]] (
 				switch (e.filter) {
 					case EVFILT_VNODE:
 						if (e.ident == static_cast<uintptr_t>(scan_dir_fd.get()))
-							rescan(prog, scan_directory, socket_fd, scan_dir_fd.get(), input_activation);
+							rescan(prog, scan_directory, socket_fd, scan_dir_fd.get(), input_activation, known);
 						else
 							std::fprintf(stderr, "%s: DEBUG: vnode event ident %lu fflags %x\n", prog, e.ident, e.fflags);
 						break;
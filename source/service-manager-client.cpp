@@ -4,14 +4,25 @@ For copyright and licensing terms, see the file named COPYING.
 */
 
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include <csignal>
 #include <cstdio>
 #include <cerrno>
 #include <vector>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include "utils.h"
 #include "fdutils.h"
+#include "FileStar.h"
 #include "FileDescriptorOwner.h"
 #include "service-manager-client.h"
 #include "service-manager.h"
@@ -91,6 +102,7 @@ make_pipe_connectable (
 ) {
 	service_manager_rpc_message m;
 	m.command = m.MAKE_PIPE_CONNECTABLE;
+	m.name[0] = '\0';
 	int fds[1] = { supervise_dir_fd };
 	do_rpc_call(prog, socket_fd, &m, sizeof m, fds, sizeof fds/sizeof *fds);
 }
@@ -133,6 +145,412 @@ unload (
 }
 #endif
 
+/// Subscribe to state changes, which are sent as service_manager_state_change records over the returned socket.
+/// Service managers that do not support subscriptions simply close their end, which the subscriber sees as end of file.
+int
+subscribe_to_state_changes (
+	const char * prog,
+	int socket_fd
+) {
+	int fds[2];
+	if (0 > socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "socketpair", std::strerror(error));
+		return -1;
+	}
+	const FileDescriptorOwner manager_fd(fds[1]);
+	set_close_on_exec(fds[0], true);
+	service_manager_rpc_message m;
+	m.command = m.SUBSCRIBE;
+	do_rpc_call(prog, socket_fd, &m, sizeof m, &fds[1], 1U);
+	return fds[0];
+}
+
+/// Ask the service manager to re-execute itself, keeping all of its services, and wait for it to do so.
+/// \returns 0 on success, or an errno value
+int
+reexec_service_manager (
+	const char * prog,
+	int socket_fd
+) {
+	int fds[2];
+	if (0 > socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "socketpair", std::strerror(error));
+		return error;
+	}
+	const FileDescriptorOwner reply_fd(fds[0]);
+	{
+		const FileDescriptorOwner manager_fd(fds[1]);
+		service_manager_rpc_message m;
+		m.command = m.REEXEC;
+		do_rpc_call(prog, socket_fd, &m, sizeof m, &fds[1], 1U);
+	}
+	// Either the old program replies with why it failed, or the new program replies once it has restored the services.
+	// A service manager that does not know this request just closes the socket.
+	int32_t error(0);
+	for (;;) {
+		const ssize_t n(recv(reply_fd.get(), &error, sizeof error, 0));
+		if (0 <= n) return n < static_cast<ssize_t>(sizeof error) ? ENOSYS : error;
+		if (EINTR != errno) return errno;
+	}
+}
+
+/* Batched service manager control API RPCs *******************************
+// **************************************************************************
+*/
+
+ServiceManagerRPCBatch::ServiceManagerRPCBatch(
+	const char * p,
+	int s
+) :
+	prog(p),
+	socket_fd(s),
+	cookie(static_cast<uint32_t>(getpid()) << 16U),
+	operations(),
+	tickets(),
+	next_ticket(0U)
+{
+}
+
+ServiceManagerRPCBatch::~ServiceManagerRPCBatch()
+{
+	close_fds(operations);
+	for (ticket_map::iterator i(tickets.begin()); tickets.end() != i; ++i) {
+		close_fds(i->second.operations);
+		if (0 <= i->second.reply_fd)
+			close(i->second.reply_fd);
+	}
+}
+
+void
+ServiceManagerRPCBatch::close_fds(
+	operation_list & ops
+) {
+	for (operation_list::const_iterator i(ops.begin()); ops.end() != i; ++i) {
+		for (std::size_t j(0U); j < i->count_fds; ++j)
+			if (0 <= i->fds[j])
+				close(i->fds[j]);
+	}
+	ops.clear();
+}
+
+bool
+ServiceManagerRPCBatch::has_room_for(
+	std::size_t n
+) const {
+	return operations.size() + n <= service_manager_rpc_batch_header::MAX_OPERATIONS;
+}
+
+std::size_t
+ServiceManagerRPCBatch::add(
+	uint8_t command,
+	const char * name,
+	int fd0,
+	int fd1,
+	std::size_t count_fds
+) {
+	operation o;
+	o.command = command;
+	if (name) o.name = name;
+	o.fds[0] = 0 < count_fds ? dup(fd0) : -1;
+	o.fds[1] = 1 < count_fds ? dup(fd1) : -1;
+	o.count_fds = count_fds;
+	o.error = 0;
+	for (std::size_t j(0U); j < count_fds; ++j) {
+		if (0 > o.fds[j]) {
+			o.error = errno;
+			break;
+		}
+	}
+	if (o.error) {
+		for (std::size_t j(0U); j < count_fds; ++j)
+			if (0 <= o.fds[j])
+				close(o.fds[j]);
+		o.command = service_manager_rpc_message::NOOP;
+		o.fds[0] = o.fds[1] = -1;
+		o.count_fds = 0U;
+	}
+	operations.push_back(o);
+	return operations.size() - 1U;
+}
+
+std::size_t
+ServiceManagerRPCBatch::plumb(
+	int out_supervise_dir_fd,
+	int in_supervise_dir_fd
+) {
+	return add(service_manager_rpc_message::PLUMB, 0, out_supervise_dir_fd, in_supervise_dir_fd, 2U);
+}
+
+std::size_t
+ServiceManagerRPCBatch::load(
+	const char * name,
+	int supervise_dir_fd,
+	int service_dir_fd
+) {
+	return add(service_manager_rpc_message::LOAD, name, supervise_dir_fd, service_dir_fd, 2U);
+}
+
+/// capacity is the size in bytes to make the pipe, or 0 to leave it at the operating system's default.
+/// The capacity is a separate operation, so that a service manager that does not know it still makes the pipe.
+/// \returns the operation that makes the pipe
+std::size_t
+ServiceManagerRPCBatch::make_pipe_connectable(
+	int supervise_dir_fd,
+	std::size_t capacity
+) {
+	const std::size_t op(add(service_manager_rpc_message::MAKE_PIPE_CONNECTABLE, 0, supervise_dir_fd, -1, 1U));
+	if (capacity) {
+		char buf[64];
+		std::snprintf(buf, sizeof buf, "%zu", capacity);
+		add(service_manager_rpc_message::SET_PIPE_SIZE, buf, supervise_dir_fd, -1, 1U);
+	}
+	return op;
+}
+
+std::size_t
+ServiceManagerRPCBatch::make_input_activated(
+	int supervise_dir_fd
+) {
+	return add(service_manager_rpc_message::MAKE_INPUT_ACTIVATED, 0, supervise_dir_fd, -1, 1U);
+}
+
+std::size_t
+ServiceManagerRPCBatch::make_run_on_empty(
+	int supervise_dir_fd
+) {
+	return add(service_manager_rpc_message::MAKE_RUN_ON_EMPTY, 0, supervise_dir_fd, -1, 1U);
+}
+
+std::size_t
+ServiceManagerRPCBatch::make_socket_activated(
+	int supervise_dir_fd,
+	int listen_fd,
+	bool accept_connections,
+	unsigned long connection_limit
+) {
+	if (!accept_connections)
+		return add(service_manager_rpc_message::MAKE_SOCKET_ACTIVATED, 0, supervise_dir_fd, listen_fd, 2U);
+	if (!connection_limit)
+		return add(service_manager_rpc_message::MAKE_SOCKET_ACTIVATED, "accept", supervise_dir_fd, listen_fd, 2U);
+	char buf[64];
+	std::snprintf(buf, sizeof buf, "accept:%lu", connection_limit);
+	return add(service_manager_rpc_message::MAKE_SOCKET_ACTIVATED, buf, supervise_dir_fd, listen_fd, 2U);
+}
+
+/// Failures to send are recorded as the statuses of the operations; successful sends are recorded as awaiting replies.
+void
+ServiceManagerRPCBatch::send_batch(
+	ticket_info & t,
+	std::size_t first,
+	std::size_t last,
+	int manager_reply_fd
+) {
+	service_manager_rpc_batch_header h;
+	h.command = service_manager_rpc_message::BATCH;
+	h.version = service_manager_rpc_batch_header::VERSION;
+	h.count = last - first;
+	h.cookie = ++cookie;
+	std::vector<char> body(reinterpret_cast<const char *>(&h), reinterpret_cast<const char *>(&h + 1));
+	std::vector<int> fds(1U, manager_reply_fd);
+	for (std::size_t i(first); i < last; ++i) {
+		const operation & o(t.operations[i]);
+		service_manager_rpc_batch_operation e;
+		e.command = o.command;
+		e.count_fds = o.count_fds;
+		e.name_length = o.name.length();
+		body.insert(body.end(), reinterpret_cast<const char *>(&e), reinterpret_cast<const char *>(&e + 1));
+		body.insert(body.end(), o.name.begin(), o.name.end());
+		fds.insert(fds.end(), o.fds, o.fds + o.count_fds);
+	}
+
+	struct iovec v[1] = { { body.data(), body.size() } };
+	std::vector<char> buf(CMSG_SPACE(fds.size() * sizeof(int)));
+	struct msghdr msg = {
+		0, 0,
+		v, sizeof v/sizeof *v,
+		buf.data(), static_cast<socklen_t>(buf.size()),
+		0
+	};
+	struct cmsghdr *cmsg(CMSG_FIRSTHDR(&msg));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+	for (unsigned retries(0U); ; ++retries) {
+		const int rc(sendmsg(socket_fd, &msg, 0));
+		if (0 <= rc) break;
+		const int error(errno);
+		// Some systems have quite small limits on datagram sizes, so fall back to smaller batches.
+		if (EMSGSIZE == error && 1U < last - first) {
+			const std::size_t middle(first + (last - first) / 2U);
+			send_batch(t, first, middle, manager_reply_fd);
+			send_batch(t, middle, last, manager_reply_fd);
+			return;
+		}
+		if (ENOBUFS != error || retries >= 5U) {
+			std::fprintf(stderr, "%s: FATAL: %s\n", prog, std::strerror(error));
+			for (std::size_t i(first); i < last; ++i)
+				t.statuses[i] = error;
+			return;
+		}
+		sleep(1);
+	}
+	t.awaited.push_back(datagram(h.cookie, first, last));
+}
+
+void
+ServiceManagerRPCBatch::send_singly(
+	ticket_info & t,
+	std::size_t first,
+	std::size_t last,
+	int timeout
+) {
+	for (std::size_t i(first); i < last; ++i) {
+		const operation & o(t.operations[i]);
+		if (service_manager_rpc_message::NOOP == o.command) continue;
+		service_manager_rpc_message m;
+		m.command = o.command;
+		std::strncpy(m.name, o.name.c_str(), sizeof m.name);
+		do_rpc_call(prog, socket_fd, &m, sizeof m, o.fds, o.count_fds);
+	}
+	for (std::size_t i(first); i < last; ++i) {
+		const operation & o(t.operations[i]);
+		if (service_manager_rpc_message::LOAD == o.command)
+			t.statuses[i] = wait_ok(o.fds[0], timeout) ? 0 : ETIMEDOUT;
+		else
+			t.statuses[i] = 0;
+	}
+}
+
+std::size_t
+ServiceManagerRPCBatch::send()
+{
+	const std::size_t ticket(next_ticket++);
+	ticket_info & t(tickets[ticket]);
+	t.operations.swap(operations);
+	t.statuses.resize(t.operations.size(), 0);
+	if (t.operations.empty()) return ticket;
+
+	int reply_fds[2];
+	if (0 > socketpair(AF_UNIX, SOCK_SEQPACKET, 0, reply_fds)) {
+		const int error(errno);
+		for (std::size_t i(0U); i < t.statuses.size(); ++i)
+			t.statuses[i] = error;
+		return ticket;
+	}
+	t.reply_fd = reply_fds[0];
+	// Our copy of the reply socket must be closed so that we see EOF if the service manager closes its copy without replying.
+	const FileDescriptorOwner manager_reply_fd(reply_fds[1]);
+	send_batch(t, 0U, t.operations.size(), manager_reply_fd.get());
+	return ticket;
+}
+
+/// Gives up on any replies still awaited, apart from those for operations that are to be sent singly.
+void
+ServiceManagerRPCBatch::fail_awaited(
+	ticket_info & t,
+	int error
+) {
+	for (datagram_list::iterator j(t.awaited.begin()); t.awaited.end() != j; ) {
+		if (j->singly) {
+			++j;
+			continue;
+		}
+		for (std::size_t k(j->first); k < j->last; ++k)
+			t.statuses[k] = error;
+		j = t.awaited.erase(j);
+	}
+}
+
+int
+ServiceManagerRPCBatch::reply_fd(
+	std::size_t ticket
+) const {
+	const ticket_map::const_iterator i(tickets.find(ticket));
+	if (tickets.end() == i) return -1;
+	const ticket_info & t(i->second);
+	for (datagram_list::const_iterator j(t.awaited.begin()); t.awaited.end() != j; ++j)
+		if (!j->singly)
+			return t.reply_fd;
+	return -1;
+}
+
+bool
+ServiceManagerRPCBatch::receive(
+	std::size_t ticket
+) {
+	const ticket_map::iterator i(tickets.find(ticket));
+	if (tickets.end() == i) return true;
+	ticket_info & t(i->second);
+	for (;;) {
+		datagram_list::iterator d(t.awaited.begin());
+		while (t.awaited.end() != d && d->singly) ++d;
+		if (t.awaited.end() == d) return true;
+
+		service_manager_rpc_batch_reply r;
+		const ssize_t n(recv(t.reply_fd, &r, sizeof r, MSG_DONTWAIT));
+		if (0 > n) {
+			const int error(errno);
+			if (EINTR == error) continue;
+			if (EAGAIN == error || EWOULDBLOCK == error) return false;
+			fail_awaited(t, error);
+			return true;
+		}
+		// The service manager closing its end without replying means that it discarded the batch, not understanding it.
+		if (0 == n) {
+			for (datagram_list::iterator j(t.awaited.begin()); t.awaited.end() != j; ++j)
+				j->singly = true;
+			return true;
+		}
+		const std::size_t header_size(sizeof r - sizeof r.statuses);
+		if (header_size > static_cast<std::size_t>(n)) continue;
+		while (t.awaited.end() != d && d->cookie != r.cookie) ++d;
+		if (t.awaited.end() == d) continue;
+		if (EPROTONOSUPPORT == r.error && 0U == r.count) {
+			d->singly = true;
+			continue;
+		}
+		const std::size_t count(std::min<std::size_t>(r.count, (n - header_size) / sizeof *r.statuses));
+		for (std::size_t k(d->first); k < d->last; ++k)
+			t.statuses[k] = k - d->first < count ? r.statuses[k - d->first] : r.error ? r.error : EIO;
+		t.awaited.erase(d);
+	}
+}
+
+std::vector<int>
+ServiceManagerRPCBatch::collect(
+	std::size_t ticket,
+	int timeout
+) {
+	const ticket_map::iterator i(tickets.find(ticket));
+	if (tickets.end() == i) return std::vector<int>();
+	ticket_info & t(i->second);
+	while (!receive(ticket)) {
+		pollfd p;
+		p.fd = t.reply_fd;
+		p.events = POLLIN;
+		const int rc(poll(&p, 1, timeout));
+		if (0 < rc) continue;
+		const int error(0 == rc ? ETIMEDOUT : errno);
+		if (EINTR == error) continue;
+		fail_awaited(t, error);
+	}
+	for (datagram_list::const_iterator j(t.awaited.begin()); t.awaited.end() != j; ++j)
+		send_singly(t, j->first, j->last, timeout);
+	for (std::size_t k(0U); k < t.operations.size(); ++k)
+		if (t.operations[k].error)
+			t.statuses[k] = t.operations[k].error;
+	std::vector<int> statuses;
+	statuses.swap(t.statuses);
+	close_fds(t.operations);
+	if (0 <= t.reply_fd)
+		close(t.reply_fd);
+	tickets.erase(i);
+	return statuses;
+}
+
 static
 int
 send_control_command (
@@ -284,6 +702,180 @@ wait_ok (
 	}
 }
 
+/* The service manager's status table **************************************
+// **************************************************************************
+*/
+
+ServiceManagerStatusTable::ServiceManagerStatusTable(
+	bool is_system
+) :
+	header(0),
+	length(0U),
+	index()
+{
+	const FileDescriptorOwner fd(open_service_manager_status_table(is_system));
+	if (0 > fd.get()) return;
+	struct stat s;
+	if (0 > fstat(fd.get(), &s) || static_cast<std::size_t>(s.st_size) < sizeof *header) return;
+	void * const base(mmap(0, s.st_size, PROT_READ, MAP_SHARED, fd.get(), 0));
+	if (MAP_FAILED == base) return;
+	header = static_cast<const service_manager_status_table_header *>(base);
+	length = s.st_size;
+	const uint32_t pid(__atomic_load_n(&header->pid, __ATOMIC_ACQUIRE));
+	if (service_manager_status_table_header::MAGIC != __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE)
+	||  service_manager_status_table_header::VERSION != header->version
+	||  sizeof(service_manager_status_table_slot) != header->slot_size
+	||  sizeof *header + header->slot_count * sizeof(service_manager_status_table_slot) > length
+	// A table left behind by a service manager that has since died is stale.
+	||  !pid
+	||  (0 > kill(pid, 0) && EPERM != errno)
+	) {
+		munmap(const_cast<service_manager_status_table_header *>(header), length);
+		header = 0;
+		length = 0U;
+		return;
+	}
+	// Index the slots once, so that looking up each of many services does not scan the whole table.
+	// Slots that are reused afterwards are caught by read(), which checks the identity of the slot that it copies.
+	const service_manager_status_table_slot * const slots(reinterpret_cast<const service_manager_status_table_slot *>(header + 1));
+	const uint32_t used(std::min(__atomic_load_n(&header->used, __ATOMIC_ACQUIRE), header->slot_count));
+	index.reserve(used);
+	for (uint32_t n(0U); n < used; ++n) {
+		const service_manager_status_table_slot & slot(slots[n]);
+		if (!__atomic_load_n(&slot.in_use, __ATOMIC_RELAXED)) continue;
+		index.push_back(std::make_pair(key(__atomic_load_n(&slot.dev, __ATOMIC_RELAXED), __atomic_load_n(&slot.ino, __ATOMIC_RELAXED)), n));
+	}
+	std::sort(index.begin(), index.end());
+}
+
+ServiceManagerStatusTable::~ServiceManagerStatusTable()
+{
+	if (header)
+		munmap(const_cast<service_manager_status_table_header *>(header), length);
+}
+
+unsigned int
+ServiceManagerStatusTable::read(
+	const int supervise_dir_fd,
+	char status[EXTENDED_STATUS_BLOCK_SIZE]
+) const {
+	if (!header || !__atomic_load_n(&header->pid, __ATOMIC_ACQUIRE)) return 0U;
+	struct stat s;
+	if (0 > fstat(supervise_dir_fd, &s)) return 0U;
+	const service_manager_status_table_slot * const slots(reinterpret_cast<const service_manager_status_table_slot *>(header + 1));
+	const key k(s.st_dev, s.st_ino);
+	for (std::vector<std::pair<key, uint32_t> >::const_iterator i(std::lower_bound(index.begin(), index.end(), std::make_pair(k, uint32_t(0U)))); index.end() != i && k == i->first; ++i) {
+		const service_manager_status_table_slot & slot(slots[i->second]);
+		// A sequence lock: retry the copy whilst the service manager is part way through writing the slot.
+		// A service manager that died part way through leaves the slot permanently odd, so the retries are bounded.
+		for (unsigned tries(0U); tries < 1000U; ++tries) {
+			const uint32_t before(__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE));
+			if (before & 1U) continue;
+			service_manager_status_table_slot copy;
+			std::memcpy(&copy, &slot, sizeof copy);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (before != __atomic_load_n(&slot.sequence, __ATOMIC_RELAXED)) continue;
+			if (!copy.in_use || static_cast<uint64_t>(s.st_dev) != copy.dev || static_cast<uint64_t>(s.st_ino) != copy.ino) break;
+			std::memcpy(status, copy.status, sizeof copy.status);
+			return sizeof copy.status;
+		}
+	}
+	return 0U;
+}
+
+/* Status snapshots *********************************************************
+// **************************************************************************
+*/
+
+ServiceManagerSnapshot::ServiceManagerSnapshot(
+	const char * prog,
+	bool is_system,
+	int timeout	///< in milliseconds
+) :
+	slots(),
+	index(),
+	taken(false)
+{
+	const FileDescriptorOwner socket_fd(open_service_manager_socket(is_system));
+	if (0 > socket_fd.get()) return;
+	int fds[2];
+	if (0 > socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) return;
+	const FileDescriptorOwner reply_fd(fds[0]);
+	{
+		// Our copy of the manager's end must be closed so that we see EOF from a service manager that does not know this request.
+		const FileDescriptorOwner manager_fd(fds[1]);
+		service_manager_rpc_message m;
+		m.command = m.SNAPSHOT;
+		m.name[0] = '\0';
+		do_rpc_call(prog, socket_fd.get(), &m, sizeof m, &fds[1], 1U);
+	}
+
+	pollfd p;
+	p.fd = reply_fd.get();
+	p.events = POLLIN;
+	if (0 >= poll(&p, 1, timeout)) return;
+	service_manager_snapshot_reply r;
+	struct iovec v[1] = { { &r, sizeof r } };
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg = {
+		0, 0,
+		v, sizeof v/sizeof *v,
+		buf, static_cast<socklen_t>(sizeof buf),
+		0
+	};
+	const ssize_t n(recvmsg(reply_fd.get(), &msg, MSG_CMSG_CLOEXEC));
+	if (0 > n) return;
+	int snapshot_fd(-1);
+	for (struct cmsghdr * cmsg(CMSG_FIRSTHDR(&msg)); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type && CMSG_LEN(sizeof(int)) <= cmsg->cmsg_len)
+			std::memcpy(&snapshot_fd, CMSG_DATA(cmsg), sizeof snapshot_fd);
+	const FileDescriptorOwner snapshot(snapshot_fd);
+	if (sizeof r != static_cast<std::size_t>(n)
+	||  service_manager_snapshot_reply::VERSION != r.version
+	||  sizeof(service_manager_status_table_slot) != r.slot_size
+	||  r.error
+	||  0 > snapshot.get()
+	)
+		return;
+
+	slots.resize(r.count * sizeof(service_manager_status_table_slot));
+	for (std::size_t o(0U); o < slots.size(); ) {
+		const ssize_t l(pread(snapshot.get(), slots.data() + o, slots.size() - o, o));
+		if (0 >= l) {
+			if (0 > l && EINTR == errno) continue;
+			slots.clear();
+			return;
+		}
+		o += l;
+	}
+	index.reserve(r.count);
+	for (std::size_t o(0U); o < slots.size(); o += sizeof(service_manager_status_table_slot)) {
+		const service_manager_status_table_slot & slot(*reinterpret_cast<const service_manager_status_table_slot *>(slots.data() + o));
+		index.push_back(std::make_pair(key(slot.dev, slot.ino), o));
+	}
+	std::sort(index.begin(), index.end());
+	taken = true;
+}
+
+ServiceManagerSnapshot::~ServiceManagerSnapshot()
+{
+}
+
+unsigned int
+ServiceManagerSnapshot::read(
+	const int supervise_dir_fd,
+	char status[EXTENDED_STATUS_BLOCK_SIZE]
+) const {
+	struct stat s;
+	if (0 > fstat(supervise_dir_fd, &s)) return 0U;
+	const key k(s.st_dev, s.st_ino);
+	const std::vector<std::pair<key, std::size_t> >::const_iterator i(std::lower_bound(index.begin(), index.end(), std::make_pair(k, std::size_t(0U))));
+	if (index.end() == i || k != i->first) return 0U;
+	const service_manager_status_table_slot & slot(*reinterpret_cast<const service_manager_status_table_slot *>(slots.data() + i->second));
+	std::memcpy(status, slot.status, sizeof slot.status);
+	return sizeof slot.status;
+}
+
 bool
 has_exited_run (
 	const unsigned int b,
@@ -469,3 +1061,256 @@ is_use_kill_signal (
 ) {
 	return no_flag_file(service_dir_fd, "no_kill_signal");
 }
+
+bool
+is_socket_activated (
+	const int service_dir_fd
+) {
+	return !no_flag_file(service_dir_fd, "listen_stream");
+}
+
+bool
+is_accept_connections (
+	const int service_dir_fd
+) {
+	return !no_flag_file(service_dir_fd, "accept");
+}
+
+/// Read the words of a file in the service directory, which can be quoted and have comments as in read_file().
+/// \returns false if there is no such file, or it has no words or is unreadable
+static
+bool
+words_of (
+	const int service_dir_fd,
+	const char * name,
+	std::vector<std::string> & words
+) {
+	const int fd(open_read_at(service_dir_fd, name));
+	if (0 > fd) return false;
+	FileStar f(fdopen(fd, "r"));
+	if (!f) {
+		close(fd);
+		return false;
+	}
+	try {
+		words = read_file(f);
+	} catch (const char *) {
+		return false;
+	}
+	return !words.empty();
+}
+
+/// The capacity of a service's input pipe is set by a pipe_size file in its service directory, containing a number of bytes.
+/// \returns 0 if there is no such file, or it does not contain a number, so that the pipe is left at the default size
+std::size_t
+pipe_capacity (
+	const int service_dir_fd
+) {
+	std::vector<std::string> words;
+	if (!words_of(service_dir_fd, "pipe_size", words)) return 0U;
+	const char * const s(words.front().c_str());
+	char * end;
+	const unsigned long n(std::strtoul(s, &end, 0));
+	if (end == s || *end) return 0U;
+	return n;
+}
+
+/// A service's concurrency class is set by a concurrency_class file in its service directory, containing a name.
+/// \returns an empty name, for the class of services that have none, if there is no such file
+std::string
+concurrency_class (
+	const int service_dir_fd
+) {
+	std::vector<std::string> words;
+	if (!words_of(service_dir_fd, "concurrency_class", words)) return std::string();
+	return words.front();
+}
+
+/// How much a starting service counts towards the concurrency limits is set by a concurrency_weight file in its service directory, containing a number.
+/// \returns 1 if there is no such file, or it does not contain a number
+unsigned long
+concurrency_weight (
+	const int service_dir_fd
+) {
+	std::vector<std::string> words;
+	if (!words_of(service_dir_fd, "concurrency_weight", words)) return 1UL;
+	const char * const s(words.front().c_str());
+	char * end;
+	const unsigned long n(std::strtoul(s, &end, 0));
+	if (end == s || *end) return 1UL;
+	return n;
+}
+
+/// A service's start and stop deadlines are set by start_timeout and stop_timeout files in its service directory.
+/// Each contains a number of seconds, optionally followed by what to do when that time is up: fail, kill, or continue.
+/// \returns false, leaving the action alone, if there is no such file or it does not begin with a number
+bool
+job_timeout (
+	const int service_dir_fd,
+	const char * name,
+	unsigned long & milliseconds,
+	timeout_action & action
+) {
+	std::vector<std::string> words;
+	if (!words_of(service_dir_fd, name, words)) return false;
+	const char * const s(words.front().c_str());
+	char * end;
+	const double seconds(std::strtod(s, &end));
+	if (end == s || *end || !(seconds >= 0.0)) return false;
+	milliseconds = static_cast<unsigned long>(seconds * 1000.0 + 0.5);
+	if (words.size() > 1U) {
+		const std::string & a(words[1]);
+		if ("fail" == a)
+			action = TIMEOUT_FAIL;
+		else
+		if ("kill" == a)
+			action = TIMEOUT_KILL;
+		else
+		if ("continue" == a)
+			action = TIMEOUT_CONTINUE;
+	}
+	return true;
+}
+
+/// How many connections a service that accepts connections may handle at once is set by a connection_limit file in its service directory, containing a number.
+/// \returns 0 if there is no such file, or it does not contain a number, so that the service manager's default applies
+unsigned long
+connection_limit (
+	const int service_dir_fd
+) {
+	std::vector<std::string> words;
+	if (!words_of(service_dir_fd, "connection_limit", words)) return 0UL;
+	const char * const s(words.front().c_str());
+	char * end;
+	const unsigned long n(std::strtoul(s, &end, 0));
+	if (end == s || *end) return 0UL;
+	return n;
+}
+
+/* Socket activation ********************************************************
+// **************************************************************************
+// The listening sockets of a socket-activated service are described by a listen_stream file in its service directory.
+// Each socket is either an absolute pathname, for a local socket, or a host and a port, for a TCP socket.
+*/
+
+enum { LISTEN_STREAM_BACKLOG = 5 };
+
+static inline
+int
+open_local_stream_socket (
+	const char * prog,
+	const char * path
+) {
+	sockaddr_un addr;
+	if (std::strlen(path) >= sizeof addr.sun_path) {
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, path, std::strerror(ENAMETOOLONG));
+		return -1;
+	}
+	FileDescriptorOwner s(socket(AF_UNIX, SOCK_STREAM, 0));
+	if (0 > s.get()) {
+exit_error:
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, path, std::strerror(error));
+		return -1;
+	}
+	set_close_on_exec(s.get(), true);
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, path, sizeof addr.sun_path);
+	unlink(path);
+	if (0 > bind(s.get(), reinterpret_cast<const sockaddr *>(&addr), sizeof addr)) goto exit_error;
+	if (0 > listen(s.get(), LISTEN_STREAM_BACKLOG)) goto exit_error;
+	return s.release();
+}
+
+static inline
+int
+open_tcp_socket (
+	const char * prog,
+	const char * host,
+	const char * port
+) {
+	addrinfo * info(0), hints = {0,0,0,0,0,0,0,0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = 0;
+	hints.ai_flags = AI_PASSIVE;
+	const int rc(getaddrinfo(host, port, &hints, &info));
+	if (0 != rc) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s %s: %s\n", prog, host, port, EAI_SYSTEM == rc ? std::strerror(error) : gai_strerror(rc));
+		return -1;
+	}
+	FileDescriptorOwner s(socket(info->ai_family, SOCK_STREAM, 0));
+	if (0 > s.get()) {
+exit_error:
+		const int error(errno);
+		freeaddrinfo(info);
+		std::fprintf(stderr, "%s: ERROR: %s %s: %s\n", prog, host, port, std::strerror(error));
+		return -1;
+	}
+	set_close_on_exec(s.get(), true);
+	if (0 > socket_set_boolean_option(s.get(), SOL_SOCKET, SO_REUSEADDR, true)) goto exit_error;
+#if defined(IPV6_V6ONLY)
+	if (AF_INET6 == info->ai_family)
+		if (0 > socket_set_boolean_option(s.get(), IPPROTO_IPV6, IPV6_V6ONLY, true)) goto exit_error;
+#endif
+	if (0 > bind(s.get(), info->ai_addr, info->ai_addrlen)) goto exit_error;
+	if (0 > listen(s.get(), LISTEN_STREAM_BACKLOG)) goto exit_error;
+	freeaddrinfo(info);
+	return s.release();
+}
+
+/// Opens the listening sockets described by a service's listen_stream file, if it has one.
+/// The sockets are close-on-exec, and are the caller's to hand to the service manager and then close.
+/// \returns false if the file exists and any of its sockets could not be opened, in which case none are returned
+bool
+open_listen_stream_sockets (
+	const char * prog,
+	const int service_dir_fd,
+	std::vector<int> & fds
+) {
+	fds.clear();
+	const int fd(open_read_at(service_dir_fd, "listen_stream"));
+	if (0 > fd) return ENOENT == errno;
+	FileStar f(fdopen(fd, "r"));
+	if (!f) {
+		const int error(errno);
+		close(fd);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "listen_stream", std::strerror(error));
+		return false;
+	}
+	std::vector<std::string> words;
+	try {
+		words = read_file(f);
+	} catch (const char * r) {
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "listen_stream", r);
+		return false;
+	}
+	bool success(true);
+	for (std::vector<std::string>::const_iterator i(words.begin()); success && words.end() != i; ++i) {
+		int s(-1);
+		if ('/' == (*i)[0])
+			s = open_local_stream_socket(prog, i->c_str());
+		else
+		if (words.end() == i + 1) {
+			std::fprintf(stderr, "%s: ERROR: %s: %s: %s\n", prog, "listen_stream", i->c_str(), "Missing port number.");
+		} else {
+			const std::string & host(*i++);
+			s = open_tcp_socket(prog, host.c_str(), i->c_str());
+		}
+		if (0 > s)
+			success = false;
+		else
+			fds.push_back(s);
+		if (success && service_manager_rpc_message::MAX_LISTEN_SOCKETS < fds.size()) {
+			std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "listen_stream", "Too many listening sockets.");
+			success = false;
+		}
+	}
+	if (!success) {
+		for (std::vector<int>::const_iterator i(fds.begin()); fds.end() != i; ++i)
+			close(*i);
+		fds.clear();
+	}
+	return success;
+}
@@ -7,10 +7,134 @@ For copyright and licensing terms, see the file named COPYING.
 #define INCLUDE_SERVICE_MANAGER_CLIENT_H
 
 #include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <stdint.h>
 
 extern bool per_user_mode;	// Shared with the system manager client API.
 
 struct ProcessEnvironment;
+struct service_manager_status_table_header;
+
+/// \brief A batch of service manager control API operations, sent in a single datagram.
+/// Descriptors are duplicated as operations are queued, so callers may close their own at once.
+/// Operations are enacted in the order that they are queued, and the service manager sends a single completion reply for the whole batch.
+/// Batches can be committed one at a time, or sent and later collected so that several are in flight at once.
+class ServiceManagerRPCBatch
+{
+public:
+	ServiceManagerRPCBatch(const char * prog, int socket_fd);
+	~ServiceManagerRPCBatch();
+	std::size_t plumb(int out_supervise_dir_fd, int in_supervise_dir_fd);
+	std::size_t load(const char * name, int supervise_dir_fd, int service_dir_fd);
+	std::size_t make_pipe_connectable(int supervise_dir_fd, std::size_t capacity);
+	std::size_t make_input_activated(int supervise_dir_fd);
+	std::size_t make_run_on_empty(int supervise_dir_fd);
+	std::size_t make_socket_activated(int supervise_dir_fd, int listen_fd, bool accept_connections, unsigned long connection_limit);
+	bool empty() const { return operations.empty(); }
+	bool has_room_for(std::size_t n) const;
+	/// Sends the queued operations without waiting for them to be enacted, emptying the batch.
+	/// Several sent batches can be awaiting their replies at once.
+	/// \returns a ticket with which to collect the statuses of the sent operations
+	std::size_t send();
+	/// \returns a descriptor that becomes readable when a reply for the ticket arrives, or -1 if there is nothing to wait for
+	int reply_fd(std::size_t ticket) const;
+	/// Reads any replies for the ticket that have already arrived, without waiting for more.
+	/// \returns true if no more replies are expected
+	bool receive(std::size_t ticket);
+	/// Waits up to timeout milliseconds for any outstanding replies for the ticket, and forgets the ticket.
+	/// Operations whose replies do not arrive in time are given ETIMEDOUT.
+	/// Service managers that predate batches are sent the operations one at a time instead.
+	/// \returns an errno value, 0 for success, for each operation of the ticket in queuing order
+	std::vector<int> collect(std::size_t ticket, int timeout);
+	/// Sends the queued operations and waits up to timeout milliseconds for them to be enacted, emptying the batch.
+	/// \returns an errno value, 0 for success, for each operation in queuing order
+	std::vector<int> commit(int timeout) { return collect(send(), timeout); }
+protected:
+	struct operation {
+		uint8_t command;
+		std::string name;
+		int fds[2];
+		std::size_t count_fds;
+		int error;	///< set if the operation could not be queued, in which case it is sent as a NOOP
+	};
+	typedef std::vector<operation> operation_list;
+	/// \brief One datagram of a sent batch, awaiting its completion reply.
+	struct datagram {
+		datagram(uint32_t c, std::size_t f, std::size_t l) : cookie(c), first(f), last(l), singly(false) {}
+		uint32_t cookie;
+		std::size_t first, last;	///< the range of the ticket's operations that the datagram carried
+		bool singly;			///< set if the service manager does not understand batches
+	};
+	typedef std::vector<datagram> datagram_list;
+	/// \brief Sent operations whose statuses are yet to be collected.
+	/// A batch that is too big for one datagram is split, and the replies for all of the pieces come back through the one reply socket.
+	struct ticket_info {
+		ticket_info() : reply_fd(-1) {}
+		operation_list operations;
+		std::vector<int> statuses;
+		datagram_list awaited;
+		int reply_fd;
+	};
+	typedef std::map<std::size_t, ticket_info> ticket_map;
+	const char * prog;
+	int socket_fd;
+	uint32_t cookie;
+	operation_list operations;
+	ticket_map tickets;
+	std::size_t next_ticket;
+
+	std::size_t add(uint8_t, const char *, int, int, std::size_t);
+	void send_batch(ticket_info &, std::size_t, std::size_t, int);
+	void send_singly(ticket_info &, std::size_t, std::size_t, int);
+	static void close_fds(operation_list &);
+	static void fail_awaited(ticket_info &, int);
+private:
+	ServiceManagerRPCBatch(const ServiceManagerRPCBatch &);
+};
+
+/// \brief A read-only mapping of the status table that a running service manager maintains.
+/// Services without a slot, and service managers without a table, are handled by falling back to the status files.
+class ServiceManagerStatusTable
+{
+public:
+	ServiceManagerStatusTable(bool is_system);
+	~ServiceManagerStatusTable();
+	bool empty() const { return !header; }
+	/// Copies a consistent snapshot of the extended status of the service whose supervise directory is given.
+	/// status must have room for EXTENDED_STATUS_BLOCK_SIZE bytes.
+	/// \returns the size of the status block copied, or 0 if the table has no slot for the service
+	unsigned int read(const int supervise_dir_fd, char status[]) const;
+protected:
+	typedef std::pair<uint64_t, uint64_t> key;
+	const service_manager_status_table_header * header;
+	std::size_t length;
+	std::vector<std::pair<key, uint32_t> > index;	///< slot numbers in ascending order of device and inode, as they were when the table was mapped
+private:
+	ServiceManagerStatusTable(const ServiceManagerStatusTable &);
+};
+
+/// \brief The status of every service loaded into a running service manager, all taken at the same instant with a single request.
+/// An empty snapshot means that there is no service manager that we can ask, in which case callers fall back to the status table and the status files.
+class ServiceManagerSnapshot
+{
+public:
+	ServiceManagerSnapshot(const char * prog, bool is_system, int timeout);
+	~ServiceManagerSnapshot();
+	bool empty() const { return !taken; }
+	/// Copies the extended status of the service whose supervise directory is given.
+	/// status must have room for EXTENDED_STATUS_BLOCK_SIZE bytes.
+	/// \returns the size of the status block copied, or 0 if the service was not loaded when the snapshot was taken
+	unsigned int read(const int supervise_dir_fd, char status[]) const;
+protected:
+	typedef std::pair<uint64_t, uint64_t> key;
+	std::vector<char> slots;
+	std::vector<std::pair<key, std::size_t> > index;	///< slot offsets in ascending order of device and inode
+	bool taken;
+private:
+	ServiceManagerSnapshot(const ServiceManagerSnapshot &);
+};
 
 void
 plumb (
@@ -45,6 +169,16 @@ make_run_on_empty (
 	int socket_fd,
 	int supervise_dir_fd
 );
+int
+subscribe_to_state_changes (
+	const char * prog,
+	int socket_fd
+);
+int
+reexec_service_manager (
+	const char * prog,
+	int socket_fd
+);
 #if 1	/// \todo TODO: Eventually we can switch off this mechanism.
 void
 unload (
@@ -189,6 +323,45 @@ bool
 is_use_kill_signal (
 	const int service_dir_fd
 ) ;
+bool
+is_socket_activated (
+	const int service_dir_fd
+) ;
+bool
+is_accept_connections (
+	const int service_dir_fd
+) ;
+std::size_t
+pipe_capacity (
+	const int service_dir_fd
+) ;
+std::string
+concurrency_class (
+	const int service_dir_fd
+) ;
+unsigned long
+concurrency_weight (
+	const int service_dir_fd
+) ;
+/// \brief What is done to a service that is still starting or stopping when its deadline passes.
+enum timeout_action { TIMEOUT_FAIL, TIMEOUT_KILL, TIMEOUT_CONTINUE };
+bool
+job_timeout (
+	const int service_dir_fd,
+	const char * name,
+	unsigned long & milliseconds,
+	timeout_action & action
+) ;
+unsigned long
+connection_limit (
+	const int service_dir_fd
+) ;
+bool
+open_listen_stream_sockets (
+	const char * prog,
+	const int service_dir_fd,
+	std::vector<int> & fds
+) ;
 int 
 listen_service_manager_socket (
 	const bool is_system, 
@@ -199,5 +372,13 @@ connect_service_manager_socket (
 	const bool is_system, 
 	const char * prog
 ) ;
+int 
+open_service_manager_socket (
+	const bool is_system
+) ;
+int 
+open_service_manager_status_table (
+	const bool is_system
+) ;
 
 #endif
@@ -12,9 +12,11 @@ For copyright and licensing terms, see the file named COPYING.
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <fcntl.h>
 #include "service-manager-client.h"
 #include "runtime-dir.h"
 #include "fdutils.h"
+#include "FileDescriptorOwner.h"
 
 static inline
 const char *
@@ -27,6 +29,17 @@ construct_service_manager_socket_name (
 	return name_buf.c_str();
 }
 
+static inline
+const char *
+construct_service_manager_status_table_name (
+	const bool is_system,
+	std::string & name_buf
+) {
+	if (is_system) return "/run/service-manager/status";
+	name_buf = effective_user_runtime_dir() + "service-manager/status";
+	return name_buf.c_str();
+}
+
 int
 listen_service_manager_socket(
 	const bool is_system,
@@ -83,3 +96,29 @@ connect_service_manager_socket(
 	}
 	return socket_fd;
 }
+
+/// Connect to the service manager's control socket without reporting failure, for tools that can do without it.
+/// \returns -1 with errno set on failure
+int
+open_service_manager_socket(
+	const bool is_system
+) {
+	std::string name_buf;
+	const char * const socket_name(construct_service_manager_socket_name(is_system, name_buf));
+	FileDescriptorOwner socket_fd(socket_close_on_exec(AF_UNIX, SOCK_DGRAM, 0));
+	if (0 > socket_fd.get()) return -1;
+	sockaddr_un addr;
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_name , sizeof addr.sun_path);
+	if (0 > socket_connect(socket_fd.get(), &addr, sizeof addr)) return -1;
+	return socket_fd.release();
+}
+
+int
+open_service_manager_status_table(
+	const bool is_system
+) {
+	std::string name_buf;
+	const char * const table_name(construct_service_manager_status_table_name(is_system, name_buf));
+	return open_read_at(AT_FDCWD, table_name);
+}
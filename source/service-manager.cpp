@@ -4,29 +4,37 @@ For copyright and licensing terms, see the file named COPYING.
 */
 
 #include <vector>
+#include <string>
 #include <map>
-#include <set>
 #include <utility>
-#include <memory>
+#include <new>
+#include <type_traits>
+#include <functional>
+#include <random>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <climits>
+#include <cstddef>
 #include <csignal>
 #include <cerrno>
 #include <ctime>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
 #include <sys/types.h>
-#if !defined(__LINUX__) && !defined(__linux__)
-#include <sys/event.h>
-#else
-#include <sys/poll.h>
-#endif
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__LINUX__) || defined(__linux__)
+#include <sched.h>
+#endif
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -35,9 +43,14 @@ For copyright and licensing terms, see the file named COPYING.
 #include "ProcessEnvironment.h"
 #include "popt.h"
 #include "pack.h"
+#include "unpack.h"
 #include "listen.h"
 #include "service-manager.h"
 #include "FileDescriptorOwner.h"
+#include "SignalManagement.h"
+#include "kqueue_common.h"
+#include "control_groups.h"
+#include "FileStar.h"
 #if defined(__LINUX__) || defined(__linux__) || defined(__FreeBSD__) || defined(__DragonFly__)
 #	define	HAS_FIFO_EXTENSION 1
 #else
@@ -45,11 +58,7 @@ For copyright and licensing terms, see the file named COPYING.
 #endif
 
 static const char * prog(0);
-#if !defined(__LINUX__) && !defined(__linux__)
 static int queue(-1);
-#else
-static std::vector<pollfd> poll_table;
-#endif
 
 /* Service objects and maps *************************************************
 // **************************************************************************
@@ -57,12 +66,27 @@ static std::vector<pollfd> poll_table;
 
 namespace {
 
+struct saved_service;
+
+/// \brief What a spawned process is given over and above the service's own standard I/O and environment.
+struct spawn_extras {
+	spawn_extras() : connection_fd(-1), listen_fds(0), count_listen_fds(0U), envs(0), listen_pid(0) {}
+	int connection_fd;		///< a connected socket to be standard input and output, or -1
+	const int * listen_fds;		///< listening sockets to be passed on from LISTEN_SOCKET_FILENO upwards
+	std::size_t count_listen_fds;
+	const char * const * envs;	///< a whole replacement environment, or 0
+	char * listen_pid;		///< where the child process writes its own ID, as the value of LISTEN_PID, or 0
+};
+
 struct index : public std::pair<dev_t, ino_t> {
+	index() : pair() {}
 	index(const struct stat & s) : pair(s.st_dev, s.st_ino) {}
 };
 
+enum { CONNECTION_LIMIT = 40U };	///< per service that accepts connections, unless it sets its own, as the default for tcp-socket-accept
+
 struct service : public index {
-	service(const struct stat &, ProcessEnvironment &);
+	service(std::size_t, const struct stat &, ProcessEnvironment &);
 	~service();
 
 	void add_process(int);
@@ -70,22 +94,42 @@ struct service : public index {
 	void stamp_activity();
 	void stamp_pending_command();
 	void stamp_process_status(const unsigned int, int, int, const timespec &);
+	void stamp_usage(const unsigned int, const struct rusage &);
 	void write_status();
-	void reap (const sigset_t &, int, int, int);
+	void publish_state_change(uint16_t);
+	void reap (const sigset_t &, int, int, int, const struct rusage &);
+#if defined(__LINUX__) || defined(__linux__)
+	void sample_control_group(const std::string &);
+#endif
+	void snapshot(service_manager_status_table_slot &) const;
+	void stamp_input_pipe_capacity();
+	bool sample_input_pipe(unsigned);
+	int exec_process(const sigset_t &, const char * const *, int, const spawn_extras &);
 	void enact_control_message(const sigset_t &, char);
+	int add_listen_socket(int, bool, unsigned);
+	void socket_ready(const sigset_t &, int);
+	void end_connection(int);
 	void add_to_input_activation_list();
 	void delete_from_input_activation_list();
 	void add_to_control_fifo_list();
 	void delete_from_control_fifo_list();
+	void timer_expired(const sigset_t &);
+	void save(saved_service &, std::vector<uint32_t> &) const;
+	void restore(const saved_service &, const std::vector<uint32_t> &);
+	bool is_current_timer(unsigned long generation) const { return NO_TIMER != timer && generation == timer_generation; }
 	void set_unload() { unload_after_stop = true; }
 	bool unloadable() const { return unload_after_stop && (NONE == activity) && !has_processes(); }
 
-	int in, out, err, pipe_fds[2], lock_fd, ok_fd, control_fd, status_fd, service_dir_fd;
+	int in, out, err, pipe_fds[2], lock_fd, ok_fd, control_fd, status_fd, service_dir_fd, status_slot;
 #if !HAS_FIFO_EXTENSION
 	int control_client_fd;
 #endif
 	char name[NAME_MAX + 1];
 	bool run_on_empty;
+	std::vector<int> listen_fds;	///< listening sockets that the service is activated by
+	bool accept_connections;	///< whether the run program is spawned afresh for each connection accepted from listen_fds
+	unsigned connection_limit;	///< how many per-connection processes may run at once
+	std::vector<int> connections;	///< per-connection processes, in ascending order
 protected:
 	char pending_command;
 	bool paused, unload_after_stop;
@@ -98,13 +142,34 @@ protected:
 	} activity;
 	int current_process_status;
 	int current_process_code;
-	unsigned char status[STATUS_BLOCK_SIZE];
-	std::set<int> processes;
+	unsigned char status[EXTENDED_STATUS_BLOCK_SIZE];
+	unsigned char published_state;
+	enum TimerType {
+		NO_TIMER = 0,
+		RESTART_BACKOFF,	///< The service is waiting to restart its "run" program.
+		SPAWN_RETRY		///< The service is waiting to retry spawning a process.
+	} timer;
+	unsigned long timer_generation;	///< Identifies the latest timer scheduled, so that earlier ones are ignored.
+	uint64_t timer_expiry;		///< In timer wheel ticks.
+	unsigned restart_backoff;	///< The number of consecutive times that the "run" program has exited too quickly.
+	bool restart_backoff_elapsed;
+	unsigned spawn_failures;
+	timespec run_started;		///< On the monotonic clock.
+	uint32_t restarts;
+	uint64_t cumulative_user_usec, cumulative_system_usec, maximum_rss;
+	std::vector<int> processes;	///< in ascending order
+	bool socket_activation_armed;
 	ProcessEnvironment & envs;
 
 	void change_state_if_necessary (const sigset_t &);
 	void enter_state(const sigset_t &);
-	void del_process(int, int, int);
+	void del_process(int, int, int, const struct rusage &);
+	void spawned_process(int);
+	void watch_process(int);
+	void schedule_timer(TimerType, unsigned);
+	int spawn(const sigset_t &, const char * const *, const spawn_extras &);
+	void update_socket_activation();
+	void accept_connection(const sigset_t &, int);
 	bool has_processes() const { return !processes.empty(); }
 	void killall(int);
 	void killtop(int);
@@ -118,8 +183,198 @@ protected:
 
 }
 
-typedef std::map<int, service *> pid_to_service_map;
+static inline
+std::size_t
+mix (
+	uint64_t k
+) {
+	// This is the finalizer from SplitMix64, so that the low bits that we mask off depend upon all of the key.
+	k ^= k >> 30;
+	k *= 0xBF58476D1CE4E5B9ULL;
+	k ^= k >> 27;
+	k *= 0x94D049BB133111EBULL;
+	k ^= k >> 31;
+	return static_cast<std::size_t>(k);
+}
+
+static inline std::size_t hash(int k) { return mix(static_cast<unsigned int>(k)); }
+static inline std::size_t hash(const struct index & k) { return mix(static_cast<uint64_t>(k.first) * 0x9E3779B97F4A7C15ULL ^ static_cast<uint64_t>(k.second)); }
+
+/// \brief An open addressed hash table from keys to services.
+/// It uses linear probing, and backward shift deletion so that there are never any tombstones.
+/// A null value marks an empty bucket.
+template <typename Key>
+class service_hash {
+public:
+	service_hash() : used(0U), buckets() {}
+	service * find(const Key &) const;
+	void insert(const Key &, service *);
+	void erase(const Key &);
+	std::size_t size() const { return used; }
+	bool empty() const { return 0U == used; }
+protected:
+	struct bucket {
+		bucket() : key(), value(0) {}
+		Key key;
+		service * value;
+	};
+	typedef std::vector<bucket> bucket_list;
+	std::size_t used;
+	bucket_list buckets;
+
+	std::size_t mask() const { return buckets.size() - 1U; }
+	std::size_t home(const Key & k) const { return hash(k) & mask(); }
+	std::size_t position(const Key &) const;
+	void grow();
+};
+
+/// Returns the bucket that holds the key, or the empty bucket where it would go.
+template <typename Key>
+std::size_t
+service_hash<Key>::position (
+	const Key & k
+) const {
+	std::size_t i(home(k));
+	while (buckets[i].value && !(buckets[i].key == k))
+		i = (i + 1U) & mask();
+	return i;
+}
+
+template <typename Key>
+service *
+service_hash<Key>::find (
+	const Key & k
+) const {
+	if (buckets.empty()) return 0;
+	return buckets[position(k)].value;
+}
+
+template <typename Key>
+void
+service_hash<Key>::insert (
+	const Key & k,
+	service * v
+) {
+	// The load factor is kept at or below one half, so that probe sequences stay short.
+	if (2U * (used + 1U) > buckets.size()) grow();
+	bucket & b(buckets[position(k)]);
+	if (!b.value) ++used;
+	b.key = k;
+	b.value = v;
+}
+
+template <typename Key>
+void
+service_hash<Key>::erase (
+	const Key & k
+) {
+	if (buckets.empty()) return;
+	std::size_t i(position(k));
+	if (!buckets[i].value) return;
+	--used;
+	// Shift later members of the probe sequence back into the gap, for as long as that does not move any of them before their home buckets.
+	for (std::size_t j((i + 1U) & mask()); buckets[j].value; j = (j + 1U) & mask()) {
+		const std::size_t h(home(buckets[j].key));
+		if (((j - h) & mask()) >= ((j - i) & mask())) {
+			buckets[i] = buckets[j];
+			i = j;
+		}
+	}
+	buckets[i] = bucket();
+}
+
+template <typename Key>
+void
+service_hash<Key>::grow (
+) {
+	bucket_list old(buckets.empty() ? 64U : 2U * buckets.size());
+	old.swap(buckets);
+	for (typename bucket_list::const_iterator i(old.begin()); old.end() != i; ++i)
+		if (i->value)
+			buckets[position(i->key)] = *i;
+}
+
+/// \brief The table of all loaded services.
+/// Services live in a slab of fixed size chunks, so that they never move once constructed and can be referred to by plain pointers.
+/// Each service has a slot number, which is reused (lowest first) once the service is unloaded, and which doubles as its status table slot.
+/// Services are found by their supervise directories through a hash index.
+class service_table {
+public:
+	service_table() : chunks(), free_slots(), used(0U), by_directory() {}
+	~service_table();
+	service * find(const struct index & i) const { return by_directory.find(i); }
+	service * at(std::size_t slot) const { return chunks[slot / CHUNK_SIZE]->get(slot % CHUNK_SIZE); }
+	service & create(const struct stat &, ProcessEnvironment &);
+	void destroy(service &);
+	std::size_t size() const { return used; }
+	bool empty() const { return 0U == used; }
+	std::size_t slots() const { return chunks.size() * CHUNK_SIZE; }
+protected:
+	enum { CHUNK_SIZE = 64 };
+	struct chunk {
+		chunk() : live() {}
+		service * get(std::size_t n) { return live[n] ? reinterpret_cast<service *>(&storage[n]) : 0; }
+		std::aligned_storage<sizeof(service), alignof(service)>::type storage[CHUNK_SIZE];
+		bool live[CHUNK_SIZE];
+	};
+	typedef std::vector<chunk *> chunk_list;
+	chunk_list chunks;
+	std::vector<std::size_t> free_slots;	///< a min-heap
+	std::size_t used;
+	service_hash<struct index> by_directory;
+};
+
+service_table::~service_table()
+{
+	for (std::size_t slot(0U); slot < slots(); ++slot)
+		if (service * s = at(slot))
+			destroy(*s);
+	for (chunk_list::const_iterator i(chunks.begin()); chunks.end() != i; ++i)
+		delete *i;
+}
+
+service &
+service_table::create (
+	const struct stat & s,
+	ProcessEnvironment & envs
+) {
+	if (free_slots.empty()) {
+		const std::size_t base(slots());
+		chunks.push_back(new chunk);
+		for (std::size_t n(0U); n < CHUNK_SIZE; ++n) {
+			free_slots.push_back(base + n);
+			std::push_heap(free_slots.begin(), free_slots.end(), std::greater<std::size_t>());
+		}
+	}
+	std::pop_heap(free_slots.begin(), free_slots.end(), std::greater<std::size_t>());
+	const std::size_t slot(free_slots.back());
+	free_slots.pop_back();
+	chunk & c(*chunks[slot / CHUNK_SIZE]);
+	service * const p(new (&c.storage[slot % CHUNK_SIZE]) service(slot, s, envs));
+	c.live[slot % CHUNK_SIZE] = true;
+	++used;
+	by_directory.insert(*p, p);
+	return *p;
+}
+
+void
+service_table::destroy (
+	service & s
+) {
+	const std::size_t slot(s.status_slot);
+	by_directory.erase(s);
+	s.~service();
+	chunks[slot / CHUNK_SIZE]->live[slot % CHUNK_SIZE] = false;
+	--used;
+	free_slots.push_back(slot);
+	std::push_heap(free_slots.begin(), free_slots.end(), std::greater<std::size_t>());
+}
+
+typedef service_hash<int> pid_to_service_map;
 static pid_to_service_map active_services;
+#if defined(__LINUX__) || defined(__linux__)
+static pid_to_service_map exit_watched_services;	///< the processes whose exits are reaped from their EVFILT_PROC events rather than by the SIGCHLD reaper
+#endif
 
 #if !defined(__LINUX__) && !defined(__linux__)
 struct forked_parent {
@@ -132,22 +387,470 @@ static pid_to_forked_parents_map forked_parents;
 typedef std::pair<pid_to_forked_parents_map::iterator, bool> forked_parent_lookup;
 #endif
 
-typedef std::map<int, service *> input_activated_service_map;
+typedef service_hash<int> input_activated_service_map;
 static input_activated_service_map input_activated_services;
 
-typedef std::map<int, service *> service_control_fifo_map;
+typedef service_hash<int> socket_activated_service_map;
+static socket_activated_service_map socket_activated_services;	///< by listening socket, whilst a service is awaiting connections
+
+static pid_to_service_map connection_services;	///< by process ID, of the per-connection processes of services that accept connections
+
+typedef service_hash<int> service_control_fifo_map;
 static service_control_fifo_map service_control_fifos;
 
-// \bug FIXME: This should be a map of shared pointers.
-typedef std::shared_ptr<service> service_pointer;
-typedef std::map<struct index, service_pointer> service_map;
-static service_map services;
+static service_table services;
+
+/* Timers *******************************************************************
+// **************************************************************************
+*/
+
+namespace {
+
+/// \brief A hierarchical timing wheel, for timers that are measured in ticks of the monotonic clock.
+/// Adding a timer is constant time, as is expiring one, except for the occasional cascade of a slot down to the next level.
+/// Timers are never cancelled; they refer to services by index and generation, and are ignored if those no longer match when they expire.
+class timer_wheel {
+public:
+	enum { TICK_MILLISECONDS = 10U };
+	struct timer {
+		timer(uint64_t e, const struct index & i, unsigned long g) : expiry(e), key(i), generation(g) {}
+		uint64_t expiry;
+		struct index key;
+		unsigned long generation;
+	};
+	typedef std::vector<timer> timer_list;
+
+	timer_wheel() : current(now()), count(0U) {}
+	static uint64_t now();
+	bool empty() const { return 0U == count; }
+	void add(const timer &);
+	void advance(uint64_t, timer_list &);
+	uint64_t ticks_until_next() const;
+protected:
+	enum { SLOT_BITS = 6U, SLOTS = 1U << SLOT_BITS, LEVELS = 4U };
+	uint64_t current;
+	std::size_t count;
+	timer_list slots[LEVELS][SLOTS];
+
+	void insert(const timer &);
+};
+
+}
+
+inline
+uint64_t
+timer_wheel::now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return static_cast<uint64_t>(t.tv_sec) * (1000U / TICK_MILLISECONDS) + static_cast<uint64_t>(t.tv_nsec) / (TICK_MILLISECONDS * 1000000U);
+}
+
+void
+timer_wheel::insert(
+	const timer & t
+) {
+	const uint64_t delta(t.expiry - current);
+	unsigned level(0U);
+	while (level + 1U < LEVELS && delta >= (uint64_t(1U) << (SLOT_BITS * (level + 1U)))) ++level;
+	// Anything beyond the top level waits in the top level's farthest slot, and is cascaded down again when that comes round.
+	const uint64_t horizon(current + (uint64_t(SLOTS - 1U) << (SLOT_BITS * level)));
+	const uint64_t at(t.expiry < horizon ? t.expiry : horizon);
+	slots[level][(at >> (SLOT_BITS * level)) & (SLOTS - 1U)].push_back(t);
+}
+
+void
+timer_wheel::add(
+	const timer & t
+) {
+	timer u(t);
+	// A timer can never expire in the current tick, which has already been processed.
+	if (u.expiry <= current) u.expiry = current + 1U;
+	insert(u);
+	++count;
+}
+
+void
+timer_wheel::advance(
+	uint64_t target,
+	timer_list & expired
+) {
+	if (0U == count) {
+		if (current < target) current = target;
+		return;
+	}
+	while (current < target && 0U != count) {
+		++current;
+		// Cascade each higher level slot that has come round down into the lower levels.
+		for (unsigned level(1U); level < LEVELS; ++level) {
+			if (current & ((uint64_t(1U) << (SLOT_BITS * level)) - 1U)) break;
+			timer_list l;
+			l.swap(slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1U)]);
+			for (timer_list::const_iterator i(l.begin()); l.end() != i; ++i) {
+				if (i->expiry <= current)
+					slots[0][current & (SLOTS - 1U)].push_back(*i);
+				else
+					insert(*i);
+			}
+		}
+		timer_list & due(slots[0][current & (SLOTS - 1U)]);
+		for (timer_list::iterator i(due.begin()); due.end() != i; ) {
+			if (i->expiry <= current) {
+				expired.push_back(*i);
+				i = due.erase(i);
+				--count;
+			} else
+				++i;
+		}
+	}
+	if (current < target) current = target;
+}
+
+/// \returns the number of ticks until the next slot that could have timers to expire or cascade, which is never 0
+uint64_t
+timer_wheel::ticks_until_next() const
+{
+	uint64_t best(uint64_t(SLOTS) << (SLOT_BITS * (LEVELS - 1U)));
+	for (unsigned level(0U); level < LEVELS; ++level) {
+		const unsigned shift(SLOT_BITS * level);
+		for (unsigned step(1U); step <= SLOTS; ++step) {
+			const uint64_t boundary(((current >> shift) + step) << shift);
+			if (boundary - current >= best) break;
+			if (!slots[level][(boundary >> shift) & (SLOTS - 1U)].empty()) {
+				best = boundary - current;
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+static timer_wheel timers;
+// Generations are global, so that a stale timer cannot match a reloaded service that happens to have the same index.
+// The first few are reserved for the samplers, whose timers belong to no service.
+static unsigned long timer_generations(1UL);
+static const struct index no_service;
+enum {
+	CONTROL_GROUP_SAMPLER_GENERATION = 0U,
+	INPUT_PIPE_SAMPLER_GENERATION = 1U,
+};
+
+/// \brief Exponential backoff with jitter, starting at 100ms and doubling up to a minute.
+/// The actual delay is chosen at random from the upper half of that range, so that services that failed together do not retry together.
+/// \returns a delay in milliseconds
+static
+unsigned
+backoff_delay (
+	unsigned attempts
+) {
+	static std::minstd_rand jitter(getpid() ^ static_cast<unsigned>(std::time(0)));
+	const unsigned shift(attempts > 1U ? attempts - 1U : 0U);
+	const unsigned d(shift >= 10U ? 60000U : std::min(100U << shift, 60000U));
+	return d / 2U + jitter() % (d / 2U + 1U);
+}
+
+/* The status table *********************************************************
+// **************************************************************************
+*/
+
+static service_manager_status_table_header * status_table(0);
+
+static inline
+service_manager_status_table_slot &
+status_table_slot (
+	uint32_t n
+) {
+	return reinterpret_cast<service_manager_status_table_slot *>(status_table + 1)[n];
+}
+
+// Readers copy a slot and then check that the sequence number is even and unchanged, retrying otherwise.
+static inline
+void
+begin_status_slot_write (
+	service_manager_status_table_slot & slot
+) {
+	__atomic_store_n(&slot.sequence, slot.sequence + 1U, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline
+void
+end_status_slot_write (
+	service_manager_status_table_slot & slot
+) {
+	__atomic_store_n(&slot.sequence, slot.sequence + 1U, __ATOMIC_RELEASE);
+}
+
+/// Create the status table as a file named "status" in the same directory as the control socket.
+/// The table is an optional extra, so failure is not fatal.
+static
+void
+open_status_table (
+	int socket_fd
+) {
+	sockaddr_un addr;
+	socklen_t len(sizeof addr);
+	if (0 > getsockname(socket_fd, reinterpret_cast<sockaddr *>(&addr), &len)) return;
+	if (AF_UNIX != addr.sun_family || offsetof(sockaddr_un, sun_path) >= len || !addr.sun_path[0]) return;
+	std::string name(addr.sun_path, strnlen(addr.sun_path, len - offsetof(sockaddr_un, sun_path)));
+	const std::string::size_type slash(name.rfind('/'));
+	name = (std::string::npos == slash ? std::string() : name.substr(0, slash + 1)) + "status";
+	// We always create a fresh file, so that readers still holding the table of a previous service manager never see ours change underneath them.
+	unlinkat(AT_FDCWD, name.c_str(), 0);
+	const FileDescriptorOwner fd(openat(AT_FDCWD, name.c_str(), O_NOCTTY|O_CLOEXEC|O_RDWR|O_CREAT|O_EXCL, 0644));
+	if (0 > fd.get()) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: WARNING: %s: %s\n", prog, name.c_str(), std::strerror(error));
+		return;
+	}
+	const std::size_t size(sizeof *status_table + service_manager_status_table_header::MAX_SLOTS * sizeof(service_manager_status_table_slot));
+	if (0 > ftruncate(fd.get(), size)) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: WARNING: %s: %s\n", prog, name.c_str(), std::strerror(error));
+		unlinkat(AT_FDCWD, name.c_str(), 0);
+		return;
+	}
+	void * const base(mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd.get(), 0));
+	if (MAP_FAILED == base) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: WARNING: %s: %s\n", prog, name.c_str(), std::strerror(error));
+		unlinkat(AT_FDCWD, name.c_str(), 0);
+		return;
+	}
+	status_table = static_cast<service_manager_status_table_header *>(base);
+	status_table->version = service_manager_status_table_header::VERSION;
+	status_table->slot_size = sizeof(service_manager_status_table_slot);
+	status_table->slot_count = service_manager_status_table_header::MAX_SLOTS;
+	status_table->used = 0U;
+	status_table->pid = getpid();
+	__atomic_store_n(&status_table->magic, static_cast<uint32_t>(service_manager_status_table_header::MAGIC), __ATOMIC_RELEASE);
+}
+
+/// Tell readers that the table is no longer maintained, so that they fall back to the status files.
+static
+void
+close_status_table (
+) {
+	if (!status_table) return;
+	__atomic_store_n(&status_table->pid, 0U, __ATOMIC_RELEASE);
+}
+
+static inline
+bool
+has_status_slot (
+	int n
+) {
+	return status_table && 0 <= n && static_cast<uint32_t>(n) < service_manager_status_table_header::MAX_SLOTS;
+}
+
+/// Slots are the slot numbers of services in the service table, which are also the service indexes that are sent to subscribers.
+/// Services whose slot numbers are beyond the end of the table simply do not appear in it.
+static
+void
+claim_status_slot (
+	int n,
+	const struct index & i,
+	const char * name
+) {
+	if (!has_status_slot(n)) return;
+	service_manager_status_table_slot & slot(status_table_slot(n));
+	begin_status_slot_write(slot);
+	slot.in_use = 1U;
+	slot.dev = i.first;
+	slot.ino = i.second;
+	std::strncpy(slot.name, name, sizeof slot.name - 1U);
+	slot.name[sizeof slot.name - 1U] = '\0';
+	std::memset(slot.status, 0, sizeof slot.status);
+	end_status_slot_write(slot);
+	if (static_cast<uint32_t>(n) >= status_table->used)
+		__atomic_store_n(&status_table->used, n + 1U, __ATOMIC_RELEASE);
+}
+
+static
+void
+release_status_slot (
+	int n
+) {
+	if (!has_status_slot(n)) return;
+	service_manager_status_table_slot & slot(status_table_slot(n));
+	begin_status_slot_write(slot);
+	slot.in_use = 0U;
+	slot.dev = slot.ino = 0U;
+	slot.name[0] = '\0';
+	end_status_slot_write(slot);
+}
+
+static
+void
+write_status_slot (
+	int n,
+	const unsigned char * status
+) {
+	if (!has_status_slot(n)) return;
+	service_manager_status_table_slot & slot(status_table_slot(n));
+	begin_status_slot_write(slot);
+	std::memcpy(slot.status, status, sizeof slot.status);
+	end_status_slot_write(slot);
+}
+
+/* State change subscribers *************************************************
+// **************************************************************************
+*/
+
+namespace {
+
+/// \brief A client that has asked to be sent state changes.
+/// Records that cannot be sent at once are queued, at most one per service, and sent when the socket becomes writable.
+/// So a slow subscriber costs memory proportional to the number of services, and never blocks us.
+struct subscriber {
+	subscriber() : pending(), want_write(false) {}
+	std::vector<service_manager_state_change> pending;
+	bool want_write;
+};
+
+}
+
+typedef std::map<int, subscriber> subscriber_map;
+static subscriber_map subscribers;
+
+static inline
+void
+set_subscriber_event (
+	int fd,
+	short filter,
+	unsigned short flags
+) {
+	struct kevent e;
+	EV_SET(&e, fd, filter, flags, 0, 0, 0);
+	kevent(queue, &e, 1, 0, 0, 0);
+}
+
+static
+int
+add_subscriber (
+	int fd
+) {
+	FileDescriptorOwner subscriber_fd(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+	if (0 > subscriber_fd.get()) return errno;
+	// We watch for input solely in order to notice the subscriber going away whilst there is nothing to send.
+	set_subscriber_event(subscriber_fd.get(), EVFILT_READ, EV_ADD);
+	subscribers[subscriber_fd.release()];
+	return 0;
+}
+
+static
+void
+drop_subscriber (
+	subscriber_map::iterator i
+) {
+	const int fd(i->first);
+	set_subscriber_event(fd, EVFILT_READ, EV_DELETE);
+	if (i->second.want_write)
+		set_subscriber_event(fd, EVFILT_WRITE, EV_DELETE);
+	close(fd);
+	subscribers.erase(i);
+}
+
+/// \returns 1 if the record was sent, 0 if the socket is full, and -1 if the subscriber has gone
+static inline
+int
+send_state_change (
+	int fd,
+	const service_manager_state_change & r
+) {
+	if (0 <= send(fd, &r, sizeof r, MSG_DONTWAIT|MSG_NOSIGNAL)) return 1;
+	const int error(errno);
+	return EAGAIN == error || EWOULDBLOCK == error || ENOBUFS == error || EINTR == error ? 0 : -1;
+}
+
+/// \returns false if the subscriber has gone
+static
+bool
+flush_subscriber (
+	int fd,
+	subscriber & u
+) {
+	std::vector<service_manager_state_change>::iterator p(u.pending.begin());
+	for (; u.pending.end() != p; ++p) {
+		const int rc(send_state_change(fd, *p));
+		if (0 > rc) return false;
+		if (0 == rc) break;
+	}
+	u.pending.erase(u.pending.begin(), p);
+	const bool want_write(!u.pending.empty());
+	if (want_write != u.want_write) {
+		set_subscriber_event(fd, EVFILT_WRITE, want_write ? EV_ADD : EV_DELETE);
+		u.want_write = want_write;
+	}
+	return true;
+}
+
+static
+void
+publish_to_subscribers (
+	const service_manager_state_change & r
+) {
+	for (subscriber_map::iterator i(subscribers.begin()); subscribers.end() != i; ) {
+		// Pre-increment because we might be erasing.
+		subscriber_map::iterator j(i++);
+		const int fd(j->first);
+		subscriber & u(j->second);
+		if (u.pending.empty()) {
+			const int rc(send_state_change(fd, r));
+			if (0 > rc) {
+				drop_subscriber(j);
+				continue;
+			}
+			if (0 < rc) continue;
+		} else {
+			// Merge with any record for the same service that is still waiting, so that the queue never grows beyond one record per service.
+			std::vector<service_manager_state_change>::iterator p(u.pending.begin());
+			while (u.pending.end() != p && (p->dev != r.dev || p->ino != r.ino)) ++p;
+			if (u.pending.end() != p) {
+				const uint8_t old_state(p->old_state);
+				*p = r;
+				p->old_state = old_state;
+				p->flags |= service_manager_state_change::COALESCED;
+				continue;
+			}
+		}
+		u.pending.push_back(r);
+		if (!flush_subscriber(fd, u))
+			drop_subscriber(j);
+	}
+}
+
+/// \returns false if the event is not for a subscriber
+static
+bool
+subscriber_event (
+	const struct kevent & e
+) {
+	const subscriber_map::iterator i(subscribers.find(e.ident));
+	if (subscribers.end() == i) return false;
+	switch (e.filter) {
+		case EVFILT_WRITE:
+			if ((EV_EOF & e.flags) || !flush_subscriber(i->first, i->second))
+				drop_subscriber(i);
+			break;
+		case EVFILT_READ:
+		{
+			// Subscribers have nothing to say to us; so this is either end of file or junk to be discarded.
+			char buf[64];
+			const ssize_t rc(recv(i->first, buf, sizeof buf, MSG_DONTWAIT));
+			if (0 == rc || (0 > rc && EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno))
+				drop_subscriber(i);
+			break;
+		}
+	}
+	return true;
+}
 
 /* Supervision **************************************************************
 // **************************************************************************
 */
 
-service::service(const struct stat & s, ProcessEnvironment & e) : 
+service::service(std::size_t slot, const struct stat & s, ProcessEnvironment & e) : 
 	index(s),
 	in(STDIN_FILENO), 
 	out(STDOUT_FILENO), 
@@ -157,21 +860,40 @@ service::service(const struct stat & s, ProcessEnvironment & e) :
 	control_fd(-1),
 	status_fd(-1),
 	service_dir_fd(-1),
+	status_slot(slot),
 #if !HAS_FIFO_EXTENSION
 	control_client_fd(-1),
 #endif
 	run_on_empty(false),
+	listen_fds(),
+	accept_connections(false),
+	connection_limit(CONNECTION_LIMIT),
+	connections(),
 	pending_command('\0'), 
 	paused(false), 
 	unload_after_stop(false),
 	activity(NONE), 
 	current_process_status(WAIT_STATUS_RUNNING),
 	current_process_code(0),
+	published_state(encore_status_stopped),
+	timer(NO_TIMER),
+	timer_generation(0UL),
+	timer_expiry(0U),
+	restart_backoff(0U),
+	restart_backoff_elapsed(false),
+	spawn_failures(0U),
+	run_started(),
+	restarts(0U),
+	cumulative_user_usec(0U),
+	cumulative_system_usec(0U),
+	maximum_rss(0U),
 	processes(),
+	socket_activation_armed(false),
 	envs(e)
 {
 	pipe_fds[0] = pipe_fds[1] = -1;
 	name[0] = '\0';
+	std::memset(status + STATUS_BLOCK_SIZE, 0, sizeof status - STATUS_BLOCK_SIZE);
 }
 
 service::~service() 
@@ -181,6 +903,22 @@ service::~service()
 #endif
 	delete_from_input_activation_list();
 	delete_from_control_fifo_list();
+	for (std::vector<int>::const_iterator i(listen_fds.begin()); listen_fds.end() != i; ++i) {
+		if (socket_activation_armed) {
+			socket_activated_services.erase(*i);
+			delete_input_ready_event(*i);
+		}
+		close(*i);
+	}
+	listen_fds.clear();
+	socket_activation_armed = false;
+	// Per-connection processes are left to finish their connections, and are reaped as strays.
+	for (std::vector<int>::const_iterator i(connections.begin()); connections.end() != i; ++i)
+		connection_services.erase(*i);
+	connections.clear();
+	publish_state_change(service_manager_state_change::UNLOADED);
+	release_status_slot(status_slot);
+	status_slot = -1;
 	close(pipe_fds[0]);
 	close(pipe_fds[1]);
 	close(status_fd);
@@ -263,19 +1001,46 @@ service::stamp_process_status (
 	pack_bigendian(status + offset + 13U, n, 4);
 }
 
+static inline
+uint64_t
+microseconds (
+	const timeval & t
+) {
+	return static_cast<uint64_t>(t.tv_sec) * 1000000U + static_cast<uint64_t>(t.tv_usec);
+}
+
+/// Account for a process that has terminated, and if it was the main process of the run program record its usage as the last run's.
+inline
+void 
+service::stamp_usage (
+	const unsigned activity_index,
+	const struct rusage & usage
+) {
+	const uint64_t user(microseconds(usage.ru_utime)), system(microseconds(usage.ru_stime));
+	// ru_maxrss is in KiB on Linux and the BSDs.
+	const uint64_t rss(usage.ru_maxrss > 0 ? usage.ru_maxrss : 0);
+	cumulative_user_usec += user;
+	cumulative_system_usec += system;
+	if (maximum_rss < rss) maximum_rss = rss;
+	if (1U == activity_index) {
+		pack_bigendian(status + LAST_RUN_USAGE_OFFSET +  0U, user, 8);
+		pack_bigendian(status + LAST_RUN_USAGE_OFFSET +  8U, system, 8);
+		pack_bigendian(status + LAST_RUN_USAGE_OFFSET + 16U, rss, 8);
+	}
+	pack_bigendian(status + CUMULATIVE_USAGE_OFFSET +  0U, cumulative_user_usec, 8);
+	pack_bigendian(status + CUMULATIVE_USAGE_OFFSET +  8U, cumulative_system_usec, 8);
+	pack_bigendian(status + CUMULATIVE_USAGE_OFFSET + 16U, maximum_rss, 8);
+}
+
 void 
 service::add_process (
 	int pid
 ) {
 	const bool affects_main_process(processes.empty());
-	if (!processes.insert(pid).second) return;
-	active_services.insert(pid_to_service_map::value_type(pid, this));
-#if !defined(__LINUX__) && !defined(__linux__)
-	struct kevent e;
-	// NOTE_EXIT is incompatible with NOTE_TRACK within a single kqueue, as they both set the data field.
-	EV_SET(&e, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT|NOTE_FORK|NOTE_TRACK, 0, 0);
-	kevent(queue, &e, 1, 0, 0, 0);
-#endif
+	const std::vector<int>::iterator p(std::lower_bound(processes.begin(), processes.end(), pid));
+	if (processes.end() != p && pid == *p) return;
+	processes.insert(p, pid);
+	watch_process(pid);
 	if (affects_main_process) {
 		timespec now;
 		clock_gettime(CLOCK_REALTIME, &now);
@@ -283,22 +1048,57 @@ service::add_process (
 	}
 }
 
+void 
+service::watch_process (
+	int pid
+) {
+	active_services.insert(pid, this);
+	struct kevent e;
+#if !defined(__LINUX__) && !defined(__linux__)
+	// NOTE_EXIT is incompatible with NOTE_TRACK within a single kqueue, as they both set the data field.
+	EV_SET(&e, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT|NOTE_FORK|NOTE_TRACK, 0, 0);
+	kevent(queue, &e, 1, 0, 0, 0);
+#else
+	// On Linux this uses a process file descriptor, so that the exit event identifies the process directly.
+	// Failure, on older kernels, is harmless, as the SIGCHLD reaper then catches the exit.
+	EV_SET(&e, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, 0);
+	if (0 <= kevent(queue, &e, 1, 0, 0, 0))
+		exit_watched_services.insert(pid, this);
+#endif
+}
+
 void 
 service::del_process (
 	int pid,
 	int wait_status,	///< a wait status from which RUNNING and PAUSED have already been excluded
-	int wait_code
+	int wait_code,
+	const struct rusage & usage
 ) {
 	const bool affects_main_process(!processes.empty() && pid == *processes.begin());
-#if !defined(__LINUX__) && !defined(__linux__)
 	struct kevent e;
+#if !defined(__LINUX__) && !defined(__linux__)
 	// NOTE_EXIT is incompatible with NOTE_TRACK within a single kqueue, as they both set the data field.
 	EV_SET(&e, pid, EVFILT_PROC, EV_DELETE, NOTE_EXIT|NOTE_FORK|NOTE_TRACK, 0, 0);
-	kevent(queue, &e, 1, 0, 0, 0);
+#else
+	EV_SET(&e, pid, EVFILT_PROC, EV_DELETE, NOTE_EXIT, 0, 0);
 #endif
+	kevent(queue, &e, 1, 0, 0, 0);
 	active_services.erase(pid);
-	processes.erase(pid);
+#if defined(__LINUX__) || defined(__linux__)
+	exit_watched_services.erase(pid);
+#endif
+	const std::vector<int>::iterator p(std::lower_bound(processes.begin(), processes.end(), pid));
+	if (processes.end() != p && pid == *p) processes.erase(p);
 	if (affects_main_process) {
+		if (RUN == activity) {
+			// A run program that exits within a second of being started is crash looping, and is restarted ever more slowly.
+			timespec monotonic_now;
+			clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+			if (monotonic_now.tv_sec - run_started.tv_sec < 1 || (monotonic_now.tv_sec - run_started.tv_sec == 1 && monotonic_now.tv_nsec < run_started.tv_nsec)) {
+				if (restart_backoff < 16U) ++restart_backoff;
+			} else
+				restart_backoff = 0U;
+		}
 		timespec now;
 		clock_gettime(CLOCK_REALTIME, &now);
 		stamp_time(now);
@@ -310,11 +1110,45 @@ service::del_process (
 			case NONE:
 			default:	break;
 		}
-	}
+		stamp_usage(RUN == activity ? 1U : 0U, usage);
+	} else
+		stamp_usage(0U, usage);
 	current_process_status = wait_status;
 	current_process_code = wait_code;
 }
 
+void
+service::schedule_timer (
+	TimerType type,
+	unsigned milliseconds
+) {
+	timer = type;
+	timer_generation = ++timer_generations;
+	timer_expiry = timer_wheel::now() + (milliseconds + timer_wheel::TICK_MILLISECONDS - 1U) / timer_wheel::TICK_MILLISECONDS;
+	timers.add(timer_wheel::timer(timer_expiry, *this, timer_generation));
+}
+
+void
+service::timer_expired (
+	const sigset_t & original_signals
+) {
+	const TimerType type(timer);
+	timer = NO_TIMER;
+	switch (type) {
+		case NO_TIMER:
+			break;
+		case RESTART_BACKOFF:
+			if (RESTART == activity && !has_processes()) {
+				restart_backoff_elapsed = true;
+				change_state_if_necessary(original_signals);
+			}
+			break;
+		case SPAWN_RETRY:
+			enter_state(original_signals);
+			break;
+	}
+}
+
 void
 service::write_status()
 {
@@ -323,6 +1157,27 @@ service::write_status()
 		const int error(errno);
 		std::fprintf(stderr, "%s: WARNING: %s: %s: %s\n", prog, name, "supervise/status", std::strerror(error));
 	}
+	write_status_slot(status_slot, status);
+	if (published_state != status[ENCORE_STATUS_OFFSET])
+		publish_state_change(0U);
+}
+
+void
+service::publish_state_change(
+	uint16_t flags
+) {
+	service_manager_state_change r;
+	r.index = 0 > status_slot ? static_cast<uint32_t>(service_manager_state_change::NO_INDEX) : static_cast<uint32_t>(status_slot);
+	r.old_state = published_state;
+	r.new_state = flags & service_manager_state_change::UNLOADED ? static_cast<unsigned char>(encore_status_stopped) : status[ENCORE_STATUS_OFFSET];
+	r.flags = flags;
+	r.pid = unpack_littleendian(status + THIS_PID_OFFSET, 4);
+	r.timestamp = unpack_bigendian(status + 0, 8);
+	r.nanoseconds = unpack_bigendian(status + 8, 4);
+	r.dev = first;
+	r.ino = second;
+	published_state = r.new_state;
+	publish_to_subscribers(r);
 }
 
 inline
@@ -330,16 +1185,9 @@ void
 service::add_input_ready_event (int fd) 
 {
 	if (0 <= fd) {
-#if !defined(__LINUX__) && !defined(__linux__)
 		struct kevent e;
 		EV_SET(&e, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
 		kevent(queue, &e, 1, 0, 0, 0);
-#else
-		pollfd p;
-		p.fd = fd;
-		p.events = POLLIN;
-		poll_table.push_back(p);
-#endif
 	}
 }
 
@@ -348,17 +1196,9 @@ void
 service::delete_input_ready_event (int fd) 
 {
 	if (0 <= fd) {
-#if !defined(__LINUX__) && !defined(__linux__)
 		struct kevent e;
 		EV_SET(&e, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
 		kevent(queue, &e, 1, 0, 0, 0);
-#else
-		for (std::vector<pollfd>::iterator i(poll_table.begin()); i != poll_table.end(); )
-			if (i->fd == fd)
-				i = poll_table.erase(i);
-			else
-				++i;
-#endif
 	}
 }
 
@@ -369,7 +1209,7 @@ service::add_to_input_activation_list ()
 	const int fd(pipe_fds[0]);
 	if (0 <= fd) {
 		add_input_ready_event(fd);
-		input_activated_services.insert(input_activated_service_map::value_type(fd, this));
+		input_activated_services.insert(fd, this);
 	}
 }
 
@@ -384,6 +1224,249 @@ service::delete_from_input_activation_list ()
 	}
 }
 
+void
+service::snapshot (
+	service_manager_status_table_slot & v
+) const {
+	std::memset(&v, 0, sizeof v);
+	v.in_use = 1U;
+	v.dev = first;
+	v.ino = second;
+	std::strncpy(v.name, name, sizeof v.name - 1U);
+	std::memcpy(v.status, status, sizeof v.status);
+}
+
+/// Record the capacity of the input pipe, where the operating system can report it.
+void
+service::stamp_input_pipe_capacity ()
+{
+#if defined(F_GETPIPE_SZ)
+	const int n(fcntl(pipe_fds[0], F_GETPIPE_SZ));
+	if (0 < n) pack_bigendian(status + INPUT_PIPE_OFFSET + 0U, n, 4);
+#endif
+}
+
+/// Sample how much is waiting in the input pipe, keeping its high-water mark, and an estimate of how long it has been full, in the status.
+/// The pipe counts as full when a writer could not write PIPE_BUF bytes to it without blocking.
+/// \returns false if the service has no input pipe
+bool
+service::sample_input_pipe (
+	unsigned interval	///< the milliseconds since the previous sample
+) {
+	const int fd(pipe_fds[0]);
+	if (0 > fd) return false;
+	int n;
+	if (0 > ioctl(fd, FIONREAD, &n) || 0 > n) return true;
+	const uint32_t used(n);
+	const uint32_t capacity(unpack_bigendian(status + INPUT_PIPE_OFFSET + 0U, 4));
+	const uint32_t high_water(unpack_bigendian(status + INPUT_PIPE_OFFSET + 4U, 4));
+	const bool full(capacity && used + PIPE_BUF > capacity);
+	if (used <= high_water && !full) return true;
+	if (used > high_water)
+		pack_bigendian(status + INPUT_PIPE_OFFSET + 4U, used, 4);
+	if (full)
+		pack_bigendian(status + INPUT_PIPE_OFFSET + 8U, unpack_bigendian(status + INPUT_PIPE_OFFSET + 8U, 8) + interval, 8);
+	write_status();
+	return true;
+}
+
+static const char * const start_args[] = { "start", 0 };
+static const char * const run_args[] = { "run", 0 };
+static const char * const stop_args[] = { "stop", 0 };
+
+/* Socket activation ********************************************************
+// **************************************************************************
+*/
+
+/// \brief Make the environment for a spawned process from the service's own, with some variables added or replaced.
+static
+void
+make_environment (
+	ProcessEnvironment & envs,
+	const char * const * extra,
+	std::vector<const char *> & e
+) {
+	e.clear();
+	for (const char * const * p(envs.data()); *p; ++p) {
+		const char * const eq(std::strchr(*p, '='));
+		const std::size_t len(eq ? static_cast<std::size_t>(eq - *p) + 1U : std::strlen(*p));
+		bool replaced(false);
+		for (const char * const * q(extra); *q && !replaced; ++q)
+			replaced = 0 == std::strncmp(*p, *q, len);
+		if (!replaced) e.push_back(*p);
+	}
+	for (const char * const * q(extra); *q; ++q)
+		e.push_back(*q);
+	e.push_back(0);
+}
+
+/// \brief Describe a connection with the UCSPI variables that tcp-socket-accept and local-stream-socket-accept set.
+static
+void
+ucspi_environment (
+	const sockaddr_storage & localaddr,
+	const sockaddr_storage & remoteaddr,
+	std::vector<std::string> & v
+) {
+	char ip[INET6_ADDRSTRLEN];
+	switch (localaddr.ss_family) {
+		case AF_INET:
+		{
+			const sockaddr_in & a(reinterpret_cast<const sockaddr_in &>(localaddr));
+			v.push_back("PROTO=TCP");
+			if (inet_ntop(a.sin_family, &a.sin_addr, ip, sizeof ip)) v.push_back(std::string("TCPLOCALIP=") + ip);
+			v.push_back("TCPLOCALPORT=" + std::to_string(ntohs(a.sin_port)));
+			break;
+		}
+		case AF_INET6:
+		{
+			const sockaddr_in6 & a(reinterpret_cast<const sockaddr_in6 &>(localaddr));
+			v.push_back("PROTO=TCP");
+			if (inet_ntop(a.sin6_family, &a.sin6_addr, ip, sizeof ip)) v.push_back(std::string("TCPLOCALIP=") + ip);
+			v.push_back("TCPLOCALPORT=" + std::to_string(ntohs(a.sin6_port)));
+			break;
+		}
+		case AF_UNIX:
+		{
+			const sockaddr_un & a(reinterpret_cast<const sockaddr_un &>(localaddr));
+			v.push_back("PROTO=UNIX");
+			v.push_back(std::string("UNIXLOCALPATH=") + std::string(a.sun_path, strnlen(a.sun_path, sizeof a.sun_path)));
+			break;
+		}
+		default:
+			break;
+	}
+	switch (remoteaddr.ss_family) {
+		case AF_INET:
+		{
+			const sockaddr_in & a(reinterpret_cast<const sockaddr_in &>(remoteaddr));
+			if (inet_ntop(a.sin_family, &a.sin_addr, ip, sizeof ip)) v.push_back(std::string("TCPREMOTEIP=") + ip);
+			v.push_back("TCPREMOTEPORT=" + std::to_string(ntohs(a.sin_port)));
+			break;
+		}
+		case AF_INET6:
+		{
+			const sockaddr_in6 & a(reinterpret_cast<const sockaddr_in6 &>(remoteaddr));
+			if (inet_ntop(a.sin6_family, &a.sin6_addr, ip, sizeof ip)) v.push_back(std::string("TCPREMOTEIP=") + ip);
+			v.push_back("TCPREMOTEPORT=" + std::to_string(ntohs(a.sin6_port)));
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+/// Listening sockets are watched for connections whilst the service is awaiting them.
+/// That is whilst it is not running at all or, if it accepts connections itself, whilst it has room for more.
+inline
+void
+service::update_socket_activation ()
+{
+	const bool want(!listen_fds.empty() && (accept_connections ? connections.size() < connection_limit : NONE == activity));
+	if (want == socket_activation_armed) return;
+	socket_activation_armed = want;
+	for (std::vector<int>::const_iterator i(listen_fds.begin()); listen_fds.end() != i; ++i) {
+		if (want) {
+			add_input_ready_event(*i);
+			socket_activated_services.insert(*i, this);
+		} else {
+			socket_activated_services.erase(*i);
+			delete_input_ready_event(*i);
+		}
+	}
+}
+
+int
+service::add_listen_socket (
+	int fd,
+	bool a,
+	unsigned limit
+) {
+	if (!listen_fds.empty() && a != accept_connections) return EINVAL;
+	if (service_manager_rpc_message::MAX_LISTEN_SOCKETS <= listen_fds.size()) return EMFILE;
+	const int l(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+	if (0 > l) return errno;
+	// Accepting must never block us, should a connection be withdrawn before we get to it.
+	// The run program of a service that does its own accepting is not so affected, as it is given its own open file description.
+	if (a) set_non_blocking(l, true);
+	listen_fds.push_back(l);
+	accept_connections = a;
+	if (a) connection_limit = limit;
+	if (socket_activation_armed) {
+		add_input_ready_event(l);
+		socket_activated_services.insert(l, this);
+	}
+	update_socket_activation();
+	return 0;
+}
+
+void
+service::socket_ready (
+	const sigset_t & original_signals,
+	int fd
+) {
+	if (accept_connections)
+		accept_connection(original_signals, fd);
+	else {
+		std::fprintf(stderr, "%s: DEBUG: socket activate %s\n", prog, name);
+		enact_control_message(original_signals, 'u');
+	}
+}
+
+inline
+void
+service::accept_connection (
+	const sigset_t & original_signals,
+	int fd
+) {
+	sockaddr_storage remoteaddr;
+	socklen_t remoteaddrsz(sizeof remoteaddr);
+	const FileDescriptorOwner s(accept(fd, reinterpret_cast<sockaddr *>(&remoteaddr), &remoteaddrsz));
+	if (0 > s.get()) {
+		const int error(errno);
+		if (EAGAIN != error && EWOULDBLOCK != error && ECONNABORTED != error && EINTR != error)
+			std::fprintf(stderr, "%s: ERROR: %s: %s: %s\n", prog, name, "accept", std::strerror(error));
+		return;
+	}
+	set_close_on_exec(s.get(), true);
+	// On the BSDs, accepted sockets inherit non-blocking mode from the listening socket.
+	set_non_blocking(s.get(), false);
+	sockaddr_storage localaddr;
+	socklen_t localaddrsz(sizeof localaddr);
+	if (0 > getsockname(s.get(), reinterpret_cast<sockaddr *>(&localaddr), &localaddrsz))
+		localaddr.ss_family = AF_UNSPEC;
+	if (0 == remoteaddrsz)
+		remoteaddr.ss_family = AF_UNSPEC;
+
+	std::vector<std::string> v;
+	ucspi_environment(localaddr, remoteaddr, v);
+	std::vector<const char *> extra;
+	for (std::vector<std::string>::const_iterator i(v.begin()); v.end() != i; ++i)
+		extra.push_back(i->c_str());
+	extra.push_back(0);
+	std::vector<const char *> e;
+	make_environment(envs, extra.data(), e);
+
+	spawn_extras x;
+	x.connection_fd = s.get();
+	x.envs = e.data();
+	const int pid(spawn(original_signals, run_args, x));
+	if (0 >= pid) return;
+	connections.insert(std::lower_bound(connections.begin(), connections.end(), pid), pid);
+	connection_services.insert(pid, this);
+	update_socket_activation();
+}
+
+void
+service::end_connection (
+	int pid
+) {
+	connection_services.erase(pid);
+	const std::vector<int>::iterator p(std::lower_bound(connections.begin(), connections.end(), pid));
+	if (connections.end() != p && pid == *p) connections.erase(p);
+	update_socket_activation();
+}
+
 inline
 void
 service::add_to_control_fifo_list () 
@@ -391,7 +1474,7 @@ service::add_to_control_fifo_list ()
 	const int fd(control_fd);
 	if (0 <= fd) {
 		add_input_ready_event(fd);
-		service_control_fifos.insert(service_control_fifo_map::value_type(fd, this));
+		service_control_fifos.insert(fd, this);
 	}
 }
 
@@ -424,7 +1507,7 @@ void
 service::killall(
 	int signo
 ) {
-	for (std::set<int>::const_iterator i(processes.begin()); processes.end() != i; ++i) {
+	for (std::vector<int>::const_iterator i(processes.begin()); processes.end() != i; ++i) {
 		const int pid(*i);
 		kill(pid, signo);
 	}
@@ -486,9 +1569,77 @@ service::enact_control_message (
 	}
 }
 
-static const char * const start_args[] = { "start", 0 };
-static const char * const run_args[] = { "run", 0 };
-static const char * const stop_args[] = { "stop", 0 };
+#if defined(__LINUX__) || defined(__linux__)
+namespace {
+
+struct vfork_arguments {
+	service * s;
+	const sigset_t * original_signals;
+	const char * const * args;
+	int exec_fd;
+	const spawn_extras * extras;
+	volatile int error;
+};
+
+// The child of a vfork-style clone() runs on this, whilst we are suspended.
+alignas(16) char vfork_stack[64U * 1024U];
+
+int
+vforked_child (
+	void * p
+) {
+	vfork_arguments & v(*static_cast<vfork_arguments *>(p));
+	v.error = v.s->exec_process(*v.original_signals, v.args, v.exec_fd, *v.extras);
+	_exit(EXIT_TEMPORARY_FAILURE);
+}
+
+}
+
+/// \brief Spawn a service process without copying our address space, which can be large after a long uptime.
+/// \returns the process ID, or -1 if no process could be created; error is set if the process has exited because the program could not be executed
+static
+int
+vfork_process (
+	service & s,
+	const sigset_t & original_signals,
+	const char * const * a,
+	int exec_fd,
+	const spawn_extras & x,
+	int & error
+) {
+	vfork_arguments v;
+	v.s = &s;
+	v.original_signals = &original_signals;
+	v.args = a;
+	v.exec_fd = exec_fd;
+	v.extras = &x;
+	v.error = 0;
+	// The stack grows downwards on every architecture that we target.
+	const int rc(clone(vforked_child, vfork_stack + sizeof vfork_stack, CLONE_VM|CLONE_VFORK|SIGCHLD, &v));
+	if (0 > rc) return -1;
+	// With CLONE_VFORK, the child has either successfully executed its program or exited by this point.
+	// An exited child is still returned, so that reaping it drives the state machine as with fork().
+	error = v.error;
+	return rc;
+}
+#endif
+
+inline
+void
+service::spawned_process (
+	int pid
+) {
+	// A successful spawn ends any run of failures, and makes any retry that is still pending stale.
+	spawn_failures = 0U;
+	if (SPAWN_RETRY == timer)
+		timer = NO_TIMER;
+	if (RUN == activity) {
+		restart_backoff_elapsed = false;
+		clock_gettime(CLOCK_MONOTONIC, &run_started);
+	}
+	add_process(pid);
+	write_status();
+}
 
 inline
 void
@@ -501,9 +1652,6 @@ service::enter_state (
 	const char * restart_args[] = { "restart", 0, 0, 0, 0, 0 };
 	switch (activity) {
 		default:	
-			sleep(1); 
-			write_status(); 
-			return;
 		case NONE:	
 			write_status(); 
 			return;
@@ -511,6 +1659,7 @@ service::enter_state (
 		{
 			timespec now;
 			clock_gettime(CLOCK_REALTIME, &now);
+			restart_backoff = 0U;
 			a = start_args; 
 			stamp_process_status(0, WAIT_STATUS_RUNNING, 0, now); 
 			stamp_process_status(1, WAIT_STATUS_RUNNING, 0, now); 
@@ -542,33 +1691,7 @@ service::enter_state (
 			break;
 	}
 
-#if !defined(__OpenBSD__)
-	const FileDescriptorOwner fd(open_exec_at(service_dir_fd, *a));
-	if (0 > fd.get()) {
-		const int error(errno);
-		std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, *a, std::strerror(error));
-		sleep(1);
-		return;
-	}
-#endif
-
-	std::fflush(stderr);
-	const int rc(fork());
-	if (0 > rc) {
-		const int error(errno);
-		std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, *a, std::strerror(error));
-		sleep(1);
-		return;
-	}
-	if (0 < rc) {
-		std::fprintf(stderr, "%s: INFO: %s/%s: pid %d\n", prog, name, *a, rc);
-		add_process(rc);
-		write_status();
-		return;
-	}
-
-	// Child process only from now on.
-
+	// This is done before forking, so that both ways of spawning the process can use it.
 	char codebuf[16];
 	switch (activity) {
 		case RUN:	
@@ -592,28 +1715,148 @@ service::enter_state (
 			break;
 	}
 
-	sigprocmask(SIG_SETMASK, &original_signals, 0);
-	fchdir(service_dir_fd);
+	// A run program that is activated by its listening sockets is passed them, as systemd does.
+	spawn_extras x;
+	std::vector<const char *> e;
+	std::string listen_fds_env;
+	char listen_pid_env[sizeof "LISTEN_PID=" + 3U * sizeof(int)] = "LISTEN_PID=";
+	if (RUN == activity && !listen_fds.empty() && !accept_connections) {
+		listen_fds_env = "LISTEN_FDS=" + std::to_string(listen_fds.size());
+		const char * const extra[] = { listen_fds_env.c_str(), listen_pid_env, 0 };
+		make_environment(envs, extra, e);
+		x.listen_fds = listen_fds.data();
+		x.count_listen_fds = listen_fds.size();
+		x.envs = e.data();
+		x.listen_pid = listen_pid_env + sizeof "LISTEN_PID=" - 1U;
+	}
 
-	dup2(in, STDIN_FILENO);
-	dup2(out, STDOUT_FILENO);
-	dup2(err, STDERR_FILENO);
-	if (in != STDIN_FILENO) close(in);
-	if (out != STDOUT_FILENO) close(out);
-	if (err != STDERR_FILENO) close(err);
+	const int rc(spawn(original_signals, a, x));
+	if (0 < rc)
+		spawned_process(rc);
+	else
+	if (0 > rc)
+		// Retry later, rather than blocking everything else whilst the system is short of resources.
+		schedule_timer(SPAWN_RETRY, backoff_delay(++spawn_failures));
+}
 
-#if defined(__OpenBSD__) || defined(__NetBSD__)
-	execve(*a, const_cast<char **>(a), const_cast<char **>(envs.data()));
+/// \brief Spawn a process running one of the service's programs.
+/// \returns the process ID, 0 if the program could not be opened, or -1 if no process could be created
+int
+service::spawn (
+	const sigset_t & original_signals,
+	const char * const * a,
+	const spawn_extras & x
+) {
+#if !defined(__OpenBSD__)
+	const FileDescriptorOwner fd(open_exec_at(service_dir_fd, *a));
+	if (0 > fd.get()) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, *a, std::strerror(error));
+		return 0;
+	}
+	const int exec_fd(fd.get());
 #else
-	fexecve(fd.get(), const_cast<char **>(a), const_cast<char **>(envs.data()));
+	const int exec_fd(-1);
 #endif
-	const int error(errno);
+
+	// The environment is built here, as building it allocates memory, which a vfork()ed child must not do.
+	spawn_extras y(x);
+	if (!y.envs) y.envs = envs.data();
+
+#if defined(__LINUX__) || defined(__linux__)
+	{
+		int error(0);
+		const int rc(vfork_process(*this, original_signals, a, exec_fd, y, error));
+		if (0 < rc) {
+			// A child that could not execute its program has exited with EXIT_TEMPORARY_FAILURE, just as a fork()ed one does.
+			if (error)
+				std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, *a, std::strerror(error));
+			else
+				std::fprintf(stderr, "%s: INFO: %s/%s: pid %d\n", prog, name, *a, rc);
+			return rc;
+		}
+		// Otherwise clone() itself is not available, so fall back to fork().
+	}
+#endif
+
+	std::fflush(stderr);
+	const int rc(fork());
+	if (0 > rc) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, *a, std::strerror(error));
+		return -1;
+	}
+	if (0 < rc) {
+		std::fprintf(stderr, "%s: INFO: %s/%s: pid %d\n", prog, name, *a, rc);
+		return rc;
+	}
+
+	// Child process only from now on.
+
+	const int error(exec_process(original_signals, a, exec_fd, y));
 	std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, *a, std::strerror(error));
 	std::fflush(stderr);
 	sleep(1);
 	_exit(EXIT_TEMPORARY_FAILURE);
 }
 
+/// \brief Set up the process state of a newly forked service process and execute its program.
+/// This must only make async-signal-safe calls, only read memory that was set up before spawning, and write to no memory other than its own stack and the LISTEN_PID buffer, as it is also run in a vfork()ed child that shares our address space.
+/// \returns the error, if the program could not be executed
+int
+service::exec_process (
+	const sigset_t & original_signals,
+	const char * const * a,
+	int exec_fd,
+	const spawn_extras & x
+) {
+	sigprocmask(SIG_SETMASK, &original_signals, 0);
+	fchdir(service_dir_fd);
+
+	if (0 <= x.connection_fd) {
+		dup2(x.connection_fd, STDIN_FILENO);
+		dup2(x.connection_fd, STDOUT_FILENO);
+		dup2(err, STDERR_FILENO);
+		if (x.connection_fd > STDERR_FILENO) close(x.connection_fd);
+	} else {
+		dup2(in, STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		dup2(err, STDERR_FILENO);
+		if (in != STDIN_FILENO) close(in);
+		if (out != STDOUT_FILENO) close(out);
+	}
+	if (err != STDERR_FILENO) close(err);
+
+	if (x.count_listen_fds) {
+		// Move them all out of the way first, so that placing one cannot overwrite another.
+		int moved[service_manager_rpc_message::MAX_LISTEN_SOCKETS];
+		for (std::size_t i(0U); i < x.count_listen_fds; ++i)
+			moved[i] = fcntl(x.listen_fds[i], F_DUPFD, LISTEN_SOCKET_FILENO + static_cast<int>(x.count_listen_fds));
+		for (std::size_t i(0U); i < x.count_listen_fds; ++i) {
+			dup2(moved[i], LISTEN_SOCKET_FILENO + static_cast<int>(i));
+			close(moved[i]);
+		}
+	}
+	if (x.listen_pid) {
+		char digits[3U * sizeof(int)];
+		std::size_t n(0U);
+		for (unsigned long pid(getpid()); n < sizeof digits && (pid || !n); pid /= 10U)
+			digits[n++] = static_cast<char>('0' + pid % 10U);
+		char * p(x.listen_pid);
+		while (n) *p++ = digits[--n];
+		*p = '\0';
+	}
+	const char * const * e(x.envs);
+
+#if defined(__OpenBSD__) || defined(__NetBSD__)
+	static_cast<void>(exec_fd);	// silence compiler warning
+	execve(*a, const_cast<char **>(a), const_cast<char **>(e));
+#else
+	fexecve(exec_fd, const_cast<char **>(a), const_cast<char **>(e));
+#endif
+	return errno;
+}
+
 void 
 service::change_state_if_necessary (
 	const sigset_t & original_signals
@@ -686,12 +1929,23 @@ service::change_state_if_necessary (
 			}
 			break;
 	}
+	// A crash looping run program waits out its backoff in the restart state, where a command to bring the service down still takes effect at once.
+	if (RESTART == prior_activity && RUN == activity && restart_backoff && !restart_backoff_elapsed) {
+		activity = RESTART;
+		if (RESTART_BACKOFF != timer)
+			schedule_timer(RESTART_BACKOFF, backoff_delay(restart_backoff));
+	}
+	if (RESTART == prior_activity && RUN == activity) {
+		++restarts;
+		pack_bigendian(status + RESTARTS_OFFSET, restarts, RESTARTS_SIZE);
+	}
 	stamp_activity();
 	stamp_pending_command();
 	if (prior_activity != activity)
 		enter_state(original_signals);
 	else
 		write_status();
+	update_socket_activation();
 }
 
 inline
@@ -700,7 +1954,8 @@ service::reap (
 	const sigset_t & original_signals,
 	int wait_status,
 	int wait_code,
-	int pid
+	int pid,
+	const struct rusage & usage
 ) {
 	// The child process might not have actually gone.
 	if (WAIT_STATUS_RUNNING == wait_status) {
@@ -717,7 +1972,7 @@ service::reap (
 	}
 
 	// We have at this point excluded everything apart from normal exit and termination by a signal.
-	del_process(pid, wait_status, wait_code);
+	del_process(pid, wait_status, wait_code, usage);
 	write_status();
 	change_state_if_necessary(original_signals);
 }
@@ -730,91 +1985,144 @@ static sig_atomic_t child_signalled = false;
 
 static sig_atomic_t stop_signalled = false;
 
-#if defined(__LINUX__) || defined(__linux__)
+// A way to set SIG_IGN that is reset by execve().
+static void sig_ignore ( int ) {}
+
+/* Input pipe sampling ******************************************************
+// **************************************************************************
+// A logger that stalls leaves its input pipe full, and the services that write to it blocked in write().
+// Reading the fill level of a pipe is cheap, so every input pipe is sampled several times a second, but only whilst there are input pipes at all.
+*/
+
+enum {
+	INPUT_PIPE_SAMPLE_INTERVAL = 250U,	///< in milliseconds
+};
+
+static bool input_pipe_sampler_scheduled(false);
 
 static
 void
-sig_child (
-	int signo
+schedule_input_pipe_sampling (
 ) {
-	if (SIGCHLD != signo) return;
-	child_signalled = true;
+	if (input_pipe_sampler_scheduled) return;
+	timers.add(timer_wheel::timer(timer_wheel::now() + INPUT_PIPE_SAMPLE_INTERVAL / timer_wheel::TICK_MILLISECONDS, no_service, INPUT_PIPE_SAMPLER_GENERATION));
+	input_pipe_sampler_scheduled = true;
 }
 
-static 
-void 
-sig_hup ( 
-	int signo 
+static
+void
+sample_input_pipes (
 ) {
-	if (SIGHUP != signo) return;
-	stop_signalled = true;
+	input_pipe_sampler_scheduled = false;
+	bool any(false);
+	for (std::size_t slot(0U); slot < services.slots(); ++slot) {
+		if (service * const i = services.at(slot))
+			if (i->sample_input_pipe(INPUT_PIPE_SAMPLE_INTERVAL))
+				any = true;
+	}
+	if (any)
+		schedule_input_pipe_sampling();
 }
 
-static 
-void 
-sig_term ( 
-	int signo 
-) {
-	if (SIGTERM != signo) return;
-	stop_signalled = true;
-}
+/* Status snapshots *********************************************************
+// **************************************************************************
+// Tools that display many services at once can ask for the status of every loaded service in a single request.
+// The reply carries an anonymous file, so that it never has to be split up to fit a datagram or block us whilst the client reads it.
+*/
 
-static 
-void 
-sig_int ( 
-	int signo 
+static
+int
+write_snapshot (
+	int fd,
+	uint32_t & count
 ) {
-	if (SIGINT != signo) return;
-	stop_signalled = true;
+	std::vector<service_manager_status_table_slot> slots;
+	slots.reserve(services.size());
+	for (std::size_t slot(0U); slot < services.slots(); ++slot) {
+		const service * const s(services.at(slot));
+		if (!s) continue;
+		slots.push_back(service_manager_status_table_slot());
+		s->snapshot(slots.back());
+	}
+	const char * buf(reinterpret_cast<const char *>(slots.data()));
+	for (std::size_t o(0U), len(slots.size() * sizeof(service_manager_status_table_slot)); o < len; ) {
+		const ssize_t n(write(fd, buf + o, len - o));
+		if (0 > n) {
+			if (EINTR == errno) continue;
+			return errno;
+		}
+		o += n;
+	}
+	count = slots.size();
+	return 0;
 }
 
-static 
-void 
-sig_quit ( 
-	int signo 
+static
+int
+send_snapshot (
+	int reply_fd
 ) {
-	if (SIGQUIT != signo) return;
-	stop_signalled = true;
-}
-
-static void sig_tstp ( int ) {}
-
-#else
-
-// A way to set SIG_IGN that is reset by execve().
-static void sig_ignore ( int ) {}
+	service_manager_snapshot_reply r;
+	std::memset(&r, 0, sizeof r);
+	r.version = service_manager_snapshot_reply::VERSION;
+	r.slot_size = sizeof(service_manager_status_table_slot);
+	const FileDescriptorOwner snapshot_fd(open_anonymous_file("service-manager-snapshot"));
+	if (0 > snapshot_fd.get())
+		r.error = errno;
+	else
+		r.error = write_snapshot(snapshot_fd.get(), r.count);
 
-#endif
+	// A failed snapshot is reported without a file.
+	struct iovec v[1] = { { &r, sizeof r } };
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg = {
+		0, 0,
+		v, sizeof v/sizeof *v,
+		r.error ? 0 : buf, r.error ? 0 : static_cast<socklen_t>(sizeof buf),
+		0
+	};
+	if (!r.error) {
+		struct cmsghdr *cmsg(CMSG_FIRSTHDR(&msg));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		const int fd(snapshot_fd.get());
+		std::memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+	}
+	if (0 > sendmsg(reply_fd, &msg, MSG_DONTWAIT)) return errno;
+	return 0;
+}
 
 /* Service Manager control API RPC handlers *********************************
 // **************************************************************************
 */
 
 static
-void
+int
 plumb (
 	int out_supervise_dir_fd,
 	int in_supervise_dir_fd
 ) {
 	struct stat in_supervise_dir_s;
-	if (!is_directory(in_supervise_dir_fd, in_supervise_dir_s)) return;
-	service_map::iterator in_supervise_dir_i(services.find(in_supervise_dir_s));
-	if (in_supervise_dir_i == services.end()) return;
-	service & in_s(*(in_supervise_dir_i->second));
+	if (!is_directory(in_supervise_dir_fd, in_supervise_dir_s)) return ENOTDIR;
+	service * const in_supervise_dir_p(services.find(in_supervise_dir_s));
+	if (!in_supervise_dir_p) return ENOENT;
+	service & in_s(*in_supervise_dir_p);
 
 	struct stat out_supervise_dir_s;
-	if (!is_directory(out_supervise_dir_fd, out_supervise_dir_s)) return;
-	service_map::iterator out_supervise_dir_i(services.find(out_supervise_dir_s));
-	if (out_supervise_dir_i == services.end()) return;
-	service & out_s(*(out_supervise_dir_i->second));
+	if (!is_directory(out_supervise_dir_fd, out_supervise_dir_s)) return ENOTDIR;
+	service * const out_supervise_dir_p(services.find(out_supervise_dir_s));
+	if (!out_supervise_dir_p) return ENOENT;
+	service & out_s(*out_supervise_dir_p);
 
 	std::fprintf(stderr, "%s: DEBUG: plumb %s to %s\n", prog, out_s.name, in_s.name);
 	if (-1 != in_s.pipe_fds[1])
 		out_s.err = out_s.out = in_s.pipe_fds[1];
+	return 0;
 }
 
 static
-void
+int
 load (
 	ProcessEnvironment & envs,
 	const char * name,
@@ -822,19 +2130,18 @@ load (
 	int service_dir_fd
 ) {
 	struct stat service_dir_s;
-	if (!is_directory(service_dir_fd, service_dir_s)) return;
+	if (!is_directory(service_dir_fd, service_dir_s)) return ENOTDIR;
 	struct stat supervise_dir_s;
-	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return;
+	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return ENOTDIR;
 
-	service_map::iterator i(services.find(service_dir_s));
-	if (i == services.end()) {
+	if (!services.find(supervise_dir_s)) {
 		FileDescriptorOwner service_dir_fd2(dup(service_dir_fd));
-		if (0 > service_dir_fd2.get()) return;
+		if (0 > service_dir_fd2.get()) return errno;
 		set_close_on_exec(service_dir_fd2.get(), true);
 		//
 		// We need an explicit lock file, because we cannot lock FIFOs.
 		FileDescriptorOwner lock_fd(open_lockfile_at(supervise_dir_fd, "lock"));
-		if (0 > lock_fd.get()) return;
+		if (0 > lock_fd.get()) return errno;
 		//
 		// We are allowed to open the read end of a FIFO in non-blocking mode without having to wait for a writer.
 		mkfifoat(supervise_dir_fd, "control", 0600);
@@ -843,20 +2150,20 @@ load (
 #else
 		FileDescriptorOwner control_fd(open_read_at(supervise_dir_fd, "control"));
 #endif
-		if (0 > control_fd.get()) return;
+		if (0 > control_fd.get()) return errno;
 #if !HAS_FIFO_EXTENSION
 		//
 		// We have to keep a client (write) end descriptor open to the control FIFO.
 		// Otherwise, the first control client process triggers POLLHUP when it closes its end.
 		// Opening the FIFO for read+write isn't standard, although it does work on Linux.
 		FileDescriptorOwner control_client_fd(open_writeexisting_at(supervise_dir_fd, "control"));
-		if (0 > control_client_fd.get()) return;
+		if (0 > control_client_fd.get()) return errno;
 #endif
 		//
 		// Unlike daemontools, but like daemontools-encore, we keep the status file open continually.
 		// This permits the supervise directory to be read-only.
 		FileDescriptorOwner status_fd(open_writetrunc_at(supervise_dir_fd, "status", 0644));
-		if (0 > status_fd.get()) return;
+		if (0 > status_fd.get()) return errno;
 		//
 		// The existence of a reader at this FIFO indicates that a supervisor is active.
 		// We must open this after the rest of the control/status API is initialized.
@@ -869,13 +2176,11 @@ load (
 		fchmodat(supervise_dir_fd, "ok", 0666, 0);
 #endif
 		FileDescriptorOwner ok_fd(open_read_at(supervise_dir_fd, "ok"));
-		if (0 > ok_fd.get()) return;
+		if (0 > ok_fd.get()) return errno;
 
 		timespec now;
 		clock_gettime(CLOCK_REALTIME, &now);
-		const service_pointer sp(new service(supervise_dir_s,envs));
-		std::pair<service_map::iterator, bool> it(services.insert(service_map::value_type(supervise_dir_s,sp)));
-		service & s(*(it.first->second));
+		service & s(services.create(supervise_dir_s,envs));
 		s.lock_fd = lock_fd.release();
 		s.ok_fd = ok_fd.release();
 		s.control_fd = control_fd.release();
@@ -885,6 +2190,7 @@ load (
 		s.status_fd = status_fd.release();
 		s.service_dir_fd = service_dir_fd2.release();
 		std::strncpy(s.name, name, sizeof s.name);
+		claim_status_slot(s.status_slot, s, s.name);
 		s.stamp_time(now);
 		s.stamp_activity();
 		s.stamp_pending_command();
@@ -894,73 +2200,158 @@ load (
 		s.add_to_control_fifo_list();
 		std::fprintf(stderr, "%s: DEBUG: load %s\n", prog, s.name);
 	}
+	return 0;
 }
 
 static
-void
+int
 make_input_activated (
 	int supervise_dir_fd
 ) {
 	struct stat supervise_dir_s;
-	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return;
-	service_map::iterator supervise_dir_i(services.find(supervise_dir_s));
-	if (supervise_dir_i == services.end()) return;
-	service & s(*(supervise_dir_i->second));
+	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return ENOTDIR;
+	service * const supervise_dir_p(services.find(supervise_dir_s));
+	if (!supervise_dir_p) return ENOENT;
+	service & s(*supervise_dir_p);
 
 	std::fprintf(stderr, "%s: DEBUG: make input activated %s\n", prog, s.name);
 	s.add_to_input_activation_list();
+	return 0;
 }
 
 static
-void
+int
 set_unload (
 	int supervise_dir_fd
 ) {
 	struct stat supervise_dir_s;
-	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return;
-	service_map::iterator supervise_dir_i(services.find(supervise_dir_s));
-	if (supervise_dir_i == services.end()) return;
+	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return ENOTDIR;
+	service * const supervise_dir_p(services.find(supervise_dir_s));
+	if (!supervise_dir_p) return ENOENT;
 
-	service & s(*(supervise_dir_i->second));
+	service & s(*supervise_dir_p);
 	std::fprintf(stderr, "%s: DEBUG: set unload after stop %s\n", prog, s.name);
 	s.set_unload();
 	if (s.unloadable()) {
 		std::fprintf(stderr, "%s: DEBUG: unloading %s\n", prog, s.name);
-		services.erase(supervise_dir_i);
+		services.destroy(s);
 	}
+	return 0;
 }
 
 static
-void
+int
 make_pipe_connectable (
 	int supervise_dir_fd
 ) {
 	struct stat supervise_dir_s;
-	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return;
-	service_map::iterator supervise_dir_i(services.find(supervise_dir_s));
-	if (supervise_dir_i == services.end()) return;
-	service & s(*(supervise_dir_i->second));
+	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return ENOTDIR;
+	service * const supervise_dir_p(services.find(supervise_dir_s));
+	if (!supervise_dir_p) return ENOENT;
+	service & s(*supervise_dir_p);
 
 	std::fprintf(stderr, "%s: DEBUG: add pipe for %s\n", prog, s.name);
 	if (-1 == s.pipe_fds[1] && -1 == s.pipe_fds[0]) {
-		if (0 <= pipe_close_on_exec(s.pipe_fds))
-			s.in = s.pipe_fds[0];
+		if (0 > pipe_close_on_exec(s.pipe_fds))
+			return errno;
+		s.in = s.pipe_fds[0];
 	}
+	s.stamp_input_pipe_capacity();
+	s.write_status();
+	schedule_input_pipe_sampling();
+	return 0;
 }
 
+/// A capacity that cannot be applied leaves the pipe usable at its old size, so it only warrants a warning.
 static
-void
+int
+set_pipe_size (
+	int supervise_dir_fd,
+	const char * capacity	///< in bytes
+) {
+	struct stat supervise_dir_s;
+	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return ENOTDIR;
+	service * const supervise_dir_p(services.find(supervise_dir_s));
+	if (!supervise_dir_p) return ENOENT;
+	service & s(*supervise_dir_p);
+	if (-1 == s.pipe_fds[1]) return EPIPE;
+
+	const char * end(capacity);
+	const unsigned long size(std::strtoul(capacity, const_cast<char **>(&end), 10));
+	if (end == capacity || *end || !size || INT_MAX < size) {
+		std::fprintf(stderr, "%s: WARNING: %s: %s: %s\n", prog, s.name, "pipe_size", "Not a valid pipe capacity; the default is used.");
+		return 0;
+	}
+#if defined(F_SETPIPE_SZ)
+	if (0 > fcntl(s.pipe_fds[1], F_SETPIPE_SZ, static_cast<int>(size))) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: WARNING: %s: %s: %s\n", prog, s.name, "pipe_size", std::strerror(error));
+	}
+#endif
+	s.stamp_input_pipe_capacity();
+	s.write_status();
+	return 0;
+}
+
+static
+int
 make_run_on_empty (
 	int supervise_dir_fd
 ) {
 	struct stat supervise_dir_s;
-	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return;
-	service_map::iterator supervise_dir_i(services.find(supervise_dir_s));
-	if (supervise_dir_i == services.end()) return;
-	service & s(*(supervise_dir_i->second));
+	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return ENOTDIR;
+	service * const supervise_dir_p(services.find(supervise_dir_s));
+	if (!supervise_dir_p) return ENOENT;
+	service & s(*supervise_dir_p);
 
 	std::fprintf(stderr, "%s: DEBUG: run-on-empty set for %s\n", prog, s.name);
 	s.run_on_empty = true;
+	return 0;
+}
+
+static inline
+int
+make_socket_activated (
+	int supervise_dir_fd,
+	int socket_fd,
+	const char * mode
+) {
+	struct stat supervise_dir_s;
+	if (!is_directory(supervise_dir_fd, supervise_dir_s)) return ENOTDIR;
+	service * const supervise_dir_p(services.find(supervise_dir_s));
+	if (!supervise_dir_p) return ENOENT;
+	service & s(*supervise_dir_p);
+
+	int type;
+	socklen_t len(sizeof type);
+	if (0 > getsockopt(socket_fd, SOL_SOCKET, SO_TYPE, &type, &len)) return errno;
+	// The mode is empty, or "accept" optionally followed by a colon and a connection limit.
+	const bool accept_connections(0 == std::strncmp(mode, "accept", sizeof "accept" - 1U));
+	if (accept_connections) mode += sizeof "accept" - 1U;
+	unsigned long limit(CONNECTION_LIMIT);
+	if (accept_connections && ':' == *mode) {
+		const char * end(++mode);
+		limit = std::strtoul(mode, const_cast<char **>(&end), 10);
+		if (end == mode || *end || !limit || UINT_MAX < limit) return EINVAL;
+	} else
+	if (*mode)
+		return EINVAL;
+	if (accept_connections && SOCK_STREAM != type && SOCK_SEQPACKET != type) return EPROTOTYPE;
+	return s.add_listen_socket(socket_fd, accept_connections, limit);
+}
+
+static int reexec_reply_fd(-1);	///< The reply socket of a pending re-execution request, which the main loop acts upon.
+
+static
+int
+request_reexec (
+	int reply_fd
+) {
+	if (0 <= reexec_reply_fd) return EALREADY;
+	reexec_reply_fd = fcntl(reply_fd, F_DUPFD_CLOEXEC, 0);
+	if (0 > reexec_reply_fd) return errno;
+	std::fprintf(stderr, "%s: DEBUG: %s\n", prog, "re-execution requested");
+	return 0;
 }
 
 /* Support functions ********************************************************
@@ -977,9 +2368,8 @@ find_forked_parent (
 	pid_to_forked_parents_map::iterator & i(r.first);
 	forked_parent & f(i->second);
 	if (r.second) {
-		pid_to_service_map::iterator j(active_services.find(ppid));
-		if (j != active_services.end())
-			f.s = j->second;
+		if (service * const j = active_services.find(ppid))
+			f.s = j;
 		else {
 			f.s = 0;
 			std::fprintf(stderr, "%s: WARNING: unable to locate service of forked PPID %u\n", prog, ppid);
@@ -1033,23 +2423,25 @@ reap (
 	const sigset_t & original_signals,
 	int status,
 	int code,
-	int pid
+	int pid,
+	const struct rusage & usage
 ) {
-	pid_to_service_map::iterator i(active_services.find(pid));
-	if (i == active_services.end()) {
+	service * const i(active_services.find(pid));
+	if (!i) {
 		if (WAIT_STATUS_PAUSED == status)
 			kill(pid, SIGCONT);
+		else
+		if (WAIT_STATUS_RUNNING != status)
+			if (service * const j = connection_services.find(pid))
+				j->end_connection(pid);
 		return;
 	}
-	service & s(*i->second);
+	service & s(*i);
 
-	s.reap(original_signals, status, code, pid);
+	s.reap(original_signals, status, code, pid, usage);
 	if (s.unloadable()) {
-		service_map::iterator j(services.find(s));
-		if (j != services.end()) {
-			std::fprintf(stderr, "%s: DEBUG: unloading %s\n", prog, s.name);
-			services.erase(j);
-		}
+		std::fprintf(stderr, "%s: DEBUG: unloading %s\n", prog, s.name);
+		services.destroy(s);
 	}
 }
 
@@ -1061,8 +2453,22 @@ reaper (
 	for (;;) {
 		int status, code;
 		pid_t c;
-		if (0 >= wait_nonblocking_for_anychild_stopcontexit(c, status, code)) break;
-		reap(original_signals, status, code, c);
+		struct rusage usage;
+#if defined(__LINUX__) || defined(__linux__)
+		// Look before reaping, as the exits of processes with process file descriptors are reaped from their own events.
+		siginfo_t si;
+		si.si_pid = si.si_signo = 0;
+		if (0 > waitid(P_ALL, -1, &si, WNOHANG|WSTOPPED|WCONTINUED|WEXITED|WNOWAIT) || 0 == si.si_pid || 0 == si.si_signo) break;
+		c = si.si_pid;
+		// Such an exit hides any other child from waitid() until it has been reaped.
+		// So stop here, and let its EVFILT_PROC event wake us and run the reaper again, rather than poll until it arrives.
+		if (exit_watched_services.find(c) && CLD_STOPPED != si.si_code && CLD_TRAPPED != si.si_code && CLD_CONTINUED != si.si_code)
+			break;
+		if (0 >= wait_nonblocking_for_stopcontexit_of(c, status, code, usage)) break;
+#else
+		if (0 >= wait_nonblocking_for_anychild_stopcontexit(c, status, code, usage)) break;
+#endif
+		reap(original_signals, status, code, c, usage);
 	}
 }
  
@@ -1073,9 +2479,8 @@ input_ready_event (
 	int fd
 ) {
 	{
-		input_activated_service_map::iterator i(input_activated_services.find(fd));
-		if (i != input_activated_services.end()) {
-			service & s(*i->second);
+		if (service * const i = input_activated_services.find(fd)) {
+			service & s(*i);
 
 			std::fprintf(stderr, "%s: DEBUG: input activate %s\n", prog, s.name);
 			s.delete_from_input_activation_list();
@@ -1083,35 +2488,157 @@ input_ready_event (
 		}
 	}
 	{
-		service_control_fifo_map::iterator i(service_control_fifos.find(fd));
-		if (i != service_control_fifos.end()) {
-			service & s(*i->second);
+		if (service * const i = socket_activated_services.find(fd))
+			i->socket_ready(original_signals, fd);
+	}
+	{
+		if (service * const i = service_control_fifos.find(fd)) {
+			service & s(*i);
 
 			char command;
 			const int rc(read(s.control_fd, &command, sizeof command));
 			if (0 <= rc) {
 				s.enact_control_message(original_signals, command);
 				if ('x' == command && s.unloadable()) {
-					service_map::iterator j(services.find(s));
-					if (j != services.end()) {
-						std::fprintf(stderr, "%s: DEBUG: unloading %s\n", prog, s.name);
-						services.erase(j);
-					}
+					std::fprintf(stderr, "%s: DEBUG: unloading %s\n", prog, s.name);
+					services.destroy(s);
 				}
 			}
 		}
 	}
 }
 
+static inline
+int
+enact_rpc_operation (
+	ProcessEnvironment & envs,
+	uint8_t command,
+	const char * name,
+	const int * fds,
+	std::size_t count_fds
+) {
+	switch (command) {
+		case service_manager_rpc_message::NOOP:
+			return 0;
+		case service_manager_rpc_message::PLUMB:
+			if (2U > count_fds) return EBADF;
+			return plumb(fds[0], fds[1]);
+		case service_manager_rpc_message::LOAD:
+			if (2U > count_fds) return EBADF;
+			return load(envs, name, fds[0], fds[1]);
+		case service_manager_rpc_message::MAKE_INPUT_ACTIVATED:
+			if (1U > count_fds) return EBADF;
+			return make_input_activated(fds[0]);
+		case service_manager_rpc_message::UNLOAD:
+			if (1U > count_fds) return EBADF;
+			return set_unload(fds[0]);
+		case service_manager_rpc_message::MAKE_PIPE_CONNECTABLE:
+			if (1U > count_fds) return EBADF;
+			return make_pipe_connectable(fds[0]);
+		case service_manager_rpc_message::MAKE_RUN_ON_EMPTY:
+			if (1U > count_fds) return EBADF;
+			return make_run_on_empty(fds[0]);
+		case service_manager_rpc_message::SUBSCRIBE:
+			if (1U > count_fds) return EBADF;
+			return add_subscriber(fds[0]);
+		case service_manager_rpc_message::REEXEC:
+			if (1U > count_fds) return EBADF;
+			return request_reexec(fds[0]);
+		case service_manager_rpc_message::MAKE_SOCKET_ACTIVATED:
+			if (2U > count_fds) return EBADF;
+			return make_socket_activated(fds[0], fds[1], name);
+		case service_manager_rpc_message::SNAPSHOT:
+			if (1U > count_fds) return EBADF;
+			return send_snapshot(fds[0]);
+		case service_manager_rpc_message::SET_PIPE_SIZE:
+			if (1U > count_fds) return EBADF;
+			return set_pipe_size(fds[0], name);
+		default:
+			std::fprintf(stderr, "%s: WARNING: unknown control message command %u with %lu file descriptors\n", prog, command, count_fds);
+			return ENOSYS;
+	}
+}
+
+static inline
+void
+batch (
+	ProcessEnvironment & envs,
+	const char * buf,
+	std::size_t len,
+	const int * fds,
+	std::size_t count_fds
+) {
+	service_manager_rpc_batch_header h;
+	if (sizeof h > len || 1U > count_fds) {
+		std::fprintf(stderr, "%s: WARNING: %s\n", prog, "short batch control message");
+		return;
+	}
+	std::memcpy(&h, buf, sizeof h);
+	buf += sizeof h;
+	len -= sizeof h;
+	const int reply_fd(fds[0]);
+	++fds;
+	--count_fds;
+
+	service_manager_rpc_batch_reply r;
+	r.version = service_manager_rpc_batch_header::VERSION;
+	r.reserved = 0U;
+	r.count = 0U;
+	r.cookie = h.cookie;
+	r.error = 0;
+	if (service_manager_rpc_batch_header::VERSION != h.version)
+		r.error = EPROTONOSUPPORT;
+	else
+	if (service_manager_rpc_batch_header::MAX_OPERATIONS < h.count)
+		r.error = EMSGSIZE;
+	else
+	for (; r.count < h.count; ++r.count) {
+		service_manager_rpc_batch_operation o;
+		char name[sizeof service_manager_rpc_message::name];
+		if (sizeof o > len) {
+			r.error = EMSGSIZE;
+			break;
+		}
+		std::memcpy(&o, buf, sizeof o);
+		buf += sizeof o;
+		len -= sizeof o;
+		if (o.name_length > len || o.name_length >= sizeof name) {
+			r.error = EMSGSIZE;
+			break;
+		}
+		std::memcpy(name, buf, o.name_length);
+		name[o.name_length] = '\0';
+		buf += o.name_length;
+		len -= o.name_length;
+		if (o.count_fds > count_fds) {
+			r.statuses[r.count] = EBADF;
+			continue;
+		}
+		r.statuses[r.count] = enact_rpc_operation(envs, o.command, name, fds, o.count_fds);
+		fds += o.count_fds;
+		count_fds -= o.count_fds;
+	}
+
+	const std::size_t reply_len(sizeof r - sizeof r.statuses + r.count * sizeof *r.statuses);
+	if (0 > send(reply_fd, &r, reply_len, MSG_DONTWAIT)) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: WARNING: %s: %s\n", prog, "batch reply", std::strerror(error));
+	}
+}
+
 static inline
 void
 control_message (
 	ProcessEnvironment & envs,
 	int socket_fd
 ) {
-	service_manager_rpc_message m;
-	struct iovec v[1] = { { &m, sizeof m } };
-	char buf[CMSG_SPACE(3 * sizeof(int))];
+	union {
+		service_manager_rpc_message m;
+		char batch[sizeof(service_manager_rpc_batch_header) + service_manager_rpc_batch_header::MAX_OPERATIONS * (sizeof(service_manager_rpc_batch_operation) + sizeof service_manager_rpc_message::name)];
+	} u;
+	struct iovec v[1] = { { &u, sizeof u } };
+	// A batch carries a reply socket and up to two descriptors per operation.
+	char buf[CMSG_SPACE((1U + 2U * service_manager_rpc_batch_header::MAX_OPERATIONS) * sizeof(int))];
 	struct msghdr msg = {
 		0, 0,
 		v, sizeof v/sizeof *v,
@@ -1124,45 +2651,30 @@ control_message (
 		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "recvmsg", std::strerror(error));
 		return;
 	}
+	std::vector<int> fds;
 	for (struct cmsghdr *cmsg(CMSG_FIRSTHDR(&msg)); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
 		if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type) {
-			const int * fds(reinterpret_cast<int*>(CMSG_DATA(cmsg)));
-			const size_t count_fds((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof *fds);
-			for (size_t i(0); i < count_fds; ++i)
-				set_close_on_exec(fds[i], true);
-		}
-	}
-	for (struct cmsghdr *cmsg(CMSG_FIRSTHDR(&msg)); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type) {
-			const int * fds(reinterpret_cast<int*>(CMSG_DATA(cmsg)));
-			const size_t count_fds((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof *fds);
-			switch (m.command) {
-				case service_manager_rpc_message::PLUMB:
-					plumb(fds[0], fds[1]);
-					break;
-				case service_manager_rpc_message::LOAD:
-					load(envs, m.name, fds[0], fds[1]);
-					break;
-				case service_manager_rpc_message::MAKE_INPUT_ACTIVATED:
-					make_input_activated(fds[0]);
-					break;
-				case service_manager_rpc_message::UNLOAD:
-					set_unload(fds[0]);
-					break;
-				case service_manager_rpc_message::MAKE_PIPE_CONNECTABLE:
-					make_pipe_connectable(fds[0]);
-					break;
-				case service_manager_rpc_message::MAKE_RUN_ON_EMPTY:
-					make_run_on_empty(fds[0]);
-					break;
-				default:
-					std::fprintf(stderr, "%s: WARNING: unknown control message command %u with %lu file descriptors\n", prog, m.command, count_fds);
-					break;
+			const int * p(reinterpret_cast<int*>(CMSG_DATA(cmsg)));
+			const size_t count_fds((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof *p);
+			for (size_t i(0); i < count_fds; ++i) {
+				set_close_on_exec(p[i], true);
+				fds.push_back(p[i]);
 			}
-			for (size_t i(0); i < count_fds; ++i)
-				close(fds[i]);
 		}
 	}
+	if (fds.empty()) return;
+	if (1 > rc) {
+		std::fprintf(stderr, "%s: WARNING: %s\n", prog, "empty control message");
+	} else
+	if (service_manager_rpc_message::BATCH == u.m.command)
+		batch(envs, u.batch, rc, fds.data(), fds.size());
+	else
+	{
+		u.m.name[sizeof u.m.name - 1] = '\0';
+		enact_rpc_operation(envs, u.m.command, u.m.name, fds.data(), fds.size());
+	}
+	for (std::vector<int>::const_iterator i(fds.begin()); fds.end() != i; ++i)
+		close(*i);
 }
 
 static
@@ -1170,18 +2682,445 @@ void
 stop_and_unload_all (
 	const sigset_t & original_signals
 ) {
-	for (service_map::iterator supervise_dir_i(services.begin()); services.end() != supervise_dir_i; ) {
-		// Pre-increment because we might be erasing.
-		service_map::iterator i(supervise_dir_i++);
-		service & s(*(i->second));
+	// Destroying a service leaves every other service in its slot, so this is safe to do as we go.
+	for (std::size_t slot(0U); slot < services.slots(); ++slot) {
+		service * const i(services.at(slot));
+		if (!i) continue;
+		service & s(*i);
 		s.enact_control_message(original_signals, 'd');
 		std::fprintf(stderr, "%s: DEBUG: set unload after stop %s\n", prog, s.name);
 		s.set_unload();
 		if (s.unloadable()) {
 			std::fprintf(stderr, "%s: DEBUG: unloading %s\n", prog, s.name);
-			services.erase(i);
+			services.destroy(s);
+		}
+	}
+}
+
+/* Control group sampling ***************************************************
+// **************************************************************************
+// Reading the control group statistics of thousands of services on every status query would be expensive.
+// So instead a small batch of services is sampled every few seconds, round robin, and the figures are kept in the status.
+*/
+
+enum {
+	CONTROL_GROUP_SAMPLE_INTERVAL = 5000U,	///< in milliseconds
+	CONTROL_GROUP_SAMPLE_BATCH = 64U,
+};
+
+#if defined(__LINUX__) || defined(__linux__)
+static std::string my_control_group;
+static std::size_t next_control_group_sample(0U);	///< a service table slot
+
+/// \returns false if the file could not be read or the number was not found
+static
+bool
+read_control_group_number (
+	const std::string & filename,
+	const char * key,	///< the key of the "key value" line to read, or null for a file that is just a single number
+	uint64_t & v
+) {
+	const FileDescriptorOwner fd(open_read_at(AT_FDCWD, filename.c_str()));
+	if (0 > fd.get()) return false;
+	char buf[4096];
+	const ssize_t n(read(fd.get(), buf, sizeof buf - 1U));
+	if (0 >= n) return false;
+	buf[n] = '\0';
+	const char * p(buf);
+	if (key) {
+		const std::size_t len(std::strlen(key));
+		for (;;) {
+			if (0 == std::strncmp(p, key, len) && ' ' == p[len]) {
+				p += len + 1U;
+				break;
+			}
+			p = std::strchr(p, '\n');
+			if (!p) return false;
+			++p;
+		}
+	}
+	char * end;
+	v = std::strtoull(p, &end, 10);
+	return end != p;
+}
+
+void
+service::sample_control_group(
+	const std::string & prefix
+) {
+	if (!has_processes()) return;
+	char filename[64];
+	std::snprintf(filename, sizeof filename, "/proc/%d/cgroup", *processes.begin());
+	const FileStar f(open_my_control_group_info(filename));
+	if (!f) return;
+	std::string g;
+	// Only the cgroups version 2 hierarchy has the statistics, and a service that shares our own control group has no statistics of its own.
+	if (!read_my_control_group(f, "", g) || g == my_control_group) return;
+	const std::string dir(prefix + g + "/");
+	uint64_t cpu(0U), memory(0U);
+	const bool has_cpu(read_control_group_number(dir + "cpu.stat", "usage_usec", cpu));
+	const bool has_memory(read_control_group_number(dir + "memory.current", 0, memory));
+	if (!has_cpu && !has_memory) return;
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	pack_bigendian(status + CONTROL_GROUP_OFFSET +  0U, cpu, 8);
+	pack_bigendian(status + CONTROL_GROUP_OFFSET +  8U, memory, 8);
+	pack_bigendian(status + CONTROL_GROUP_OFFSET + 16U, time_to_tai64(envs, TimeTAndLeap(now.tv_sec, false)), 8);
+	write_status();
+}
+#endif
+
+static
+void
+schedule_control_group_sampling (
+) {
+#if defined(__LINUX__) || defined(__linux__)
+	const FileStar f(open_my_control_group_info("/proc/self/cgroup"));
+	if (!f || !read_my_control_group(f, "", my_control_group)) return;
+	timers.add(timer_wheel::timer(timer_wheel::now() + CONTROL_GROUP_SAMPLE_INTERVAL / timer_wheel::TICK_MILLISECONDS, no_service, CONTROL_GROUP_SAMPLER_GENERATION));
+#endif
+}
+
+static
+void
+sample_control_groups (
+) {
+#if defined(__LINUX__) || defined(__linux__)
+	const std::string prefix("/sys/fs/cgroup");
+	std::size_t slot(next_control_group_sample);
+	for (std::size_t n(0U), scanned(0U); n < CONTROL_GROUP_SAMPLE_BATCH && scanned < services.slots(); ++scanned, ++slot) {
+		if (slot >= services.slots()) slot = 0U;
+		if (service * const i = services.at(slot)) {
+			i->sample_control_group(prefix);
+			++n;
+		}
+	}
+	next_control_group_sample = slot;
+	timers.add(timer_wheel::timer(timer_wheel::now() + CONTROL_GROUP_SAMPLE_INTERVAL / timer_wheel::TICK_MILLISECONDS, no_service, CONTROL_GROUP_SAMPLER_GENERATION));
+#endif
+}
+
+/* State handoff across re-execution **************************************
+// **************************************************************************
+// To re-execute itself, the service manager writes its service table to an anonymous file and passes that, and every descriptor that the table refers to, across execve().
+// Supervised processes stay our children throughout, as the process ID does not change.
+// The format is private to the service manager, in native byte order, and versioned so that a newer service manager can recognize (and reject) one that it does not understand.
+*/
+
+namespace {
+
+struct saved_state_header {
+	enum { MAGIC = 0x6E6F7368U, VERSION = 4U };
+	uint32_t magic;
+	uint16_t version;
+	uint16_t service_size;	///< sizeof(saved_service)
+	uint32_t count;		///< the number of saved_service records that follow
+	int32_t reply_fd;	///< the socket on which to report that the handoff is complete
+	unsigned char original_signals[sizeof(sigset_t)];
+};
+
+/// \brief A service, which is followed by count_processes and then count_connections 32-bit process IDs, each in ascending order.
+struct saved_service {
+	uint64_t dev, ino;
+	int32_t in, out, err, pipe_fds[2], lock_fd, ok_fd, control_fd, control_client_fd, status_fd, service_dir_fd;
+	int32_t current_process_status, current_process_code;
+	uint32_t restart_backoff, spawn_failures, restarts;
+	uint64_t timer_expiry;
+	uint64_t cumulative_user_usec, cumulative_system_usec, maximum_rss;
+	int64_t run_started_seconds;
+	int32_t run_started_nanoseconds;
+	uint32_t count_processes, count_connections, count_listen_fds, connection_limit;
+	int32_t listen_fds[service_manager_rpc_message::MAX_LISTEN_SOCKETS];
+	uint8_t run_on_empty, pending_command, paused, unload_after_stop, activity, published_state, timer, restart_backoff_elapsed, input_activated, accept_connections;
+	char name[NAME_MAX + 1];
+	unsigned char status[EXTENDED_STATUS_BLOCK_SIZE];
+};
+
+}
+
+void
+service::save (
+	saved_service & v,
+	std::vector<uint32_t> & pids
+) const {
+	std::memset(&v, 0, sizeof v);
+	v.dev = first;
+	v.ino = second;
+	v.in = in;
+	v.out = out;
+	v.err = err;
+	v.pipe_fds[0] = pipe_fds[0];
+	v.pipe_fds[1] = pipe_fds[1];
+	v.lock_fd = lock_fd;
+	v.ok_fd = ok_fd;
+	v.control_fd = control_fd;
+#if !HAS_FIFO_EXTENSION
+	v.control_client_fd = control_client_fd;
+#else
+	v.control_client_fd = -1;
+#endif
+	v.status_fd = status_fd;
+	v.service_dir_fd = service_dir_fd;
+	v.current_process_status = current_process_status;
+	v.current_process_code = current_process_code;
+	v.restart_backoff = restart_backoff;
+	v.spawn_failures = spawn_failures;
+	v.restarts = restarts;
+	v.timer_expiry = timer_expiry;
+	v.cumulative_user_usec = cumulative_user_usec;
+	v.cumulative_system_usec = cumulative_system_usec;
+	v.maximum_rss = maximum_rss;
+	v.run_started_seconds = run_started.tv_sec;
+	v.run_started_nanoseconds = run_started.tv_nsec;
+	v.count_processes = processes.size();
+	v.count_connections = connections.size();
+	v.count_listen_fds = listen_fds.size();
+	std::copy(listen_fds.begin(), listen_fds.end(), v.listen_fds);
+	v.accept_connections = accept_connections;
+	v.connection_limit = connection_limit;
+	v.run_on_empty = run_on_empty;
+	v.pending_command = pending_command;
+	v.paused = paused;
+	v.unload_after_stop = unload_after_stop;
+	v.activity = activity;
+	v.published_state = published_state;
+	v.timer = timer;
+	v.restart_backoff_elapsed = restart_backoff_elapsed;
+	v.input_activated = 0 <= pipe_fds[0] && this == input_activated_services.find(pipe_fds[0]);
+	std::memcpy(v.name, name, sizeof v.name);
+	std::memcpy(v.status, status, sizeof v.status);
+	pids.assign(processes.begin(), processes.end());
+	pids.insert(pids.end(), connections.begin(), connections.end());
+}
+
+void
+service::restore (
+	const saved_service & v,
+	const std::vector<uint32_t> & pids
+) {
+	in = v.in;
+	out = v.out;
+	err = v.err;
+	pipe_fds[0] = v.pipe_fds[0];
+	pipe_fds[1] = v.pipe_fds[1];
+	lock_fd = v.lock_fd;
+	ok_fd = v.ok_fd;
+	control_fd = v.control_fd;
+#if !HAS_FIFO_EXTENSION
+	control_client_fd = v.control_client_fd;
+#endif
+	status_fd = v.status_fd;
+	service_dir_fd = v.service_dir_fd;
+	current_process_status = v.current_process_status;
+	current_process_code = v.current_process_code;
+	restart_backoff = v.restart_backoff;
+	spawn_failures = v.spawn_failures;
+	restarts = v.restarts;
+	cumulative_user_usec = v.cumulative_user_usec;
+	cumulative_system_usec = v.cumulative_system_usec;
+	maximum_rss = v.maximum_rss;
+	run_started.tv_sec = v.run_started_seconds;
+	run_started.tv_nsec = v.run_started_nanoseconds;
+	run_on_empty = v.run_on_empty;
+	pending_command = v.pending_command;
+	paused = v.paused;
+	unload_after_stop = v.unload_after_stop;
+	activity = static_cast<ActivityType>(v.activity);
+	published_state = v.published_state;
+	restart_backoff_elapsed = v.restart_backoff_elapsed;
+	std::memcpy(name, v.name, sizeof name);
+	name[sizeof name - 1U] = '\0';
+	std::memcpy(status, v.status, sizeof status);
+	for (std::vector<uint32_t>::const_iterator i(pids.begin()); pids.begin() + v.count_processes != i; ++i) {
+		processes.push_back(*i);
+		watch_process(*i);
+	}
+	for (std::vector<uint32_t>::const_iterator i(pids.begin() + v.count_processes); pids.end() != i; ++i) {
+		connections.push_back(*i);
+		connection_services.insert(*i, this);
+	}
+	listen_fds.assign(v.listen_fds, v.listen_fds + std::min<std::size_t>(v.count_listen_fds, service_manager_rpc_message::MAX_LISTEN_SOCKETS));
+	accept_connections = v.accept_connections;
+	connection_limit = v.connection_limit;
+	update_socket_activation();
+	// The monotonic clock carries on across execve(), so timer expiry times remain valid.
+	timer = static_cast<TimerType>(v.timer);
+	if (NO_TIMER != timer) {
+		timer_generation = ++timer_generations;
+		timer_expiry = v.timer_expiry;
+		timers.add(timer_wheel::timer(timer_expiry, *this, timer_generation));
+	}
+	claim_status_slot(status_slot, *this, name);
+	write_status_slot(status_slot, status);
+	if (v.input_activated)
+		add_to_input_activation_list();
+	add_to_control_fifo_list();
+}
+
+static
+void
+set_service_descriptors_close_on_exec (
+	bool v
+) {
+	for (std::size_t slot(0U); slot < services.slots(); ++slot) {
+		const service * const s(services.at(slot));
+		if (!s) continue;
+		const int fds[] = {
+			s->pipe_fds[0], s->pipe_fds[1], s->lock_fd, s->ok_fd, s->control_fd, s->status_fd, s->service_dir_fd,
+#if !HAS_FIFO_EXTENSION
+			s->control_client_fd,
+#endif
+		};
+		for (std::size_t i(0U); i < sizeof fds/sizeof *fds; ++i)
+			if (0 <= fds[i])
+				set_close_on_exec(fds[i], v);
+		for (std::vector<int>::const_iterator i(s->listen_fds.begin()); s->listen_fds.end() != i; ++i)
+			set_close_on_exec(*i, v);
+	}
+}
+
+/// Write the service table to an anonymous file and execute a (possibly new) service-manager program with it.
+/// \returns an errno value only if that fails; success never returns
+static
+int
+reexec (
+	const sigset_t & original_signals,
+	ProcessEnvironment & envs,
+	unsigned listen_fds,
+	int reply_fd
+) {
+	std::vector<unsigned char> buf(sizeof(saved_state_header));
+	saved_state_header h;
+	std::memset(&h, 0, sizeof h);
+	h.magic = saved_state_header::MAGIC;
+	h.version = saved_state_header::VERSION;
+	h.service_size = sizeof(saved_service);
+	h.count = services.size();
+	h.reply_fd = reply_fd;
+	std::memcpy(h.original_signals, &original_signals, sizeof h.original_signals);
+	std::memcpy(buf.data(), &h, sizeof h);
+	for (std::size_t slot(0U); slot < services.slots(); ++slot) {
+		const service * const s(services.at(slot));
+		if (!s) continue;
+		saved_service v;
+		std::vector<uint32_t> pids;
+		s->save(v, pids);
+		const std::size_t o(buf.size());
+		buf.resize(o + sizeof v + pids.size() * sizeof(uint32_t));
+		std::memcpy(buf.data() + o, &v, sizeof v);
+		if (!pids.empty())
+			std::memcpy(buf.data() + o + sizeof v, pids.data(), pids.size() * sizeof(uint32_t));
+	}
+
+	FileDescriptorOwner state_fd(open_anonymous_file("service-manager-state"));
+	if (0 > state_fd.get()) return errno;
+	for (std::size_t o(0U); o < buf.size(); ) {
+		const ssize_t n(write(state_fd.get(), buf.data() + o, buf.size() - o));
+		if (0 > n) {
+			if (EINTR == errno) continue;
+			return errno;
+		}
+		o += n;
+	}
+	if (0 > lseek(state_fd.get(), 0, SEEK_SET)) return errno;
+
+	char state_fd_buf[64], listen_fds_buf[64], listen_pid_buf[64];
+	std::snprintf(state_fd_buf, sizeof state_fd_buf, "%d", state_fd.get());
+	std::snprintf(listen_fds_buf, sizeof listen_fds_buf, "%u", listen_fds);
+	std::snprintf(listen_pid_buf, sizeof listen_pid_buf, "%u", getpid());
+	envs.set("STATE_FD", state_fd_buf);
+	envs.set("LISTEN_FDS", listen_fds_buf);
+	envs.set("LISTEN_PID", listen_pid_buf);
+	set_close_on_exec(state_fd.get(), false);
+	set_close_on_exec(reply_fd, false);
+	for (unsigned i(0U); i < listen_fds; ++i)
+		set_close_on_exec(LISTEN_SOCKET_FILENO + i, false);
+	set_service_descriptors_close_on_exec(false);
+	// Readers must not trust the table whilst no-one is maintaining it; the new program will make a fresh one.
+	close_status_table();
+
+	std::fprintf(stderr, "%s: INFO: re-executing with %lu services\n", prog, services.size());
+	std::fflush(stderr);
+	const char * args[] = { "service-manager", 0 };
+	safe_execvp(args[0], args, envs);
+	const int error(errno);
+
+	// Put everything back as it was.
+	if (status_table)
+		__atomic_store_n(&status_table->pid, static_cast<uint32_t>(getpid()), __ATOMIC_RELEASE);
+	set_service_descriptors_close_on_exec(true);
+	set_close_on_exec(reply_fd, true);
+	for (unsigned i(0U); i < listen_fds; ++i)
+		set_close_on_exec(LISTEN_SOCKET_FILENO + i, true);
+	envs.unset("STATE_FD");
+	envs.unset("LISTEN_FDS");
+	envs.unset("LISTEN_PID");
+	return error;
+}
+
+/// Rebuild the service table from the state that a previous service-manager program passed across execve().
+static
+void
+restore_state (
+	int state_fd,
+	sigset_t & original_signals,
+	ProcessEnvironment & envs
+) {
+	std::vector<unsigned char> buf;
+	for (;;) {
+		unsigned char b[65536];
+		const ssize_t n(read(state_fd, b, sizeof b));
+		if (0 > n) {
+			if (EINTR == errno) continue;
+			const int error(errno);
+			std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "STATE_FD", std::strerror(error));
+			return;
 		}
+		if (0 == n) break;
+		buf.insert(buf.end(), b, b + n);
+	}
+	saved_state_header h;
+	if (sizeof h > buf.size()) {
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "STATE_FD", "Truncated saved state.");
+		return;
+	}
+	std::memcpy(&h, buf.data(), sizeof h);
+	const FileDescriptorOwner reply_fd(saved_state_header::MAGIC == h.magic ? h.reply_fd : -1);
+	int32_t error(0);
+	if (saved_state_header::MAGIC != h.magic || saved_state_header::VERSION != h.version || sizeof(saved_service) != h.service_size) {
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "STATE_FD", "Unrecognized saved state format.");
+		error = EPROTONOSUPPORT;
+		send(reply_fd.get(), &error, sizeof error, MSG_DONTWAIT|MSG_NOSIGNAL);
+		return;
+	}
+	std::memcpy(&original_signals, h.original_signals, sizeof h.original_signals);
+	std::size_t o(sizeof h);
+	for (uint32_t i(0U); i < h.count; ++i) {
+		saved_service v;
+		if (sizeof v > buf.size() - o) break;
+		std::memcpy(&v, buf.data() + o, sizeof v);
+		o += sizeof v;
+		const std::size_t count_pids(std::size_t(v.count_processes) + v.count_connections);
+		if (count_pids * sizeof(uint32_t) > buf.size() - o) break;
+		std::vector<uint32_t> pids(count_pids);
+		if (count_pids)
+			std::memcpy(pids.data(), buf.data() + o, count_pids * sizeof(uint32_t));
+		o += count_pids * sizeof(uint32_t);
+
+		struct stat st;
+		std::memset(&st, 0, sizeof st);
+		st.st_dev = v.dev;
+		st.st_ino = v.ino;
+		service & s(services.create(st, envs));
+		s.restore(v, pids);
 	}
+	set_service_descriptors_close_on_exec(true);
+	if (h.count != services.size()) {
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "STATE_FD", "Truncated saved state.");
+		error = EPROTO;
+	}
+	std::fprintf(stderr, "%s: INFO: restored %lu services\n", prog, services.size());
+	send(reply_fd.get(), &error, sizeof error, MSG_DONTWAIT|MSG_NOSIGNAL);
 }
 
 /* Main function ************************************************************
@@ -1238,9 +3177,22 @@ service_manager [[gnu::noreturn]] (
 		throw EXIT_FAILURE;
 	}
 
+	open_status_table(LISTEN_SOCKET_FILENO);
+
 	subreaper(true);
 
-#if !defined(__LINUX__) && !defined(__linux__)
+	// On Linux, kqueue signal events are delivered through a signalfd, which requires that the signals be blocked.
+	ReserveSignalsForKQueue kqueue_reservation(
+		SIGHUP,
+		SIGTERM,
+		SIGINT,
+		SIGQUIT,
+		SIGTSTP,
+		SIGCHLD,
+		SIGPIPE,
+		0
+	);
+
 	queue = kqueue();
 	if (0 > queue) {
 		const int error(errno);
@@ -1259,7 +3211,7 @@ service_manager [[gnu::noreturn]] (
 		EV_SET(&p[listen_fds + 4], SIGTSTP, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
 		EV_SET(&p[listen_fds + 5], SIGCHLD, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
 		EV_SET(&p[listen_fds + 6], SIGPIPE, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
-		if (0 > kevent(queue, p.data(), listen_fds + 6, 0, 0, 0)) {
+		if (0 > kevent(queue, p.data(), p.size(), 0, 0, 0)) {
 			const int error(errno);
 			std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "kevent", std::strerror(error));
 			throw EXIT_FAILURE;
@@ -1278,54 +3230,26 @@ service_manager [[gnu::noreturn]] (
 		sigaction(SIGCHLD,&sa,NULL);
 		sigaction(SIGPIPE,&sa,NULL);
 	}
-#else
-	for (unsigned i(0U); i < listen_fds; ++i) {
-		pollfd p;
-		p.fd = LISTEN_SOCKET_FILENO + i;
-		p.events = POLLIN;
-		poll_table.push_back(p);
-	}
 
-	{
-		struct sigaction sa;
-		sa.sa_flags=0;
-		sigemptyset(&sa.sa_mask);
-		sa.sa_handler=sig_hup;
-		sigaction(SIGHUP,&sa,NULL);
-		sa.sa_handler=sig_term;
-		sigaction(SIGTERM,&sa,NULL);
-		sa.sa_handler=sig_int;
-		sigaction(SIGINT,&sa,NULL);
-		sa.sa_handler=sig_tstp;
-		sigaction(SIGTSTP,&sa,NULL);
-		sa.sa_handler=sig_child;
-		sigaction(SIGCHLD,&sa,NULL);
-		sa.sa_handler=sig_quit;
-		sigaction(SIGQUIT,&sa,NULL);
+	if (const char * state_fd_str = envs.query("STATE_FD")) {
+		const char * end(state_fd_str);
+		const long state_fd(std::strtol(state_fd_str, const_cast<char **>(&end), 10));
+		envs.unset("STATE_FD");
+		if (end == state_fd_str || *end || 0 > state_fd || INT_MAX < state_fd) {
+			std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "STATE_FD", "Not a file descriptor number.");
+		} else {
+			const FileDescriptorOwner fd(state_fd);
+			restore_state(fd.get(), original_signals, envs);
+			// Anything that ended during the handoff is waiting to be reaped.
+			child_signalled = true;
+		}
 	}
 
-	sigset_t masked_signals(original_signals);
-	sigaddset(&masked_signals, SIGHUP);
-	sigaddset(&masked_signals, SIGTERM);
-	sigaddset(&masked_signals, SIGINT);
-	sigaddset(&masked_signals, SIGTSTP);
-	sigaddset(&masked_signals, SIGCHLD);
-	sigaddset(&masked_signals, SIGPIPE);
-	sigprocmask(SIG_SETMASK, &masked_signals, 0);
-
-	sigset_t masked_signals_during_poll(masked_signals);
-	sigdelset(&masked_signals_during_poll, SIGHUP);
-	sigdelset(&masked_signals_during_poll, SIGTERM);
-	sigdelset(&masked_signals_during_poll, SIGINT);
-	sigdelset(&masked_signals_during_poll, SIGTSTP);
-	sigdelset(&masked_signals_during_poll, SIGCHLD);
-	sigdelset(&masked_signals_during_poll, SIGPIPE);
-#endif
+	schedule_control_group_sampling();
+	schedule_input_pipe_sampling();
 
 	bool in_shutdown(false);
-#if !defined(__LINUX__) && !defined(__linux__)
 	const timespec zero_timeout = { 0, 0 };
-#endif
 	for (;;) {
 		try {
 			if (in_shutdown) {
@@ -1337,9 +3261,22 @@ service_manager [[gnu::noreturn]] (
 				in_shutdown = true;
 				stop_signalled = false;
 			}
-#if !defined(__LINUX__) && !defined(__linux__)
+			if (0 <= reexec_reply_fd) {
+				const FileDescriptorOwner reply_fd(reexec_reply_fd);
+				reexec_reply_fd = -1;
+				// A successful re-execution hands the reply socket over to the new program, which replies once it has restored the services.
+				const int32_t error(in_shutdown ? ESHUTDOWN : reexec(original_signals, envs, listen_fds, reply_fd.get()));
+				std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, "re-execution", std::strerror(error));
+				send(reply_fd.get(), &error, sizeof error, MSG_DONTWAIT|MSG_NOSIGNAL);
+			}
 			struct kevent p[1024];
-			const int rc(kevent(queue, 0, 0, p, sizeof p/sizeof *p, child_signalled ? &zero_timeout : 0));
+			timespec timer_timeout;
+			if (!timers.empty()) {
+				const uint64_t ms(timers.ticks_until_next() * timer_wheel::TICK_MILLISECONDS);
+				timer_timeout.tv_sec = ms / 1000U;
+				timer_timeout.tv_nsec = (ms % 1000U) * 1000000U;
+			}
+			const int rc(kevent(queue, 0, 0, p, sizeof p/sizeof *p, child_signalled ? &zero_timeout : !timers.empty() ? &timer_timeout : 0));
 			if (0 > rc) {
 				const int error(errno);
 				if (EINTR == error) continue;
@@ -1353,8 +3290,12 @@ service_manager [[gnu::noreturn]] (
 						if (LISTEN_SOCKET_FILENO <= static_cast<int>(e.ident) && LISTEN_SOCKET_FILENO + static_cast<int>(listen_fds) > static_cast<int>(e.ident))
 							control_message(envs, e.ident);
 						else
+						if (!subscriber_event(e))
 							input_ready_event(original_signals, e.ident);
 						break;
+					case EVFILT_WRITE:
+						subscriber_event(e);
+						break;
 					case EVFILT_SIGNAL:
 						switch (e.ident) {
 							case SIGTERM:
@@ -1388,6 +3329,7 @@ service_manager [[gnu::noreturn]] (
 						break;
 				}
 			}
+#if !defined(__LINUX__) && !defined(__linux__)
 			// Special handling of EVFILT_PROC:
 			// The order here is important.
 			// We must attach the process to its parent's service before registering any forks that it has done.
@@ -1412,49 +3354,53 @@ service_manager [[gnu::noreturn]] (
 			// NOTE_EXIT is incompatible with NOTE_TRACK within a single kqueue, as they both set the data field.
 			// So this should ideally not be triggered, if we can arrange it.
 			// Since we need to process SIGCHILD for untracked children anyway, we should just let the SIGCHLD reaper handle all exits.
+#endif
+			// On Linux, however, NOTE_EXIT is all that we ask for, for the processes that we spawn ourselves.
+			// Reaping them here, by process ID, leaves the SIGCHLD reaper to deal with stops, continues, and adopted orphans.
+			// The SIGCHLD reaper only beats us to an exit that happens between its look at a stop and its reaping of it, leaving nothing to do here.
 			for (std::size_t i(0); i < static_cast<std::size_t>(rc); ++i) {
 				const struct kevent & e(p[i]);
 				if (EVFILT_PROC != e.filter) continue;
 				const int pid(e.ident);
 				if (e.fflags & NOTE_EXIT) {
+					exit_watched_services.erase(pid);
 					int status, code;
-					wait_nonblocking_for_stopcontexit_of(pid, status, code);
-					reap(original_signals, status, code, pid);
+					struct rusage usage;
+					if (0 < wait_nonblocking_for_stopcontexit_of(pid, status, code, usage)) {
+						reap(original_signals, status, code, pid, usage);
+						// Other children that exited whilst this one was waiting to be reaped were hidden from the SIGCHLD reaper.
+						child_signalled = true;
+					}
 				}
 			}
 			if (child_signalled) {
 				reaper(original_signals);
 				child_signalled = false;
 			}
-#else
-			// This must happen before the main poll because of the continue on EINTR.
-			if (child_signalled) {
-				reaper(original_signals);
-				child_signalled = false;
-				continue;
-			}
-			if (0 > ppoll(poll_table.data(), poll_table.size(), 0, &masked_signals_during_poll)) {
-				const int error(errno);
-				if (EINTR == error) continue;
-				std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "ppoll", std::strerror(error));
-				throw EXIT_FAILURE;
-			}
-			for (std::vector<pollfd>::iterator i(poll_table.begin()); i != poll_table.end(); ++i) {
-				if (i->revents & POLLIN) {
-					if (LISTEN_SOCKET_FILENO <= i->fd && LISTEN_SOCKET_FILENO + static_cast<int>(listen_fds) > i->fd)
-						control_message(envs, i->fd);
-					else
-						input_ready_event(original_signals, i->fd);
-					break;
-				} else {
-					if (i->revents) std::fprintf(stderr, "%s: DEBUG: fd %d ignore revents %x\n", prog, i->fd, i->revents);
+			if (!timers.empty()) {
+				timer_wheel::timer_list expired;
+				timers.advance(timer_wheel::now(), expired);
+				for (timer_wheel::timer_list::const_iterator i(expired.begin()); expired.end() != i; ++i) {
+					if (CONTROL_GROUP_SAMPLER_GENERATION == i->generation) {
+						sample_control_groups();
+						continue;
+					}
+					if (INPUT_PIPE_SAMPLER_GENERATION == i->generation) {
+						sample_input_pipes();
+						continue;
+					}
+					service * const j(services.find(i->key));
+					if (!j) continue;
+					service & s(*j);
+					if (s.is_current_timer(i->generation))
+						s.timer_expired(original_signals);
 				}
 			}
-#endif
 		} catch (const std::exception & e) {
 			std::fprintf(stderr, "%s: ERROR: exception: %s\n", prog, e.what());
 		}
 	}
+	close_status_table();
 	std::fprintf(stderr, "%s: DEBUG: all engines stop\n", prog);
 	throw EXIT_SUCCESS;
 }
@@ -29,11 +29,94 @@ enum {
 	EXIT_STATUSES_OFFSET = ENCORE_STATUS_BLOCK_SIZE,
 		EXIT_STATUS_SIZE = 17U,	// a byte code, a 32-bit number, and a TAI64N timestamp
 	STATUS_BLOCK_SIZE = ENCORE_STATUS_BLOCK_SIZE + 4U * EXIT_STATUS_SIZE,
+	// nosh service manager resource accounting, all numbers big-endian
+	RESTARTS_OFFSET = STATUS_BLOCK_SIZE,
+		RESTARTS_SIZE = 4U,	// automatic restarts of the run program since the service was loaded
+	LAST_RUN_USAGE_OFFSET = RESTARTS_OFFSET + RESTARTS_SIZE,
+		USAGE_SIZE = 24U,	// 64-bit user CPU and system CPU microseconds, and maximum resident set size in KiB
+	CUMULATIVE_USAGE_OFFSET = LAST_RUN_USAGE_OFFSET + USAGE_SIZE,
+	CONTROL_GROUP_OFFSET = CUMULATIVE_USAGE_OFFSET + USAGE_SIZE,
+		CONTROL_GROUP_SIZE = 24U,	// 64-bit cpu.stat usage_usec, memory.current, and a TAI64 timestamp of the sample
+	INPUT_PIPE_OFFSET = CONTROL_GROUP_OFFSET + CONTROL_GROUP_SIZE,
+		INPUT_PIPE_SIZE = 16U,	// 32-bit capacity and high-water mark in bytes, and 64-bit milliseconds that the pipe was seen full
+	EXTENDED_STATUS_BLOCK_SIZE = INPUT_PIPE_OFFSET + INPUT_PIPE_SIZE,
 };
 struct service_manager_rpc_message {
-	enum { NOOP = 0, PLUMB, LOAD, MAKE_INPUT_ACTIVATED, UNLOAD, MAKE_PIPE_CONNECTABLE, MAKE_RUN_ON_EMPTY };
+	enum { NOOP = 0, PLUMB, LOAD, MAKE_INPUT_ACTIVATED, UNLOAD, MAKE_PIPE_CONNECTABLE, MAKE_RUN_ON_EMPTY, BATCH, SUBSCRIBE, REEXEC, MAKE_SOCKET_ACTIVATED, SNAPSHOT, SET_PIPE_SIZE };
+	enum { MAX_LISTEN_SOCKETS = 16U };	///< per service, for MAKE_SOCKET_ACTIVATED
 	uint8_t command;
 	char name[256 + sizeof "/log"];
 };
+/// \brief The header of a batch datagram, which is followed by count operations.
+/// The first descriptor passed with a batch is a socket for the completion reply.
+/// The remaining descriptors are consumed by the operations, in order.
+struct service_manager_rpc_batch_header {
+	enum { VERSION = 1U, MAX_OPERATIONS = 64U };
+	uint8_t command;	///< always BATCH, so that older service managers simply discard batches
+	uint8_t version;
+	uint16_t count;
+	uint32_t cookie;
+};
+struct service_manager_rpc_batch_operation {
+	uint8_t command;
+	uint8_t count_fds;
+	uint16_t name_length;	///< the number of name bytes immediately following, without a terminating NUL
+};
+/// \brief The completion reply to a batch, truncated after count statuses.
+struct service_manager_rpc_batch_reply {
+	uint8_t version;
+	uint8_t reserved;
+	uint16_t count;
+	uint32_t cookie;
+	int32_t error;		///< an errno value for the batch as a whole
+	int32_t statuses[service_manager_rpc_batch_header::MAX_OPERATIONS];	///< errno values for each operation
+};
+
+/// \brief The header of the status table that a service manager maintains in a file named "status" alongside its control socket.
+/// The header is followed by a fixed array of slots, one per loaded service, which readers map into memory read-only.
+struct service_manager_status_table_header {
+	enum { MAGIC = 0x6E6F7368U, VERSION = 3U, MAX_SLOTS = 16384U };
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;
+	uint32_t slot_count;	///< the number of slots in the table
+	uint32_t used;		///< one more than the highest slot ever allocated, so that readers need not scan the whole table
+	uint32_t pid;		///< the service manager process that maintains the table
+	uint32_t reserved;
+};
+/// \brief A slot in the status table, identified by the device and inode of the service's supervise directory.
+/// sequence is a sequence lock, odd whilst the slot is being written, which readers check before and after copying the slot.
+struct service_manager_status_table_slot {
+	uint32_t sequence;
+	uint32_t in_use;
+	uint64_t dev, ino;
+	char name[256];
+	unsigned char status[EXTENDED_STATUS_BLOCK_SIZE];
+};
+
+/// \brief The reply to a SNAPSHOT request, which is sent together with an anonymous file holding count status table slots.
+/// The slots are a copy of every loaded service's status, all taken at the same instant, in no particular order.
+struct service_manager_snapshot_reply {
+	enum { VERSION = 1U };
+	uint8_t version;
+	uint8_t reserved;
+	uint16_t slot_size;	///< sizeof(service_manager_status_table_slot)
+	uint32_t count;
+	int32_t error;		///< an errno value, in which case there is no file
+};
+
+/// \brief A record of a change in a service's state, sent to subscribers as a single message.
+/// A subscriber that cannot keep up has successive changes to each service merged into one record, with the COALESCED flag set.
+struct service_manager_state_change {
+	enum { COALESCED = 0x0001U, UNLOADED = 0x0002U, NO_INDEX = 0xFFFFFFFFU };
+	uint32_t index;		///< the service's slot in the status table, or NO_INDEX
+	uint8_t old_state;	///< a daemontools-encore status
+	uint8_t new_state;	///< a daemontools-encore status
+	uint16_t flags;
+	uint32_t pid;		///< the main process, or 0
+	uint32_t nanoseconds;
+	uint64_t timestamp;	///< TAI64
+	uint64_t dev, ino;	///< of the service's supervise directory
+};
 
 #endif
@@ -5,7 +5,13 @@ For copyright and licensing terms, see the file named COPYING.
 
 #define __STDC_FORMAT_MACROS
 #include <vector>
+#include <map>
+#include <list>
+#include <string>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -14,15 +20,14 @@ For copyright and licensing terms, see the file named COPYING.
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <dirent.h>
 #include "utils.h"
 #include "fdutils.h"
 #include "unpack.h"
 #include "popt.h"
 #include "service-manager-client.h"
 #include "service-manager.h"
+#include "bundle-graph-cache.h"
 #include "FileDescriptorOwner.h"
-#include "DirStar.h"
 
 /* JSON and INI output ******************************************************
 // **************************************************************************
@@ -72,17 +77,30 @@ to_ini_string (
 }
 
 static bool json(false);
-static char inner_comma(' ');
-static char outer_comma(' ');
+
+namespace {
+
+/// \brief The output for one bundle, formatted into a buffer of its own.
+/// Bundles are formatted by several workers at once, and emitted in the order that they were named.
+struct formatted_bundle {
+	formatted_bundle() : done(false), shown(false), inner_comma(' '), text(), errors(), samples() {}
+	bool done;	///< whether a worker has finished with this bundle
+	bool shown;	///< whether text holds a section
+	char inner_comma;
+	std::string text, errors;
+	std::vector<std::pair<std::size_t, std::size_t> > samples;	///< the parts of text, as start and end offsets, that hold sampled usage and pipe figures
+	void begin_samples() { samples.push_back(std::make_pair(text.length(), text.length())); }
+	void end_samples() { samples.back().second = text.length(); }
+};
+
+}
 
 static
 void
 write_document_start()
 {
-	if (json) {
+	if (json)
 		std::fputs("{\n", stdout);
-		outer_comma = ' ';
-	}
 }
 
 static
@@ -93,105 +111,107 @@ write_document_end()
 		std::fputs("}\n", stdout);
 }
 
+/// The separating comma between sections is not part of a section, as whether one is needed is only known when the sections are emitted.
 static
 void
 write_section_start(
+	formatted_bundle & o,
 	const char * name
 ) {
 	if (json) {
-		std::fprintf(stdout, "%c%s:{", outer_comma, to_json_string(name).c_str());
-		outer_comma = ',';
-		inner_comma = ' ';
-	} else
-		std::fprintf(stdout, "[%s]\n", name);
+		o.text += to_json_string(name);
+		o.text += ":{";
+		o.inner_comma = ' ';
+	} else {
+		o.text += '[';
+		o.text += name;
+		o.text += "]\n";
+	}
+	o.shown = true;
 }
 
 static
 void
-write_section_end()
-{
+write_section_end(
+	formatted_bundle & o
+) {
 	if (json)
-		std::fputs("}\n", stdout);
+		o.text += "}\n";
 	else
-		std::fputc('\n', stdout);
+		o.text += '\n';
 }
 
 static
 void
-write_boolean_value(
-	const char * name,
-	bool value
+write_name(
+	formatted_bundle & o,
+	const std::string & name
 ) {
 	if (json) {
-		std::fprintf(stdout, "%c%s:%s", inner_comma, to_json_string(name).c_str(), value ? "true": "false");
-		inner_comma = ',';
-	} else
-		std::fprintf(stdout, "%s=%s\n", name, value ? "yes" : "no");
+		o.text += o.inner_comma;
+		o.text += to_json_string(name);
+		o.text += ':';
+		o.inner_comma = ',';
+	} else {
+		o.text += name;
+		o.text += '=';
+	}
 }
 
 static
 void
-write_string_value(
+write_boolean_value(
+	formatted_bundle & o,
 	const char * name,
-	const char * value
+	bool value
 ) {
-	if (json) {
-		std::fprintf(stdout, "%c%s:%s", inner_comma, to_json_string(name).c_str(), to_json_string(value).c_str());
-		inner_comma = ',';
-	} else
-		std::fprintf(stdout, "%s=%s\n", name, to_ini_string(value, false).c_str());
+	write_name(o, name);
+	if (json)
+		o.text += value ? "true": "false";
+	else
+		o.text += value ? "yes\n" : "no\n";
 }
 
 static
 void
-write_numeric_int_value(
-	const std::string & name,
-	int value
+write_string_value(
+	formatted_bundle & o,
+	const char * name,
+	const char * value
 ) {
-	if (json) {
-		std::fprintf(stdout, "%c%s:%d", inner_comma, to_json_string(name).c_str(), value);
-		inner_comma = ',';
-	} else
-		std::fprintf(stdout, "%s=%d\n", name.c_str(), value);
+	write_name(o, name);
+	if (json)
+		o.text += to_json_string(value);
+	else {
+		o.text += to_ini_string(value, false);
+		o.text += '\n';
+	}
 }
 
 static
 void
 write_numeric_int_value(
-	const char * name,
+	formatted_bundle & o,
+	const std::string & name,
 	int value
 ) {
-	if (json) {
-		std::fprintf(stdout, "%c%s:%d", inner_comma, to_json_string(name).c_str(), value);
-		inner_comma = ',';
-	} else
-		std::fprintf(stdout, "%s=%d\n", name, value);
+	char buf[32];
+	std::snprintf(buf, sizeof buf, json ? "%d" : "%d\n", value);
+	write_name(o, name);
+	o.text += buf;
 }
 
 static
 void
 write_numeric_uint64_value(
+	formatted_bundle & o,
 	const std::string & name,
 	uint_least64_t value
 ) {
-	if (json) {
-		std::fprintf(stdout, "%c%s:%" PRIu64, inner_comma, to_json_string(name).c_str(), value);
-		inner_comma = ',';
-	} else
-		std::fprintf(stdout, "%s=%" PRIu64 "\n", name.c_str(), value);
-}
-
-static
-void
-write_numeric_uint64_value(
-	const char * name,
-	uint_least64_t value
-) {
-	if (json) {
-		std::fprintf(stdout, "%c%s:%" PRIu64, inner_comma, to_json_string(name).c_str(), value);
-		inner_comma = ',';
-	} else
-		std::fprintf(stdout, "%s=%" PRIu64 "\n", name, value);
+	char buf[32];
+	std::snprintf(buf, sizeof buf, json ? "%" PRIu64 : "%" PRIu64 "\n", value);
+	write_name(o, name);
+	o.text += buf;
 }
 
 static
@@ -221,39 +241,22 @@ state_of (
 
 typedef std::list<std::string> Relations;
 
+/// Only symbolic links are relations; their targets are given relative to the bundle directory rather than to the relation subdirectory.
 static
 Relations
 get_relations (
+	BundleGraphCache & cache,
 	int bundle_dir_fd,
-	const char * relation
+	BundleGraphCache::relation relation
 ) {
 	Relations r;
-	FileDescriptorOwner relation_dir_fd(open_dir_at(bundle_dir_fd, relation));
-	if (0 <= relation_dir_fd.get()) {
-		const DirStar relation_dir(relation_dir_fd);
-		if (relation_dir) for (;;) {
-			const dirent * entry(readdir(relation_dir));
-			if (!entry) break;
-#if defined(_DIRENT_HAVE_D_NAMLEN)
-			if (1 > entry->d_namlen) continue;
-#endif
-			if ('.' == entry->d_name[0]) continue;
-#if defined(_DIRENT_HAVE_D_TYPE)
-			if (DT_LNK != entry->d_type)
-				continue;
-#endif
-
-			struct stat s;
-			if (0 > fstatat(relation_dir.fd(), entry->d_name, &s, AT_SYMLINK_NOFOLLOW)) continue;
-			if (!S_ISLNK(s.st_mode)) continue;
-			std::vector<char> buf(s.st_size, char());
-			const int l(readlinkat(relation_dir.fd(), entry->d_name, buf.data(), s.st_size));
-			if (0 > l) continue;
-			std::string d(buf.data(), l);
-			if ("../" == d.substr(0, 3))
-				d = d.substr(3, d.npos);
-			r.push_back(d);
-		}
+	const BundleGraphCache::entry_list entries(cache.entries(bundle_dir_fd, relation));
+	for (BundleGraphCache::entry_list::const_iterator i(entries.begin()); entries.end() != i; ++i) {
+		if (!i->is_link) continue;
+		std::string d(i->link);
+		if ("../" == d.substr(0, 3))
+			d = d.substr(3, d.npos);
+		r.push_back(d);
 	}
 	return r;
 }
@@ -261,29 +264,29 @@ get_relations (
 static
 void
 write_string_array(
+	formatted_bundle & o,
 	const char * name,
 	const Relations & values
 ) {
-	if (json) {
-		std::fprintf(stdout, "%c%s:[", inner_comma, to_json_string(name).c_str());
-		inner_comma = ',';
-	} else
-		std::fprintf(stdout, "%s=", name);
-	std::string array_comma("");
+	write_name(o, name);
+	if (json)
+		o.text += '[';
+	const char * array_comma("");
 	for (Relations::const_iterator i(values.begin()); values.end() != i; ++i) {
 		const std::string & value(*i);
+		o.text += array_comma;
 		if (json) {
-			std::fprintf(stdout, "%s%s", array_comma.c_str(), to_json_string(value).c_str());
+			o.text += to_json_string(value);
 			array_comma = ",";
 		} else {
-			std::fprintf(stdout, "%s%s", array_comma.c_str(), to_ini_string(value, true).c_str());
+			o.text += to_ini_string(value, true);
 			array_comma = " ";
 		}
 	}
 	if (json)
-		std::fprintf(stdout, "]");
+		o.text += ']';
 	else
-		std::fprintf(stdout, "\n");
+		o.text += '\n';
 }
 
 static
@@ -300,6 +303,358 @@ get_log (
 	return std::string(buf.data(), l);
 }
 
+static
+void
+write_error(
+	formatted_bundle & o,
+	const char * name,
+	const char * what,
+	const char * message
+) {
+	o.errors += name;
+	o.errors += ": ";
+	if (what) {
+		o.errors += what;
+		o.errors += ": ";
+	}
+	o.errors += message;
+	o.errors += '\n';
+}
+
+// strerror_r() returns an error number in its XSI form and a message in its GNU form; these accept either.
+static inline const char * strerror_r_message(int rc, const char * buf) { return rc ? "Unknown error" : buf; }
+static inline const char * strerror_r_message(const char * message, const char *) { return message; }
+
+/// This is called from the worker threads, so uses strerror_r() rather than std::strerror(), which is not thread-safe.
+static inline
+void
+write_error(
+	formatted_bundle & o,
+	const char * name,
+	const char * what,
+	int error
+) {
+	char buf[256];
+	write_error(o, name, what, strerror_r_message(strerror_r(error, buf, sizeof buf), buf));
+}
+
+/* Formatting bundles *******************************************************
+// **************************************************************************
+*/
+
+namespace {
+
+/// \brief What is shared amongst the workers that format bundles.
+struct show_pool {
+	show_pool(const ProcessEnvironment & e, const std::vector<const char *> & n, const ServiceManagerSnapshot & s, const ServiceManagerStatusTable & t, BundleGraphCache & c) :
+		envs(e),
+		names(n),
+		snapshot(s),
+		status_table(t),
+		cache(c),
+		next(0U),
+		bundles(n.size())
+	{
+	}
+	const ProcessEnvironment & envs;
+	const std::vector<const char *> & names;
+	const ServiceManagerSnapshot & snapshot;
+	const ServiceManagerStatusTable & status_table;
+	BundleGraphCache & cache;	///< not thread-safe, so guarded by cache_lock
+	std::mutex cache_lock;
+	std::mutex lock;	///< guards next and the done flags
+	std::condition_variable finished;
+	std::size_t next;
+	std::vector<formatted_bundle> bundles;
+
+	void show(formatted_bundle &, const char *);
+	bool work_one();
+	void work();
+};
+
+}
+
+void
+show_pool::show(
+	formatted_bundle & o,
+	const char * name
+) {
+	const FileDescriptorOwner bundle_dir_fd(open_dir_at(AT_FDCWD, name));
+	if (0 > bundle_dir_fd.get()) {
+		const int error(errno);
+		write_error(o, name, NULL, error);
+		return;
+	}
+	Relations relations[BundleGraphCache::RELATION_COUNT];
+	{
+		const std::lock_guard<std::mutex> l(cache_lock);
+		for (std::size_t r(0U); r < BundleGraphCache::RELATION_COUNT; ++r)
+			relations[r] = get_relations(cache, bundle_dir_fd.get(), static_cast<BundleGraphCache::relation>(r));
+	}
+	const std::string log_service(get_log(bundle_dir_fd.get()));
+
+
+	const FileDescriptorOwner supervise_dir_fd(open_supervise_dir(bundle_dir_fd.get()));
+	if (0 > supervise_dir_fd.get()) {
+		const int error(errno);
+		write_error(o, name, "supervise", error);
+		return;
+	}
+	const FileDescriptorOwner service_dir_fd(open_service_dir(bundle_dir_fd.get()));
+	if (0 > service_dir_fd.get()) {
+		const int error(errno);
+		write_error(o, name, "service", error);
+		return;
+	}
+
+	const bool initially_up(is_initially_up(service_dir_fd.get()));
+	const bool run_on_empty(!is_done_after_exit(service_dir_fd.get()));
+	const bool ready_after_run(is_ready_after_run(service_dir_fd.get()));
+	char status[EXTENDED_STATUS_BLOCK_SIZE];
+	// Services that are not in the snapshot might yet be under some other supervisor, so are looked at individually.
+	ssize_t b(snapshot.read(supervise_dir_fd.get(), status));
+	if (!b) {
+		const FileDescriptorOwner ok_fd(open_writeexisting_at(supervise_dir_fd.get(), "ok"));
+		if (0 > ok_fd.get()) {
+			const int error(errno);
+			if (ENXIO == error)
+				write_error(o, name, NULL, "No supervisor is running");
+			else
+				write_error(o, name, "supervise/ok", error);
+			return;
+		}
+		b = status_table.read(supervise_dir_fd.get(), status);
+	}
+	if (!b) {
+		const FileDescriptorOwner status_fd(open_read_at(supervise_dir_fd.get(), "status"));
+		if (0 > status_fd.get()) {
+			const int error(errno);
+			write_error(o, name, "status", error);
+			return;
+		}
+		b = read(status_fd.get(), status, sizeof status);
+	}
+	write_section_start(o, name);
+	if (b < DAEMONTOOLS_STATUS_BLOCK_SIZE)
+		write_boolean_value(o, "Loading", true);
+	else {
+		const uint64_t s(unpack_bigendian(status, 8));
+//		const uint32_t n(unpack_bigendian(status + 8, 4));
+		const uint32_t p(unpack_littleendian(status + THIS_PID_OFFSET, 4));
+
+		char & want_flag(status[WANT_FLAG_OFFSET]);
+		if (b < ENCORE_STATUS_BLOCK_SIZE) {
+			// supervise doesn't turn off the want flag.
+			if (p) {
+				if ('u' == want_flag) want_flag = '\0';
+			} else {
+				if ('d' == want_flag) want_flag = '\0';
+			}
+		}
+		write_string_value(o, "DaemontoolsState", p ? "up" : "down");
+		if (b >= ENCORE_STATUS_BLOCK_SIZE)
+			write_string_value(o, "DaemontoolsEncoreState", state_of(status[ENCORE_STATUS_OFFSET]));
+		write_numeric_int_value(o, "MainPID", p);
+		write_numeric_uint64_value(o, "Timestamp", s);
+		const TimeTAndLeap z(tai64_to_time(envs, s));
+		write_numeric_uint64_value(o, "UTCTimestamp", z.time);
+		const char * const want('u' == want_flag ? "up" : 'O' == want_flag ? "once at most" : 'o' == want_flag ? "once" : 'd' == want_flag ? "down" : "nothing");
+		write_string_value(o, "Want", want);
+		write_boolean_value(o, "Paused", status[PAUSE_FLAG_OFFSET]);
+		for (unsigned int j(0U); j < 4U; ++j) {
+			if (b >= (EXIT_STATUSES_OFFSET + j * EXIT_STATUS_SIZE) + EXIT_STATUS_SIZE) {
+				const uint8_t code(status[EXIT_STATUSES_OFFSET + j * EXIT_STATUS_SIZE]);
+				const uint32_t number(unpack_bigendian(status + (EXIT_STATUSES_OFFSET + j * EXIT_STATUS_SIZE + 1U), 4));
+				const uint64_t stamp(unpack_bigendian(status + (EXIT_STATUSES_OFFSET + j * EXIT_STATUS_SIZE + 5U), 8));
+				write_numeric_int_value(o, status_event[j] + std::string("ExitStatusCode"), code);
+				write_numeric_int_value(o, status_event[j] + std::string("ExitStatusNumber"), number);
+				write_numeric_uint64_value(o, status_event[j] + std::string("Timestamp"), stamp);
+				const TimeTAndLeap zulu(tai64_to_time(envs, stamp));
+				write_numeric_uint64_value(o, status_event[j] + std::string("UTCTimestamp"), zulu.time);
+			}
+		}
+		if (b >= INPUT_PIPE_OFFSET) {
+			write_numeric_uint64_value(o, "Restarts", unpack_bigendian(status + RESTARTS_OFFSET, RESTARTS_SIZE));
+			o.begin_samples();
+			write_numeric_uint64_value(o, "LastRunUserCPUMicroseconds", unpack_bigendian(status + LAST_RUN_USAGE_OFFSET + 0U, 8));
+			write_numeric_uint64_value(o, "LastRunSystemCPUMicroseconds", unpack_bigendian(status + LAST_RUN_USAGE_OFFSET + 8U, 8));
+			write_numeric_uint64_value(o, "LastRunMaximumRSSKiB", unpack_bigendian(status + LAST_RUN_USAGE_OFFSET + 16U, 8));
+			write_numeric_uint64_value(o, "TotalUserCPUMicroseconds", unpack_bigendian(status + CUMULATIVE_USAGE_OFFSET + 0U, 8));
+			write_numeric_uint64_value(o, "TotalSystemCPUMicroseconds", unpack_bigendian(status + CUMULATIVE_USAGE_OFFSET + 8U, 8));
+			write_numeric_uint64_value(o, "TotalMaximumRSSKiB", unpack_bigendian(status + CUMULATIVE_USAGE_OFFSET + 16U, 8));
+			const uint64_t sampled(unpack_bigendian(status + CONTROL_GROUP_OFFSET + 16U, 8));
+			if (sampled) {
+				write_numeric_uint64_value(o, "ControlGroupCPUMicroseconds", unpack_bigendian(status + CONTROL_GROUP_OFFSET + 0U, 8));
+				write_numeric_uint64_value(o, "ControlGroupMemoryBytes", unpack_bigendian(status + CONTROL_GROUP_OFFSET + 8U, 8));
+				write_numeric_uint64_value(o, "ControlGroupSampleTimestamp", sampled);
+				const TimeTAndLeap zulu(tai64_to_time(envs, sampled));
+				write_numeric_uint64_value(o, "ControlGroupSampleUTCTimestamp", zulu.time);
+			}
+			o.end_samples();
+		}
+		if (b >= INPUT_PIPE_OFFSET + INPUT_PIPE_SIZE) {
+			const uint32_t capacity(unpack_bigendian(status + INPUT_PIPE_OFFSET + 0U, 4));
+			const uint32_t high_water(unpack_bigendian(status + INPUT_PIPE_OFFSET + 4U, 4));
+			if (capacity || high_water) {
+				write_numeric_uint64_value(o, "InputPipeCapacityBytes", capacity);
+				o.begin_samples();
+				write_numeric_uint64_value(o, "InputPipeHighWaterBytes", high_water);
+				write_numeric_uint64_value(o, "InputPipeFullMilliseconds", unpack_bigendian(status + INPUT_PIPE_OFFSET + 8U, 8));
+				o.end_samples();
+			}
+		}
+	}
+	write_boolean_value(o, "Enabled", initially_up);
+	write_boolean_value(o, "RemainAfterExit", run_on_empty);
+	write_boolean_value(o, "ReadyAfterRun", ready_after_run);
+	write_string_array(o, "Wants", relations[BundleGraphCache::WANTS]);
+	write_string_array(o, "Wanted-By", relations[BundleGraphCache::WANTED_BY]);
+	write_string_array(o, "Before", relations[BundleGraphCache::BEFORE]);
+	write_string_array(o, "After", relations[BundleGraphCache::AFTER]);
+	write_string_array(o, "Expects", relations[BundleGraphCache::EXPECTS]);
+	write_string_array(o, "Requires", relations[BundleGraphCache::REQUIRES]);
+	write_string_array(o, "Required-By", relations[BundleGraphCache::REQUIRED_BY]);
+	write_string_array(o, "Conflicts", relations[BundleGraphCache::CONFLICTS]);
+	write_string_array(o, "Stopped-By", relations[BundleGraphCache::STOPPED_BY]);
+	write_string_value(o, "LogService", log_service.c_str());
+	write_section_end(o);
+}
+
+/// Take the next unformatted bundle, in the order that they were named, and format it.
+/// \returns false if there were none left
+bool
+show_pool::work_one()
+{
+	std::size_t i;
+	{
+		const std::lock_guard<std::mutex> l(lock);
+		if (next >= bundles.size()) return false;
+		i = next++;
+	}
+	show(bundles[i], names[i]);
+	{
+		const std::lock_guard<std::mutex> l(lock);
+		bundles[i].done = true;
+	}
+	finished.notify_all();
+	return true;
+}
+
+void
+show_pool::work()
+{
+	for (;;)
+		if (!work_one()) break;
+}
+
+/* Changed-since snapshots **************************************************
+// **************************************************************************
+*/
+
+namespace {
+
+typedef std::map<std::string, uint64_t> fingerprint_map;
+
+}
+
+/// A 64-bit FNV-1a hash of a formatted section, which stands in for the section when looking for changes.
+/// Sampled usage and pipe figures are left out, as they change all of the time without the service's status or settings changing.
+/// The time of the last change of state is kept, so that a service that has restarted into the same state still counts as changed.
+static
+uint64_t
+fingerprint (
+	const formatted_bundle & o
+) {
+	uint64_t h(0xCBF29CE484222325ULL);
+	std::size_t p(0U);
+	for (std::vector<std::pair<std::size_t, std::size_t> >::const_iterator i(o.samples.begin()); ; ++i) {
+		const std::size_t e(o.samples.end() == i ? o.text.length() : i->first);
+		for (; p < e; ++p) {
+			h ^= static_cast<unsigned char>(o.text[p]);
+			h *= 0x100000001B3ULL;
+		}
+		if (o.samples.end() == i) break;
+		p = i->second;
+	}
+	return h;
+}
+
+/// The file has one line per bundle, a fingerprint in hexadecimal followed by a space and the bundle name.
+/// A missing or unreadable file is the same as an empty one; so everything is changed.
+static
+void
+load_fingerprints (
+	const char * prog,
+	const char * filename,
+	fingerprint_map & fingerprints
+) {
+	const FileDescriptorOwner fd(open_read_at(AT_FDCWD, filename));
+	if (0 > fd.get()) {
+		const int error(errno);
+		if (ENOENT != error)
+			std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, filename, std::strerror(error));
+		return;
+	}
+	std::string content;
+	char buf[65536];
+	for (;;) {
+		const ssize_t n(read(fd.get(), buf, sizeof buf));
+		if (0 > n) {
+			const int error(errno);
+			if (EINTR == error) continue;
+			std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, filename, std::strerror(error));
+			return;
+		}
+		if (0 == n) break;
+		content.append(buf, n);
+	}
+	for (std::string::size_type p(0U); p < content.length(); ) {
+		std::string::size_type nl(content.find('\n', p));
+		if (content.npos == nl) nl = content.length();
+		const std::string line(content.substr(p, nl - p));
+		p = nl + 1U;
+		const std::string::size_type space(line.find(' '));
+		if (line.npos == space || 0U == space) continue;
+		const char * const hex(line.c_str());
+		char * end;
+		const uint64_t h(std::strtoull(hex, &end, 16));
+		if (end != hex + space) continue;
+		fingerprints[line.substr(space + 1U)] = h;
+	}
+}
+
+/// Write a new file and atomically replace the old one, so that a concurrent run always sees one or the other in full.
+static
+bool
+save_fingerprints (
+	const char * prog,
+	const char * filename,
+	const fingerprint_map & fingerprints
+) {
+	std::string content;
+	for (fingerprint_map::const_iterator i(fingerprints.begin()); fingerprints.end() != i; ++i) {
+		char hex[32];
+		std::snprintf(hex, sizeof hex, "%016" PRIx64 " ", i->second);
+		content += hex;
+		content += i->first;
+		content += '\n';
+	}
+	char pid[32];
+	std::snprintf(pid, sizeof pid, ".%u", static_cast<unsigned>(getpid()));
+	const std::string temp_name(filename + std::string(pid));
+	const FileDescriptorOwner fd(open(temp_name.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY|O_CLOEXEC, 0644));
+	if (0 > fd.get()
+	||  static_cast<ssize_t>(content.length()) != write(fd.get(), content.data(), content.length())
+	||  0 > rename(temp_name.c_str(), filename)
+	) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, filename, std::strerror(error));
+		if (0 <= fd.get()) unlink(temp_name.c_str());
+		return false;
+	}
+	return true;
+}
+
 /* Main function ************************************************************
 // **************************************************************************
 */
@@ -312,10 +667,16 @@ service_show [[gnu::noreturn]] (
 ) {
 	const char * prog(basename_of(args[0]));
 
+	const char * changed_since(0);
+	unsigned long jobs(0UL);
 	try {
 		popt::bool_definition json_option('\0', "json", "Output in JSON format.", json);
+		popt::string_definition changed_since_option('\0', "changed-since", "filename", "Only output bundles that have changed since the fingerprints in this file, and update it.", changed_since);
+		popt::unsigned_number_definition jobs_option('\0', "jobs", "number", "Format at most this many bundles at once.", jobs, 0);
 		popt::definition * top_table[] = {
-			&json_option
+			&json_option,
+			&changed_since_option,
+			&jobs_option
 		};
 		popt::top_table_definition main_option(sizeof top_table/sizeof *top_table, top_table, "Main options", "{directory}");
 
@@ -333,116 +694,82 @@ service_show [[gnu::noreturn]] (
 		std::fprintf(stderr, "%s: FATAL: %s\n", prog, "Missing directory name(s).");
 		throw static_cast<int>(EXIT_USAGE);
 	}
+	if (!jobs) {
+		const long processors(sysconf(_SC_NPROCESSORS_ONLN));
+		jobs = 0 < processors ? processors : 1;
+	}
+	if (jobs > args.size())
+		jobs = args.size();
 
-	write_document_start();
-	for (std::vector<const char *>::const_iterator i(args.begin()); i != args.end(); ++i) {
-		const char * name(*i);
+	fingerprint_map fingerprints;
+	if (changed_since)
+		load_fingerprints(prog, changed_since, fingerprints);
 
-		const FileDescriptorOwner bundle_dir_fd(open_dir_at(AT_FDCWD, name));
-		if (0 > bundle_dir_fd.get()) {
-			const int error(errno);
-			std::fprintf(stderr, "%s: %s\n", name, std::strerror(error));
-			continue;
-		}
-		const Relations wants(get_relations(bundle_dir_fd.get(), "wants"));
-		const Relations expects(get_relations(bundle_dir_fd.get(), "expects"));
-		const Relations before(get_relations(bundle_dir_fd.get(), "before"));
-		const Relations after(get_relations(bundle_dir_fd.get(), "after"));
-		const Relations conflicts(get_relations(bundle_dir_fd.get(), "conflicts"));
-		const Relations requires(get_relations(bundle_dir_fd.get(), "requires"));
-		const Relations required_by(get_relations(bundle_dir_fd.get(), "required-by"));
-		const Relations wanted_by(get_relations(bundle_dir_fd.get(), "wanted-by"));
-		const Relations stopped_by(get_relations(bundle_dir_fd.get(), "stopped-by"));
-		const std::string log_service(get_log(bundle_dir_fd.get()));
-
-		const FileDescriptorOwner supervise_dir_fd(open_supervise_dir(bundle_dir_fd.get()));
-		if (0 > supervise_dir_fd.get()) {
-			const int error(errno);
-			std::fprintf(stderr, "%s: %s: %s\n", name, "supervise", std::strerror(error));
-			continue;
-		}
-		const FileDescriptorOwner service_dir_fd(open_service_dir(bundle_dir_fd.get()));
-		if (0 > service_dir_fd.get()) {
-			const int error(errno);
-			std::fprintf(stderr, "%s: %s: %s\n", name, "service", std::strerror(error));
-			continue;
-		}
+	const ServiceManagerSnapshot snapshot(prog, !per_user_mode, 1000);
+	const ServiceManagerStatusTable status_table(!per_user_mode);
+	BundleGraphCache cache(!per_user_mode);
+	show_pool pool(envs, args, snapshot, status_table, cache);
 
-		const bool initially_up(is_initially_up(service_dir_fd.get()));
-		const bool run_on_empty(!is_done_after_exit(service_dir_fd.get()));
-		const bool ready_after_run(is_ready_after_run(service_dir_fd.get()));
-		const FileDescriptorOwner ok_fd(open_writeexisting_at(supervise_dir_fd.get(), "ok"));
-		if (0 > ok_fd.get()) {
-			const int error(errno);
-			if (ENXIO == error)
-				std::fprintf(stderr, "%s: No supervisor is running\n", name);
-			else
-				std::fprintf(stderr, "%s: %s: %s\n", name, "supervise/ok", std::strerror(error));
-			continue;
-		}
-		const FileDescriptorOwner status_fd(open_read_at(supervise_dir_fd.get(), "status"));
-		if (0 > status_fd.get()) {
-			const int error(errno);
-			std::fprintf(stderr, "%s: %s: %s\n", name, "status", std::strerror(error));
-			continue;
+	// tai64_to_time() lazily caches what it learns about the timezone, so make it do so before there are any other threads.
+	tai64_to_time(envs, 0U);
+
+	// The main thread is one of the workers, formatting a bundle itself whenever the next one to be emitted is not yet ready.
+	std::vector<std::thread> workers;
+	for (unsigned long j(1UL); j < jobs; ++j)
+		workers.push_back(std::thread(&show_pool::work, &pool));
+
+	write_document_start();
+	char outer_comma(' ');
+	for (std::size_t i(0U); i < pool.bundles.size(); ++i) {
+		formatted_bundle & o(pool.bundles[i]);
+		{
+			std::unique_lock<std::mutex> l(pool.lock);
+			while (!o.done) {
+				if (pool.next < pool.bundles.size()) {
+					l.unlock();
+					pool.work_one();
+					l.lock();
+				} else
+					pool.finished.wait(l);
+			}
 		}
-		char status[STATUS_BLOCK_SIZE];
-		const ssize_t b(read(status_fd.get(), status, sizeof status));
-		write_section_start(name);
-		if (b < DAEMONTOOLS_STATUS_BLOCK_SIZE)
-			write_boolean_value("Loading", true);
-		else {
-			const uint64_t s(unpack_bigendian(status, 8));
-//			const uint32_t n(unpack_bigendian(status + 8, 4));
-			const uint32_t p(unpack_littleendian(status + THIS_PID_OFFSET, 4));
-
-			char & want_flag(status[WANT_FLAG_OFFSET]);
-			if (b < ENCORE_STATUS_BLOCK_SIZE) {
-				// supervise doesn't turn off the want flag.
-				if (p) {
-					if ('u' == want_flag) want_flag = '\0';
-				} else {
-					if ('d' == want_flag) want_flag = '\0';
-				}
+		std::fputs(o.errors.c_str(), stderr);
+		if (o.shown) {
+			const char * name(args[i]);
+			bool changed(true);
+			if (changed_since) {
+				const uint64_t h(fingerprint(o));
+				const fingerprint_map::iterator f(fingerprints.find(name));
+				if (fingerprints.end() == f)
+					fingerprints[name] = h;
+				else if (h == f->second)
+					changed = false;
+				else
+					f->second = h;
 			}
-			write_string_value("DaemontoolsState", p ? "up" : "down");
-			if (b >= ENCORE_STATUS_BLOCK_SIZE)
-				write_string_value("DaemontoolsEncoreState", state_of(status[ENCORE_STATUS_OFFSET]));
-			write_numeric_int_value("MainPID", p);
-			write_numeric_uint64_value("Timestamp", s);
-			const TimeTAndLeap z(tai64_to_time(envs, s));
-			write_numeric_uint64_value("UTCTimestamp", z.time);
-			const char * const want('u' == want_flag ? "up" : 'O' == want_flag ? "once at most" : 'o' == want_flag ? "once" : 'd' == want_flag ? "down" : "nothing");
-			write_string_value("Want", want);
-			write_boolean_value("Paused", status[PAUSE_FLAG_OFFSET]);
-			for (unsigned int j(0U); j < 4U; ++j) {
-				if (b >= (EXIT_STATUSES_OFFSET + j * EXIT_STATUS_SIZE) + EXIT_STATUS_SIZE) {
-					const uint8_t code(status[EXIT_STATUSES_OFFSET + j * EXIT_STATUS_SIZE]);
-					const uint32_t number(unpack_bigendian(status + (EXIT_STATUSES_OFFSET + j * EXIT_STATUS_SIZE + 1U), 4));
-					const uint64_t stamp(unpack_bigendian(status + (EXIT_STATUSES_OFFSET + j * EXIT_STATUS_SIZE + 5U), 8));
-					write_numeric_int_value(status_event[j] + std::string("ExitStatusCode"), code);
-					write_numeric_int_value(status_event[j] + std::string("ExitStatusNumber"), number);
-					write_numeric_uint64_value(status_event[j] + std::string("Timestamp"), stamp);
-					const TimeTAndLeap zulu(tai64_to_time(envs, stamp));
-					write_numeric_uint64_value(status_event[j] + std::string("UTCTimestamp"), zulu.time);
+			if (changed) {
+				if (json) {
+					std::fputc(outer_comma, stdout);
+					outer_comma = ',';
 				}
+				std::fwrite(o.text.data(), o.text.length(), 1, stdout);
 			}
-		}
-		write_boolean_value("Enabled", initially_up);
-		write_boolean_value("RemainAfterExit", run_on_empty);
-		write_boolean_value("ReadyAfterRun", ready_after_run);
-		write_string_array("Wants", wants);
-		write_string_array("Wanted-By", wanted_by);
-		write_string_array("Before", before);
-		write_string_array("After", after);
-		write_string_array("Expects", expects);
-		write_string_array("Requires", requires);
-		write_string_array("Required-By", required_by);
-		write_string_array("Conflicts", conflicts);
-		write_string_array("Stopped-By", stopped_by);
-		write_string_value("LogService", log_service.c_str());
-		write_section_end();
+		} else if (changed_since)
+			// A bundle that could not be shown is forgotten, so that it is output in full when it can be shown again.
+			fingerprints.erase(args[i]);
+		// Free the memory as we go, as there could be many bundles.
+		std::string().swap(o.text);
+		std::string().swap(o.errors);
+		std::vector<std::pair<std::size_t, std::size_t> >().swap(o.samples);
 	}
 	write_document_end();
+	for (std::vector<std::thread>::iterator j(workers.begin()); workers.end() != j; ++j)
+		j->join();
+	cache.save();
+	if (changed_since) {
+		std::fflush(stdout);
+		if (!save_fingerprints(prog, changed_since, fingerprints))
+			throw EXIT_FAILURE;
+	}
 	throw EXIT_SUCCESS;
 }
@@ -5,16 +5,20 @@ For copyright and licensing terms, see the file named COPYING.
 
 #define __STDC_FORMAT_MACROS
 #include <vector>
+#include <string>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <cctype>
 #include <csignal>
 #include <cerrno>
 #include <ctime>
 #include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "utils.h"
@@ -27,6 +31,8 @@ For copyright and licensing terms, see the file named COPYING.
 #include "CharacterCell.h"
 #include "ECMA48Output.h"
 #include "TerminalCapabilities.h"
+#include "TAI64NLocalConverter.h"
+#include "DirStar.h"
 
 /* Time *********************************************************************
 // **************************************************************************
@@ -45,6 +51,22 @@ convert(
 	return tm;
 }
 
+/* Following state changes *************************************************
+// **************************************************************************
+*/
+
+namespace {
+
+struct followed_service {
+	followed_service(const char * n, const struct stat & s, bool r) : name(n), dev(s.st_dev), ino(s.st_ino), ready_after_run(r) {}
+	const char * name;
+	dev_t dev;
+	ino_t ino;
+	bool ready_after_run;
+};
+
+}
+
 /* Pretty coloured output ***************************************************
 // **************************************************************************
 */
@@ -206,6 +228,19 @@ write_timestamp (
 	std::fprintf(stdout, " %" PRIu64 "s ago", secs);
 }
 
+static inline
+void
+write_usage (
+	const char * label,
+	const char * usage
+) {
+	const uint64_t user(unpack_bigendian(usage +  0U, 8));
+	const uint64_t system(unpack_bigendian(usage +  8U, 8));
+	const uint64_t rss(unpack_bigendian(usage + 16U, 8));
+	if (!user && !system && !rss) return;
+	std::fprintf(stdout, "\n\t%-8.8s: %" PRIu64 ".%06" PRIu64 "s user, %" PRIu64 ".%06" PRIu64 "s system, %" PRIu64 " KiB maximum RSS", label, user / 1000000U, user % 1000000U, system / 1000000U, system % 1000000U, rss);
+}
+
 static inline
 void
 display (
@@ -222,7 +257,7 @@ display (
 	const bool use_kill,
 	const uint64_t z,
 	const unsigned int b,
-	char status[STATUS_BLOCK_SIZE]
+	char status[EXTENDED_STATUS_BLOCK_SIZE]
 ) {
 	const uint64_t s(unpack_bigendian(status, 8));
 //	const uint32_t n(unpack_bigendian(status + 8, 4));
@@ -291,6 +326,28 @@ display (
 					write_timestamp(envs, o, attributes, "at", z, stamp);
 				}
 			}
+			if (b >= INPUT_PIPE_OFFSET) {
+				const uint32_t restarts(unpack_bigendian(status + RESTARTS_OFFSET, RESTARTS_SIZE));
+				if (restarts)
+					std::fprintf(stdout, "\n\tRestarts: %" PRIu32, restarts);
+				write_usage("Last run", status + LAST_RUN_USAGE_OFFSET);
+				write_usage("Total", status + CUMULATIVE_USAGE_OFFSET);
+				const uint64_t sampled(unpack_bigendian(status + CONTROL_GROUP_OFFSET + 16U, 8));
+				if (sampled) {
+					const uint64_t cpu(unpack_bigendian(status + CONTROL_GROUP_OFFSET + 0U, 8));
+					const uint64_t memory(unpack_bigendian(status + CONTROL_GROUP_OFFSET + 8U, 8));
+					std::fprintf(stdout, "\n\tCGroup  : %" PRIu64 ".%06" PRIu64 "s CPU, %" PRIu64 " KiB memory", cpu / 1000000U, cpu % 1000000U, memory / 1024U);
+					if (z >= sampled)
+						write_timestamp(envs, o, attributes, "sampled", z, sampled);
+				}
+			}
+			if (b >= INPUT_PIPE_OFFSET + INPUT_PIPE_SIZE) {
+				const uint32_t capacity(unpack_bigendian(status + INPUT_PIPE_OFFSET + 0U, 4));
+				const uint32_t high_water(unpack_bigendian(status + INPUT_PIPE_OFFSET + 4U, 4));
+				const uint64_t full(unpack_bigendian(status + INPUT_PIPE_OFFSET + 8U, 8));
+				if (capacity || high_water)
+					std::fprintf(stdout, "\n\tInput   : %" PRIu32 " of %" PRIu32 " bytes at most, full for %" PRIu64 ".%03" PRIu64 "s", high_water, capacity, full / 1000U, full % 1000U);
+			}
 		} else {
 			const bool is_up(b < ENCORE_STATUS_BLOCK_SIZE ? p : encore_status_stopped != status[ENCORE_STATUS_OFFSET] || (ready_after_run && exited_run));
 			if (*want || *paused || is_up != initially_up)
@@ -322,8 +379,193 @@ display (
 	}
 }
 
-// Used to preserve this argument when we return with new arguments.
-static std::string current;
+/* Log tails **************************************************************
+// **************************************************************************
+*/
+
+namespace {
+
+enum { LOG_BLOCK_SIZE = 65536 };
+
+/// \brief A part of a log file, from an offset to its end.
+struct log_chunk {
+	log_chunk(const std::string & n, off_t o) : name(n), offset(o) {}
+	std::string name;
+	off_t offset;
+};
+typedef std::vector<log_chunk> log_chunk_list;
+
+}
+
+/// Find where the last lines of a file begin, reading backwards from its end in large blocks and counting newlines.
+/// As with tail, an unterminated final line counts as a line.
+/// On return, lines is however many lines were wanted but not found in the file.
+static
+bool
+find_last_lines (
+	int fd,
+	off_t & offset,
+	unsigned long & lines
+) {
+	struct stat s;
+	if (0 > fstat(fd, &s)) return false;
+	offset = s.st_size;
+	if (!lines || 0 >= s.st_size) return true;
+	char buf[LOG_BLOCK_SIZE];
+	unsigned long count(0U);
+	// The very last byte is either the newline that terminates the last line or part of an unterminated last line.
+	off_t end(s.st_size - 1);
+	while (end > 0) {
+		const off_t start(end > LOG_BLOCK_SIZE ? end - LOG_BLOCK_SIZE : 0);
+		const ssize_t n(pread(fd, buf, end - start, start));
+		if (0 > n) return false;
+		if (end - start != n) {
+			// The file has been truncated underneath us.
+			errno = EIO;
+			return false;
+		}
+		for (ssize_t i(n); i > 0; ) {
+			--i;
+			if ('\n' != buf[i]) continue;
+			if (++count >= lines) {
+				offset = start + i + 1;
+				lines = 0U;
+				return true;
+			}
+		}
+		end = start;
+	}
+	offset = 0;
+	lines -= count + 1U;
+	return true;
+}
+
+/// Find where line number line (counting from 1) of a file begins, reading forwards from its start.
+static
+bool
+find_line (
+	int fd,
+	off_t & offset,
+	unsigned long line
+) {
+	offset = 0;
+	char buf[LOG_BLOCK_SIZE];
+	for (;;) {
+		if (line <= 1U) return true;
+		const ssize_t n(pread(fd, buf, sizeof buf, offset));
+		if (0 > n) return false;
+		if (0 == n) return true;
+		const char * p(buf), * const e(buf + n);
+		while (line > 1U) {
+			const char * nl(static_cast<const char *>(std::memchr(p, '\n', e - p)));
+			if (!nl) {
+				p = e;
+				break;
+			}
+			p = nl + 1;
+			--line;
+		}
+		offset += p - buf;
+	}
+}
+
+/// Collect the rotated log files, as many as it takes to supply the remaining lines, newest first.
+static
+void
+find_rotated_lines (
+	int log_main_dir_fd,
+	log_chunk_list & chunks,
+	unsigned long & lines
+) {
+	FileDescriptorOwner dir_fd(open_dir_at(log_main_dir_fd, "."));
+	if (0 > dir_fd.get()) return;
+	const DirStar dir(dir_fd);
+	if (!dir) return;
+	std::vector<std::string> names;
+	for (;;) {
+		const dirent * d(readdir(dir));
+		if (!d) break;
+		if ('@' != d->d_name[0]) continue;
+		const std::string name(d->d_name);
+		std::string base;
+		if (ends_in(name, ".s", base) || ends_in(name, ".u", base))
+			names.push_back(name);
+	}
+	// TAI64N timestamps in hexadecimal sort in time order.
+	std::sort(names.begin(), names.end());
+	for (std::vector<std::string>::const_reverse_iterator i(names.rbegin()); names.rend() != i && lines > 0U; ++i) {
+		const FileDescriptorOwner fd(open_read_at(dir.fd(), i->c_str()));
+		if (0 > fd.get()) continue;
+		off_t offset;
+		if (!find_last_lines(fd.get(), offset, lines)) continue;
+		chunks.push_back(log_chunk(*i, offset));
+	}
+}
+
+/// Write part of a log file through the timestamp converter, from an offset to its end.
+/// A partial last line is left in the converter, so that the next chunk can carry on from it.
+static
+bool
+write_log_chunk (
+	int fd,
+	off_t offset,
+	TAI64NLocalConverter & converter
+) {
+	char buf[LOG_BLOCK_SIZE];
+	for (;;) {
+		const ssize_t n(pread(fd, buf, sizeof buf, offset));
+		if (0 > n) {
+			if (EINTR == errno) continue;
+			return false;
+		}
+		if (0 == n) break;
+		converter.Process(buf, n);
+		offset += n;
+	}
+	return true;
+}
+
+static
+void
+write_log_tail (
+	const char * prog,
+	const char * name,
+	ProcessEnvironment & envs,
+	int log_main_dir_fd,
+	bool from_start,
+	unsigned long lines,
+	bool include_rotated
+) {
+	const FileDescriptorOwner current_fd(open_read_at(log_main_dir_fd, "current"));
+	if (0 > current_fd.get()) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, "log/main/current", std::strerror(error));
+		return;
+	}
+	off_t offset;
+	if (from_start ? !find_line(current_fd.get(), offset, lines) : !find_last_lines(current_fd.get(), offset, lines)) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, "log/main/current", std::strerror(error));
+		return;
+	}
+	TAI64NLocalConverter converter(envs, stdout, false);
+	if (include_rotated && !from_start && lines > 0U) {
+		log_chunk_list chunks;
+		find_rotated_lines(log_main_dir_fd, chunks, lines);
+		for (log_chunk_list::const_reverse_iterator i(chunks.rbegin()); chunks.rend() != i; ++i) {
+			const FileDescriptorOwner fd(open_read_at(log_main_dir_fd, i->name.c_str()));
+			if (0 > fd.get() || !write_log_chunk(fd.get(), i->offset, converter)) {
+				const int error(errno);
+				std::fprintf(stderr, "%s: ERROR: %s/%s/%s: %s\n", prog, name, "log/main", i->name.c_str(), std::strerror(error));
+			}
+		}
+	}
+	if (!write_log_chunk(current_fd.get(), offset, converter)) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, name, "log/main/current", std::strerror(error));
+	}
+	converter.Finish();
+}
 
 /* Main function ************************************************************
 // **************************************************************************
@@ -341,15 +583,21 @@ service_status (
 
 	bool long_form(0 != std::strcmp(prog, "svstat"));
 	bool colours(isatty(STDOUT_FILENO));
+	bool follow(false);
 	const char * log_lines = "5";
+	bool include_rotated(false);
 	try {
 		popt::bool_definition long_form_option('\0', "long", "Output in a longer form.", long_form);
 		popt::bool_definition colours_option('\0', "colour", "Force output in colour even if standard output is not a terminal.", colours);
 		popt::string_definition log_lines_option('\0', "log-lines", "number", "Control the number of log lines printed.", log_lines);
+		popt::bool_definition include_rotated_option('\0', "log-include-rotated", "Take log lines from rotated log files if the current one is too short.", include_rotated);
+		popt::bool_definition follow_option('\0', "follow", "After printing the statuses, print each subsequent change of state.", follow);
 		popt::definition * top_table[] = {
 			&long_form_option,
 			&colours_option,
-			&log_lines_option
+			&log_lines_option,
+			&include_rotated_option,
+			&follow_option
 		};
 		popt::top_table_definition main_option(sizeof top_table/sizeof *top_table, top_table, "Main options", "{directories...}");
 
@@ -368,6 +616,16 @@ service_status (
 		throw static_cast<int>(EXIT_USAGE);
 	}
 
+	// As with tail, +N means from line N onwards and N or -N means the last N lines.
+	const bool log_from_start('+' == log_lines[0]);
+	const char * log_lines_number(log_lines + ('+' == log_lines[0] || '-' == log_lines[0] ? 1 : 0));
+	const char * end(log_lines_number);
+	const unsigned long log_line_count(std::isdigit(*log_lines_number) ? std::strtoul(log_lines_number, const_cast<char **>(&end), 10) : 0UL);
+	if (end == log_lines_number || *end) {
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, log_lines, "Not a number of lines.");
+		throw static_cast<int>(EXIT_USAGE);
+	}
+
 	if (!colours)
 		caps.colour_level = caps.NO_COLOURS;
 
@@ -377,6 +635,10 @@ service_status (
 
 	reset_colour(o);
 
+	const ServiceManagerSnapshot snapshot(prog, !per_user_mode, 1000);
+	const ServiceManagerStatusTable status_table(!per_user_mode);
+	std::vector<followed_service> followed;
+
 	for (std::vector<const char *>::const_iterator i(args.begin()); i != args.end(); ++i) {
 		const char * name(*i);
 		const FileDescriptorOwner bundle_dir_fd(open_dir_at(AT_FDCWD, name));
@@ -408,74 +670,90 @@ service_status (
 		const bool ready_after_run(is_ready_after_run(service_dir_fd.get()));
 		const bool use_hangup(is_use_hangup_signal(service_dir_fd.get()));
 		const bool use_kill(is_use_kill_signal(service_dir_fd.get()));
-		char status[STATUS_BLOCK_SIZE];
+		char status[EXTENDED_STATUS_BLOCK_SIZE];
 
-		const FileDescriptorOwner ok_fd(open_writeexisting_at(supervise_dir_fd.get(), "ok"));
-		if (0 > ok_fd.get()) {
-			const int error(errno);
-			if (ENXIO != error) {
-				std::fprintf(stdout, "%s: %s: ", name, "supervise/ok");
-				if (colours) set_italics(o, true);
-				std::fprintf(stdout, "%s", std::strerror(error));
-				if (colours) set_italics(o, false);
-				std::fputc('\n', stdout);
-				continue;
-			}
-			display(envs, name, o, colours, long_form, false, initially_up, run_on_empty, ready_after_run, use_hangup, use_kill, z, 0U, status);
-		} else {
-			const FileDescriptorOwner status_fd(open_read_at(supervise_dir_fd.get(), "status"));
-			if (0 > status_fd.get()) {
+		if (follow) {
+			struct stat supervise_dir_s;
+			if (0 <= fstat(supervise_dir_fd.get(), &supervise_dir_s))
+				followed.push_back(followed_service(name, supervise_dir_s, ready_after_run));
+		}
+
+		// Services that are not in the snapshot might yet be under some other supervisor, so are looked at individually.
+		if (const unsigned int size = snapshot.read(supervise_dir_fd.get(), status)) {
+			display(envs, name, o, colours, long_form, true, initially_up, run_on_empty, ready_after_run, use_hangup, use_kill, z, size, status);
+		} else
+		{
+			const FileDescriptorOwner ok_fd(open_writeexisting_at(supervise_dir_fd.get(), "ok"));
+			if (0 > ok_fd.get()) {
 				const int error(errno);
-				std::fprintf(stdout, "%s: %s: ", name, "status");
-				if (colours) set_italics(o, true);
-				std::fprintf(stdout, "%s", std::strerror(error));
-				if (colours) set_italics(o, false);
-				std::fputc('\n', stdout);
-				display(envs, name, o, colours, long_form, true, initially_up, run_on_empty, ready_after_run, use_hangup, use_kill, z, 0U, status);
+				if (ENXIO != error) {
+					std::fprintf(stdout, "%s: %s: ", name, "supervise/ok");
+					if (colours) set_italics(o, true);
+					std::fprintf(stdout, "%s", std::strerror(error));
+					if (colours) set_italics(o, false);
+					std::fputc('\n', stdout);
+					continue;
+				}
+				display(envs, name, o, colours, long_form, false, initially_up, run_on_empty, ready_after_run, use_hangup, use_kill, z, 0U, status);
+			} else if (const unsigned int n = status_table.read(supervise_dir_fd.get(), status)) {
+				display(envs, name, o, colours, long_form, true, initially_up, run_on_empty, ready_after_run, use_hangup, use_kill, z, n, status);
 			} else {
-				const int b(read(status_fd.get(), status, sizeof status));
-				display(envs, name, o, colours, long_form, true, initially_up, run_on_empty, ready_after_run, use_hangup, use_kill, z, static_cast<unsigned int>(b), status);
+				const FileDescriptorOwner status_fd(open_read_at(supervise_dir_fd.get(), "status"));
+				if (0 > status_fd.get()) {
+					const int error(errno);
+					std::fprintf(stdout, "%s: %s: ", name, "status");
+					if (colours) set_italics(o, true);
+					std::fprintf(stdout, "%s", std::strerror(error));
+					if (colours) set_italics(o, false);
+					std::fputc('\n', stdout);
+					display(envs, name, o, colours, long_form, true, initially_up, run_on_empty, ready_after_run, use_hangup, use_kill, z, 0U, status);
+				} else {
+					const int b(read(status_fd.get(), status, sizeof status));
+					display(envs, name, o, colours, long_form, true, initially_up, run_on_empty, ready_after_run, use_hangup, use_kill, z, static_cast<unsigned int>(b), status);
+				}
 			}
 		}
 
 		if (long_form) {
 			const FileDescriptorOwner log_main_dir_fd(open_dir_at(bundle_dir_fd.get(), "log/main/"));
 
-			if (0 <= log_main_dir_fd.get()) {
-				std::fflush(stdout);
-
-				// We are going to clean up the grandchild(ren) so that our parent does not get stuck with zombies.
-				subreaper(true);
+			if (0 <= log_main_dir_fd.get())
+				write_log_tail(prog, name, envs, log_main_dir_fd.get(), log_from_start, log_line_count, include_rotated);
+		}
+	}
 
-				const int child(fork());
-				if (0 > child) {
-					const int error(errno);
-					std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "fork", std::strerror(error));
-					throw EXIT_FAILURE;
-				}
-				if (0 == child) {
-					// We could do some of this in code, but this is simpler and more maintainable, given that we have the builtins.
-					current = name + std::string("/log/main/current");
-					args.clear();
-					args.insert(args.end(), "pipe");
-					args.insert(args.end(), "--inwards");
-					args.insert(args.end(), "tail");
-					args.insert(args.end(), "-n");
-					args.insert(args.end(), log_lines);
-					args.insert(args.end(), current.c_str());
-					args.insert(args.end(), "|");
-					args.insert(args.end(), "tai64nlocal");
-					args.insert(args.end(), 0);
-					next_prog = arg0_of(args);
-					return;
-				}
-				for (;;) {
-					int child_status, child_code;
-					pid_t c;
-					if (0 >= wait_blocking_for_anychild_exit(c, child_status, child_code)) break;
-				}
+	if (follow) {
+		std::fflush(stdout);
+		const FileDescriptorOwner socket_fd(connect_service_manager_socket(!per_user_mode, prog));
+		if (0 > socket_fd.get()) throw EXIT_FAILURE;
+		const FileDescriptorOwner subscription_fd(subscribe_to_state_changes(prog, socket_fd.get()));
+		if (0 > subscription_fd.get()) throw EXIT_FAILURE;
+		for (;;) {
+			service_manager_state_change r;
+			const ssize_t n(recv(subscription_fd.get(), &r, sizeof r, 0));
+			if (0 > n) {
+				const int error(errno);
+				if (EINTR == error) continue;
+				std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "recv", std::strerror(error));
+				throw EXIT_FAILURE;
+			}
+			if (static_cast<std::size_t>(n) < sizeof r) break;
+			for (std::vector<followed_service>::const_iterator i(followed.begin()); followed.end() != i; ++i) {
+				const followed_service & f(*i);
+				if (static_cast<uint64_t>(f.dev) != r.dev || static_cast<uint64_t>(f.ino) != r.ino) continue;
+				std::fprintf(stdout, "%s: %s", f.name, state_of(f.ready_after_run, r.pid, false, r.old_state));
+				if (r.flags & r.COALESCED)
+					std::fputs(" ...", stdout);
+				std::fprintf(stdout, " -> %s", r.flags & r.UNLOADED ? "unloaded" : state_of(f.ready_after_run, r.pid, false, r.new_state));
+				if (r.pid)
+					std::fprintf(stdout, " (pid %" PRIu32 ")", r.pid);
+				clock_gettime(CLOCK_REALTIME, &now);
+				write_timestamp(envs, o, colours, "at", time_to_tai64(envs, TimeTAndLeap(now.tv_sec, false)), r.timestamp);
+				std::fputc('\n', stdout);
+				std::fflush(stdout);
 			}
 		}
+		std::fprintf(stderr, "%s: INFO: %s\n", prog, "The service manager has ended the subscription.");
 	}
 	throw EXIT_SUCCESS;
 }
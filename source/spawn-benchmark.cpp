@@ -0,0 +1,113 @@
+/* COPYING ******************************************************************
+For copyright and licensing terms, see the file named COPYING.
+// **************************************************************************
+*/
+
+// Measure how the two ways that service-manager spawns service processes scale with the size of the parent.
+// Usage: spawn-benchmark [MiB...]
+// For each size, the parent touches that many MiB of memory and then spawns /bin/true repeatedly, both ways.
+// The clone(CLONE_VM|CLONE_VFORK) time runs until the child has executed its program, as that is when the parent resumes.
+// The fork() time runs only until fork() returns in the parent; the page tables have been copied by then.
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__LINUX__) || defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace {
+
+const unsigned SPAWNS = 200U;
+const char * const args[] = { "/bin/true", 0 };
+
+double
+now_microseconds()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000.0 + t.tv_nsec / 1000.0;
+}
+
+#if defined(__LINUX__) || defined(__linux__)
+alignas(16) char vfork_stack[64U * 1024U];
+
+int
+vforked_child (
+	void *
+) {
+	execv(*args, const_cast<char **>(args));
+	_exit(EXIT_FAILURE);
+}
+
+double
+clone_time()
+{
+	const double start(now_microseconds());
+	const int pid(clone(vforked_child, vfork_stack + sizeof vfork_stack, CLONE_VM|CLONE_VFORK|SIGCHLD, 0));
+	const double elapsed(now_microseconds() - start);
+	if (0 < pid) waitpid(pid, 0, 0);
+	return elapsed;
+}
+#endif
+
+double
+fork_time()
+{
+	const double start(now_microseconds());
+	const int pid(fork());
+	if (0 == pid) {
+		execv(*args, const_cast<char **>(args));
+		_exit(EXIT_FAILURE);
+	}
+	const double elapsed(now_microseconds() - start);
+	if (0 < pid) waitpid(pid, 0, 0);
+	return elapsed;
+}
+
+}
+
+int
+main (
+	int argc,
+	const char * argv[]
+) {
+	std::vector<unsigned long> sizes;
+	for (int i(1); i < argc; ++i)
+		sizes.push_back(std::strtoul(argv[i], 0, 0));
+	if (sizes.empty()) {
+		const unsigned long defaults[] = { 8UL, 64UL, 256UL, 1024UL };
+		sizes.assign(defaults, defaults + sizeof defaults/sizeof *defaults);
+	}
+	std::vector<char *> ballast;
+	unsigned long total(0UL);
+	for (std::vector<unsigned long>::const_iterator i(sizes.begin()); sizes.end() != i; ++i) {
+		// Grow the resident set to the wanted size, touching every page so that it has to be mapped.
+		if (*i > total) {
+			const std::size_t bytes((*i - total) << 20U);
+			char * p(static_cast<char *>(std::malloc(bytes)));
+			if (!p) {
+				std::fprintf(stderr, "%s: FATAL: %lu MiB: %s\n", argv[0], *i, std::strerror(errno));
+				return EXIT_FAILURE;
+			}
+			std::memset(p, 1, bytes);
+			ballast.push_back(p);
+			total = *i;
+		}
+		double c(0.0), f(0.0);
+		for (unsigned n(0U); n < SPAWNS; ++n) {
+#if defined(__LINUX__) || defined(__linux__)
+			c += clone_time();
+#endif
+			f += fork_time();
+		}
+		std::fprintf(stdout, "%5lu MiB: clone(CLONE_VM|CLONE_VFORK) %8.1f us, fork() %8.1f us\n", total, c / SPAWNS, f / SPAWNS);
+	}
+	return EXIT_SUCCESS;
+}
@@ -4,7 +4,10 @@ For copyright and licensing terms, see the file named COPYING.
 */
 
 #include <vector>
+#include <list>
+#include <algorithm>
 #include <map>
+#include <queue>
 #include <unordered_map>
 #include <set>
 #include <cstddef>
@@ -13,6 +16,8 @@ For copyright and licensing terms, see the file named COPYING.
 #include <csignal>
 #include <cstring>
 #include <cerrno>
+#include <ctime>
+#include <inttypes.h>
 #include <new>
 #include <memory>
 #include <unistd.h>
@@ -22,8 +27,11 @@ For copyright and licensing terms, see the file named COPYING.
 #include "fdutils.h"
 #include "kqueue_common.h"
 #include "service-manager-client.h"
+#include "service-manager.h"
+#include "bundle-graph-cache.h"
 #include "popt.h"
 #include "FileDescriptorOwner.h"
+#include "FileStar.h"
 #include "DirStar.h"
 #include "CharacterCell.h"
 #include "ECMA48Output.h"
@@ -54,10 +62,37 @@ reset_colour (
 */
 
 static bool verbose(false), pretending(false);
+static const char * timeline_filename(0), * gantt_filename(0);
+static unsigned long max_concurrent(0UL);
+static popt::string_pair_list_definition::list_type class_limit_options;
+
+static inline
+uint64_t
+monotonic_microseconds()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return static_cast<uint64_t>(t.tv_sec) * 1000000U + static_cast<uint64_t>(t.tv_nsec) / 1000U;
+}
+
+static inline
+uint64_t
+monotonic_milliseconds()
+{
+	return monotonic_microseconds() / 1000U;
+}
+
+static inline
+bool
+recording_timeline()
+{
+	return timeline_filename || gantt_filename;
+}
 
 namespace {
 struct index : public std::pair<dev_t, ino_t> {
 	index(const struct stat & s) : pair(s.st_dev, s.st_ino) {}
+	index(dev_t d, ino_t i) : pair(d, i) {}
 	std::size_t hash() const { return static_cast<std::size_t>(first) + static_cast<std::size_t>(second); }
 };
 
@@ -66,6 +101,7 @@ struct bundle;
 
 typedef std::set<bundle *> bundle_pointer_set;
 typedef std::list<bundle *> bundle_pointer_list;
+typedef std::vector<bundle *> bundle_pointer_vector;
 
 namespace {
 struct bundle {
@@ -78,8 +114,19 @@ struct bundle {
 		primary_target(false),
 		use_hangup(false), 
 		use_final_kill(false), 
-		order(-1), 
+		socket_activated(false), 
+		unsorted_predecessors(0U), 
 		wants(WANT_NONE), 
+		blockers(0U), 
+		moments(),
+		order(0U), 
+		downstream(0U), 
+		slot_class(), 
+		slot_weight(1UL), 
+		holds_slot(false), 
+		timeout_milliseconds(0UL), 
+		on_timeout(TIMEOUT_FAIL), 
+		deadline(0U), 
 		job_state(INITIAL) 
 	{
 	}
@@ -95,13 +142,25 @@ struct bundle {
 		WANT_START = 0x2,
 		WANT_STOP = 0x4,
 	};
-	enum event { LOAD, LOG_LOAD, RUN_ON_EMPTY, LOG_RUN_ON_EMPTY, IS_BLOCKED, IS_BLOCKING, IS_UNBLOCKED, IS_START, IS_STOP, STOP_HARDER, STOP_HARDEST, CANNOT_START, CANNOT_STOP, IS_READY, IS_DONE };
+	enum moment { QUEUED, LOAD_REQUESTED, LOADED, ACTION_REQUESTED, FINISHED, MOMENTS };
+	enum event { LOAD, LOG_LOAD, RUN_ON_EMPTY, LOG_RUN_ON_EMPTY, IS_BLOCKED, IS_BLOCKING, IS_UNBLOCKED, IS_START, IS_STOP, STOP_HARDER, STOP_HARDEST, CANNOT_START, CANNOT_STOP, TIMED_OUT, IS_READY, IS_DONE };
 	int bundle_dir_fd, supervise_dir_fd, service_dir_fd, status_file_fd;
 	std::string path, name;
-	bool ss_scanned, primary_target, use_hangup, use_final_kill;
-	int order;
+	bool ss_scanned, primary_target, use_hangup, use_final_kill, socket_activated;
+	std::size_t unsorted_predecessors;	///< the bundles in sort_after that the topological sort is yet to output
 	unsigned wants;
 	bundle_pointer_set sort_after;
+	bundle_pointer_vector sort_before;	///< the bundles that have this one in their sort_after, filled in by the topological sort
+	unsigned blockers;	///< the bundles in sort_after that are yet to be done
+	uint64_t moments[MOMENTS];	///< when each moment of the timeline happened, in monotonic microseconds, or zero if it has not
+	std::size_t order;	///< the position of the bundle in the topological sort
+	std::size_t downstream;	///< the number of bundles in the longest chain of successors that starts with this one
+	std::string slot_class;	///< the concurrency class that the bundle takes a slot from when starting
+	unsigned long slot_weight;	///< how many slots the bundle takes when starting
+	bool holds_slot;
+	unsigned long timeout_milliseconds;	///< how long the bundle has to start or to stop, or zero for no limit
+	timeout_action on_timeout;
+	uint64_t deadline;	///< in monotonic milliseconds, or zero if there is none pending
 
 	bool done() const { return job_state >= DONE; }
 	bool initial() const { return job_state < BLOCKED; }
@@ -114,7 +173,11 @@ struct bundle {
 	bool needs_initial_action() const { return ACTIONED == job_state; }
 	bool needs_harder_action() const { return ORDERED == job_state || REREQUESTED == job_state; }
 	bool needs_hardest_action() const { return FORCED == job_state; }
+	bool is_slow() const { return job_state >= REREQUESTED; }
 	void stop_initial() { 
+		// Stopping a socket-activated service stops it listening, too.
+		if (socket_activated)
+			unload_when_stopped(supervise_dir_fd);
 		if (use_hangup)
 			hangup_daemon(supervise_dir_fd); 
 		stop(supervise_dir_fd); 
@@ -130,10 +193,17 @@ struct bundle {
 		if (use_final_kill)
 			kill_daemon(supervise_dir_fd);
 	}
-	void start_initial() { start(supervise_dir_fd); }
+	void start_initial() { 
+		// A socket-activated service is started by the service manager, upon its first connection.
+		if (!socket_activated)
+			start(supervise_dir_fd); 
+	}
 	bool has_started() const;
 	bool has_stopped() const;
+	bool has_finished() const;
 	void print_event(const char *, ECMA48Output &, enum event) const;
+	void stamp(enum moment m) { if (recording_timeline() && !moments[m]) moments[m] = monotonic_microseconds(); }
+	uint64_t span(enum moment from, enum moment to) const { return moments[from] && moments[to] > moments[from] ? moments[to] - moments[from] : 0U; }
 protected:
 	// Our state machine guarantees that state transitions only ever increase the state value.
 	// Even though we don't make use of it, our logic requires at least one state between FORCED and DONE, for timed-out jobs to sit in.
@@ -158,6 +228,7 @@ bool
 bundle::has_started() const
 {
 	if (0 > supervise_dir_fd || !is_ok(supervise_dir_fd)) return false;
+	if (socket_activated) return true;
 	if (is_ready_after_run(service_dir_fd)) {
 		const bool include_stopped(is_done_after_exit(service_dir_fd));
 		return 0 < after_run_status_file(status_file_fd, include_stopped);
@@ -169,7 +240,22 @@ inline
 bool
 bundle::has_stopped() const
 {
-	return 0 <= supervise_dir_fd && (!is_ok(supervise_dir_fd) || 0 < stopped_status_file(status_file_fd));
+	if (0 > supervise_dir_fd) return false;
+	if (!is_ok(supervise_dir_fd)) return true;
+	// A socket-activated service has not stopped until it is no longer listening, which is when it is unloaded.
+	return !socket_activated && 0 < stopped_status_file(status_file_fd);
+}
+
+/// Whether the bundle has reached the state that is wanted of it.
+inline
+bool
+bundle::has_finished() const
+{
+	switch (wants) {
+		case WANT_START:	return has_started();
+		case WANT_STOP:		return has_stopped();
+		default:		return true;
+	}
 }
 
 inline
@@ -191,6 +277,7 @@ bundle::name_of (
 		case STOP_HARDEST:		return "stop hardest";
 		case CANNOT_START:		return "cannot start";
 		case CANNOT_STOP:		return "cannot stop";
+		case TIMED_OUT:			return "timed out";
 		case IS_READY:			return "ready";
 		case IS_DONE:			return "done";
 		default:			return "unknown";
@@ -216,6 +303,7 @@ bundle::colour_of (
 		case STOP_HARDEST:		return COLOUR_YELLOW;
 		case CANNOT_START:		return COLOUR_RED;
 		case CANNOT_STOP:		return COLOUR_RED;
+		case TIMED_OUT:			return COLOUR_RED;
 		case IS_READY:			return COLOUR_GREEN;
 		case IS_DONE:			return COLOUR_GREEN;
 		default:			return COLOUR_DEFAULT;
@@ -301,6 +389,7 @@ add_bundle (
 	b.wants = wants;
 	b.use_hangup = is_use_hangup_signal(b.service_dir_fd);
 	b.use_final_kill = is_use_kill_signal(b.service_dir_fd);
+	b.socket_activated = is_socket_activated(b.service_dir_fd);
 	return &b;
 }
 
@@ -338,108 +427,156 @@ add_primary_target_bundles (
 	}
 }
 
+/// Entries that the cache says lead to bundles that we already have need not be opened.
 static inline
 void
 add_related_bundles (
 	bundle_info_map & bundles,
+	bundle_pointer_vector & unscanned,
+	BundleGraphCache & cache,
 	const bundle & b,
-	const char * subdir_name,
+	BundleGraphCache::relation relation,
 	int want
 ) {
-	FileDescriptorOwner subdir_fd(open_dir_at(b.bundle_dir_fd, subdir_name));
-	if (0 > subdir_fd.get()) return;
-	const DirStar subdir_dir(subdir_fd);
-	if (!subdir_dir) return;
-	for (;;) {
-		const dirent * entry(readdir(subdir_dir));
-		if (!entry) break;
-#if defined(_DIRENT_HAVE_D_TYPE)
-		if (DT_DIR != entry->d_type && DT_LNK != entry->d_type) continue;
-#endif
-		if ('.' == entry->d_name[0]) continue;
-		const int dir_fd(open_dir_at(subdir_dir.fd(), entry->d_name));
+	const std::string subdir_name(std::string(BundleGraphCache::name_of(relation)) + "/");
+	const BundleGraphCache::entry_list entries(cache.entries(b.bundle_dir_fd, relation));
+	for (BundleGraphCache::entry_list::const_iterator i(entries.begin()); entries.end() != i; ++i) {
+		if (!i->is_directory) continue;
+		if (i->has_target) {
+			const struct index key(i->dev, i->ino);
+			bundle_info_map::iterator known(bundles.find(key));
+			if (bundles.end() != known) {
+				known->second.wants |= START == want ? bundle::WANT_START : bundle::WANT_STOP;
+				continue;
+			}
+		}
+		const int dir_fd(open_dir_at(b.bundle_dir_fd, (subdir_name + i->name).c_str()));
 		if (0 > dir_fd) continue;
-		add_bundle(bundles, dir_fd, (b.path + b.name + "/") + subdir_name, entry->d_name, want);
+		if (bundle * r = add_bundle(bundles, dir_fd, (b.path + b.name + "/") + subdir_name, i->name, want))
+			if (!r->ss_scanned)
+				unscanned.push_back(r);
 	}
 }
 
-static inline
-bundle *
-lookup_without_adding (
-	bundle_info_map & bundles,
-	const int bundle_dir_fd
-) {
-	struct stat bundle_dir_s;
-	if (!is_directory(bundle_dir_fd, bundle_dir_s))
-		return 0;
-	bundle_info_map::iterator bundle_i(bundles.find(bundle_dir_s));
-	if (bundle_i != bundles.end())
-		return &bundle_i->second;
-	return 0;
-}
-
+/// Entries that the cache says lead to bundles that we have are taken at its word.
+/// Others are checked, as the bundles that they lead to might have been replaced since they were cached.
 static inline
 bundle_pointer_set
 lookup_without_adding (
 	bundle_info_map & bundles,
+	BundleGraphCache & cache,
 	const bundle & b,
-	const char * subdir_name
+	BundleGraphCache::relation relation
 ) {
 	bundle_pointer_set r;
-	FileDescriptorOwner subdir_fd(open_dir_at(b.bundle_dir_fd, subdir_name));
-	if (0 > subdir_fd.get()) return r;
-	const DirStar subdir_dir(subdir_fd);
-	if (!subdir_dir) return r;
-	for (;;) {
-		const dirent * entry(readdir(subdir_dir));
-		if (!entry) break;
-#if defined(_DIRENT_HAVE_D_TYPE)
-		if (DT_DIR != entry->d_type && DT_LNK != entry->d_type) continue;
-#endif
-		if ('.' == entry->d_name[0]) continue;
-		const FileDescriptorOwner dir_fd(open_dir_at(subdir_dir.fd(), entry->d_name));
-		if (0 > dir_fd.get()) continue;
-		if (bundle * p = lookup_without_adding(bundles, dir_fd.get()))
-			r.insert(p);
+	const std::string subdir_name(std::string(BundleGraphCache::name_of(relation)) + "/");
+	const BundleGraphCache::entry_list entries(cache.entries(b.bundle_dir_fd, relation));
+	for (BundleGraphCache::entry_list::const_iterator i(entries.begin()); entries.end() != i; ++i) {
+		if (!i->is_directory) continue;
+		if (i->has_target) {
+			const struct index key(i->dev, i->ino);
+			bundle_info_map::iterator known(bundles.find(key));
+			if (bundles.end() != known) {
+				r.insert(&known->second);
+				continue;
+			}
+		}
+		struct stat s;
+		if (0 > fstatat(b.bundle_dir_fd, (subdir_name + i->name).c_str(), &s, 0) || !S_ISDIR(s.st_mode)) continue;
+		bundle_info_map::iterator actual(bundles.find(s));
+		if (bundles.end() != actual)
+			r.insert(&actual->second);
 	}
 	return r;
 }
 
+/// Walk back from a bundle through its unsorted predecessors until one repeats, which it must as they all have unsorted predecessors too.
+/// Report the loop thus found in full, and break it by ignoring its last ordering.
 static
 void
-mark_paths_in_order (
-	bundle * parent,
-	bundle * b
+break_ordering_loop (
+	const char * prog,
+	bundle * b,
+	bundle_pointer_list & ready
 ) {
-	if (0 == b->order) {
-		std::fprintf(stderr, "%s: %s: %s\n", parent ? parent->name.c_str() : "", b->name.c_str(), "Ordering loop.");
-		return;
-	}
-	if (0 > b->order) {
-		b->order = 0;	// fencepost "marking in progress" value
-		const bundle_pointer_set & a(b->sort_after);
-		for (bundle_pointer_set::const_iterator j(a.begin()); a.end() != j; ++j) {
-			bundle * p(*j);
-			mark_paths_in_order(b, p);
-			if (p->order > b->order) b->order = p->order;
+	std::unordered_map<bundle *, std::size_t> seen;
+	bundle_pointer_vector walk;
+	while (seen.insert(std::make_pair(b, walk.size())).second) {
+		walk.push_back(b);
+		for (bundle_pointer_set::const_iterator j(b->sort_after.begin()); b->sort_after.end() != j; ++j) {
+			if ((*j)->unsorted_predecessors) {
+				b = *j;
+				break;
+			}
 		}
-		++b->order;	// Never assigns order zero.
 	}
+	// The walk goes against the orderings, so the loop reads backwards from its end.
+	const std::size_t first(seen[b]);
+	std::string loop(b->path + b->name);
+	for (std::size_t j(walk.size()); j > first + 1U; ) {
+		--j;
+		loop += " -> " + walk[j]->path + walk[j]->name;
+	}
+	loop += " -> " + b->path + b->name;
+	std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, loop.c_str(), "Ordering loop, broken by ignoring its last ordering.");
+	bundle * p(first + 1U < walk.size() ? walk[first + 1U] : b);
+	b->sort_after.erase(p);
+	p->sort_before.erase(std::find(p->sort_before.begin(), p->sort_before.end(), b));
+	if (0U == --b->unsorted_predecessors)
+		ready.push_back(b);
 }
 
+/// Kahn's algorithm, taking bundles in the order that they become ready, which puts them in order of their longest chains of predecessors.
+/// This is linear in the numbers of bundles and orderings, apart from loops, each of which costs a walk around it.
 static
 void
-insertion_sort (
-	bundle_pointer_list & sorted,
-	bundle * b
+topological_sort (
+	const char * prog,
+	const bundle_pointer_set & unsorted,
+	bundle_pointer_list & sorted
 ) {
-	for (bundle_pointer_list::iterator j(sorted.begin()); sorted.end() != j; ++j) {
-		if ((*j)->order > b->order) {
-			sorted.insert(j, b);
-			return;
+	bundle_pointer_list ready;
+	for (bundle_pointer_set::const_iterator i(unsorted.begin()); unsorted.end() != i; ++i) {
+		bundle * b(*i);
+		b->unsorted_predecessors = b->sort_after.size();
+		for (bundle_pointer_set::const_iterator j(b->sort_after.begin()); b->sort_after.end() != j; ++j)
+			(*j)->sort_before.push_back(b);
+		if (!b->unsorted_predecessors)
+			ready.push_back(b);
+	}
+	bundle_pointer_set::const_iterator next(unsorted.begin());
+	for (std::size_t remaining(unsorted.size()); remaining; ) {
+		if (ready.empty()) {
+			// Everything that is left is in, or is after, an ordering loop.
+			while (!(*next)->unsorted_predecessors) ++next;
+			break_ordering_loop(prog, *next, ready);
+			continue;
 		}
+		bundle * b(ready.front());
+		ready.pop_front();
+		sorted.push_back(b);
+		--remaining;
+		for (bundle_pointer_vector::const_iterator j(b->sort_before.begin()); b->sort_before.end() != j; ++j)
+			if (0U == --(*j)->unsorted_predecessors)
+				ready.push_back(*j);
+	}
+}
+
+/// Measure the longest chain of successors of each bundle, working backwards through the sorted bundles so that every successor is measured first.
+static
+void
+measure_downstream_chains (
+	const bundle_pointer_list & sorted
+) {
+	std::size_t order(0U);
+	for (bundle_pointer_list::const_iterator i(sorted.begin()); sorted.end() != i; ++i)
+		(*i)->order = order++;
+	for (bundle_pointer_list::const_reverse_iterator i(sorted.rbegin()); sorted.rend() != i; ++i) {
+		bundle & b(**i);
+		b.downstream = 1U;
+		for (bundle_pointer_vector::const_iterator j(b.sort_before.begin()); b.sort_before.end() != j; ++j)
+			b.downstream = std::max(b.downstream, 1U + (*j)->downstream);
 	}
-	sorted.push_back(b);
 }
 
 static inline
@@ -459,34 +596,836 @@ make_symlink_target (
 	mkdirat(bundle_dir_fd, buf.data(), mode);
 }
 
+namespace {
+
+/// \brief A load operation queued in a batch, whose result is yet to be checked.
+struct pending_load {
+	pending_load(bundle * b, const std::string & n, bool l, std::size_t o) : owner(b), name(n), is_log(l), op(o) {}
+	bundle * owner;
+	std::string name;
+	bool is_log;
+	std::size_t op;		///< the index of the load operation in the batch
+};
+typedef std::vector<pending_load> pending_load_list;
+
+}
+
 static inline
-bool
+void
 load (
 	const char * prog,
 	ECMA48Output & o,
 	bundle & b,
-	const int socket_fd,
+	ServiceManagerRPCBatch & batch,
+	pending_load_list & loads,
 	const int supervise_dir_fd,
 	const int service_dir_fd,
 	const std::string name,
 	bundle::event load_event,
-	bundle::event run_on_empty_event
+	bundle::event run_on_empty_event,
+	bool is_log
 ) {
 	const bool was_already_loaded(is_ok(supervise_dir_fd));
-	if (was_already_loaded) return true;
+	if (was_already_loaded) return;
 	const bool run_on_empty(!is_done_after_exit(service_dir_fd));
 	if (verbose) {
 		b.print_event(prog, o, load_event);
 		if (run_on_empty)
 			b.print_event(prog, o, run_on_empty_event);
 	}
-	if (pretending) return true;
+	if (pretending) return;
+	if (!is_log)
+		b.stamp(b.LOAD_REQUESTED);
 	make_supervise_fifos (supervise_dir_fd);
-	load(prog, socket_fd, name.c_str(), supervise_dir_fd, service_dir_fd);
+	loads.push_back(pending_load(&b, name, is_log, batch.load(name.c_str(), supervise_dir_fd, service_dir_fd)));
 	if (run_on_empty)
-		make_run_on_empty(prog, socket_fd, supervise_dir_fd);
-	make_pipe_connectable(prog, socket_fd, supervise_dir_fd);
-	return wait_ok(supervise_dir_fd, 5000);
+		batch.make_run_on_empty(supervise_dir_fd);
+	batch.make_pipe_connectable(supervise_dir_fd, pipe_capacity(service_dir_fd));
+	std::vector<int> listen_fds;
+	if (!open_listen_stream_sockets(prog, service_dir_fd, listen_fds))
+		std::fprintf(stderr, "%s: ERROR: %s/%s: %s\n", prog, b.path.c_str(), name.c_str(), "Unable to open listening sockets; the service will not be socket activated.");
+	const bool accept_connections(is_accept_connections(service_dir_fd));
+	const unsigned long limit(accept_connections ? connection_limit(service_dir_fd) : 0UL);
+	for (std::vector<int>::const_iterator i(listen_fds.begin()); listen_fds.end() != i; ++i) {
+		batch.make_socket_activated(supervise_dir_fd, *i, accept_connections, limit);
+		close(*i);
+	}
+}
+
+/* The load pipeline *******************************************************
+// **************************************************************************
+// Loads are sent to the service manager in batches, with several batches in flight at once.
+// Replies are collected through the event loop as they arrive, and each batch has its own deadline.
+// So a batch that is slow to be enacted holds up neither the preparation nor the sending of the ones after it.
+*/
+
+namespace {
+
+struct load_pipeline {
+	enum { MAX_IN_FLIGHT = 8U, TIMEOUT_MILLISECONDS = 5000U };
+	load_pipeline(const char * p, int q, int s) : batch(p, s), loads(), prog(p), queue(q), in_flight(), all_loaded(true) {}
+
+	ServiceManagerRPCBatch batch;	///< the batch being filled
+	pending_load_list loads;	///< the loads queued in the batch being filled
+	void send();
+	bool finish();
+protected:
+	struct flight {
+		flight() : loads(), reply_fd(-1), deadline(0U) {}
+		pending_load_list loads;
+		int reply_fd;
+		uint64_t deadline;	///< in monotonic milliseconds
+	};
+	typedef std::map<std::size_t, flight> flight_map;
+	const char * prog;
+	int queue;
+	flight_map in_flight;	///< sent batches awaiting their replies, by ticket
+	bool all_loaded;
+
+	void wait();
+	void land(flight_map::iterator, int);
+};
+
+}
+
+/// Send the batch being filled, first waiting for room in the pipeline if need be.
+void
+load_pipeline::send (
+) {
+	if (batch.empty()) return;
+	while (in_flight.size() >= MAX_IN_FLIGHT)
+		wait();
+	const std::size_t ticket(batch.send());
+	const flight_map::iterator i(in_flight.insert(flight_map::value_type(ticket, flight())).first);
+	flight & f(i->second);
+	f.loads.swap(loads);
+	f.deadline = monotonic_milliseconds() + TIMEOUT_MILLISECONDS;
+	f.reply_fd = batch.reply_fd(ticket);
+	if (0 > f.reply_fd) {
+		land(i, TIMEOUT_MILLISECONDS);
+		return;
+	}
+	struct kevent k;
+	set_event(&k, f.reply_fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+	kevent(queue, &k, 1, 0, 0, 0);
+}
+
+/// Wait for a reply to arrive or a deadline to pass, and land every batch that is then complete or overdue.
+/// Rather than match events to batches, this simply checks all of them, as there are only ever a few in flight.
+void
+load_pipeline::wait (
+) {
+	if (in_flight.empty()) return;
+	uint64_t deadline(in_flight.begin()->second.deadline);
+	for (flight_map::const_iterator i(in_flight.begin()); in_flight.end() != i; ++i)
+		deadline = std::min(deadline, i->second.deadline);
+	const uint64_t before(monotonic_milliseconds());
+	const uint64_t ms(deadline > before ? deadline - before : 0U);
+	timespec t;
+	t.tv_sec = ms / 1000U;
+	t.tv_nsec = (ms % 1000U) * 1000000U;
+	struct kevent e[MAX_IN_FLIGHT];
+	kevent(queue, 0, 0, e, sizeof e/sizeof *e, &t);
+	const uint64_t after(monotonic_milliseconds());
+	for (flight_map::iterator i(in_flight.begin()); in_flight.end() != i; ) {
+		const flight_map::iterator f(i++);
+		if (batch.receive(f->first))
+			land(f, TIMEOUT_MILLISECONDS);
+		else
+		if (f->second.deadline <= after)
+			land(f, 0);
+	}
+}
+
+/// Collect the statuses of a sent batch, reporting each load that failed individually.
+/// The timeout only matters if there are replies still outstanding, or if the service manager predates batches.
+void
+load_pipeline::land (
+	flight_map::iterator i,
+	int timeout
+) {
+	flight & f(i->second);
+	if (0 <= f.reply_fd) {
+		struct kevent k;
+		set_event(&k, f.reply_fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+		kevent(queue, &k, 1, 0, 0, 0);
+	}
+	const std::vector<int> statuses(batch.collect(i->first, timeout));
+	for (pending_load_list::const_iterator j(f.loads.begin()); f.loads.end() != j; ++j) {
+		const int status(statuses[j->op]);
+		bundle & b(*j->owner);
+		if (!j->is_log)
+			b.stamp(b.LOADED);
+		if (!status) continue;
+		std::fprintf(stderr, "%s: ERROR: %s/%s/%s: %s: %s\n", prog, b.path.c_str(), j->name.c_str(), "ok", "Unable to load service bundle", std::strerror(status));
+		if (j->is_log) continue;
+		if (b.primary_target)
+			all_loaded = false;
+		else
+			b.wants = b.WANT_NONE;
+	}
+	in_flight.erase(i);
+}
+
+/// \returns false if any primary target bundle could not be loaded
+bool
+load_pipeline::finish (
+) {
+	send();
+	while (!in_flight.empty())
+		wait();
+	return all_loaded;
+}
+
+/* The job engine ***********************************************************
+// **************************************************************************
+// Each bundle counts the predecessors that it is waiting for.
+// Only a change to a bundle's own status prompts a look at it, and finishing it only touches the counts of its successors.
+// So the work per event is proportional to the number of successors of the bundle that changed, not to the number of bundles.
+//
+// Runnable starts then wait for slots, overall and in their concurrency classes, so that hundreds of services do not all contend for the disc or the CPU at once.
+// The waiting bundle with the longest chain of successors still to come goes first, as that is the chain that will otherwise finish last.
+// A start holds its slots until it is done, or until it has been going for as long as it takes a stop to be re-requested, so that a stuck start cannot hold up everything else.
+//
+// Bundles with start or stop deadlines have them kept in a min-heap, and the event loop sleeps until the earliest of them.
+// A bundle that finishes in time leaves its entry behind, to be discarded when it comes to the top; which is cheaper than finding and removing it.
+*/
+
+namespace {
+
+typedef std::map<std::string, unsigned long> concurrency_limit_map;
+
+/// Orders bundles by priority, lowest first, as std::priority_queue wants.
+struct by_priority {
+	bool operator() (const bundle * a, const bundle * b) const {
+		if (a->downstream != b->downstream) return a->downstream < b->downstream;
+		return a->order > b->order;
+	}
+};
+typedef std::priority_queue<bundle *, bundle_pointer_vector, by_priority> bundle_priority_queue;
+
+struct pending_deadline {
+	pending_deadline(uint64_t w, bundle * b) : when(w), owner(b) {}
+	uint64_t when;	///< in monotonic milliseconds
+	bundle * owner;
+};
+/// Orders deadlines latest first, as std::priority_queue wants, so that the earliest is on top.
+struct later {
+	bool operator() (const pending_deadline & a, const pending_deadline & b) const { return a.when > b.when; }
+};
+typedef std::priority_queue<pending_deadline, std::vector<pending_deadline>, later> deadline_heap;
+
+struct job_engine {
+	job_engine(const char * p, ECMA48Output & out, int q, unsigned long, const concurrency_limit_map &);
+
+	void add(bundle &);
+	void run();
+	bool failed() const { return any_failed; }
+protected:
+	typedef std::unordered_map<int, bundle *> status_file_map;
+	struct slots {
+		slots() : limit(0UL), used(0UL) {}
+		unsigned long limit, used;	///< a limit of zero is no limit
+		/// A bundle that is heavier than the limit can still start, on its own.
+		bool fit(unsigned long weight) const { return !limit || !used || used + weight <= limit; }
+	};
+	struct start_queue : public slots {
+		bundle_priority_queue waiting;	///< runnable bundles in the class that are yet to be given slots
+	};
+	typedef std::map<std::string, start_queue> start_queue_map;
+	const char * prog;
+	ECMA48Output & o;
+	int queue;
+	bool limited, classified, any_failed;
+	std::size_t pending;		///< bundles that are yet to be done
+	bundle_pointer_list runnable;	///< bundles whose predecessors are all done, in the order that they became so
+	bundle_pointer_list actioned;	///< bundles that have had action taken, and may not yet be done
+	status_file_map watched;	///< actioned bundles, by the status files whose changes we are watching for
+	slots total;
+	start_queue_map start_queues;	///< by concurrency class
+	deadline_heap deadlines;
+
+	void finish(bundle &);
+	void retire(bundle &);
+	void release_successors(bundle &);
+	void admit();
+	void release_slots(bundle &);
+	void unblock(bundle &);
+	void act(bundle &);
+	void timeout();
+	void fire_deadlines(uint64_t);
+	void deadline_passed(bundle &);
+	void status_changed(int);
+};
+
+}
+
+job_engine::job_engine (
+	const char * p,
+	ECMA48Output & out,
+	int q,
+	unsigned long total_limit,
+	const concurrency_limit_map & class_limits
+) :
+	prog(p),
+	o(out),
+	queue(q),
+	limited(total_limit || !class_limits.empty()),
+	classified(!class_limits.empty()),
+	any_failed(false),
+	pending(0U)
+{
+	total.limit = total_limit;
+	for (concurrency_limit_map::const_iterator i(class_limits.begin()); class_limits.end() != i; ++i)
+		start_queues[i->first].limit = i->second;
+}
+
+/// Add bundles in sorted order, so that those that are runnable from the start are enacted in that order.
+void
+job_engine::add (
+	bundle & b
+) {
+	// A bundle that is already where it is wanted is done from the start, whatever its predecessors.
+	if (b.has_finished()) {
+		if (verbose)
+			b.print_event(prog, o, bundle::WANT_START == b.wants ? b.IS_READY: b.IS_DONE);
+		b.stamp(b.FINISHED);
+		b.mark_done();
+		return;
+	}
+	++pending;
+	// The concurrency settings are only worth reading if there are limits that they count against.
+	if (bundle::WANT_START == b.wants && limited) {
+		if (classified)
+			b.slot_class = concurrency_class(b.service_dir_fd);
+		b.slot_weight = concurrency_weight(b.service_dir_fd);
+	}
+	// Each bundle only has a deadline for the direction in which it is going.
+	timeout_action action(bundle::WANT_START == b.wants ? TIMEOUT_FAIL : TIMEOUT_KILL);
+	unsigned long milliseconds(0UL);
+	if (job_timeout(b.service_dir_fd, bundle::WANT_START == b.wants ? "start_timeout" : "stop_timeout", milliseconds, action)) {
+		b.timeout_milliseconds = milliseconds;
+		b.on_timeout = action;
+	}
+	for (bundle_pointer_set::const_iterator j(b.sort_after.begin()); b.sort_after.end() != j; ++j) {
+		bundle * p(*j);
+		if (!p->done()) {
+			if (verbose && !b.blockers) {
+				b.print_event(prog, o, b.IS_BLOCKED);
+				p->print_event(prog, o, p->IS_BLOCKING);
+			}
+			++b.blockers;
+		}
+	}
+	if (b.blockers)
+		b.mark_blocked();
+	else
+		runnable.push_back(&b);
+}
+
+/// Finishing the action transitions the state machine to the done state from any state, and perhaps unblocks successors.
+void
+job_engine::finish (
+	bundle & b
+) {
+	if (verbose)
+		b.print_event(prog, o, bundle::WANT_START == b.wants ? b.IS_READY: b.IS_DONE);
+	retire(b);
+}
+
+/// Transition to the done state, whether or not the bundle got to where it was wanted.
+void
+job_engine::retire (
+	bundle & b
+) {
+	b.stamp(b.FINISHED);
+	b.mark_done();
+	--pending;
+	release_slots(b);
+	if (0 <= b.status_file_fd && watched.erase(b.status_file_fd)) {
+		struct kevent k;
+		set_event(&k, b.status_file_fd, EVFILT_VNODE, EV_DELETE|EV_DISABLE, NOTE_WRITE, 0, 0);
+		kevent(queue, &k, 1, 0, 0, 0);
+	}
+	release_successors(b);
+}
+
+void
+job_engine::release_successors (
+	bundle & b
+) {
+	for (bundle_pointer_vector::const_iterator j(b.sort_before.begin()); b.sort_before.end() != j; ++j) {
+		bundle & s(**j);
+		if (s.blockers && 0U == --s.blockers && !s.done())
+			runnable.push_back(&s);
+	}
+}
+
+/// Give slots to the highest priority waiting bundles that fit, across all classes, until no more fit.
+/// There are only ever a few classes, so the best of them is simply found afresh each time.
+void
+job_engine::admit (
+) {
+	for (;;) {
+		start_queue * best(0);
+		for (start_queue_map::iterator i(start_queues.begin()); start_queues.end() != i; ++i) {
+			start_queue & q(i->second);
+			if (q.waiting.empty()) continue;
+			const bundle * b(q.waiting.top());
+			if (!q.fit(b->slot_weight) || !total.fit(b->slot_weight)) continue;
+			if (!best || by_priority()(best->waiting.top(), b))
+				best = &q;
+		}
+		if (!best) break;
+		bundle & b(*best->waiting.top());
+		best->waiting.pop();
+		if (b.done()) continue;
+		if (b.has_finished()) {
+			finish(b);
+			continue;
+		}
+		b.holds_slot = true;
+		best->used += b.slot_weight;
+		total.used += b.slot_weight;
+		unblock(b);
+		act(b);
+	}
+}
+
+void
+job_engine::release_slots (
+	bundle & b
+) {
+	if (!b.holds_slot) return;
+	b.holds_slot = false;
+	start_queues[b.slot_class].used -= b.slot_weight;
+	total.used -= b.slot_weight;
+}
+
+/// All predecessors finishing causes transition from BLOCKED to ACTIONED.
+void
+job_engine::unblock (
+	bundle & b
+) {
+	if (verbose)
+		b.print_event(prog, o, b.IS_UNBLOCKED);
+	b.stamp(b.ACTION_REQUESTED);
+	b.mark_unblocked();
+	if (0 <= b.status_file_fd) {
+		struct kevent k;
+		set_event(&k, b.status_file_fd, EVFILT_VNODE, EV_ADD|EV_ENABLE|EV_CLEAR, NOTE_WRITE, 0, 0);
+		if (0 <= kevent(queue, &k, 1, 0, 0, 0))
+			watched[b.status_file_fd] = &b;
+	}
+	actioned.push_back(&b);
+	if (b.timeout_milliseconds) {
+		b.deadline = monotonic_milliseconds() + b.timeout_milliseconds;
+		deadlines.push(pending_deadline(b.deadline, &b));
+	}
+}
+
+/// Take any action that is due on entering the bundle's current state.
+void
+job_engine::act (
+	bundle & b
+) {
+	if (!b.needs_action()) return;
+	switch (b.wants) {
+		case bundle::WANT_START:
+		{
+			if (0 > b.supervise_dir_fd) break;
+			const bool was_already_loaded(is_ok(b.supervise_dir_fd));
+			if (!was_already_loaded)
+				b.print_event(prog, o, b.CANNOT_START);
+			else 
+			if (b.needs_initial_action()) {
+				if (verbose)
+					b.print_event(prog, o, b.IS_START);
+				if (!pretending)
+					b.start_initial();
+			}
+			break;
+		}
+		case bundle::WANT_STOP:
+		{
+			if (0 > b.supervise_dir_fd) break;
+			const bool was_already_loaded(is_ok(b.supervise_dir_fd));
+			if (!was_already_loaded)
+				b.print_event(prog, o, b.CANNOT_STOP);
+			else
+			if (b.needs_hardest_action()) {
+				if (verbose)
+					b.print_event(prog, o, b.STOP_HARDEST);
+				if (!pretending)
+					b.stop_hardest();
+			} else 
+			if (b.needs_harder_action()) {
+				if (verbose)
+					b.print_event(prog, o, b.STOP_HARDER);
+				if (!pretending)
+					b.stop_harder();
+			} else 
+			if (b.needs_initial_action()) {
+				if (verbose)
+					b.print_event(prog, o, b.IS_STOP);
+				if (!pretending)
+					b.stop_initial();
+			}
+			break;
+		}
+	}
+}
+
+/// Timing out transitions all actioned bundles to their next states.
+/// It is also when we notice bundles that became done without their status files changing, such as by being unloaded.
+void
+job_engine::timeout (
+) {
+	for (bundle_pointer_list::iterator i(actioned.begin()); actioned.end() != i; ) {
+		bundle & b(**i);
+		if (!b.done() && b.has_finished())
+			finish(b);
+		if (b.done()) {
+			i = actioned.erase(i);
+			continue;
+		}
+		b.tick();
+		if (b.is_slow())
+			release_slots(b);
+		act(b);
+		++i;
+	}
+}
+
+void
+job_engine::fire_deadlines (
+	uint64_t now
+) {
+	while (!deadlines.empty() && deadlines.top().when <= now) {
+		const pending_deadline d(deadlines.top());
+		deadlines.pop();
+		bundle & b(*d.owner);
+		if (b.done() || b.deadline != d.when) continue;
+		deadline_passed(b);
+	}
+}
+
+/// A bundle that is still starting or stopping when its deadline passes fails, is killed, or is left to carry on without its successors waiting for it.
+void
+job_engine::deadline_passed (
+	bundle & b
+) {
+	b.deadline = 0U;
+	if (b.has_finished()) {
+		finish(b);
+		return;
+	}
+	b.print_event(prog, o, b.TIMED_OUT);
+	switch (b.on_timeout) {
+		case TIMEOUT_KILL:
+			if (0 <= b.supervise_dir_fd && !pretending) {
+				terminate_daemon(b.supervise_dir_fd);
+				continue_daemon(b.supervise_dir_fd);
+				kill_daemon(b.supervise_dir_fd);
+			}
+			// A killed service will soon have stopped, but it will never have started.
+			if (bundle::WANT_STOP == b.wants) break;
+			any_failed = true;
+			retire(b);
+			break;
+		case TIMEOUT_FAIL:
+			any_failed = true;
+			retire(b);
+			break;
+		case TIMEOUT_CONTINUE:
+			retire(b);
+			break;
+	}
+}
+
+void
+job_engine::status_changed (
+	int fd
+) {
+	const status_file_map::const_iterator i(watched.find(fd));
+	if (watched.end() == i) return;
+	bundle & b(*i->second);
+	if (!b.done() && b.has_finished())
+		finish(b);
+}
+
+/// The main enacting loop; where we keep trying to start/stop any remaining services with pending actions until no more are left.
+void
+job_engine::run (
+) {
+	std::vector<struct kevent> revents(256);
+	uint64_t last_activity(monotonic_milliseconds());
+	for (;;) {
+		while (!runnable.empty()) {
+			bundle & b(*runnable.front());
+			runnable.pop_front();
+			if (b.done()) continue;
+			if (b.has_finished()) {
+				finish(b);
+				continue;
+			}
+			if (bundle::WANT_START == b.wants) {
+				start_queues[b.slot_class].waiting.push(&b);
+				continue;
+			}
+			unblock(b);
+			act(b);
+		}
+		admit();
+		if (!runnable.empty()) continue;
+		if (!pending) break;
+		// Wait for an event, for the earliest deadline, or for a whole second without events; whichever comes first.
+		const uint64_t before(monotonic_milliseconds());
+		uint64_t wake(last_activity + 1000U);
+		if (!deadlines.empty())
+			wake = std::min(wake, deadlines.top().when);
+		const uint64_t ms(wake > before ? wake - before : 0U);
+		timespec t;
+		t.tv_sec = ms / 1000U;
+		t.tv_nsec = (ms % 1000U) * 1000000U;
+		const int ne(kevent(queue, 0, 0, revents.data(), revents.size(), &t));
+		const uint64_t after(monotonic_milliseconds());
+		fire_deadlines(after);
+		if (0 < ne) {
+			last_activity = after;
+			for (int i(0); i < ne; ++i) {
+				const struct kevent & e(revents[i]);
+				if (EVFILT_VNODE == e.filter)
+					status_changed(e.ident);
+			}
+		} else
+		if (after >= last_activity + 1000U) {
+			last_activity = after;
+			timeout();
+		}
+	}
+}
+
+/* The timeline *************************************************************
+// **************************************************************************
+// Each bundle in the job records when it reaches each moment of its timeline.
+// Afterwards the timeline is written out as a Chrome trace, for a trace viewer and for analyse-critical-chain, and as an SVG Gantt chart, for a WWW browser.
+// Times are relative to the start of the job.
+*/
+
+static
+std::string
+to_json_string (
+	const std::string & s
+) {
+	std::string r;
+	for (std::string::const_iterator p(s.begin()); s.end() != p; ++p) {
+		const char c(*p);
+		if ('\\' == c || '\"' == c)
+			r += '\\';
+		else
+		if (static_cast<unsigned char>(c) < 0x20) {
+			char buf[8];
+			std::snprintf(buf, sizeof buf, "\\u%04x", static_cast<unsigned char>(c));
+			r += buf;
+			continue;
+		}
+		r += c;
+	}
+	return "\"" + r + "\"";
+}
+
+static
+std::string
+to_xml_string (
+	const std::string & s
+) {
+	std::string r;
+	for (std::string::const_iterator p(s.begin()); s.end() != p; ++p) {
+		const char c(*p);
+		switch (c) {
+			case '&':	r += "&amp;"; break;
+			case '<':	r += "&lt;"; break;
+			case '>':	r += "&gt;"; break;
+			case '\"':	r += "&quot;"; break;
+			default:	r += c; break;
+		}
+	}
+	return r;
+}
+
+static inline
+uint64_t
+relative (
+	uint64_t t,
+	uint64_t origin
+) {
+	return t > origin ? t - origin : 0U;
+}
+
+/// A bundle that never finished ends at the last moment that it reached.
+static inline
+uint64_t
+end_of (
+	const bundle & b
+) {
+	if (b.moments[b.FINISHED]) return b.moments[b.FINISHED];
+	return *std::max_element(b.moments, b.moments + b.MOMENTS);
+}
+
+static inline
+bool
+is_on_timeline (
+	const bundle & b
+) {
+	return bundle::WANT_NONE != b.wants && b.moments[b.QUEUED];
+}
+
+static
+void
+write_chrome_trace (
+	const char * prog,
+	const char * filename,
+	const uint64_t origin,
+	const bundle_pointer_list & sorted
+) {
+	FileStar f(std::fopen(filename, "w"));
+	if (!f) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, filename, std::strerror(error));
+		return;
+	}
+	std::fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	std::fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":%s}}", to_json_string(prog).c_str());
+	unsigned tid(0U);
+	for (bundle_pointer_list::const_iterator i(sorted.begin()); sorted.end() != i; ++i) {
+		const bundle & b(**i);
+		if (!is_on_timeline(b)) continue;
+		++tid;
+		const std::string name(to_json_string(b.path + b.name));
+		const char * action(bundle::WANT_START == b.wants ? "start" : "stop");
+		const uint64_t end(end_of(b));
+		std::fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":%s}}", tid, name.c_str());
+		std::fprintf(f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"sort_index\":%u}}", tid, tid);
+		// The job event spans the bundle's whole time in the job, and carries what analyse-critical-chain needs.
+		std::fprintf(f, ",\n{\"name\":%s,\"cat\":\"job\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"args\":{\"wants\":\"%s\",\"load\":%" PRIu64 ",\"action\":%" PRIu64 ",\"after\":[", 
+			name.c_str(), 
+			tid, 
+			relative(b.moments[b.QUEUED], origin), 
+			relative(end, b.moments[b.QUEUED]), 
+			action, 
+			b.span(b.LOAD_REQUESTED, b.LOADED), 
+			b.span(b.ACTION_REQUESTED, b.FINISHED)
+		);
+		const char * comma("");
+		for (bundle_pointer_set::const_iterator j(b.sort_after.begin()); b.sort_after.end() != j; ++j) {
+			const bundle & p(**j);
+			if (!is_on_timeline(p)) continue;
+			std::fprintf(f, "%s%s", comma, to_json_string(p.path + p.name).c_str());
+			comma = ",";
+		}
+		std::fprintf(f, "]}}");
+		if (b.moments[b.LOAD_REQUESTED] && b.moments[b.LOADED])
+			std::fprintf(f, ",\n{\"name\":\"load\",\"cat\":\"load\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "}", tid, relative(b.moments[b.LOAD_REQUESTED], origin), b.span(b.LOAD_REQUESTED, b.LOADED));
+		if (b.moments[b.ACTION_REQUESTED])
+			std::fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"action\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "}", action, tid, relative(b.moments[b.ACTION_REQUESTED], origin), relative(end, b.moments[b.ACTION_REQUESTED]));
+	}
+	std::fprintf(f, "\n]}\n");
+	if (std::ferror(f) || 0 != std::fclose(f.release())) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, filename, std::strerror(error));
+	}
+}
+
+/// Choose a tick interval for the time axis of 1, 2, or 5 times a power of ten microseconds, that yields at most a dozen or so ticks.
+static inline
+uint64_t
+tick_interval (
+	uint64_t total
+) {
+	uint64_t interval(1U);
+	for (;;) {
+		if (total / interval <= 12U) return interval;
+		if (total / (interval * 2U) <= 12U) return interval * 2U;
+		if (total / (interval * 5U) <= 12U) return interval * 5U;
+		interval *= 10U;
+	}
+}
+
+static
+void
+write_gantt (
+	const char * prog,
+	const char * filename,
+	const uint64_t origin,
+	const bundle_pointer_list & sorted
+) {
+	enum { ROW_HEIGHT = 18, BAR_HEIGHT = 12, AXIS_HEIGHT = 30, CHART_WIDTH = 1000, CHARACTER_WIDTH = 7, MAX_LABEL_CHARACTERS = 80 };
+
+	std::size_t rows(0U), label_characters(0U);
+	uint64_t total(1U);
+	for (bundle_pointer_list::const_iterator i(sorted.begin()); sorted.end() != i; ++i) {
+		const bundle & b(**i);
+		if (!is_on_timeline(b)) continue;
+		++rows;
+		label_characters = std::max(label_characters, b.path.length() + b.name.length());
+		total = std::max(total, relative(end_of(b), origin));
+	}
+	const unsigned left(static_cast<unsigned>(std::min<std::size_t>(label_characters, MAX_LABEL_CHARACTERS)) * CHARACTER_WIDTH + 10U);
+	const unsigned width(left + CHART_WIDTH + 20U), height(AXIS_HEIGHT + rows * ROW_HEIGHT + 10U);
+
+	FileStar f(std::fopen(filename, "w"));
+	if (!f) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, filename, std::strerror(error));
+		return;
+	}
+	std::fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	std::fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%u\" height=\"%u\" font-family=\"monospace\" font-size=\"11\">\n", width, height);
+	std::fprintf(f, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+
+	// The time axis, with a grid line at each tick.
+	const uint64_t interval(tick_interval(total));
+	for (uint64_t t(0U); t <= total; t += interval) {
+		const double x(left + double(t) * CHART_WIDTH / double(total));
+		std::fprintf(f, "<line x1=\"%.1f\" y1=\"%u\" x2=\"%.1f\" y2=\"%u\" stroke=\"#dddddd\"/>\n", x, AXIS_HEIGHT - 5U, x, height);
+		std::fprintf(f, "<text x=\"%.1f\" y=\"%u\" text-anchor=\"middle\">%.3fs</text>\n", x, AXIS_HEIGHT - 10U, double(t) / 1000000.0);
+	}
+
+	// One row per bundle: the time queued, loading, and starting or stopping.
+	unsigned y(AXIS_HEIGHT);
+	for (bundle_pointer_list::const_iterator i(sorted.begin()); sorted.end() != i; ++i) {
+		const bundle & b(**i);
+		if (!is_on_timeline(b)) continue;
+		const bool starting(bundle::WANT_START == b.wants);
+		const uint64_t end(relative(end_of(b), origin));
+		const unsigned bar_y(y + (ROW_HEIGHT - BAR_HEIGHT) / 2U);
+		std::fprintf(f, "<g><title>%s: %s, loaded in %.3fs, %s in %.3fs</title>\n", 
+			to_xml_string(b.path + b.name).c_str(), 
+			starting ? "start" : "stop", 
+			double(b.span(b.LOAD_REQUESTED, b.LOADED)) / 1000000.0, 
+			starting ? "ready" : "done", 
+			double(b.span(b.ACTION_REQUESTED, b.FINISHED)) / 1000000.0
+		);
+		std::fprintf(f, "<text x=\"%u\" y=\"%u\" text-anchor=\"end\">%s</text>\n", left - 5U, y + ROW_HEIGHT - 5U, to_xml_string(b.path + b.name).c_str());
+		const uint64_t queued(relative(b.moments[b.QUEUED], origin));
+		std::fprintf(f, "<rect x=\"%.1f\" y=\"%u\" width=\"%.1f\" height=\"%u\" fill=\"#eeeeee\"/>\n", left + double(queued) * CHART_WIDTH / double(total), bar_y, double(end - queued) * CHART_WIDTH / double(total), unsigned(BAR_HEIGHT));
+		if (b.moments[b.LOAD_REQUESTED] && b.moments[b.LOADED]) {
+			const uint64_t start(relative(b.moments[b.LOAD_REQUESTED], origin));
+			std::fprintf(f, "<rect x=\"%.1f\" y=\"%u\" width=\"%.1f\" height=\"%u\" fill=\"#6699cc\"/>\n", left + double(start) * CHART_WIDTH / double(total), bar_y, double(b.span(b.LOAD_REQUESTED, b.LOADED)) * CHART_WIDTH / double(total), unsigned(BAR_HEIGHT));
+		}
+		if (b.moments[b.ACTION_REQUESTED]) {
+			const uint64_t start(relative(b.moments[b.ACTION_REQUESTED], origin));
+			std::fprintf(f, "<rect x=\"%.1f\" y=\"%u\" width=\"%.1f\" height=\"%u\" fill=\"%s\"/>\n", left + double(start) * CHART_WIDTH / double(total), bar_y, double(end - start) * CHART_WIDTH / double(total), unsigned(BAR_HEIGHT), starting ? "#66aa66" : "#cc6666");
+		}
+		std::fprintf(f, "</g>\n");
+		y += ROW_HEIGHT;
+	}
+	std::fprintf(f, "</svg>\n");
+	if (std::ferror(f) || 0 != std::fclose(f.release())) {
+		const int error(errno);
+		std::fprintf(stderr, "%s: ERROR: %s: %s\n", prog, filename, std::strerror(error));
+	}
 }
 
 /* System control subcommands ***********************************************
@@ -502,6 +1441,19 @@ start_stop_common [[gnu::noreturn]] (
 	int want,
 	bool colours
 ) {
+	const uint64_t origin(monotonic_microseconds());
+	concurrency_limit_map class_limits;
+	for (popt::string_pair_list_definition::list_type::const_iterator i(class_limit_options.begin()); class_limit_options.end() != i; ++i) {
+		const char * const s(i->second.c_str());
+		char * end;
+		const unsigned long n(std::strtoul(s, &end, 0));
+		if (end == s || *end) {
+			std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, s, "Not a number.");
+			throw static_cast<int>(EXIT_USAGE);
+		}
+		class_limits[i->first] = n;
+	}
+
 	TerminalCapabilities caps(envs);
 	ECMA48Output o(caps, stderr, true /* C1 is 7-bit aliased */);
 	if (!colours)
@@ -518,31 +1470,33 @@ start_stop_common [[gnu::noreturn]] (
 	if (0 > socket_fd.get()) throw EXIT_FAILURE;
 
 	// Create the list of primary target bundles from the command-line arguments, then add in all of the bundles that they relate to.
+	// The relation subdirectories are read through the bundle graph cache, which only reads those that have changed since they were cached.
 	bundle_info_map bundles;
+	BundleGraphCache cache(!per_user_mode);
 	add_primary_target_bundles(prog, envs, bundles, args, want);
-	for (;;) {
-		bool done_one(false);
-		for (bundle_info_map::iterator i(bundles.begin()); bundles.end() != i; ++i) {
-			if (!i->second.ss_scanned) {
-				i->second.ss_scanned = true;
-				switch (i->second.wants) {
-					case bundle::WANT_NONE:
-						break;
-					case bundle::WANT_START:
-						add_related_bundles(bundles, i->second, "wants/", START);
-						add_related_bundles(bundles, i->second, "conflicts/", STOP);
-						break;
-					case bundle::WANT_STOP:
+	// Each bundle is scanned once, when it is taken off the work list, rather than by repeatedly sweeping the whole map.
+	bundle_pointer_vector unscanned;
+	for (bundle_info_map::iterator i(bundles.begin()); bundles.end() != i; ++i)
+		unscanned.push_back(&i->second);
+	while (!unscanned.empty()) {
+		bundle & b(*unscanned.back());
+		unscanned.pop_back();
+		if (b.ss_scanned) continue;
+		b.ss_scanned = true;
+		switch (b.wants) {
+			case bundle::WANT_NONE:
+				break;
+			case bundle::WANT_START:
+				add_related_bundles(bundles, unscanned, cache, b, BundleGraphCache::WANTS, START);
+				add_related_bundles(bundles, unscanned, cache, b, BundleGraphCache::CONFLICTS, STOP);
+				break;
+			case bundle::WANT_STOP:
 #if 0 /// TODO \todo Maybe, in the future.
-						add_related_bundles(bundles, i->second, "on-stop/", START);
+				add_related_bundles(bundles, unscanned, cache, b, BundleGraphCache::ON_STOP, START);
 #endif
-						add_related_bundles(bundles, i->second, "required-by/", STOP);
-						break;
-				}
-				done_one = true;
-			}
+				add_related_bundles(bundles, unscanned, cache, b, BundleGraphCache::REQUIRED_BY, STOP);
+				break;
 		}
-		if (!done_one) break;
 	}
 
 	// Check that we aren't starting and stopping a bundle at the same time.
@@ -565,8 +1519,8 @@ start_stop_common [[gnu::noreturn]] (
 	// This is complicated by the fact that ordering depends from whether a predecessor/successor is being started or stopped and whether this bundle is being started or stopped.
 	bundle_pointer_set unsorted;
 	for (bundle_info_map::iterator i(bundles.begin()); bundles.end() != i; ++i) {
-		const bundle_pointer_set a(lookup_without_adding(bundles, i->second, "after/"));
-		const bundle_pointer_set b(lookup_without_adding(bundles, i->second, "before/"));
+		const bundle_pointer_set a(lookup_without_adding(bundles, cache, i->second, BundleGraphCache::AFTER));
+		const bundle_pointer_set b(lookup_without_adding(bundles, cache, i->second, BundleGraphCache::BEFORE));
 		switch (i->second.wants) {
 			case bundle::WANT_START:
 				for (bundle_pointer_set::const_iterator j(a.begin()); a.end() != j; ++j) {
@@ -625,15 +1579,14 @@ start_stop_common [[gnu::noreturn]] (
 		}
 		unsorted.insert(&i->second);
 	}
+	cache.save();
 
 	// Do a topological sort on the bundles.
-	// This isn't strictly necessary, as checks in the enacting loop will ensure that no bundle has action taken if a predecessor action has yet to happen.
-	// But for large targets, with lots of prerequisites, this yields a consistent and fairly sensible ordering of actions in the log output, for humans.
-	for (bundle_pointer_set::const_iterator i(unsorted.begin()); unsorted.end() != i; ++i)
-		mark_paths_in_order(0, *i);
+	// This guarantees that every bundle comes after its predecessors, which the job engine relies upon when counting the predecessors that block each bundle.
+	// For large targets, with lots of prerequisites, it also yields a consistent and fairly sensible ordering of actions in the log output, for humans.
 	bundle_pointer_list sorted;
-	for (bundle_pointer_set::const_iterator i(unsorted.begin()); unsorted.end() != i; ++i)
-		insertion_sort(sorted, *i);
+	topological_sort(prog, unsorted, sorted);
+	measure_downstream_chains(sorted);
 
 	// Make the various "supervise" directories, if they are in a RAM volume, and open file descriptors for them.
 	umask(0022);
@@ -641,6 +1594,7 @@ start_stop_common [[gnu::noreturn]] (
 	for (bundle_pointer_list::const_iterator i(sorted.begin()); sorted.end() != i; ++i) {
 		bundle & b(**i);
 		if (bundle::WANT_NONE == b.wants) continue;
+		b.stamp(b.QUEUED);
 		make_symlink_target(b.bundle_dir_fd, "supervise", 0755);
 		make_supervise (b.bundle_dir_fd);
 		b.supervise_dir_fd = open_supervise_dir(b.bundle_dir_fd);
@@ -658,36 +1612,32 @@ start_stop_common [[gnu::noreturn]] (
 	// Load any services (into the service manager) that are about to be started but that are not already loaded.
 	// Do the same for their log services, even if those log services are not part of the calculated bundle set.
 	// This is because the service manager must have the log service loaded in order to plumb the main service's output to the right place, even if the log service isn't being acted upon here.
-	bool any_not_loaded(false);
+	// These are all sent to the service manager in batches, rather than one at a time, with several batches in flight at once.
+	load_pipeline pipeline(prog, queue.get(), socket_fd.get());
 	for (bundle_pointer_list::const_iterator i(sorted.begin()); sorted.end() != i; ++i) {
 		bundle & b(**i);
 		if (bundle::WANT_START != b.wants) continue;
 		if (0 > b.supervise_dir_fd) continue;
 
-		if (!load(prog, o, b, socket_fd.get(), b.supervise_dir_fd, b.service_dir_fd, b.name, b.LOAD, b.RUN_ON_EMPTY)) {
-			std::fprintf(stderr, "%s: ERROR: %s/%s/%s: %s\n", prog, b.path.c_str(), b.name.c_str(), "ok", "Unable to load service bundle.");
-			if (b.primary_target)
-				any_not_loaded = true;
-			else
-				b.wants = b.WANT_NONE;
-			continue;
-		}
+		// A bundle and its log take at most nine operations, plus one for each listening socket.
+		if (!pipeline.batch.has_room_for(9U + 2U * service_manager_rpc_message::MAX_LISTEN_SOCKETS))
+			pipeline.send();
+
+		load(prog, o, b, pipeline.batch, pipeline.loads, b.supervise_dir_fd, b.service_dir_fd, b.name, b.LOAD, b.RUN_ON_EMPTY, false);
 		const FileDescriptorOwner log_bundle_dir_fd(open_dir_at(b.bundle_dir_fd, "log/"));
 		if (0 <= log_bundle_dir_fd.get()) {
 			const FileDescriptorOwner log_supervise_dir_fd(open_supervise_dir(log_bundle_dir_fd.get()));
 			const FileDescriptorOwner log_service_dir_fd(open_service_dir(log_bundle_dir_fd.get()));
 			if (0 <= log_supervise_dir_fd.get() && 0 <= log_service_dir_fd.get()) {
 				const std::string log_name(b.name + "/log");
-				if (!load(prog, o, b, socket_fd.get(), log_supervise_dir_fd.get(), log_service_dir_fd.get(), log_name, b.LOG_LOAD, b.LOG_RUN_ON_EMPTY)) {
-					std::fprintf(stderr, "%s: ERROR: %s/%s/%s: %s\n", prog, b.path.c_str(), log_name.c_str(), "ok", "Unable to load service bundle.");
-					continue;
-				}
+				load(prog, o, b, pipeline.batch, pipeline.loads, log_supervise_dir_fd.get(), log_service_dir_fd.get(), log_name, b.LOG_LOAD, b.LOG_RUN_ON_EMPTY, true);
+				// The service manager enacts a batch in order, so this happens after both loads, and fails harmlessly if either failed.
 				if (!pretending)
-					plumb(prog, socket_fd.get(), b.supervise_dir_fd, log_supervise_dir_fd.get());
+					pipeline.batch.plumb(b.supervise_dir_fd, log_supervise_dir_fd.get());
 			}
 		}
 	}
-	if (any_not_loaded) throw EXIT_FAILURE;
+	if (!pipeline.finish()) throw EXIT_FAILURE;
 
 	// Open all of the status files.
 	bool any_status_not_opened(false);
@@ -706,125 +1656,17 @@ start_stop_common [[gnu::noreturn]] (
 	}
 	if (any_status_not_opened) throw EXIT_FAILURE;
 
-	// The main enacting loop; where we keep trying to start/stop any remaining services with pending actions until no more are left.
-	timespec one_second;
-	bool timed_out(true);
-	one_second.tv_sec = 1;
-	one_second.tv_nsec = 0;
-	std::vector<struct kevent> revents(256);
-	for (;;) {
-		bool any_more_pending(false);
-		for (bundle_pointer_list::const_iterator i(sorted.begin()); sorted.end() != i; ++i) {
-			bundle & b(**i);
-			
-			// Check for any outward transitions that we can make.
-
-			// Finishing the action transitions the state machine to the done state from any state.
-			if (!b.done()) {
-				bool is_done(true);
-				switch (b.wants) {
-					case bundle::WANT_START:	is_done = b.has_started(); break;
-					case bundle::WANT_STOP:		is_done = b.has_stopped(); break;
-				}
-				if (is_done) {
-					if (verbose)
-						b.print_event(prog, o, bundle::WANT_START == b.wants ? b.IS_READY: b.IS_DONE);
-					b.mark_done();
-					struct kevent k;
-					set_event(&k, b.status_file_fd, EVFILT_VNODE, EV_DELETE|EV_DISABLE, NOTE_WRITE, 0, 0);
-					kevent(queue.get(), &k, 1, 0, 0, 0);
-				}
-			}
-			if (b.done()) continue;
-			any_more_pending = true;
-			if (b.blocked()) {
-				// All dependencies finishing causes transition from BLOCKED to ACTIONED.
-				bool is_blocked(false);
-				const bundle_pointer_set & a(b.sort_after);
-				for (bundle_pointer_set::const_iterator j(a.begin()); a.end() != j; ++j) {
-					bundle * p(*j);
-					if (!p->done()) {
-						if (verbose && b.initial()) {
-							b.print_event(prog, o, b.IS_BLOCKED);
-							p->print_event(prog, o, p->IS_BLOCKING);
-						}
-						is_blocked = true;
-						break;
-					}
-				}
-				if (is_blocked) {
-					if (b.initial())
-						b.mark_blocked();
-					continue;
-				}
-				if (verbose)
-					b.print_event(prog, o, b.IS_UNBLOCKED);
-				b.mark_unblocked();
-				struct kevent k;
-				set_event(&k, b.status_file_fd, EVFILT_VNODE, EV_ADD|EV_ENABLE|EV_CLEAR, NOTE_WRITE, 0, 0);
-				kevent(queue.get(), &k, 1, 0, 0, 0);
-			} else {
-				// Timing out transitions all states at ACTIONED and above to the next state.
-				if (!timed_out) continue;
-				b.tick();
-			}
+	job_engine engine(prog, o, queue.get(), max_concurrent, class_limits);
+	for (bundle_pointer_list::const_iterator i(sorted.begin()); sorted.end() != i; ++i)
+		engine.add(**i);
+	engine.run();
 
-			// At this point, we have just transitioned into a new state.
-			// Check for actions on entering the state.
-
-			if (b.needs_action()) {
-				switch (b.wants) {
-					case bundle::WANT_START:
-					{
-						if (0 > b.supervise_dir_fd) break;
-						const bool was_already_loaded(is_ok(b.supervise_dir_fd));
-						if (!was_already_loaded)
-							b.print_event(prog, o, b.CANNOT_START);
-						else 
-						if (b.needs_initial_action()) {
-							if (verbose)
-								b.print_event(prog, o, b.IS_START);
-							if (!pretending)
-								b.start_initial();
-						}
-						break;
-					}
-					case bundle::WANT_STOP:
-					{
-						if (0 > b.supervise_dir_fd) break;
-						const bool was_already_loaded(is_ok(b.supervise_dir_fd));
-						if (!was_already_loaded)
-							b.print_event(prog, o, b.CANNOT_STOP);
-						else
-						if (b.needs_hardest_action()) {
-							if (verbose)
-								b.print_event(prog, o, b.STOP_HARDEST);
-							if (!pretending)
-								b.stop_hardest();
-						} else 
-						if (b.needs_harder_action()) {
-							if (verbose)
-								b.print_event(prog, o, b.STOP_HARDER);
-							if (!pretending)
-								b.stop_harder();
-						} else 
-						if (b.needs_initial_action()) {
-							if (verbose)
-								b.print_event(prog, o, b.IS_STOP);
-							if (!pretending)
-								b.stop_initial();
-						}
-						break;
-					}
-				}
-			}
-		}
-		if (!any_more_pending) break;
-		const int ne(kevent(queue.get(), 0, 0, revents.data(), revents.size(), &one_second));
-		timed_out = 0 == ne;
-	}
+	if (timeline_filename)
+		write_chrome_trace(prog, timeline_filename, origin, sorted);
+	if (gantt_filename)
+		write_gantt(prog, gantt_filename, origin, sorted);
 
-	throw EXIT_SUCCESS;
+	throw engine.failed() ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 void
@@ -840,11 +1682,19 @@ activate [[gnu::noreturn]] (
 		popt::bool_definition colours_option('\0', "colour", "Force output in colour even if standard error is not a terminal.", colours);
 		popt::bool_definition verbose_option('v', "verbose", "Display verbose information.", verbose);
 		popt::bool_definition pretending_option('n', "pretend", "Pretend to take action, without telling the service manager to do anything.", pretending);
+		popt::string_definition timeline_option('\0', "timeline", "filename", "Record the timeline of the job as a Chrome trace in this file.", timeline_filename);
+		popt::string_definition gantt_option('\0', "gantt", "filename", "Record the timeline of the job as an SVG Gantt chart in this file.", gantt_filename);
+		popt::unsigned_number_definition max_concurrent_option('\0', "max-concurrent", "number", "Start at most this many services at once.", max_concurrent, 0);
+		popt::string_pair_list_definition class_limit_option('\0', "class-limit", "class number", "Start at most this many services of this concurrency class at once.", class_limit_options);
 		popt::definition * main_table[] = {
 			&user_option,
 			&colours_option,
 			&verbose_option,
-			&pretending_option
+			&pretending_option,
+			&timeline_option,
+			&gantt_option,
+			&max_concurrent_option,
+			&class_limit_option
 		};
 		popt::top_table_definition main_option(sizeof main_table/sizeof *main_table, main_table, "Main options", "[service(s)...]");
 
@@ -875,11 +1725,19 @@ deactivate [[gnu::noreturn]] (
 		popt::bool_definition colours_option('\0', "colour", "Force output in colour even if standard error is not a terminal.", colours);
 		popt::bool_definition verbose_option('v', "verbose", "Display verbose information.", verbose);
 		popt::bool_definition pretending_option('n', "pretend", "Pretend to take action, without telling the service manager to do anything.", pretending);
+		popt::string_definition timeline_option('\0', "timeline", "filename", "Record the timeline of the job as a Chrome trace in this file.", timeline_filename);
+		popt::string_definition gantt_option('\0', "gantt", "filename", "Record the timeline of the job as an SVG Gantt chart in this file.", gantt_filename);
+		popt::unsigned_number_definition max_concurrent_option('\0', "max-concurrent", "number", "Start at most this many services at once.", max_concurrent, 0);
+		popt::string_pair_list_definition class_limit_option('\0', "class-limit", "class number", "Start at most this many services of this concurrency class at once.", class_limit_options);
 		popt::definition * main_table[] = {
 			&user_option,
 			&colours_option,
 			&verbose_option,
-			&pretending_option
+			&pretending_option,
+			&timeline_option,
+			&gantt_option,
+			&max_concurrent_option,
+			&class_limit_option
 		};
 		popt::top_table_definition main_option(sizeof main_table/sizeof *main_table, main_table, "Main options", "[service(s)...]");
 
@@ -910,11 +1768,19 @@ isolate [[gnu::noreturn]] (
 		popt::bool_definition colours_option('\0', "colour", "Force output in colour even if standard error is not a terminal.", colours);
 		popt::bool_definition verbose_option('v', "verbose", "Display verbose information.", verbose);
 		popt::bool_definition pretending_option('n', "pretend", "Pretend to take action, without telling the service manager to do anything.", pretending);
+		popt::string_definition timeline_option('\0', "timeline", "filename", "Record the timeline of the job as a Chrome trace in this file.", timeline_filename);
+		popt::string_definition gantt_option('\0', "gantt", "filename", "Record the timeline of the job as an SVG Gantt chart in this file.", gantt_filename);
+		popt::unsigned_number_definition max_concurrent_option('\0', "max-concurrent", "number", "Start at most this many services at once.", max_concurrent, 0);
+		popt::string_pair_list_definition class_limit_option('\0', "class-limit", "class number", "Start at most this many services of this concurrency class at once.", class_limit_options);
 		popt::definition * main_table[] = {
 			&user_option,
 			&colours_option,
 			&verbose_option,
-			&pretending_option
+			&pretending_option,
+			&timeline_option,
+			&gantt_option,
+			&max_concurrent_option,
+			&class_limit_option
 		};
 		popt::top_table_definition main_option(sizeof main_table/sizeof *main_table, main_table, "Main options", "[service(s)...]");
 
@@ -945,11 +1811,19 @@ reset [[gnu::noreturn]] (
 		popt::bool_definition colours_option('\0', "colour", "Force output in colour even if standard error is not a terminal.", colours);
 		popt::bool_definition verbose_option('v', "verbose", "Display verbose information.", verbose);
 		popt::bool_definition pretending_option('n', "pretend", "Pretend to take action, without telling the service manager to do anything.", pretending);
+		popt::string_definition timeline_option('\0', "timeline", "filename", "Record the timeline of the job as a Chrome trace in this file.", timeline_filename);
+		popt::string_definition gantt_option('\0', "gantt", "filename", "Record the timeline of the job as an SVG Gantt chart in this file.", gantt_filename);
+		popt::unsigned_number_definition max_concurrent_option('\0', "max-concurrent", "number", "Start at most this many services at once.", max_concurrent, 0);
+		popt::string_pair_list_definition class_limit_option('\0', "class-limit", "class number", "Start at most this many services of this concurrency class at once.", class_limit_options);
 		popt::definition * main_table[] = {
 			&user_option,
 			&colours_option,
 			&verbose_option,
-			&pretending_option
+			&pretending_option,
+			&timeline_option,
+			&gantt_option,
+			&max_concurrent_option,
+			&class_limit_option
 		};
 		popt::top_table_definition main_option(sizeof main_table/sizeof *main_table, main_table, "Main options", "[service(s)...]");
 
@@ -0,0 +1,463 @@
+/* COPYING ******************************************************************
+For copyright and licensing terms, see the file named COPYING.
+// **************************************************************************
+*/
+
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include "utils.h"
+#include "popt.h"
+#include "FileStar.h"
+
+/* A minimal JSON reader ****************************************************
+// **************************************************************************
+// This reads just enough JSON for Chrome trace files, which are a single value.
+// Numbers are read as doubles, which is exact for microsecond timestamps.
+*/
+
+namespace {
+
+struct json_value {
+	enum type { NONE, NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+	json_value() : kind(NONE), number(0.0), string(), elements(), members() {}
+
+	type kind;
+	double number;
+	std::string string;
+	std::vector<json_value> elements;
+	std::vector<std::pair<std::string, json_value> > members;
+
+	/// \returns the named member of an object, or a value of type NONE if there is no such member
+	const json_value & member(const char *) const;
+};
+
+struct json_reader {
+	json_reader(const std::string & t) : text(t), pos(0U) {}
+	/// \returns false if the text is not a single JSON value
+	bool read(json_value &);
+protected:
+	const std::string & text;
+	std::size_t pos;
+
+	void skip_whitespace();
+	bool literal(const char *);
+	bool value(json_value &);
+	bool string(std::string &);
+	bool number(double &);
+	bool array(std::vector<json_value> &);
+	bool object(std::vector<std::pair<std::string, json_value> > &);
+	static void append_utf8(std::string &, unsigned long);
+};
+
+}
+
+const json_value &
+json_value::member (
+	const char * name
+) const {
+	static const json_value none;
+	for (std::vector<std::pair<std::string, json_value> >::const_iterator i(members.begin()); members.end() != i; ++i)
+		if (i->first == name)
+			return i->second;
+	return none;
+}
+
+bool
+json_reader::read (
+	json_value & v
+) {
+	if (!value(v)) return false;
+	skip_whitespace();
+	return text.length() == pos;
+}
+
+void
+json_reader::skip_whitespace (
+) {
+	while (pos < text.length() && (' ' == text[pos] || '\t' == text[pos] || '\n' == text[pos] || '\r' == text[pos]))
+		++pos;
+}
+
+bool
+json_reader::literal (
+	const char * l
+) {
+	const std::size_t n(std::strlen(l));
+	if (0 != text.compare(pos, n, l)) return false;
+	pos += n;
+	return true;
+}
+
+bool
+json_reader::value (
+	json_value & v
+) {
+	skip_whitespace();
+	if (pos >= text.length()) return false;
+	switch (text[pos]) {
+		case '{':	v.kind = v.OBJECT; return object(v.members);
+		case '[':	v.kind = v.ARRAY; return array(v.elements);
+		case '\"':	v.kind = v.STRING; return string(v.string);
+		case 't':	v.kind = v.BOOLEAN; v.number = 1.0; return literal("true");
+		case 'f':	v.kind = v.BOOLEAN; v.number = 0.0; return literal("false");
+		case 'n':	v.kind = v.NUL; return literal("null");
+		default:	v.kind = v.NUMBER; return number(v.number);
+	}
+}
+
+void
+json_reader::append_utf8 (
+	std::string & s,
+	unsigned long c
+) {
+	if (c < 0x80) {
+		s += char(c);
+	} else
+	if (c < 0x800) {
+		s += char(0xC0 | (c >> 6));
+		s += char(0x80 | (c & 0x3F));
+	} else
+	if (c < 0x10000) {
+		s += char(0xE0 | (c >> 12));
+		s += char(0x80 | ((c >> 6) & 0x3F));
+		s += char(0x80 | (c & 0x3F));
+	} else
+	{
+		s += char(0xF0 | (c >> 18));
+		s += char(0x80 | ((c >> 12) & 0x3F));
+		s += char(0x80 | ((c >> 6) & 0x3F));
+		s += char(0x80 | (c & 0x3F));
+	}
+}
+
+bool
+json_reader::string (
+	std::string & s
+) {
+	if (!literal("\"")) return false;
+	while (pos < text.length()) {
+		const char c(text[pos++]);
+		if ('\"' == c) return true;
+		if ('\\' != c) {
+			s += c;
+			continue;
+		}
+		if (pos >= text.length()) return false;
+		switch (text[pos++]) {
+			case '\"':	s += '\"'; break;
+			case '\\':	s += '\\'; break;
+			case '/':	s += '/'; break;
+			case 'b':	s += '\b'; break;
+			case 'f':	s += '\f'; break;
+			case 'n':	s += '\n'; break;
+			case 'r':	s += '\r'; break;
+			case 't':	s += '\t'; break;
+			case 'u':
+			{
+				if (pos + 4U > text.length()) return false;
+				const std::string hex(text.substr(pos, 4U));
+				char * end(0);
+				unsigned long c16(std::strtoul(hex.c_str(), &end, 16));
+				if (*end) return false;
+				pos += 4U;
+				// A surrogate pair is two escapes that together make one character.
+				if (0xD800 <= c16 && c16 < 0xDC00 && pos + 6U <= text.length() && 0 == text.compare(pos, 2U, "\\u")) {
+					const std::string low_hex(text.substr(pos + 2U, 4U));
+					const unsigned long low(std::strtoul(low_hex.c_str(), &end, 16));
+					if (!*end && 0xDC00 <= low && low < 0xE000) {
+						c16 = 0x10000 + ((c16 - 0xD800) << 10) + (low - 0xDC00);
+						pos += 6U;
+					}
+				}
+				append_utf8(s, c16);
+				break;
+			}
+			default:	return false;
+		}
+	}
+	return false;
+}
+
+bool
+json_reader::number (
+	double & d
+) {
+	const char * begin(text.c_str() + pos);
+	char * end(0);
+	d = std::strtod(begin, &end);
+	if (end == begin) return false;
+	pos += end - begin;
+	return true;
+}
+
+bool
+json_reader::array (
+	std::vector<json_value> & elements
+) {
+	if (!literal("[")) return false;
+	skip_whitespace();
+	if (literal("]")) return true;
+	for (;;) {
+		elements.push_back(json_value());
+		if (!value(elements.back())) return false;
+		skip_whitespace();
+		if (literal("]")) return true;
+		if (!literal(",")) return false;
+	}
+}
+
+bool
+json_reader::object (
+	std::vector<std::pair<std::string, json_value> > & members
+) {
+	if (!literal("{")) return false;
+	skip_whitespace();
+	if (literal("}")) return true;
+	for (;;) {
+		skip_whitespace();
+		members.push_back(std::pair<std::string, json_value>());
+		if (!string(members.back().first)) return false;
+		skip_whitespace();
+		if (!literal(":")) return false;
+		if (!value(members.back().second)) return false;
+		skip_whitespace();
+		if (literal("}")) return true;
+		if (!literal(",")) return false;
+	}
+}
+
+/* Critical chain analysis **************************************************
+// **************************************************************************
+// start-stop-service --timeline records one "job" event per bundle, spanning its whole time in the job.
+// Its arguments give the time taken to load the bundle and to act upon it, and the bundles that it was ordered after.
+// The critical chain is the chain of orderings with the greatest total time spent acting, which is what bounds how quickly the whole job can complete.
+*/
+
+namespace {
+
+struct job {
+	job() : name(), ready(0U), load(0U), action(0U), after(), chain(0U), critical_predecessor(NONE), state(UNVISITED) {}
+	enum { NONE = static_cast<std::size_t>(-1) };
+	enum { UNVISITED, VISITING, VISITED };
+
+	std::string name;
+	uint64_t ready, load, action;	///< in microseconds
+	std::vector<std::size_t> after;
+	uint64_t chain;		///< the total action time of the heaviest chain ending in this job, inclusive
+	std::size_t critical_predecessor;
+	int state;
+};
+typedef std::vector<job> job_list;
+
+struct by_blame {
+	by_blame(const job_list & j) : jobs(j) {}
+	bool operator() (std::size_t a, std::size_t b) const { return jobs[a].load + jobs[a].action > jobs[b].load + jobs[b].action; }
+	const job_list & jobs;
+};
+
+}
+
+static inline
+uint64_t
+microseconds (
+	const json_value & v
+) {
+	return json_value::NUMBER == v.kind && v.number > 0.0 ? static_cast<uint64_t>(v.number + 0.5) : 0U;
+}
+
+static inline
+double
+seconds (
+	uint64_t us
+) {
+	return double(us) / 1000000.0;
+}
+
+static
+void
+read_jobs (
+	const json_value & trace,
+	job_list & jobs
+) {
+	// The trace is either an object with a traceEvents array, or just the array.
+	const json_value & events(json_value::OBJECT == trace.kind ? trace.member("traceEvents") : trace);
+	std::map<std::string, std::size_t> index_of;
+	std::vector<std::vector<std::string> > afters;
+	for (std::vector<json_value>::const_iterator i(events.elements.begin()); events.elements.end() != i; ++i) {
+		const json_value & e(*i);
+		if ("job" != e.member("cat").string || "X" != e.member("ph").string) continue;
+		const json_value & args(e.member("args"));
+		job j;
+		j.name = e.member("name").string;
+		j.ready = microseconds(e.member("ts")) + microseconds(e.member("dur"));
+		j.load = microseconds(args.member("load"));
+		j.action = microseconds(args.member("action"));
+		std::vector<std::string> after;
+		const json_value & a(args.member("after"));
+		for (std::vector<json_value>::const_iterator k(a.elements.begin()); a.elements.end() != k; ++k)
+			after.push_back(k->string);
+		index_of[j.name] = jobs.size();
+		jobs.push_back(j);
+		afters.push_back(after);
+	}
+	for (std::size_t i(0U); i < jobs.size(); ++i) {
+		for (std::vector<std::string>::const_iterator k(afters[i].begin()); afters[i].end() != k; ++k) {
+			const std::map<std::string, std::size_t>::const_iterator p(index_of.find(*k));
+			if (index_of.end() != p)
+				jobs[i].after.push_back(p->second);
+		}
+	}
+}
+
+/// Weigh the heaviest chain ending in each job.
+/// This is a depth-first search with an explicit stack, as chains can be thousands of bundles long.
+/// Recorded orderings never loop, as start-stop-service breaks loops before acting; but an edited trace might, and any ordering that closes a loop is ignored.
+static
+void
+weigh_chains (
+	job_list & jobs
+) {
+	std::vector<std::size_t> stack;
+	for (std::size_t r(0U); r < jobs.size(); ++r) {
+		if (job::UNVISITED != jobs[r].state) continue;
+		stack.push_back(r);
+		while (!stack.empty()) {
+			job & j(jobs[stack.back()]);
+			if (job::UNVISITED == j.state) {
+				j.state = job::VISITING;
+				for (std::vector<std::size_t>::const_iterator p(j.after.begin()); j.after.end() != p; ++p)
+					if (job::UNVISITED == jobs[*p].state)
+						stack.push_back(*p);
+				continue;
+			}
+			stack.pop_back();
+			if (job::VISITED == j.state) continue;
+			j.chain = 0U;
+			for (std::vector<std::size_t>::const_iterator p(j.after.begin()); j.after.end() != p; ++p) {
+				const job & predecessor(jobs[*p]);
+				if (job::VISITED != predecessor.state) continue;
+				if (job::NONE == j.critical_predecessor || predecessor.chain > j.chain) {
+					j.chain = predecessor.chain;
+					j.critical_predecessor = *p;
+				}
+			}
+			j.chain += j.action;
+			j.state = job::VISITED;
+		}
+	}
+}
+
+/* System control subcommands ***********************************************
+// **************************************************************************
+*/
+
+void
+analyse_critical_chain [[gnu::noreturn]] (
+	const char * & next_prog,
+	std::vector<const char *> & args,
+	ProcessEnvironment & /*envs*/
+) {
+	const char * prog(basename_of(args[0]));
+	unsigned long blame_count(0UL);
+	try {
+		popt::unsigned_number_definition blame_option('\0', "blame", "count", "List only this many bundles in the blame list.", blame_count, 0);
+		popt::definition * main_table[] = {
+			&blame_option
+		};
+		popt::top_table_definition main_option(sizeof main_table/sizeof *main_table, main_table, "Main options", "{trace-file}");
+
+		std::vector<const char *> new_args;
+		popt::arg_processor<const char **> p(args.data() + 1, args.data() + args.size(), prog, main_option, new_args);
+		p.process(true /* strictly options before arguments */);
+		args = new_args;
+		next_prog = arg0_of(args);
+		if (p.stopped()) throw EXIT_SUCCESS;
+	} catch (const popt::error & e) {
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, e.arg, e.msg);
+		throw static_cast<int>(EXIT_USAGE);
+	}
+
+	if (args.empty()) {
+		std::fprintf(stderr, "%s: FATAL: %s\n", prog, "Missing trace file name.");
+		throw static_cast<int>(EXIT_USAGE);
+	}
+	const char * filename(args.front());
+	args.erase(args.begin());
+	if (!args.empty()) {
+		std::fprintf(stderr, "%s: FATAL: %s\n", prog, "Unexpected argument(s).");
+		throw static_cast<int>(EXIT_USAGE);
+	}
+
+	std::string text;
+	{
+		FileStar f(std::fopen(filename, "r"));
+		if (!f) {
+			const int error(errno);
+			std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, filename, std::strerror(error));
+			throw EXIT_FAILURE;
+		}
+		char buf[65536];
+		for (;;) {
+			const std::size_t n(std::fread(buf, 1, sizeof buf, f));
+			if (!n) break;
+			text.append(buf, n);
+		}
+		if (std::ferror(f)) {
+			const int error(errno);
+			std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, filename, std::strerror(error));
+			throw EXIT_FAILURE;
+		}
+	}
+	json_value trace;
+	if (!json_reader(text).read(trace)) {
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, filename, "Not a JSON trace file.");
+		throw EXIT_FAILURE;
+	}
+
+	job_list jobs;
+	read_jobs(trace, jobs);
+	if (jobs.empty()) {
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, filename, "No bundle jobs in the trace.");
+		throw EXIT_FAILURE;
+	}
+	weigh_chains(jobs);
+
+	// The critical chain ends in the heaviest job, preferring the one that finished last among equals.
+	std::size_t last(0U);
+	for (std::size_t i(1U); i < jobs.size(); ++i)
+		if (jobs[i].chain > jobs[last].chain || (jobs[i].chain == jobs[last].chain && jobs[i].ready > jobs[last].ready))
+			last = i;
+	std::vector<std::size_t> chain;
+	for (std::size_t i(last); job::NONE != i; i = jobs[i].critical_predecessor)
+		chain.push_back(i);
+
+	std::fprintf(stdout, "Critical chain, %.3fs of actions in total:\n", seconds(jobs[last].chain));
+	std::fprintf(stdout, "The time when each bundle became ready or done is after the \"@\" character.\n");
+	std::fprintf(stdout, "The time that each bundle took to start or stop is after the \"+\" character.\n\n");
+	for (std::vector<std::size_t>::const_reverse_iterator i(chain.rbegin()); chain.rend() != i; ++i) {
+		const job & j(jobs[*i]);
+		std::fprintf(stdout, "\t@%.3fs\t+%.3fs\t%s\n", seconds(j.ready), seconds(j.action), j.name.c_str());
+	}
+
+	std::vector<std::size_t> blame;
+	for (std::size_t i(0U); i < jobs.size(); ++i)
+		blame.push_back(i);
+	std::stable_sort(blame.begin(), blame.end(), by_blame(jobs));
+	if (blame_count && blame_count < blame.size())
+		blame.resize(blame_count);
+	std::fprintf(stdout, "\nBlame, as total, load, and action times:\n\n");
+	for (std::vector<std::size_t>::const_iterator i(blame.begin()); blame.end() != i; ++i) {
+		const job & j(jobs[*i]);
+		std::fprintf(stdout, "\t%.3fs\t%.3fs\t%.3fs\t%s\n", seconds(j.load + j.action), seconds(j.load), seconds(j.action), j.name.c_str());
+	}
+
+	throw EXIT_SUCCESS;
+}
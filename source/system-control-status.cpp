@@ -60,6 +60,12 @@ convert (
 
 static std::vector<std::string> args_storage;
 
+/// The options that are only passed on to the subcommands that understand them.
+enum {
+	LOG_INCLUDE_ROTATED_OPTION = 1U,	///< service-status
+	CHANGED_SINCE_OPTION = 2U,	///< service-show
+};
+
 static
 void
 common_subcommand ( 
@@ -67,18 +73,26 @@ common_subcommand (
 	std::vector<const char *> & args,
 	const ProcessEnvironment & envs,
 	const char * command,
-	const char * arg
+	const char * arg,
+	unsigned options
 ) {
 	const char * prog(basename_of(args[0]));
 	const char * log_lines(0);
+	bool log_include_rotated(false);
+	const char * changed_since(0);
 	try {
 		popt::bool_definition user_option('u', "user", "Communicate with the per-user manager.", per_user_mode);
 		popt::string_definition log_lines_option('\0', "log-lines", "number", "Control the number of log lines printed.", log_lines);
-		popt::definition * main_table[] = {
-			&user_option,
-			&log_lines_option
-		};
-		popt::top_table_definition main_option(sizeof main_table/sizeof *main_table, main_table, "Main options", "{service(s)...}");
+		popt::bool_definition log_include_rotated_option('\0', "log-include-rotated", "Take log lines from rotated log files if the current one is too short.", log_include_rotated);
+		popt::string_definition changed_since_option('\0', "changed-since", "filename", "Only show bundles that have changed since the fingerprints in this file, and update it.", changed_since);
+		std::vector<popt::definition *> main_table;
+		main_table.push_back(&user_option);
+		main_table.push_back(&log_lines_option);
+		if (LOG_INCLUDE_ROTATED_OPTION & options)
+			main_table.push_back(&log_include_rotated_option);
+		if (CHANGED_SINCE_OPTION & options)
+			main_table.push_back(&changed_since_option);
+		popt::top_table_definition main_option(main_table.size(), main_table.data(), "Main options", "{service(s)...}");
 
 		std::vector<const char *> new_args;
 		popt::arg_processor<const char **> p(args.data() + 1, args.data() + args.size(), prog, main_option, new_args);
@@ -99,6 +113,12 @@ common_subcommand (
 		args.insert(args.begin(), log_lines);
 		args.insert(args.begin(), "--log-lines");
 	}
+	if (log_include_rotated)
+		args.insert(args.begin(), "--log-include-rotated");
+	if (changed_since) {
+		args.insert(args.begin(), changed_since);
+		args.insert(args.begin(), "--changed-since");
+	}
 	args.insert(args.begin(), command);
 	next_prog = arg0_of(args);
 }
@@ -109,7 +129,7 @@ find (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "ls", "-1d");
+	common_subcommand(next_prog, args, envs, "ls", "-1d", 0U);
 }
 
 void
@@ -118,7 +138,7 @@ show_json (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-show", "--json");
+	common_subcommand(next_prog, args, envs, "service-show", "--json", CHANGED_SINCE_OPTION);
 }
 
 void
@@ -127,7 +147,7 @@ show (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-show", NULL);
+	common_subcommand(next_prog, args, envs, "service-show", NULL, CHANGED_SINCE_OPTION);
 }
 
 void
@@ -136,7 +156,7 @@ status (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-status", NULL);
+	common_subcommand(next_prog, args, envs, "service-status", NULL, LOG_INCLUDE_ROTATED_OPTION);
 }
 
 void
@@ -145,7 +165,7 @@ try_restart (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-control", "--terminate");
+	common_subcommand(next_prog, args, envs, "service-control", "--terminate", 0U);
 }
 
 void
@@ -154,7 +174,7 @@ unload_when_stopped (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-control", "--exit");
+	common_subcommand(next_prog, args, envs, "service-control", "--exit", 0U);
 }
 
 void
@@ -163,7 +183,7 @@ hangup (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-control", "--hangup-main");
+	common_subcommand(next_prog, args, envs, "service-control", "--hangup-main", 0U);
 }
 
 void
@@ -172,7 +192,7 @@ is_active (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-is-up", NULL);
+	common_subcommand(next_prog, args, envs, "service-is-up", NULL, 0U);
 }
 
 void
@@ -181,7 +201,7 @@ is_loaded (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-is-ok", NULL);
+	common_subcommand(next_prog, args, envs, "service-is-ok", NULL, 0U);
 }
 
 void
@@ -190,5 +210,5 @@ is_enabled (
 	std::vector<const char *> & args,
 	ProcessEnvironment & envs
 ) {
-	common_subcommand(next_prog, args, envs, "service-is-enabled", NULL);
+	common_subcommand(next_prog, args, envs, "service-is-enabled", NULL, 0U);
 }
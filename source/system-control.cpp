@@ -176,11 +176,12 @@ system_control (
 		popt::top_table_definition main_option(sizeof top_table/sizeof *top_table, top_table, "Main options", 
 				"{"
 				"halt|reboot|poweroff|powercycle|"
-				"emergency|rescue|normal|init|sysinit|"
+				"emergency|rescue|normal|init|sysinit|daemon-reexec|"
 				"start|stop|enable|disable|preset|reset|unload-when-stopped|"
 				"try-restart|hangup|"
 				"is-active|is-loaded|is-enabled|"
 				"cat|show|status|show-json|"
+				"analyse-critical-chain|"
 				"set-service-env|print-service-env|"
 				"convert-systemd-units|convert-fstab-services|"
 				"nagios-check-service|load-kernel-module|unload-kernel-module|"
@@ -15,6 +15,7 @@ For copyright and licensing terms, see the file named COPYING.
 #include "fdutils.h"
 #include "runtime-dir.h"
 #include "common-manager.h"
+#include "service-manager-client.h"
 #include "FileDescriptorOwner.h"
 #include "popt.h"
 
@@ -153,6 +154,23 @@ powercycle (
 #endif
 }
 
+static inline
+void
+reexec (
+	const char * prog
+) {
+#if defined(REEXEC_SIGNAL)
+	instruct_manager_process(prog, REEXEC_SIGNAL, 'X');
+#else
+	if (per_user_mode)
+		send_command_to_per_user_manager_process(prog, 'X');
+	else {
+		std::fprintf(stderr, "%s: FATAL: %s\n", prog, "Process #1 cannot be re-executed on this platform.");
+		throw EXIT_FAILURE;
+	}
+#endif
+}
+
 /* System control commands **************************************************
 // **************************************************************************
 // These are the built-in state change commands in system-control.
@@ -254,6 +272,47 @@ emergency_rescue_normal_command [[gnu::noreturn]] (
 	throw EXIT_SUCCESS;
 }
 
+void
+daemon_reexec_command [[gnu::noreturn]] ( 
+	const char * & next_prog,
+	std::vector<const char *> & args,
+	ProcessEnvironment & /*envs*/
+) {
+	const char * prog(basename_of(args[0]));
+	try {
+		popt::bool_definition user_option('u', "user", "Communicate with the per-user manager.", per_user_mode);
+		popt::definition * main_table[] = {
+			&user_option
+		};
+		popt::top_table_definition main_option(sizeof main_table/sizeof *main_table, main_table, "Main options", "");
+
+		std::vector<const char *> new_args;
+		popt::arg_processor<const char **> p(args.data() + 1, args.data() + args.size(), prog, main_option, new_args);
+		p.process(true /* strictly options before arguments */);
+		args = new_args;
+		next_prog = arg0_of(args);
+		if (p.stopped()) throw EXIT_SUCCESS;
+	} catch (const popt::error & e) {
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, e.arg, e.msg);
+		throw static_cast<int>(EXIT_USAGE);
+	}
+	if (!args.empty()) {
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, args.front(), "Unexpected argument.");
+		throw static_cast<int>(EXIT_USAGE);
+	}
+
+	// The service manager goes first, so that if it cannot be re-executed we have not disturbed anything.
+	const FileDescriptorOwner socket_fd(connect_service_manager_socket(!per_user_mode, prog));
+	if (0 > socket_fd.get()) throw EXIT_FAILURE;
+	if (const int error = reexec_service_manager(prog, socket_fd.get())) {
+		std::fprintf(stderr, "%s: FATAL: %s: %s\n", prog, "service-manager", std::strerror(error));
+		throw EXIT_FAILURE;
+	}
+	reexec(prog);
+
+	throw EXIT_SUCCESS;
+}
+
 void
 init ( 
 	const char * & next_prog,
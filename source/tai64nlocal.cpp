@@ -3,66 +3,21 @@ For copyright and licensing terms, see the file named COPYING.
 // **************************************************************************
 */
 
-#define __STDC_FORMAT_MACROS
 #include <vector>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <inttypes.h>
-#include <stdint.h>
-#include <cctype>
 #include <cerrno>
-#include <ctime>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "utils.h"
 #include "fdutils.h"
 #include "popt.h"
+#include "TAI64NLocalConverter.h"
 
 static bool non_standard(false);
 
-static 
-void 
-finish (
-	std::size_t at,
-	const char * s,
-	std::size_t s_len,
-	const char * n,
-	std::size_t n_len
-) {
-	if (at) std::fputc('@', stdout);
-	std::fwrite(s, s_len, 1, stdout);
-	std::fwrite(n, n_len, 1, stdout);
-}
-
-static inline 
-int 
-x2d ( int c ) 
-{
-	if (std::isdigit(c)) return c - '0';
-	if (std::isalpha(c)) {
-		c = std::tolower(c);
-		return c - 'a' + 10;
-	}
-	return EOF;
-}
-
-static
-uint64_t
-convert (
-	const char * buf,
-	std::size_t len
-) {
-	uint64_t r(0U);
-	while (len) {
-		--len;
-		r <<= 4;
-		r |= x2d(*buf++);
-	}
-	return r;
-}
-
 static 
 bool 
 process (
@@ -71,12 +26,10 @@ process (
 	const char * name,
 	int fd
 ) {
-	char buf[32768], s[16], n[8];
-	size_t s_pos(0), n_pos(0), at(0);
-	bool done(false);
-	enum { BOL, STAMP, BODY } state = BOL;
+	char buf[32768];
+	TAI64NLocalConverter converter(envs, stdout, non_standard);
 	for (;;) {
-		if (BOL == state)
+		if (converter.AtLineStart())
 			std::fflush(stdout);
 		const int rd(read(fd, buf, sizeof buf));
 		if (0 > rd) {
@@ -85,72 +38,9 @@ process (
 			return false;
 		} else if (0 == rd)
 			break;
-		done = true;
-		for (int i(0); i < rd; ++i) {
-			const char c(buf[i]);
-			switch (state) {
-				body:
-				case BODY:
-					std::fputc(c, stdout);
-					if ('\n' == c) state = BOL;
-					break;;
-				case BOL:
-					if ('@' == c) {
-						state = STAMP;
-						s_pos = n_pos = 0;
-						at = 1;
-					} else {
-						finish(at, s, s_pos, n, s_pos);
-						at = s_pos = n_pos = 0;
-						state = BODY;
-						goto body;
-					}
-					break;
-				case STAMP:
-					if (s_pos < sizeof s/sizeof *s) {
-						if (std::isxdigit(c)) {
-							s[s_pos++] = c;
-						} else {
-							finish(at, s, s_pos, n, n_pos);
-							at = s_pos = n_pos = 0;
-							state = BODY;
-							goto body;
-						}
-					} else
-					if (n_pos < sizeof n/sizeof *n) {
-						if (std::isxdigit(c)) {
-							n[n_pos++] = c;
-						} else {
-							finish(at, s, s_pos, n, n_pos);
-							at = s_pos = n_pos = 0;
-							state = BODY;
-							goto body;
-						}
-					} else
-					{
-						const TimeTAndLeap z(tai64_to_time(envs, convert(s, s_pos)));
-						const uint32_t nano(convert(n, n_pos));
-						struct tm tm;
-						if (localtime_r(&z.time, &tm)) {
-							if (z.leap) ++tm.tm_sec;
-							char fmt[64];
-							const int l(std::strftime(fmt, sizeof fmt, non_standard ? "%x %X" : "%F %T", &tm));
-							std::fwrite(fmt, l, 1, stdout);
-							std::fprintf(stdout, ".%09" PRIu32, nano);
-						} else
-							finish(at, s, s_pos, n, n_pos);
-						at = s_pos = n_pos = 0;
-						state = BODY;
-						goto body;
-					}
-					break;
-			}
-		}
-	}
-	if (BOL != state && done) {
-		finish(at, s, s_pos, n, n_pos);
-		std::fputc('\n', stdout);
+		converter.Process(buf, rd);
 	}
+	converter.Finish();
 	return true;
 }
 
@@ -22,6 +22,7 @@ enum {
 };
 
 struct ProcessEnvironment;
+struct rusage;
 
 struct command {
 	const char * name;
@@ -315,6 +316,22 @@ wait_nonblocking_for_stopcontexit_of (
 ) ;
 extern
 int
+wait_nonblocking_for_anychild_stopcontexit (
+	pid_t & child,
+	int & status,
+	int & code,
+	struct rusage & usage
+) ;
+extern
+int
+wait_nonblocking_for_stopcontexit_of (
+	const pid_t child,
+	int & status,
+	int & code,
+	struct rusage & usage
+) ;
+extern
+int
 wait_nonblocking_for_stopexit_of (
 	const pid_t child,
 	int & status,